@@ -0,0 +1,415 @@
+/*
+ * admission.c
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "admission.h"
+
+/* how long a request of every class waits for a slot, ns */
+#define GET_DEADLINE         (50 * 1000000ULL)
+#define COLLECTION_DEADLINE  (1000 * 1000000ULL)
+#define WRITE_DEADLINE       (200 * 1000000ULL)
+
+/* a route class
+ * in_flight, waiting and limit are read with no lock, so a request is
+ * admitted with a single compare and swap when there's a free slot and
+ * nobody waits. the list of waiting requests is changed with the lock
+ */
+typedef struct admission_queue {
+  pthread_mutex_t lock;
+  int in_flight;
+  int waiting;
+  int limit;
+  int min_limit;
+  int max_limit;
+  uint64_t deadline;
+  Admission_Ticket *head, *tail;
+
+  /* the latency window */
+  uint64_t window_sum;
+  int window_n;
+  bool limited;           /* some request had to wait in this window */
+  int windows;
+  uint64_t latency;
+  uint64_t min_latency;
+
+  uint64_t admitted;
+  uint64_t queued;
+  uint64_t rejected;
+  uint64_t expired;
+} Admission_Queue;
+
+static Admission_Queue Queues[N_ADMISSION_CLASSES] = {
+  [0 ... N_ADMISSION_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static void (*Suspend)(void *arg);
+static void (*Resume)(void *arg);
+static bool Shutting_Down;
+
+/* monotonic time, in ns */
+uint64_t admission_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_class(Admission_Class cls, int limit, int min_limit,
+    int max_limit, uint64_t deadline) {
+  Admission_Queue *q = &Queues[cls];
+
+  q->limit = limit;
+  q->min_limit = min_limit;
+  q->max_limit = max_limit;
+  q->deadline = deadline;
+}
+
+/* set the limits for a pool of threads
+ * cheap requests can take all the threads, and their limit doesn't
+ * change: they are never the ones that make the others slow. the
+ * collection can take half of them, and changes all of them, both less
+ * when their latency goes up
+ * suspend() and resume() suspend a waiting request, and resume it when
+ * it's admitted or rejected. they are called holding a lock, and
+ * should not call back here
+ */
+void admission_configure(int threads, void (*suspend)(void *arg),
+    void (*resume)(void *arg)) {
+  int half = (threads > 1) ? threads / 2 : 1;
+
+  assert(threads > 0);
+  assert(suspend != NULL && resume != NULL);
+
+  set_class(ADMISSION_GET, threads, threads, threads, GET_DEADLINE);
+  set_class(ADMISSION_COLLECTION, half, 1, half, COLLECTION_DEADLINE);
+  set_class(ADMISSION_WRITE, threads, 1, threads, WRITE_DEADLINE);
+  Suspend = suspend;
+  Resume = resume;
+  Shutting_Down = false;
+}
+
+/* the class of a request
+ * GET /terminals/changes is not limited, GET /terminals is the collection
+ * (all of it or ?ids=), other GETs read a single thing
+ */
+Admission_Class admission_classify(const char *method, const char *url) {
+  assert(method != NULL && url != NULL);
+
+  if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+    return ADMISSION_WRITE;
+  }
+  if (strcmp(url, "/terminals/changes") == 0) {
+    return ADMISSION_NONE;
+  }
+  if (strcmp(url, "/terminals") == 0 || strcmp(url, "/terminals/") == 0 ||
+      strcmp(url, "/export") == 0) {
+    return ADMISSION_COLLECTION;
+  }
+  return ADMISSION_GET;
+}
+
+/* take a slot, if there's one */
+static bool take_slot(Admission_Queue *q) {
+  int n = __atomic_load_n(&q->in_flight, __ATOMIC_SEQ_CST);
+
+  while (n < __atomic_load_n(&q->limit, __ATOMIC_RELAXED)) {
+    if (__atomic_compare_exchange_n(&q->in_flight, &n, n + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void set_state(Admission_Ticket *t, Admission_State state) {
+  __atomic_store_n(&t->state, state, __ATOMIC_RELEASE);
+}
+
+Admission_State admission_state(Admission_Ticket *t) {
+  return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+}
+
+/* give the free slots to the requests waiting, the oldest first
+ * the ones past their deadline are rejected instead
+ * called with the lock
+ */
+static void hand_slots(Admission_Queue *q, uint64_t now) {
+  Admission_Ticket *t;
+  void *arg;
+
+  while (q->head != NULL) {
+    t = q->head;
+    if (t->deadline > now && !take_slot(q)) {
+      break;
+    }
+    q->head = t->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    t->next = NULL;
+    __atomic_sub_fetch(&q->waiting, 1, __ATOMIC_SEQ_CST);
+    /* the ticket is not used after the state changes, the request can
+     * be done with it by then
+     */
+    arg = t->arg;
+    if (t->deadline > now) {
+      t->started = now;
+      __atomic_add_fetch(&q->admitted, 1, __ATOMIC_RELAXED);
+      set_state(t, ADMISSION_ADMITTED);
+    } else {
+      q->expired++;
+      set_state(t, ADMISSION_REJECTED);
+    }
+    Resume(arg);
+  }
+}
+
+/* admit a request of class cls
+ * returns ADMISSION_ADMITTED if it can go on now, then admission_leave()
+ * should be called when it's done. ADMISSION_WAITING if it's suspended
+ * (with suspend(arg)), it's resumed later as admitted or rejected, see
+ * admission_state(). ADMISSION_REJECTED if it should be answered 503
+ */
+Admission_State admission_enter(Admission_Ticket *t, Admission_Class cls,
+    void *arg) {
+  Admission_Queue *q;
+  Admission_State state;
+
+  assert(t != NULL);
+
+  t->cls = cls;
+  t->arg = arg;
+  t->next = NULL;
+  if (cls == ADMISSION_NONE) {
+    set_state(t, ADMISSION_ADMITTED);
+    return ADMISSION_ADMITTED;
+  }
+  q = &Queues[cls];
+
+  /* nobody waiting, and a free slot */
+  if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST) == 0 && take_slot(q)) {
+    t->started = admission_now();
+    __atomic_add_fetch(&q->admitted, 1, __ATOMIC_RELAXED);
+    set_state(t, ADMISSION_ADMITTED);
+    return ADMISSION_ADMITTED;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  /* counted as waiting before the slots are checked again, so a request
+   * that ends meanwhile sees it, see admission_leave()
+   */
+  __atomic_add_fetch(&q->waiting, 1, __ATOMIC_SEQ_CST);
+  q->limited = true;
+  if (q->head == NULL && take_slot(q)) {
+    __atomic_sub_fetch(&q->waiting, 1, __ATOMIC_SEQ_CST);
+    t->started = admission_now();
+    __atomic_add_fetch(&q->admitted, 1, __ATOMIC_RELAXED);
+    state = ADMISSION_ADMITTED;
+  } else if (Shutting_Down ||
+      __atomic_load_n(&q->waiting, __ATOMIC_RELAXED) >
+        ADMISSION_QUEUE_FACTOR * __atomic_load_n(&q->limit, __ATOMIC_RELAXED)) {
+    __atomic_sub_fetch(&q->waiting, 1, __ATOMIC_SEQ_CST);
+    q->rejected++;
+    state = ADMISSION_REJECTED;
+  } else {
+    t->deadline = admission_now() + q->deadline;
+    if (q->tail != NULL) {
+      q->tail->next = t;
+    } else {
+      q->head = t;
+    }
+    q->tail = t;
+    q->queued++;
+    state = ADMISSION_WAITING;
+    Suspend(arg);
+  }
+  /* a waiting request can be resumed as soon as the lock is released,
+   * the state returned is the one it had here
+   */
+  set_state(t, state);
+  pthread_mutex_unlock(&q->lock);
+  return state;
+}
+
+/* change the limit after a window of requests
+ * called with the lock
+ */
+static void adapt(Admission_Queue *q) {
+  uint64_t sum, avg;
+  int n, limit, step;
+
+  n = __atomic_exchange_n(&q->window_n, 0, __ATOMIC_RELAXED);
+  sum = __atomic_exchange_n(&q->window_sum, 0, __ATOMIC_RELAXED);
+  if (n == 0) {
+    return;
+  }
+  avg = sum / n;
+  q->latency = avg;
+  if (q->min_latency == 0 || avg < q->min_latency || ++q->windows >= ADMISSION_MIN_RESET) {
+    q->min_latency = avg;
+    q->windows = 0;
+  }
+
+  limit = __atomic_load_n(&q->limit, __ATOMIC_RELAXED);
+  if (avg > ADMISSION_TOLERANCE * q->min_latency) {
+    step = (limit >= 10) ? limit / 10 : 1;
+    limit = (limit - step > q->min_limit) ? limit - step : q->min_limit;
+  } else if (q->limited && limit < q->max_limit) {
+    limit++;
+  }
+  q->limited = false;
+  __atomic_store_n(&q->limit, limit, __ATOMIC_RELAXED);
+}
+
+/* give back the slot of a request, sample says if it's latency counts */
+static void release(Admission_Ticket *t, bool sample) {
+  Admission_Queue *q = &Queues[t->cls];
+  uint64_t now = admission_now();
+
+  set_state(t, ADMISSION_IDLE);
+  if (sample) {
+    __atomic_add_fetch(&q->window_sum, now - t->started, __ATOMIC_RELAXED);
+  }
+  __atomic_sub_fetch(&q->in_flight, 1, __ATOMIC_SEQ_CST);
+
+  if (sample && __atomic_add_fetch(&q->window_n, 1, __ATOMIC_RELAXED) >= ADMISSION_WINDOW &&
+      pthread_mutex_trylock(&q->lock) == 0) {
+    adapt(q);
+    hand_slots(q, now);
+    pthread_mutex_unlock(&q->lock);
+  } else if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&q->lock);
+    hand_slots(q, now);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+/* a request admitted is done, it's slot goes to the next one waiting */
+void admission_leave(Admission_Ticket *t) {
+  assert(t != NULL);
+
+  if (t->cls != ADMISSION_NONE && admission_state(t) == ADMISSION_ADMITTED) {
+    release(t, true);
+  }
+}
+
+/* a request ended before it was answered, like when the server stops
+ * if it's waiting it's taken out of the list, and a slot it has is given
+ * back
+ */
+void admission_cancel(Admission_Ticket *t) {
+  Admission_Queue *q;
+  Admission_Ticket **p;
+  Admission_State state;
+
+  assert(t != NULL);
+
+  /* only a waiting request can change meanwhile, most are done */
+  state = admission_state(t);
+  if (t->cls == ADMISSION_NONE || state == ADMISSION_IDLE || state == ADMISSION_REJECTED) {
+    return;
+  }
+  q = &Queues[t->cls];
+  pthread_mutex_lock(&q->lock);
+  if ((state = admission_state(t)) == ADMISSION_WAITING) {
+    for (p = &q->head; *p != NULL; p = &(*p)->next) {
+      if (*p == t) {
+        *p = t->next;
+        break;
+      }
+    }
+    q->tail = NULL;
+    for (p = &q->head; *p != NULL; p = &(*p)->next) {
+      q->tail = *p;
+    }
+    __atomic_sub_fetch(&q->waiting, 1, __ATOMIC_SEQ_CST);
+    set_state(t, ADMISSION_IDLE);
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (state == ADMISSION_ADMITTED) {
+    release(t, false);
+  }
+}
+
+/* reject the requests waiting past their deadline, and admit the ones
+ * that can be, if the limits went up
+ */
+void admission_expire(uint64_t now) {
+  Admission_Queue *q;
+  int i;
+
+  for (i = 0; i < N_ADMISSION_CLASSES; i++) {
+    q = &Queues[i];
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST) > 0) {
+      pthread_mutex_lock(&q->lock);
+      hand_slots(q, now);
+      pthread_mutex_unlock(&q->lock);
+    }
+  }
+}
+
+static void *admission_timer(void *arg) {
+  for (;;) {
+    usleep(ADMISSION_TICK_MS * 1000);
+    admission_expire(admission_now());
+  }
+  return NULL;
+}
+
+/* start checking the deadlines */
+bool admission_start(void) {
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, admission_timer, NULL) != 0) {
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+/* reject all the requests waiting, before stopping the server
+ * from here on no request waits
+ */
+void admission_shutdown(void) {
+  Admission_Queue *q;
+  int i;
+
+  for (i = 0; i < N_ADMISSION_CLASSES; i++) {
+    q = &Queues[i];
+    pthread_mutex_lock(&q->lock);
+    Shutting_Down = true;
+    /* all of them are past the deadline */
+    hand_slots(q, UINT64_MAX);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+/* the counters of a class
+ * they are not read all at the same time
+ */
+void admission_get_stats(Admission_Class cls, Admission_Stats *st) {
+  Admission_Queue *q;
+
+  assert(cls >= 0 && cls < N_ADMISSION_CLASSES);
+  assert(st != NULL);
+
+  q = &Queues[cls];
+  pthread_mutex_lock(&q->lock);
+  st->limit = __atomic_load_n(&q->limit, __ATOMIC_RELAXED);
+  st->in_flight = __atomic_load_n(&q->in_flight, __ATOMIC_RELAXED);
+  st->waiting = __atomic_load_n(&q->waiting, __ATOMIC_RELAXED);
+  st->admitted = __atomic_load_n(&q->admitted, __ATOMIC_RELAXED);
+  st->queued = q->queued;
+  st->rejected = q->rejected;
+  st->expired = q->expired;
+  st->latency_ns = q->latency;
+  st->min_latency_ns = q->min_latency;
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,92 @@
+/*
+ * admission.h
+ *
+ */
+
+#ifndef __ADMISSION_H
+#define __ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* admission control
+ * requests get to the dispatcher by route class, every class with a limit
+ * of requests in the handlers at the same time, so the expensive routes
+ * can't take all the threads of the pool, and the cheap ones keep their
+ * latency when the expensive ones are saturated
+ * a request over the limit of it's class waits suspended, holding no
+ * thread, until one of the class ends, up to the deadline of the class.
+ * if too many are waiting already, or the deadline passes, it's answered
+ * 503 with Retry-After at once
+ * the limits of the expensive classes adapt to the latency seen, in
+ * windows of ADMISSION_WINDOW requests: when the average is more than
+ * ADMISSION_TOLERANCE times the lowest seen the limit goes down by a
+ * tenth, when requests had to wait and the latency is fine it goes up by
+ * one. the lowest latency is measured again every ADMISSION_MIN_RESET
+ * windows, as the load changes
+ * the change feed is not limited, it waits suspended and holds no thread
+ */
+#define ADMISSION_TICK_MS        5    /* how often the deadlines are checked */
+#define ADMISSION_WINDOW         64   /* requests between limit changes */
+#define ADMISSION_TOLERANCE      2
+#define ADMISSION_MIN_RESET      256
+#define ADMISSION_QUEUE_FACTOR   4    /* most requests waiting, times the limit */
+#define ADMISSION_RETRY_AFTER    1    /* seconds, in the 503 responses */
+
+/* route classes */
+typedef enum admission_class {
+  ADMISSION_NONE = -1,      /* not limited */
+  ADMISSION_GET,            /* a terminal by id, the stats, the catalog */
+  ADMISSION_COLLECTION,     /* all the terminals, or many by id, the export */
+  ADMISSION_WRITE,          /* POST, PUT, PATCH, DELETE */
+  N_ADMISSION_CLASSES
+} Admission_Class;
+
+typedef enum admission_state {
+  ADMISSION_IDLE,           /* not admitted yet, or done */
+  ADMISSION_WAITING,        /* suspended, waiting for a slot */
+  ADMISSION_ADMITTED,       /* holds a slot until admission_leave() */
+  ADMISSION_REJECTED        /* to answer with 503 */
+} Admission_State;
+
+/* a request going through admission, kept with the request */
+typedef struct admission_ticket {
+  Admission_Class cls;
+  Admission_State state;
+  void *arg;                /* given to suspend() and resume() */
+  uint64_t deadline;        /* ns, while waiting */
+  uint64_t started;         /* ns, when admitted */
+  struct admission_ticket *next;
+} Admission_Ticket;
+
+typedef struct admission_stats {
+  int limit;
+  int in_flight;
+  int waiting;
+  uint64_t admitted;
+  uint64_t queued;
+  uint64_t rejected;        /* too many waiting */
+  uint64_t expired;         /* waited past the deadline */
+  uint64_t latency_ns;      /* average of the last window */
+  uint64_t min_latency_ns;
+} Admission_Stats;
+
+
+/* prototypes */
+extern void admission_configure(int threads, void (*suspend)(void *arg),
+                void (*resume)(void *arg));
+extern bool admission_start(void);
+extern void admission_shutdown(void);
+extern Admission_Class admission_classify(const char *method, const char *url);
+extern Admission_State admission_enter(Admission_Ticket *t, Admission_Class cls,
+                void *arg);
+extern Admission_State admission_state(Admission_Ticket *t);
+extern void admission_leave(Admission_Ticket *t);
+extern void admission_cancel(Admission_Ticket *t);
+extern void admission_expire(uint64_t now);
+extern void admission_get_stats(Admission_Class cls, Admission_Stats *st);
+extern uint64_t admission_now(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
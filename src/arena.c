@@ -0,0 +1,173 @@
+/*
+ * arena.c
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "arena.h"
+#include "mem.h"
+#include "jansson.h"
+
+/* chunks start small and grow when a request doesn't fit in one chunk
+ * so after a few requests the usual response is built in a single chunk
+ * without calling malloc at all
+ */
+#define ARENA_MIN_CHUNK  (16 * 1024)
+#define ARENA_MAX_CHUNK  (4 * 1024 * 1024)
+#define ARENA_ALIGN      16
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;          /* usable bytes in data */
+  size_t used;
+  /* data follows, aligned to ARENA_ALIGN */
+} Arena_Chunk;
+
+#define CHUNK_HEADER  ((sizeof(Arena_Chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *) (c) + CHUNK_HEADER)
+
+typedef struct arena {
+  Arena_Chunk *head;    /* current chunk, older chunks follow */
+  size_t chunk_size;    /* size for the next chunk */
+  Arena_Stats stats;
+} Arena;
+
+/* every thread has it's own arena, so no locking is needed
+ * the key is only used to release the chunks when a thread exits,
+ * as libmicrohttpd creates and destroys threads as connections come and go
+ */
+static __thread Arena *Thread_Arena;
+static pthread_key_t Arena_Key;
+static pthread_once_t Arena_Key_Once = PTHREAD_ONCE_INIT;
+
+static void arena_destroy(void *p) {
+  Arena *a = p;
+  Arena_Chunk *c, *next;
+
+  for (c = a->head; c != NULL; c = next) {
+    next = c->next;
+    mem_free(MEM_SERIALIZER, c);
+  }
+  mem_free(MEM_SERIALIZER, a);
+}
+
+static void arena_make_key(void) {
+  (void) pthread_key_create(&Arena_Key, arena_destroy);
+}
+
+static Arena *arena_get(void) {
+  if (Thread_Arena == NULL) {
+    (void) pthread_once(&Arena_Key_Once, arena_make_key);
+    Thread_Arena = mem_calloc(MEM_SERIALIZER, 1, sizeof(Arena));
+    if (Thread_Arena == NULL) {
+      return NULL;
+    }
+    Thread_Arena->chunk_size = ARENA_MIN_CHUNK;
+    (void) pthread_setspecific(Arena_Key, Thread_Arena);
+  }
+  return Thread_Arena;
+}
+
+/* allocate a new chunk big enough for size bytes and make it current */
+static Arena_Chunk *arena_new_chunk(Arena *a, size_t size) {
+  Arena_Chunk *c;
+  size_t n = a->chunk_size;
+
+  while (n < size) {
+    n *= 2;
+  }
+  if ((c = mem_malloc(MEM_SERIALIZER, CHUNK_HEADER + n)) == NULL) {
+    return NULL;
+  }
+  c->size = n;
+  c->used = 0;
+  c->next = a->head;
+  a->head = c;
+  a->stats.chunk_allocs++;
+  a->stats.bytes_reserved += n;
+  return c;
+}
+
+/* allocate size bytes from the arena of the calling thread */
+void *arena_malloc(size_t size) {
+  Arena *a;
+  Arena_Chunk *c;
+  void *p;
+
+  if ((a = arena_get()) == NULL) {
+    return NULL;
+  }
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+  c = a->head;
+  if (c == NULL || c->size - c->used < size) {
+    if ((c = arena_new_chunk(a, size)) == NULL) {
+      return NULL;
+    }
+  }
+  p = CHUNK_DATA(c) + c->used;
+  c->used += size;
+  a->stats.bytes_in_use += size;
+  return p;
+}
+
+/* single allocations are never given back, see arena_reset() */
+void arena_free(void *p) {
+  (void) p;
+}
+
+/* give back all the memory allocated by the calling thread
+ * the current chunk is kept for the next request. if the request needed
+ * more than one chunk, the next chunk will be bigger, so the arena
+ * quickly adapts to the size of the usual response
+ */
+void arena_reset(void) {
+  Arena *a = Thread_Arena;
+  Arena_Chunk *c, *next;
+
+  if (a == NULL || a->head == NULL) {
+    return;
+  }
+  if (a->head->next != NULL) {
+    /* the request didn't fit in one chunk */
+    while (a->chunk_size < a->stats.bytes_in_use && a->chunk_size < ARENA_MAX_CHUNK) {
+      a->chunk_size *= 2;
+    }
+    for (c = a->head; c != NULL; c = next) {
+      next = c->next;
+      mem_free(MEM_SERIALIZER, c);
+    }
+    a->head = NULL;
+    a->stats.bytes_reserved = 0;
+  } else {
+    a->head->used = 0;
+  }
+  a->stats.bytes_in_use = 0;
+  a->stats.resets++;
+}
+
+void arena_get_stats(Arena_Stats *st) {
+  Arena *a;
+
+  assert(st != NULL);
+  if ((a = arena_get()) == NULL) {
+    st->chunk_allocs = st->resets = st->bytes_in_use = st->bytes_reserved = 0;
+    return;
+  }
+  *st = a->stats;
+}
+
+/* route all jansson allocations to the thread arena
+ * this must be called once, before any thread uses jansson
+ * after this, strings returned by json_dumps() live in the arena, they
+ * should not be given to free(), and they are gone after arena_reset()
+ */
+void arena_install_json(void) {
+  json_set_alloc_funcs(arena_malloc, arena_free);
+}
+
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,39 @@
+/*
+ * arena.h
+ *
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/* a bump ("arena") allocator
+ * every thread owns one arena. allocations just advance a pointer inside
+ * the current chunk, and freeing a single allocation does nothing.
+ * all the memory is given back at once with arena_reset(), that's called
+ * when the response for the request has been queued.
+ * this fits the request lifecycle of the server: jansson builds a lot of
+ * small nodes and strings for a single response and throws them all away
+ * right after.
+ */
+
+/* statistics for the arena of the calling thread */
+typedef struct arena_stats {
+  size_t chunk_allocs;     /* number of chunks taken from malloc */
+  size_t resets;           /* number of times the arena was reset */
+  size_t bytes_in_use;     /* bytes handed out since the last reset */
+  size_t bytes_reserved;   /* bytes held in chunks */
+} Arena_Stats;
+
+
+/* prototypes */
+extern void *arena_malloc(size_t size);
+extern void arena_free(void *p);
+extern void arena_reset(void);
+extern void arena_get_stats(Arena_Stats *st);
+extern void arena_install_json(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
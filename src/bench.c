@@ -0,0 +1,980 @@
+/*
+ * bench.c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "jansson.h"
+#include "card_type.h"
+#include "transaction_type.h"
+#include "terminal.h"
+#include "arena.h"
+#include "pool.h"
+#include "msgpack.h"
+#include "id_lease.h"
+#include "change_feed.h"
+#include "catalog.h"
+#include "shm.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "job_pool.h"
+#include "import.h"
+#include "export.h"
+#include "store.h"
+#include "query.h"
+#include "mem.h"
+
+/* micro benchmarks for the model
+ * these run the same code the handlers run, without the HTTP layer,
+ * and print the time and the number of calls to malloc per operation
+ * run them with ./bench [iterations]
+ */
+
+#define DEFAULT_ITERATIONS  200
+
+/* malloc calls made on behalf of jansson */
+static size_t Mallocs;
+
+static void *counting_malloc(size_t size) {
+  Mallocs++;
+  return malloc(size);
+}
+
+static void counting_free(void *p) {
+  free(p);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, int iterations, double elapsed,
+        size_t mallocs) {
+  printf("%-36s %8d ops %12.0f ns/op %10.1f mallocs/op\n",
+    name,
+    iterations,
+    elapsed / iterations,
+    (double) mallocs / iterations);
+}
+
+/* fill the terminals table with some mix of card and transaction types */
+static void fill_table(void) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC" };
+  static char *trxs[] = { "Cheque", "Savings", "Credit", "Other" };
+  Terminal_Data t;
+  int i, j;
+
+  for (i = 0; i < N_TERMINALS; i++) {
+    terminal_init_data(&t);
+    for (j = 0; j <= i % 5; j++) {
+      terminal_add_card_type(&t, cards[(i + j) % 5]);
+    }
+    for (j = 0; j <= i % 4; j++) {
+      terminal_add_transaction_type(&t, trxs[(i + j) % 4]);
+    }
+    if (!terminal_add(&t)) {
+      break;
+    }
+  }
+}
+
+/* GET /terminals with jansson on malloc, the response is a copy
+ * like libmicrohttpd does with MHD_RESPMEM_MUST_COPY
+ */
+static void bench_all_to_json_malloc(int iterations) {
+  double start;
+  char *p, *buf;
+  size_t len;
+  int i;
+
+  json_set_alloc_funcs(counting_malloc, counting_free);
+  Mallocs = 0;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    p = terminal_all_to_json(NULL);
+    len = strlen(p);
+    buf = malloc(len);
+    Mallocs++;
+    memcpy(buf, p, len);
+    free(buf);
+    terminal_free_json(p);
+  }
+  report("all_to_json malloc", iterations, now_ns() - start, Mallocs);
+}
+
+/* GET /terminals with jansson on the thread arena and the response in
+ * a pool buffer, like the dispatcher does
+ */
+static void bench_all_to_json_arena(int iterations) {
+  Terminal_Stats st;
+  Arena_Stats ast;
+  Pool_Stats pst;
+  size_t chunk_allocs, pool_misses;
+  double start, elapsed;
+  char *p, *buf;
+  size_t len;
+  int i;
+
+  arena_install_json();
+  arena_get_stats(&ast);
+  pool_get_stats(&pst);
+  chunk_allocs = ast.chunk_allocs;
+  pool_misses = pst.allocs - pst.hits;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    p = terminal_all_to_json(NULL);
+    len = strlen(p);
+    buf = pool_alloc(len);
+    memcpy(buf, p, len);
+    pool_free(buf);
+    arena_reset();
+  }
+  elapsed = now_ns() - start;
+  arena_get_stats(&ast);
+  pool_get_stats(&pst);
+  report("all_to_json arena+pool", iterations, elapsed,
+    (ast.chunk_allocs - chunk_allocs) + (pst.allocs - pst.hits - pool_misses));
+  terminal_get_stats(&st);
+  printf("%-36s %8.1f ns/terminal\n", "", elapsed / iterations / st.terminals);
+}
+
+/* check the types of every terminal against the catalog, as every
+ * function that took a terminal used to
+ */
+static void bench_validate(int iterations) {
+  Terminal_Data t;
+  double start;
+  int i, id, ops = 0;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    for (id = 1; terminal_get(id, &t); id++) {
+      ops += terminal_is_valid(&t);
+    }
+  }
+  report("terminal_is_valid", ops, now_ns() - start, 0);
+}
+
+/* encode every terminal by itself, as GET /terminals/{id} does
+ * reports time and bytes per terminal for JSON and MessagePack
+ */
+static void bench_encode_terminal(int iterations) {
+  Terminal_Data t;
+  double start;
+  size_t bytes, len;
+  int ops;
+  char *p;
+  int i, id;
+
+  arena_install_json();
+  bytes = 0;
+  ops = 0;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    for (id = 1; terminal_get(id, &t); id++) {
+      p = terminal_to_json(&t);
+      bytes += strlen(p);
+      ops++;
+    }
+    arena_reset();
+  }
+  report("encode terminal json", ops, now_ns() - start, 0);
+  printf("%-36s %8.1f bytes/terminal\n", "", (double) bytes / ops);
+
+  bytes = 0;
+  ops = 0;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    for (id = 1; terminal_get(id, &t); id++) {
+      p = terminal_to_msgpack(&t, &len);
+      bytes += len;
+      ops++;
+      pool_free(p);
+    }
+  }
+  report("encode terminal msgpack", ops, now_ns() - start, 0);
+  printf("%-36s %8.1f bytes/terminal\n", "", (double) bytes / ops);
+}
+
+/* a span of a request not traced, that's what tracing costs most of the
+ * time, and of one traced
+ */
+static void bench_trace(int iterations) {
+  double start;
+  int i;
+
+  trace_enter(0);
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    trace_end("bench", trace_start());
+  }
+  report("trace span, not traced", iterations, now_ns() - start, 0);
+
+  trace_enter(1);
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    trace_end("bench", trace_start());
+  }
+  report("trace span, traced", iterations, now_ns() - start, 0);
+  trace_enter(0);
+}
+
+/* what the accounting costs, an allocation and a free of a request's
+ * state, with malloc() and with the wrappers
+ */
+static void bench_mem(int iterations) {
+  double start;
+  void *p;
+  int i;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    p = malloc(256);
+    __asm__ volatile("" : : "r" (p) : "memory");
+    free(p);
+  }
+  report("malloc/free", iterations, now_ns() - start, 0);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    p = mem_malloc(MEM_CONNECTIONS, 256);
+    __asm__ volatile("" : : "r" (p) : "memory");
+    mem_free(MEM_CONNECTIONS, p);
+  }
+  report("mem_malloc/mem_free", iterations, now_ns() - start, 0);
+}
+
+/* GET /terminals as MessagePack */
+static void bench_all_to_msgpack(int iterations) {
+  Pool_Stats pst;
+  size_t pool_misses;
+  double start;
+  size_t len;
+  char *p;
+  int i;
+
+  pool_get_stats(&pst);
+  pool_misses = pst.allocs - pst.hits;
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    p = terminal_all_to_msgpack(&len, NULL);
+    pool_free(p);
+  }
+  pool_get_stats(&pst);
+  report("all_to_msgpack", iterations, now_ns() - start,
+    pst.allocs - pst.hits - pool_misses);
+  printf("%-36s %8zu bytes\n", "", len);
+}
+
+
+/* take a snapshot of a new generation of the table
+ * that's the time writers wait for a reader of the whole table, the
+ * encoding is done from the snapshot with no locks held
+ */
+static void bench_snapshot(int iterations) {
+  Terminal_Snapshot *snap;
+  Terminal_Data t;
+  double start;
+  int i;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    /* a new generation every time */
+    if (terminal_get(1 + i % N_TERMINALS, &t)) {
+      terminal_update(t.id, &t, TERMINAL_ANY_VERSION, NULL);
+    }
+    snap = terminal_snapshot_acquire();
+    terminal_snapshot_release(snap);
+  }
+  report("snapshot new generation", iterations, now_ns() - start, 0);
+
+  snap = terminal_snapshot_acquire();
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    terminal_snapshot_release(terminal_snapshot_acquire());
+  }
+  report("snapshot same generation", iterations, now_ns() - start, 0);
+  terminal_snapshot_release(snap);
+}
+
+/* a catalog with more types than fit in a profile inline */
+#define LONG_CATALOG "{\"CardType\":[{\"id\":1,\"name\":\"Visa\"}," \
+  "{\"id\":2,\"name\":\"MasterCard\"},{\"id\":3,\"name\":\"EFTPOS\"}," \
+  "{\"id\":4,\"name\":\"Amex\"},{\"id\":5,\"name\":\"JBC\"}," \
+  "{\"id\":6,\"name\":\"Diners\"},{\"id\":7,\"name\":\"Discover\"}," \
+  "{\"id\":8,\"name\":\"UnionPay\"},{\"id\":9,\"name\":\"Maestro\"}," \
+  "{\"id\":10,\"name\":\"Electron\"},{\"id\":11,\"name\":\"RuPay\"}," \
+  "{\"id\":12,\"name\":\"Mir\"}],\"TransactionType\":[" \
+  "{\"id\":91,\"name\":\"Cheque\"},{\"id\":92,\"name\":\"Savings\"}," \
+  "{\"id\":93,\"name\":\"Credit\"},{\"id\":94,\"name\":\"Other\"}]}"
+
+/* the memory of the table for the terminals, and lookups of a terminal
+ * with a short profile (inline) and with a long one (overflow)
+ * a terminal is it's slot and a share of it's profile, a profile is a
+ * cache line. with a fixed array of every type it'd be a Terminal_Data
+ */
+static void bench_profiles(int iterations) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC",
+    "Diners", "Discover", "UnionPay", "Maestro", "Electron", "RuPay", "Mir" };
+  Terminal_Data t, saved;
+  Terminal_Stats *st;
+  double start;
+  int i;
+
+  if ((st = malloc(sizeof(Terminal_Stats))) == NULL) {
+    return;
+  }
+  terminal_get_stats(st);
+  printf("%-36s %8.1f bytes/terminal (%lu profiles, %lu overflows)\n",
+      "terminals table", sizeof(Terminal_Slot) + 64.0 * st->profiles / st->terminals,
+      (unsigned long) st->profiles, (unsigned long) st->overflows);
+  printf("%-36s %8zu bytes/terminal\n", "terminals table, fixed arrays",
+      sizeof(Terminal_Data));
+  free(st);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    terminal_get(2, &t);
+  }
+  report("get inline profile", iterations, now_ns() - start, 0);
+
+  if (!catalog_load_json(LONG_CATALOG) || !terminal_get(1, &saved)) {
+    return;
+  }
+  terminal_init_data(&t);
+  for (i = 0; i < 12; i++) {
+    terminal_add_card_type(&t, cards[i]);
+  }
+  terminal_add_transaction_type(&t, "Cheque");
+  terminal_add_transaction_type(&t, "Credit");
+  terminal_update(1, &t, TERMINAL_ANY_VERSION, NULL);
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    terminal_get(1, &t);
+  }
+  report("get overflow profile", iterations, now_ns() - start, 0);
+  terminal_update(1, &saved, TERMINAL_ANY_VERSION, NULL);
+}
+
+/* arguments of a benchmark thread */
+typedef struct thread_args {
+  int ops;
+  unsigned int seed;
+} Thread_Args;
+
+/* run a benchmark in 1, 2, 4 and 8 threads, every one doing ops operations
+ * the time per operation is the elapsed time over all operations, it
+ * should go down as threads are added, when there are cores for them
+ */
+static void run_threads(const char *name, void *(*worker)(void *), int ops) {
+  pthread_t threads[8];
+  Thread_Args args[8];
+  char label[64];
+  double start;
+  int n, i;
+
+  for (n = 1; n <= 8; n *= 2) {
+    for (i = 0; i < n; i++) {
+      args[i].ops = ops;
+      args[i].seed = i + 1;
+    }
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    for (i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    snprintf(label, sizeof(label), "%s threads=%d", name, n);
+    report(label, n * ops, now_ns() - start, 0);
+  }
+}
+
+/* as run_threads(), with worker processes that share the terminals table
+ * in shared memory (option -w of the server)
+ */
+static void run_processes(const char *name, void *(*worker)(void *), int ops) {
+  pid_t pids[8];
+  Thread_Args args;
+  char label[64];
+  double start;
+  int n, i;
+
+  for (n = 1; n <= 8; n *= 2) {
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+      if ((pids[i] = fork()) == 0) {
+        args.ops = ops;
+        args.seed = i + 1;
+        worker(&args);
+        _exit(0);
+      }
+    }
+    for (i = 0; i < n; i++) {
+      waitpid(pids[i], NULL, 0);
+    }
+    snprintf(label, sizeof(label), "%s processes=%d", name, n);
+    report(label, n * ops, now_ns() - start, 0);
+  }
+}
+
+/* reads of single terminals (GET /terminals/{id}), they take no lock */
+static void *get_worker(void *arg) {
+  Thread_Args *a = arg;
+  Terminal_Data t;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    terminal_get(1 + rand_r(&a->seed) % N_TERMINALS, &t);
+  }
+  return NULL;
+}
+
+/* mixed reads and updates of single terminals
+ * every thread does 1 update (PUT) every 10 reads (GET /terminals/{id}) of
+ * random terminals. updates to terminals in different stripes don't wait
+ * for each other
+ */
+static void *mixed_worker(void *arg) {
+  Thread_Args *a = arg;
+  Terminal_Data t;
+  terminal_id id;
+  card_type_id c;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    id = 1 + rand_r(&a->seed) % N_TERMINALS;
+    if (!terminal_get(id, &t)) {
+      continue;
+    }
+    if (i % 10 == 0) {
+      /* rotate the card types */
+      t.id = 0;
+      if (t.cards[1] != 0) {
+        c = t.cards[0];
+        t.cards[0] = t.cards[1];
+        t.cards[1] = c;
+      }
+      terminal_update(id, &t, TERMINAL_ANY_VERSION, NULL);
+    }
+  }
+  return NULL;
+}
+
+/* terminal ids from a shared atomic counter, what new_terminal_id() would
+ * be without leases, against ids from per thread leases
+ */
+static uint32_t Id_Counter;
+
+static void *atomic_id_worker(void *arg) {
+  Thread_Args *a = arg;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    __atomic_add_fetch(&Id_Counter, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static void *lease_id_worker(void *arg) {
+  Thread_Args *a = arg;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    id_lease_next();
+  }
+  return NULL;
+}
+
+/* terminal_add() and terminal_delete() of new terminals */
+static void *add_worker(void *arg) {
+  Thread_Args *a = arg;
+  Terminal_Data t;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    terminal_init_data(&t);
+    t.cards[0] = 1;
+    t.trxs[0] = 91;
+    if (terminal_add(&t)) {
+      terminal_delete(t.id, TERMINAL_ANY_VERSION);
+    }
+  }
+  return NULL;
+}
+
+/* admission of cheap requests, the cost added to every request */
+static void *admission_worker(void *arg) {
+  Thread_Args *a = arg;
+  Admission_Ticket t;
+  int i;
+
+  memset(&t, 0, sizeof(t));
+  for (i = 0; i < a->ops; i++) {
+    admission_enter(&t, ADMISSION_GET, NULL);
+    admission_leave(&t);
+  }
+  return NULL;
+}
+
+/* every thread is a client of it's own, with no limit in practice */
+static void *ratelimit_worker(void *arg) {
+  Thread_Args *a = arg;
+  uint64_t key = ratelimit_key(NULL, NULL) + a->seed * 64;
+  int i;
+
+  for (i = 0; i < a->ops; i++) {
+    ratelimit_take(key, ratelimit_now());
+  }
+  return NULL;
+}
+
+static void no_suspend(void *arg) {
+}
+
+static void bench_threads(int iterations) {
+  int id;
+
+  run_threads("get", get_worker, iterations * 1000);
+  run_threads("mixed get/update", mixed_worker, iterations * 1000);
+  admission_configure(8, no_suspend, no_suspend);
+  run_threads("admission", admission_worker, iterations * 1000);
+  ratelimit_configure(RATELIMIT_MAX, RATELIMIT_MAX);
+  run_threads("ratelimit", ratelimit_worker, iterations * 1000);
+  ratelimit_configure(0, 0);
+  run_threads("ids atomic counter", atomic_id_worker, iterations * 10000);
+  id_lease_configure(NULL, ID_LEASE_MAX_BLOCK);
+  run_threads("ids leased", lease_id_worker, iterations * 10000);
+
+  /* make room for the new terminals */
+  for (id = 1; id <= 8; id++) {
+    terminal_delete(id, TERMINAL_ANY_VERSION);
+  }
+  run_threads("add/delete", add_worker, iterations * 100);
+}
+
+static void bench_processes(int iterations) {
+  if (!shm_init(SHM_DEFAULT_SIZE) || !terminal_share() ||
+      !change_feed_share() || !id_lease_share()) {
+    fprintf(stderr, "no shared memory, skipping the worker processes\n");
+    return;
+  }
+  run_processes("get", get_worker, iterations * 1000);
+  run_processes("mixed get/update", mixed_worker, iterations * 1000);
+}
+
+/* GET /export, the file written for a new generation, and opened again
+ * for the same one, that's all a download costs but for the sendfile()
+ * of the kernel. compare with all_to_json, for every GET /terminals that
+ * misses the cache
+ */
+static void bench_export(int iterations) {
+  Terminal_Data t;
+  uint64_t generation, size = 0;
+  double start;
+  int format, i, fd;
+
+  for (format = 0; format < N_EXPORT_FORMATS; format++) {
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+      /* a new generation every time */
+      if (terminal_get(1 + i % N_TERMINALS, &t)) {
+        terminal_update(t.id, &t, TERMINAL_ANY_VERSION, NULL);
+      }
+      if ((fd = export_open(format, &generation, &size)) >= 0) {
+        close(fd);
+      }
+    }
+    report(format == EXPORT_NDJSON ? "export ndjson written" :
+        "export msgpack written", iterations, now_ns() - start, 0);
+    printf("%-36s %8llu bytes\n", "", (unsigned long long) size);
+
+    start = now_ns();
+    for (i = 0; i < iterations * 100; i++) {
+      if ((fd = export_open(format, &generation, &size)) >= 0) {
+        close(fd);
+      }
+    }
+    report(format == EXPORT_NDJSON ? "export ndjson reused" :
+        "export msgpack reused", iterations * 100, now_ns() - start, 0);
+  }
+}
+
+/* the disk backend (option -D), with a cache of STORE_BENCH_CACHE
+ * terminals, reading random terminals of a working set half the size of
+ * the cache, of one 8 times bigger, and of a skewed one: most reads to a
+ * hot set that fits, the rest to any terminal. the file is in the page
+ * cache, a miss is a pread() or two, not a seek
+ */
+#define STORE_BENCH_TERMINALS  65536
+#define STORE_BENCH_CACHE      4096
+
+static void store_bench_reads(const char *name, terminal_id *ids, int ops,
+        int set, int hot_percent) {
+  Store_Stats before, after;
+  Terminal_Data t;
+  unsigned int seed = 1;
+  double start = 0;
+  uint64_t lookups;
+  int pass, i, k;
+
+  /* a pass to warm the cache, and one that's timed */
+  for (pass = 0; pass < 2; pass++) {
+    store_get_stats(&before);
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+      k = rand_r(&seed);
+      if ((int) (k % 100) < hot_percent) {
+        k = k / 100 % set;
+      } else {
+        k = k / 100 % STORE_BENCH_TERMINALS;
+      }
+      terminal_get(ids[k], &t);
+    }
+  }
+  store_get_stats(&after);
+  lookups = after.hits + after.misses - before.hits - before.misses;
+  printf("%-36s %8d ops %12.0f ns/op %9.1f%% hits\n",
+    name,
+    ops,
+    (now_ns() - start) / ops,
+    lookups > 0 ? 100.0 * (after.hits - before.hits) / lookups : 0.0);
+}
+
+static void bench_store(int iterations) {
+  Terminal_Data t[256];
+  terminal_id *ids;
+  char path[64];
+  double start;
+  int i, n;
+
+  snprintf(path, sizeof(path), "/tmp/bench-store-%d", (int) getpid());
+  unlink(path);
+  if ((ids = malloc(STORE_BENCH_TERMINALS * sizeof(terminal_id))) == NULL ||
+      !terminal_open_store(path, 2 * STORE_BENCH_TERMINALS, STORE_BENCH_CACHE)) {
+    free(ids);
+    return;
+  }
+
+  start = now_ns();
+  for (n = 0; n < STORE_BENCH_TERMINALS; n += 256) {
+    for (i = 0; i < 256; i++) {
+      terminal_init_data(&t[i]);
+      terminal_add_card_type(&t[i], i % 2 ? "Visa" : "Amex");
+      terminal_add_transaction_type(&t[i], "Credit");
+    }
+    if (terminal_add_many(t, 256) != 256) {
+      break;
+    }
+    for (i = 0; i < 256; i++) {
+      ids[n + i] = t[i].id;
+    }
+  }
+  report("store add", n, now_ns() - start, 0);
+
+  if (n == STORE_BENCH_TERMINALS) {
+    store_bench_reads("store get, set of cache/2", ids, iterations,
+        STORE_BENCH_CACHE / 2, 100);
+    store_bench_reads("store get, set of cache*8", ids, iterations,
+        STORE_BENCH_CACHE * 8, 100);
+    store_bench_reads("store get, 90% to a hot set", ids, iterations,
+        STORE_BENCH_CACHE / 2, 90);
+  }
+
+  terminal_close_store();
+  unlink(path);
+  free(ids);
+}
+
+/* GET /terminals?q=, an expression matched against n terminals, compiled
+ * once and run on a snapshot, and interpreted: compiled again for every
+ * terminal, names and all. the table has room for N_TERMINALS, so the
+ * snapshot is QUERY_BENCH_TERMINALS of them, searched again and again
+ * with new ids
+ */
+#define QUERY_BENCH_TERMINALS  4096
+#define QUERY_BENCH_EXPR  "(CardType has Amex or JBC) and not TransactionType has Cheque " \
+  "and id in 1-5000000"
+
+static void bench_query(int n) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC" };
+  static char *trxs[] = { "Cheque", "Savings", "Credit", "Other" };
+  Terminal_Snapshot *snap;
+  Terminal_Data *out, *t;
+  Query *q, *r;
+  double start;
+  long found;
+  int error, i, j, k;
+
+  snap = malloc(sizeof(Terminal_Snapshot) +
+      QUERY_BENCH_TERMINALS * sizeof(Terminal_Data));
+  out = malloc(QUERY_BENCH_TERMINALS * sizeof(Terminal_Data));
+  if (snap == NULL || out == NULL ||
+      (q = query_get(QUERY_BENCH_EXPR, &error)) == NULL) {
+    free(snap);
+    free(out);
+    return;
+  }
+  snap->n = QUERY_BENCH_TERMINALS;
+  for (i = 0; i < QUERY_BENCH_TERMINALS; i++) {
+    t = &snap->terminals[i];
+    terminal_init_data(t);
+    for (j = 0; j <= i % 5; j++) {
+      terminal_add_card_type(t, cards[(i * 7 + j) % 5]);
+    }
+    for (j = 0; j <= i % 3; j++) {
+      terminal_add_transaction_type(t, trxs[(i * 3 + j) % 4]);
+    }
+  }
+
+  found = 0;
+  start = now_ns();
+  for (k = 0; k < n; k += QUERY_BENCH_TERMINALS) {
+    for (i = 0; i < QUERY_BENCH_TERMINALS; i++) {
+      snap->terminals[i].id = k + i + 1;
+    }
+    found += query_search(q, snap->terminals, snap->n, out);
+  }
+  report("query compiled, per terminal", k, now_ns() - start, 0);
+  printf("%-36s %8ld found\n", "", found);
+
+  found = 0;
+  start = now_ns();
+  for (k = 0; k < n / 100; k++) {
+    t = &snap->terminals[k % QUERY_BENCH_TERMINALS];
+    t->id = k + 1;
+    if ((r = query_compile(QUERY_BENCH_EXPR, &error)) != NULL) {
+      found += query_search(r, t, 1, out);
+      query_release(r);
+    }
+  }
+  report("query interpreted, per terminal", k, now_ns() - start, 0);
+  printf("%-36s %8ld found\n", "", found);
+
+  query_release(q);
+  free(out);
+  free(snap);
+}
+
+/* import a seed file of n terminals, NDJSON and CSV, with 1, 2, 4 and 8
+ * threads. the table has room for N_TERMINALS, so the lines are only
+ * parsed and checked (dry run), that's most of the work of an import
+ */
+static void bench_import(int n) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC" };
+  static char *trxs[] = { "Cheque", "Savings", "Credit", "Other" };
+  Import_Stats st;
+  char path[64], label[64];
+  const char *format;
+  FILE *f;
+  int csv, i, threads;
+
+  for (csv = 0; csv <= 1; csv++) {
+    format = csv ? "csv" : "ndjson";
+    snprintf(path, sizeof(path), "/tmp/bench-import-%d.%s", (int) getpid(), format);
+    if ((f = fopen(path, "w")) == NULL) {
+      return;
+    }
+    if (csv) {
+      fprintf(f, "id,CardType,TransactionType\n");
+    }
+    for (i = 0; i < n; i++) {
+      if (csv) {
+        fprintf(f, "%d,%s|%s,%s\n", i + 1, cards[i % 5], cards[(i + 1) % 5],
+            trxs[i % 4]);
+      } else {
+        fprintf(f, "{\"id\":%d,\"CardType\":[\"%s\",\"%s\"],"
+            "\"TransactionType\":[\"%s\"]}\n", i + 1, cards[i % 5],
+            cards[(i + 1) % 5], trxs[i % 4]);
+      }
+    }
+    fclose(f);
+    for (threads = 1; threads <= 8; threads *= 2) {
+      if (!import_file(path, threads, true, &st) || st.seconds <= 0) {
+        break;
+      }
+      snprintf(label, sizeof(label), "import %s threads=%d", format, threads);
+      printf("%-36s %8llu ops %12.0f terminals/s %6.0f MB/s\n",
+        label,
+        (unsigned long long) st.added,
+        st.added / st.seconds,
+        st.bytes / st.seconds / 1e6);
+    }
+    unlink(path);
+  }
+}
+
+/* requests arrive on a schedule, whether the ones before are done or
+ * not, on OFFLOAD_THREADS threads like the threads of libmicrohttpd. most
+ * are cheap (a terminal by id), one of every OFFLOAD_EVERY is for all the
+ * terminals. the latency of a request is from when it arrived, so it
+ * counts the time it waited behind a slow one
+ * the slow ones are done on the thread, or handed to the job pool
+ */
+#define OFFLOAD_THREADS     2
+#define OFFLOAD_EVERY       20
+#define OFFLOAD_INTERVAL    200000    /* ns between requests of a thread */
+
+typedef struct offload_args {
+  int ops;
+  bool offload;
+  int shed;                 /* the job pool was full */
+  double *latency;          /* of the cheap requests */
+  int n;
+} Offload_Args;
+
+/* encode all the terminals, like the dispatcher does */
+static void all_to_json(void) {
+  char *p, *buf;
+  size_t len;
+
+  p = terminal_all_to_json(NULL);
+  len = strlen(p);
+  if ((buf = pool_alloc(len)) != NULL) {
+    memcpy(buf, p, len);
+    pool_free(buf);
+  }
+  arena_reset();
+}
+
+static void all_to_json_job(Job *job) {
+  all_to_json();
+  free(job);
+}
+
+static void *offload_worker(void *arg) {
+  Offload_Args *a = arg;
+  struct timespec ts;
+  Terminal_Data t;
+  double start, arrival;
+  unsigned int seed = 1;
+  char *p, *buf;
+  Job *job;
+  int i;
+
+  start = now_ns();
+  for (i = 0; i < a->ops; i++) {
+    arrival = start + (double) i * OFFLOAD_INTERVAL;
+    ts.tv_sec = arrival / 1e9;
+    ts.tv_nsec = arrival - ts.tv_sec * 1e9;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    if (i % OFFLOAD_EVERY == OFFLOAD_EVERY - 1) {
+      if (!a->offload) {
+        all_to_json();
+      } else if ((job = malloc(sizeof(Job))) != NULL) {
+        job->run = all_to_json_job;
+        if (!job_pool_submit(job)) {
+          free(job);
+          a->shed++;
+        }
+      }
+      continue;
+    }
+    terminal_get(1 + rand_r(&seed) % N_TERMINALS, &t);
+    if ((p = terminal_to_json(&t)) != NULL) {
+      if ((buf = pool_alloc(strlen(p))) != NULL) {
+        memcpy(buf, p, strlen(p));
+        pool_free(buf);
+      }
+      terminal_free_json(p);
+    }
+    arena_reset();
+    a->latency[a->n++] = now_ns() - arrival;
+  }
+  return NULL;
+}
+
+static int double_compare(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void run_offload(const char *name, int ops, bool offload) {
+  pthread_t threads[OFFLOAD_THREADS];
+  Offload_Args args[OFFLOAD_THREADS];
+  double *latency;
+  int i, n = 0, shed = 0;
+
+  if ((latency = malloc(OFFLOAD_THREADS * ops * sizeof(double))) == NULL) {
+    return;
+  }
+  if (offload && !job_pool_start(JOB_POOL_DEFAULT_THREADS)) {
+    free(latency);
+    return;
+  }
+  for (i = 0; i < OFFLOAD_THREADS; i++) {
+    args[i].ops = ops;
+    args[i].offload = offload;
+    args[i].shed = 0;
+    args[i].latency = latency + i * ops;
+    args[i].n = 0;
+    pthread_create(&threads[i], NULL, offload_worker, &args[i]);
+  }
+  for (i = 0; i < OFFLOAD_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    /* pack them */
+    memmove(latency + n, args[i].latency, args[i].n * sizeof(double));
+    n += args[i].n;
+    shed += args[i].shed;
+  }
+  if (offload) {
+    job_pool_shutdown();
+  }
+  qsort(latency, n, sizeof(double), double_compare);
+  printf("%-36s %8d ops %8.0f ns p50 %8.0f ns p99 %4d shed\n",
+    name,
+    n,
+    latency[n / 2],
+    latency[n * 99 / 100],
+    shed);
+  free(latency);
+}
+
+static void bench_offload(int iterations) {
+  run_offload("get, slow ones inline", iterations, false);
+  run_offload("get, slow ones on the job pool", iterations, true);
+}
+
+/* benchmarks */
+int main(int argc, char *argv[]) {
+  int iterations = DEFAULT_ITERATIONS;
+
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+
+  fill_table();
+
+  bench_all_to_json_malloc(iterations);
+  bench_all_to_json_arena(iterations);
+  bench_all_to_msgpack(iterations);
+  bench_encode_terminal(iterations / 10 + 1);
+  bench_validate(iterations * 10);
+  bench_snapshot(iterations * 10);
+  bench_profiles(iterations * 10000);
+  bench_trace(iterations * 10000);
+  bench_mem(iterations * 10000);
+  bench_offload(iterations * 40);
+  bench_import(iterations * 4000);
+  bench_export(iterations);
+  bench_store(iterations * 4000);
+  bench_query(iterations * 50000);
+  bench_threads(iterations);
+  bench_processes(iterations);
+
+  return 0;
+}
+/* vim: set et sm ai ts=2: */
@@ -6,34 +6,35 @@
 #include <assert.h>
 #include <string.h>
 #include "card_type.h"
+#include "catalog.h"
 
 
 /* this is the card types "table"
- * it's implemented as a simple array
- * in this implementation, it's a read only object, that's
- * initialized to a given list values.
- * These values are hardcoded.
- * A better implementation would allow reading these values
- * from a file, like a config file
+ * it lives in the catalog (see catalog.h), that's read from a config file
+ * and can be reloaded while the server runs. every function here loads the
+ * catalog in use once, with no lock, and works on that one
  *
- * lookups to this array are sequential, always like "full table scan"
- * stepping through the whole table looking for data,
- * A better implementation would use a hash map to enable fast access
- * although for very low cardinality data like card types it won't
- * make a difference.
- * Or it might be hash map that acts a a cache on the real database table
- * Also memcached can be evaluated as an im memory key value store,
- * although memcached is "out of process" architecture and will need
- * network traffic for access
+ * lookups by name are sequential, always like "full table scan"
+ * for very low cardinality data like card types a hash map won't make a
+ * difference. lookups by id are done for every type of every terminal
+ * that's checked or encoded, they use the positions of the catalog
+ * (card_pos) and scan only for big ids
  */
-static Card_Type Cards[] = {
-        { 1, "Visa" },
-        { 2, "MasterCard" },
-        { 3, "EFTPOS" },
-        { 4, "Amex" },
-        { 5, "JBC" },
-        { 0, NULL }
-};
+
+/* the position of a card type in a catalog, -1 if it's not there */
+static int find_index(Catalog *c, card_type_id id) {
+  int i;
+
+  if (id < CATALOG_FAST_IDS) {
+    return c->card_pos[id] - 1;
+  }
+  for (i = 0; i < c->n_cards; i++) {
+    if (c->cards[i].id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
 
 
 /* checks if card type is valid */
@@ -44,12 +45,14 @@ bool card_type_is_valid(const char *name) {
 
 /* find a card type in the table using it's name */
 Card_Type *card_type_find_by_name(const char *name) {
+  Catalog *c = catalog_current();
   int i;
 
   assert(name != NULL);
-  for (i = 0; Cards[i].name != NULL; i++) {
-    if (strcmp(Cards[i].name, name) == 0) {
-      return &Cards[i];
+  for (i = 0; i < c->n_cards; i++) {
+    /* retired types are only found by id */
+    if (!c->cards[i].retired && strcmp(c->cards[i].name, name) == 0) {
+      return &c->cards[i];
     }
   }
   return NULL;
@@ -57,14 +60,32 @@ Card_Type *card_type_find_by_name(const char *name) {
 
 /* find a card type by it's id */
 Card_Type *card_type_find_by_id(card_type_id id) {
+  Catalog *c = catalog_current();
   int i;
 
-  for (i = 0; Cards[i].id != 0; i++) {
-    if (Cards[i].id == id) {
-      return &Cards[i];
-    }
+  i = find_index(c, id);
+  return (i < 0) ? NULL : &c->cards[i];
+}
+
+/* get the position of a card type in the table, -1 if it doesn't exist
+ * positions go from 0 to the number of card types - 1, so they can be used
+ * to index arrays that have an entry for every card type
+ * a type keeps it's position when the catalog is reloaded
+ */
+int card_type_index(card_type_id id) {
+  return find_index(catalog_current(), id);
+}
+
+/* get the card type at a position in the table, NULL past the end
+ * this is the way to step through all card types
+ */
+Card_Type *card_type_at(int i) {
+  Catalog *c = catalog_current();
+
+  if (i < 0 || i >= c->n_cards) {
+    return NULL;
   }
-  return NULL;
+  return &c->cards[i];
 }
 
 
@@ -19,13 +19,20 @@ typedef uint32_t card_type_id;
 typedef struct card_type {
   card_type_id id;
   char *name;
+  bool retired;      /* not in the catalog file anymore, see catalog.h */
 } Card_Type;
 
 
+/* most card types in the table, for arrays indexed by card_type_index() */
+#define MAX_CARD_TYPES  32
+
+
 /* prototypes */
 extern bool card_type_is_valid(const char *name);
 extern Card_Type *card_type_find_by_name(const char *name);
 extern Card_Type *card_type_find_by_id(card_type_id id);
+extern int card_type_index(card_type_id id);
+extern Card_Type *card_type_at(int i);
 
 #endif
 
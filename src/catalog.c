@@ -0,0 +1,479 @@
+/*
+ * catalog.c
+ *
+ */
+
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "catalog.h"
+#include "arena.h"
+#include "mem.h"
+#include "jansson.h"
+
+#define CATALOG_CARDS_JSON "CardType"
+#define CATALOG_TRXS_JSON "TransactionType"
+#define CATALOG_ID_JSON "id"
+#define CATALOG_NAME_JSON "name"
+#define CATALOG_RETIRED_JSON "retired"
+
+/* the built in catalog, used when there's no file
+ * it's never freed
+ */
+static Catalog Builtin = {
+  .n_cards = 5,
+  .cards = {
+    { 1, "Visa" },
+    { 2, "MasterCard" },
+    { 3, "EFTPOS" },
+    { 4, "Amex" },
+    { 5, "JBC" }
+  },
+  .n_trxs = 4,
+  .trxs = {
+    { 91, "Cheque" },
+    { 92, "Savings" },
+    { 93, "Credit" },
+    { 94, "Other" }
+  },
+  .card_pos = { [1] = 1, [2] = 2, [3] = 3, [4] = 4, [5] = 5 },
+  .trx_pos = { [91] = 1, [92] = 2, [93] = 3, [94] = 4 },
+  .generation = 1
+};
+
+/* the catalog in use, readers load it once and use it with no lock */
+static Catalog *Current = &Builtin;
+
+/* reloads are done one at a time, the lock is never taken by readers */
+static pthread_mutex_t Reload_Lock = PTHREAD_MUTEX_INITIALIZER;
+static Catalog *Replaced;
+static const char *Path;
+static void (*Reload_Hook)(bool signaled);
+
+/* the readers of the catalogs, see catalog.h
+ * a slot is taken by a thread the first time it reads, and given back
+ * when it exits. with no slot left, a reader is counted in Unslotted
+ */
+typedef struct catalog_reader {
+  uint64_t epoch;         /* the one it's reading in, 0 if it's not */
+  int taken;
+} __attribute__((aligned(64))) Catalog_Reader;
+
+static Catalog_Reader Readers[CATALOG_READERS];
+static uint64_t Epoch = 1;
+static int Unslotted;
+static __thread Catalog_Reader *My_Reader;
+static __thread int Depth;              /* read sections can nest */
+static pthread_key_t Reader_Key;
+static pthread_once_t Reader_Key_Once = PTHREAD_ONCE_INIT;
+
+/* a type while a catalog is built, the same for both kinds */
+typedef struct entry {
+  uint32_t id;
+  bool retired;
+} Entry;
+
+/* the catalog in use
+ * the pointer is good until the end of the read section of the caller
+ * (see catalog_read_begin()), it should not be kept beyond it
+ */
+Catalog *catalog_current(void) {
+  return __atomic_load_n(&Current, __ATOMIC_SEQ_CST);
+}
+
+static void reader_exit(void *p) {
+  Catalog_Reader *r = p;
+
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->taken, 0, __ATOMIC_RELEASE);
+}
+
+static void reader_make_key(void) {
+  (void) pthread_key_create(&Reader_Key, reader_exit);
+}
+
+/* the slot of the thread, taken now if it has none
+ * returns NULL if there's none left
+ */
+static Catalog_Reader *reader_get(void) {
+  int i, none;
+
+  if (My_Reader != NULL) {
+    return My_Reader;
+  }
+  (void) pthread_once(&Reader_Key_Once, reader_make_key);
+  for (i = 0; i < CATALOG_READERS; i++) {
+    none = 0;
+    if (__atomic_compare_exchange_n(&Readers[i].taken, &none, 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      My_Reader = &Readers[i];
+      (void) pthread_setspecific(Reader_Key, My_Reader);
+      break;
+    }
+  }
+  return My_Reader;
+}
+
+/* start a read section, the catalogs the thread loads in it are not freed
+ * until it ends. read sections can nest, only the outer one counts
+ * the epoch is stored before the catalog is loaded, both sequentially
+ * consistent, as the catalog and the epoch by a reload: a reload either
+ * sees the epoch, or it published the new catalog before it's loaded
+ */
+void catalog_read_begin(void) {
+  Catalog_Reader *r;
+
+  if (Depth++ > 0) {
+    return;
+  }
+  if ((r = reader_get()) != NULL) {
+    __atomic_store_n(&r->epoch, __atomic_load_n(&Epoch, __ATOMIC_SEQ_CST),
+        __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_add_fetch(&Unslotted, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* end a read section, the pointers loaded in it are not good anymore */
+void catalog_read_end(void) {
+  assert(Depth > 0);
+  if (--Depth > 0) {
+    return;
+  }
+  if (My_Reader != NULL) {
+    __atomic_store_n(&My_Reader->epoch, 0, __ATOMIC_RELEASE);
+  } else {
+    __atomic_sub_fetch(&Unslotted, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* true if no reader can have a catalog that was replaced in epoch */
+static bool quiescent(uint64_t epoch) {
+  uint64_t e;
+  int i;
+
+  if (__atomic_load_n(&Unslotted, __ATOMIC_SEQ_CST) > 0) {
+    return false;
+  }
+  for (i = 0; i < CATALOG_READERS; i++) {
+    e = __atomic_load_n(&Readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (e != 0 && e < epoch) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* read the types of one kind from a JSON array, into the ones of the
+ * catalog before (n of them, all retired to start with)
+ * returns false if the array is not valid, or there are too many types
+ */
+static bool load_types(json_t *array, const char *kind, Entry *e,
+    char (*names)[CATALOG_NAME_SIZE], int *n, int max) {
+  uint32_t seen[2] = { 0, 0 };    /* positions taken by the file */
+  json_t *v, *id, *name;
+  json_int_t i;
+  size_t k;
+  int j, pos;
+
+  assert(max <= 64);
+
+  if (!json_is_array(array)) {
+    fprintf(stderr, "catalog: %s should be an array\n", kind);
+    return false;
+  }
+  for (k = 0; k < json_array_size(array); k++) {
+    v = json_array_get(array, k);
+    id = json_object_get(v, CATALOG_ID_JSON);
+    name = json_object_get(v, CATALOG_NAME_JSON);
+    if (!json_is_integer(id) || !json_is_string(name) ||
+        (i = json_integer_value(id)) <= 0 || i > UINT32_MAX ||
+        json_string_length(name) == 0 ||
+        json_string_length(name) >= CATALOG_NAME_SIZE) {
+      fprintf(stderr, "catalog: %s %zu should have an id and a name\n", kind, k);
+      return false;
+    }
+    /* a type listed as retired (like in GET /catalog) is not taken */
+    if (json_is_true(json_object_get(v, CATALOG_RETIRED_JSON))) {
+      continue;
+    }
+
+    for (pos = 0; pos < *n && e[pos].id != (uint32_t) i; pos++) {
+      ;
+    }
+    if (pos < *n && (seen[pos / 32] & (1u << (pos % 32)))) {
+      fprintf(stderr, "catalog: %s id %lld is repeated\n", kind, (long long) i);
+      return false;
+    }
+    for (j = 0; j < *n; j++) {
+      if ((seen[j / 32] & (1u << (j % 32))) &&
+          strcmp(names[j], json_string_value(name)) == 0) {
+        fprintf(stderr, "catalog: %s name %s is repeated\n", kind,
+          json_string_value(name));
+        return false;
+      }
+    }
+    if (pos == *n) {
+      /* a new type, the retired ones keep their positions too */
+      if (*n == max) {
+        fprintf(stderr, "catalog: more than %d %s, counting the retired ones\n",
+          max, kind);
+        return false;
+      }
+      e[pos].id = i;
+      (*n)++;
+    }
+    strcpy(names[pos], json_string_value(name));
+    e[pos].retired = false;
+    seen[pos / 32] |= 1u << (pos % 32);
+  }
+  return true;
+}
+
+/* build a new catalog from the JSON one, with the types of the one in use
+ * at the same positions
+ * returns NULL if it's not valid
+ */
+static Catalog *build(json_t *json) {
+  Catalog *old = catalog_current();
+  Catalog *c;
+  Entry cards[MAX_CARD_TYPES];
+  Entry trxs[MAX_TRANSACTION_TYPES];
+  char (*card_names)[CATALOG_NAME_SIZE];
+  char (*trx_names)[CATALOG_NAME_SIZE];
+  int i;
+
+  if (!json_is_object(json) || (c = mem_calloc(MEM_CATALOG, 1, sizeof(Catalog))) == NULL) {
+    return NULL;
+  }
+  card_names = &c->names[0];
+  trx_names = &c->names[MAX_CARD_TYPES];
+
+  c->n_cards = old->n_cards;
+  for (i = 0; i < old->n_cards; i++) {
+    cards[i].id = old->cards[i].id;
+    cards[i].retired = true;
+    strcpy(card_names[i], old->cards[i].name);
+  }
+  c->n_trxs = old->n_trxs;
+  for (i = 0; i < old->n_trxs; i++) {
+    trxs[i].id = old->trxs[i].id;
+    trxs[i].retired = true;
+    strcpy(trx_names[i], old->trxs[i].name);
+  }
+
+  if (!load_types(json_object_get(json, CATALOG_CARDS_JSON), "card types",
+          cards, card_names, &c->n_cards, MAX_CARD_TYPES) ||
+      !load_types(json_object_get(json, CATALOG_TRXS_JSON), "transaction types",
+          trxs, trx_names, &c->n_trxs, MAX_TRANSACTION_TYPES)) {
+    mem_free(MEM_CATALOG, c);
+    return NULL;
+  }
+
+  for (i = 0; i < c->n_cards; i++) {
+    c->cards[i].id = cards[i].id;
+    c->cards[i].name = card_names[i];
+    c->cards[i].retired = cards[i].retired;
+    if (cards[i].id < CATALOG_FAST_IDS) {
+      c->card_pos[cards[i].id] = i + 1;
+    }
+  }
+  for (i = 0; i < c->n_trxs; i++) {
+    c->trxs[i].id = trxs[i].id;
+    c->trxs[i].name = trx_names[i];
+    c->trxs[i].retired = trxs[i].retired;
+    if (trxs[i].id < CATALOG_FAST_IDS) {
+      c->trx_pos[trxs[i].id] = i + 1;
+    }
+  }
+  return c;
+}
+
+/* publish a new catalog, in a new epoch, and free the replaced ones no
+ * reader can have anymore. the one it replaces is freed by a later reload
+ * at the earliest
+ * called with the reload lock
+ */
+static void publish(Catalog *c) {
+  Catalog *old = catalog_current();
+  Catalog **p, *q;
+  uint64_t epoch;
+
+  c->generation = old->generation + 1;
+  __atomic_store_n(&Current, c, __ATOMIC_SEQ_CST);
+  epoch = __atomic_add_fetch(&Epoch, 1, __ATOMIC_SEQ_CST);
+
+  for (p = &Replaced; *p != NULL; ) {
+    if (quiescent((*p)->replaced)) {
+      q = *p;
+      *p = q->next;
+      mem_free(MEM_CATALOG, q);
+    } else {
+      p = &(*p)->next;
+    }
+  }
+  if (old != &Builtin) {
+    old->replaced = epoch;
+    old->next = Replaced;
+    Replaced = old;
+  }
+}
+
+/* build and publish a catalog
+ * if it's not valid, the one in use is kept
+ */
+static bool load(json_t *json) {
+  Catalog *c;
+
+  pthread_mutex_lock(&Reload_Lock);
+  if ((c = build(json)) != NULL) {
+    publish(c);
+  }
+  pthread_mutex_unlock(&Reload_Lock);
+  return c != NULL;
+}
+
+static bool load_file(const char *path) {
+  json_error_t error;
+  json_t *json;
+  bool st;
+
+  if ((json = json_load_file(path, 0, &error)) == NULL) {
+    fprintf(stderr, "catalog: %s line %d: %s\n", path, error.line, error.text);
+    return false;
+  }
+  st = load(json);
+  json_decref(json);
+  return st;
+}
+
+/* load a catalog from a JSON string, see catalog.h */
+bool catalog_load_json(const char *input) {
+  json_error_t error;
+  json_t *json;
+  bool st;
+
+  assert(input != NULL);
+
+  if ((json = json_loads(input, 0, &error)) == NULL) {
+    return false;
+  }
+  st = load(json);
+  json_decref(json);
+  return st;
+}
+
+/* load the catalog from the file at path, that's read again on reloads
+ * with a NULL path the built in catalog is used
+ * returns false if the file can't be read or it's not valid
+ */
+bool catalog_configure(const char *path) {
+  Path = path;
+  return path == NULL || load_file(path);
+}
+
+/* read the file again, signaled tells if it's for SIGHUP */
+static bool reload(bool signaled) {
+  if (Path == NULL || !load_file(Path)) {
+    return false;
+  }
+  fprintf(stderr, "catalog: reloaded from %s\n", Path);
+  if (Reload_Hook != NULL) {
+    Reload_Hook(signaled);
+  }
+  return true;
+}
+
+/* read the catalog file again
+ * returns false if there's no file, or it's not valid. then the catalog
+ * in use is kept
+ */
+bool catalog_reload(void) {
+  return reload(false);
+}
+
+static void *watch_thread(void *arg) {
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  for (;;) {
+    if (sigwait(&set, &sig) == 0) {
+      reload(true);
+      arena_reset();
+    }
+  }
+  return NULL;
+}
+
+/* reload the catalog on SIGHUP
+ * SIGHUP is blocked in the calling thread, and it's taken by a thread of
+ * it's own. it should be called before other threads are started, so
+ * they don't take it either
+ */
+bool catalog_watch(void) {
+  pthread_t thread;
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+      pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+/* a function called after every reload, like to tell other processes
+ * signaled is true if the reload was for SIGHUP
+ */
+void catalog_set_reload_hook(void (*hook)(bool signaled)) {
+  Reload_Hook = hook;
+}
+
+static json_t *type_to_json(uint32_t id, const char *name, bool retired) {
+  json_t *json;
+
+  json = json_object();
+  json_object_set_new(json, CATALOG_ID_JSON, json_integer(id));
+  json_object_set_new(json, CATALOG_NAME_JSON, json_string(name));
+  if (retired) {
+    json_object_set_new(json, CATALOG_RETIRED_JSON, json_true());
+  }
+  return json;
+}
+
+/* encode the catalog in use as JSON, in the format of the file
+ * retired types are listed with "retired": true
+ */
+char *catalog_to_json(void) {
+  Catalog *c = catalog_current();
+  json_t *json, *cards, *trxs;
+  char *p;
+  int i;
+
+  cards = json_array();
+  for (i = 0; i < c->n_cards; i++) {
+    json_array_append_new(cards, type_to_json(c->cards[i].id, c->cards[i].name,
+        c->cards[i].retired));
+  }
+  trxs = json_array();
+  for (i = 0; i < c->n_trxs; i++) {
+    json_array_append_new(trxs, type_to_json(c->trxs[i].id, c->trxs[i].name,
+        c->trxs[i].retired));
+  }
+
+  json = json_object();
+  json_object_set_new(json, CATALOG_CARDS_JSON, cards);
+  json_object_set_new(json, CATALOG_TRXS_JSON, trxs);
+  p = json_dumps(json, JSON_INDENT(1));
+  json_decref(json);
+  return p;
+}
+
+/* vim: set et sm ai ts=2: */
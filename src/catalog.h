@@ -0,0 +1,85 @@
+/*
+ * catalog.h
+ *
+ */
+
+#ifndef __CATALOG_H
+#define __CATALOG_H
+
+#include <stdbool.h>
+#include <time.h>
+#include "card_type.h"
+#include "transaction_type.h"
+
+/* the card type and transaction type catalogs
+ * they are read from a JSON file at startup (option -C), and read again on
+ * SIGHUP or POST /catalog, with no restart:
+ *   { "CardType": [ { "id": 1, "name": "Visa" }, ... ],
+ *     "TransactionType": [ { "id": 91, "name": "Cheque" }, ... ] }
+ * with no file, the catalog is the one built in
+ * a catalog is never changed once it's published. a reload builds a new
+ * one off to the side and publishes it with a single pointer swap (RCU),
+ * so readers take no lock and always see a whole catalog, the one before
+ * or the new one
+ * a reader uses a catalog, and the types in it, in a read section
+ * (catalog_read_begin() and catalog_read_end(), like a request). every
+ * thread in one has the epoch it started in, in a slot of it's own, and
+ * a reload goes to a new epoch. the one before is freed by a later
+ * reload, once every reader is out of it's read section or in an epoch
+ * after it was replaced (epoch based reclamation)
+ * a type keeps it's position across reloads, the positions index the
+ * aggregate counters of the terminals table (see terminal.h). a type
+ * that's not in the file anymore is retired: it's still found by it's id,
+ * for the terminals that have it, but not by it's name, so no terminal
+ * can take it again
+ */
+#define CATALOG_READERS    1024   /* threads in read sections with a slot, the
+                                     others hold back every replaced catalog */
+#define CATALOG_NAME_SIZE  32     /* longest type name, with the NUL */
+#define CATALOG_FAST_IDS   1024   /* ids found with no scan, see Catalog */
+
+_Static_assert(MAX_CARD_TYPES < 256 && MAX_TRANSACTION_TYPES < 256,
+    "the positions of the types should fit in a byte");
+
+typedef struct catalog {
+  int n_cards;
+  Card_Type cards[MAX_CARD_TYPES];
+  int n_trxs;
+  Transaction_Type trxs[MAX_TRANSACTION_TYPES];
+
+  /* the names, so a catalog is a single block */
+  char names[MAX_CARD_TYPES + MAX_TRANSACTION_TYPES][CATALOG_NAME_SIZE];
+
+  /* the position + 1 of the type with an id, 0 if there's none, for ids
+   * below CATALOG_FAST_IDS. it's built with the catalog, so checking the
+   * types of a terminal, or finding their names, is a load for every
+   * type and not a scan of the catalog. bigger ids are scanned for
+   */
+  uint8_t card_pos[CATALOG_FAST_IDS];
+  uint8_t trx_pos[CATALOG_FAST_IDS];
+
+  /* it goes up with every reload, what's built from the names is stale
+   * when it changes
+   */
+  uint64_t generation;
+
+  /* replaced catalogs, waiting to be freed */
+  uint64_t replaced;          /* the first epoch it's not the current one */
+  struct catalog *next;
+} Catalog;
+
+
+/* prototypes */
+extern Catalog *catalog_current(void);
+extern void catalog_read_begin(void);
+extern void catalog_read_end(void);
+extern bool catalog_configure(const char *path);
+extern bool catalog_load_json(const char *input);
+extern bool catalog_reload(void);
+extern bool catalog_watch(void);
+extern void catalog_set_reload_hook(void (*hook)(bool signaled));
+extern char *catalog_to_json(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,211 @@
+/*
+ * change_feed.c
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "change_feed.h"
+#include "shm.h"
+
+/* the ring, the change with sequence number seq is at
+ * ring[seq & (CHANGE_FEED_SIZE - 1)]
+ * it's in a single structure so it can be moved to shared memory, with
+ * the terminals table (see change_feed_share())
+ */
+typedef struct change_feed {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint64_t last_seq;
+  Terminal_Change ring[CHANGE_FEED_SIZE];
+} Change_Feed;
+
+static Change_Feed Local_Feed = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .changed = PTHREAD_COND_INITIALIZER
+};
+static Change_Feed *Feed = &Local_Feed;
+
+/* called after every change, to wake up the clients waiting for it */
+static void (*Notify)(void);
+
+/* append a change to the feed, returns it's sequence number
+ * it's called by the functions that change the terminals table, holding
+ * the lock of the terminal, so changes to a terminal are in the feed in
+ * the same order they were done
+ */
+uint64_t change_feed_append(Change_Op op, Terminal_Data *t, uint32_t version) {
+  Terminal_Change *c;
+  uint64_t seq;
+
+  assert(t != NULL);
+
+  pthread_mutex_lock(&Feed->lock);
+  seq = ++Feed->last_seq;
+  c = &Feed->ring[seq & (CHANGE_FEED_SIZE - 1)];
+  c->seq = seq;
+  c->op = op;
+  c->version = version;
+  if (op == CHANGE_DELETE) {
+    terminal_init_data(&c->terminal);
+    c->terminal.id = t->id;
+  } else {
+    memcpy(&c->terminal, t, sizeof(Terminal_Data));
+  }
+  pthread_cond_broadcast(&Feed->changed);
+  pthread_mutex_unlock(&Feed->lock);
+
+  if (Notify != NULL) {
+    Notify();
+  }
+  return seq;
+}
+
+/* get the changes after since, at most max of them
+ * *next is the sequence number to ask for the following changes, the last
+ * one returned (or since if there are none)
+ * returns the number of changes, or CHANGE_FEED_RESYNC if the changes
+ * after since are not in the ring anymore, or since is a sequence number
+ * not given yet. then *next is the last sequence number
+ */
+int change_feed_read(uint64_t since, Terminal_Change *out, int max, uint64_t *next) {
+  uint64_t seq;
+  int n = 0;
+
+  assert(out != NULL || max == 0);
+  assert(next != NULL);
+
+  pthread_mutex_lock(&Feed->lock);
+  if (since > Feed->last_seq ||
+      (Feed->last_seq > CHANGE_FEED_SIZE && since < Feed->last_seq - CHANGE_FEED_SIZE)) {
+    *next = Feed->last_seq;
+    pthread_mutex_unlock(&Feed->lock);
+    return CHANGE_FEED_RESYNC;
+  }
+  for (seq = since + 1; seq <= Feed->last_seq && n < max; seq++) {
+    if (Feed->ring[seq & (CHANGE_FEED_SIZE - 1)].seq != seq) {
+      /* skipped by change_feed_reset() */
+      *next = Feed->last_seq;
+      pthread_mutex_unlock(&Feed->lock);
+      return CHANGE_FEED_RESYNC;
+    }
+    memcpy(&out[n++], &Feed->ring[seq & (CHANGE_FEED_SIZE - 1)], sizeof(Terminal_Change));
+  }
+  *next = seq - 1;
+  pthread_mutex_unlock(&Feed->lock);
+  return n;
+}
+
+/* wait until there are changes after since, or up to timeout_ms
+ * milliseconds. returns the sequence number of the last change
+ */
+uint64_t change_feed_wait(uint64_t since, int timeout_ms) {
+  struct timespec ts;
+  uint64_t seq;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&Feed->lock);
+  while (Feed->last_seq <= since) {
+    if (pthread_cond_timedwait(&Feed->changed, &Feed->lock, &ts) != 0) {
+      break;
+    }
+  }
+  seq = Feed->last_seq;
+  pthread_mutex_unlock(&Feed->lock);
+  return seq;
+}
+
+/* make every client of the feed resync, for when the whole table changes
+ * at once. the sequence numbers jump over the whole ring, so every
+ * sequence number given before is too old
+ */
+void change_feed_reset(void) {
+  pthread_mutex_lock(&Feed->lock);
+  Feed->last_seq += CHANGE_FEED_SIZE;
+  pthread_cond_broadcast(&Feed->changed);
+  pthread_mutex_unlock(&Feed->lock);
+
+  if (Notify != NULL) {
+    Notify();
+  }
+}
+
+/* get the sequence number of the last change */
+uint64_t change_feed_last_seq(void) {
+  uint64_t seq;
+
+  pthread_mutex_lock(&Feed->lock);
+  seq = Feed->last_seq;
+  pthread_mutex_unlock(&Feed->lock);
+  return seq;
+}
+
+/* move the feed to shared memory (see shm.h), so all the worker processes
+ * append to and read from the same feed. it should be called before any
+ * other thread uses the feed
+ * the notify function is still called only in the process that made the
+ * change, the other ones should wait for changes with change_feed_wait()
+ * returns false if there's no room for it in shared memory
+ */
+bool change_feed_share(void) {
+  Change_Feed *f;
+
+  if ((f = shm_alloc(sizeof(Change_Feed))) == NULL) {
+    return false;
+  }
+  if (shm_attached()) {
+    Feed = f;
+    return true;
+  }
+  memcpy(f, Feed, sizeof(Change_Feed));
+  if (!shm_mutex_init(&f->lock) || !shm_cond_init(&f->changed)) {
+    return false;
+  }
+  Feed = f;
+  return true;
+}
+
+/* true if the lock of the feed is not held for more than timeout_ms, see
+ * terminal_locks_free()
+ */
+bool change_feed_locks_free(int timeout_ms) {
+  return shm_mutex_free(&Feed->lock, timeout_ms);
+}
+
+/* repair the shared feed after a worker process died holding it's lock,
+ * with no worker running (see terminal_repair()). the change it was
+ * appending may be half written, and the table is built again, so every
+ * client resyncs, as after change_feed_reset()
+ * returns false if the locks can't be initialized
+ */
+bool change_feed_repair(void) {
+  if (!shm_mutex_init(&Feed->lock) || !shm_cond_init(&Feed->changed)) {
+    return false;
+  }
+  Feed->last_seq += CHANGE_FEED_SIZE;
+  return true;
+}
+
+/* true if the feed is shared by many processes */
+bool change_feed_shared(void) {
+  return Feed != &Local_Feed;
+}
+
+/* set the function called after every change
+ * it's called without any lock of the feed held, but maybe holding the
+ * locks of the terminals table, so it should not use the table
+ */
+void change_feed_set_notify(void (*notify)(void)) {
+  Notify = notify;
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,43 @@
+/*
+ * change_feed.h
+ *
+ */
+
+#ifndef __CHANGE_FEED_H
+#define __CHANGE_FEED_H
+
+#include <stdint.h>
+#include "terminal.h"
+
+/* the change feed
+ * every change to the terminals table is appended, with a sequence
+ * number, to a ring buffer in memory. clients ask for the changes after
+ * the last sequence number they have seen, and get only those.
+ * the ring keeps the last CHANGE_FEED_SIZE changes, a client that asks for
+ * older ones (or for sequence numbers of another run of the server) has
+ * to resync: read the whole table again and continue from the last
+ * sequence number
+ * sequence numbers start at 1, 0 is "before any change"
+ */
+#define CHANGE_FEED_SIZE    4096
+#define CHANGE_FEED_RESYNC  (-1)
+
+_Static_assert((CHANGE_FEED_SIZE & (CHANGE_FEED_SIZE - 1)) == 0,
+    "CHANGE_FEED_SIZE should be a power of 2");
+
+
+/* prototypes */
+extern uint64_t change_feed_append(Change_Op op, Terminal_Data *t, uint32_t version);
+extern int change_feed_read(uint64_t since, Terminal_Change *out, int max, uint64_t *next);
+extern uint64_t change_feed_last_seq(void);
+extern uint64_t change_feed_wait(uint64_t since, int timeout_ms);
+extern void change_feed_reset(void);
+extern bool change_feed_share(void);
+extern bool change_feed_shared(void);
+extern bool change_feed_locks_free(int timeout_ms);
+extern bool change_feed_repair(void);
+extern void change_feed_set_notify(void (*notify)(void));
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,118 @@
+/*
+ * compress.c
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+#include "compress.h"
+#include "pool.h"
+#include "header.h"
+
+/* zlib window bits, adding 16 asks zlib for a gzip header and trailer
+ * instead of the zlib ones. "deflate" in HTTP means the zlib format
+ */
+#define WINDOW_BITS  15
+#define GZIP_BITS    16
+#define MEM_LEVEL    8
+
+/* configuration, set once at startup */
+static int Compress_Level = COMPRESS_DEFAULT_LEVEL;
+static size_t Compress_Min_Size = COMPRESS_DEFAULT_MIN_SIZE;
+
+static const char *Encoding_Names[N_ENCODINGS] = {
+  "identity",
+  "gzip",
+  "deflate"
+};
+
+/* set the compression level (0 disables compression) and the minimum
+ * size of a response to be compressed
+ */
+void compress_configure(int level, size_t min_size) {
+  if (level < 0) {
+    level = 0;
+  } else if (level > 9) {
+    level = 9;
+  }
+  Compress_Level = level;
+  Compress_Min_Size = min_size;
+}
+
+const char *compress_encoding_name(Content_Encoding enc) {
+  assert(enc < N_ENCODINGS);
+  return Encoding_Names[enc];
+}
+
+/* choose an encoding for a response of the given size from the
+ * Accept-Encoding request header
+ * a header like "gzip, deflate;q=0.5" picks gzip, a missing header
+ * or a small response is identity
+ */
+Content_Encoding compress_negotiate(const char *accept_encoding, size_t size) {
+  Content_Encoding best = ENCODING_IDENTITY;
+  double best_q = 0.0;
+  double q;
+  int enc;
+
+  if (accept_encoding == NULL || Compress_Level == 0 || size < Compress_Min_Size) {
+    return ENCODING_IDENTITY;
+  }
+
+  for (enc = ENCODING_GZIP; enc < N_ENCODINGS; enc++) {
+    q = header_quality(accept_encoding, Encoding_Names[enc]);
+    if (q > best_q) {
+      best = enc;
+      best_q = q;
+    }
+  }
+  return best;
+}
+
+/* compress a buffer
+ * the returned buffer comes from the pools, it must be released with
+ * pool_free(). NULL is returned on errors
+ */
+char *compress_buffer(const char *input, size_t len, Content_Encoding enc,
+        size_t *out_len) {
+  z_stream zs;
+  char *out;
+  size_t bound;
+  int bits;
+
+  assert(input != NULL);
+  assert(out_len != NULL);
+  assert(enc == ENCODING_GZIP || enc == ENCODING_DEFLATE);
+
+  bits = (enc == ENCODING_GZIP) ? WINDOW_BITS + GZIP_BITS : WINDOW_BITS;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Compress_Level, Z_DEFLATED, bits, MEM_LEVEL,
+        Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+
+  /* deflateBound() is for the zlib header, gzip needs a few more bytes */
+  bound = deflateBound(&zs, len) + 18;
+  if ((out = pool_alloc(bound)) == NULL) {
+    deflateEnd(&zs);
+    return NULL;
+  }
+
+  zs.next_in = (Bytef *) input;
+  zs.avail_in = len;
+  zs.next_out = (Bytef *) out;
+  zs.avail_out = bound;
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&zs);
+    pool_free(out);
+    return NULL;
+  }
+  *out_len = zs.total_out;
+  deflateEnd(&zs);
+  return out;
+}
+
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,40 @@
+/*
+ * compress.h
+ *
+ */
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stddef.h>
+
+/* content encodings that can be used for responses
+ * the order is the preference order when the client accepts more than one
+ * with the same quality
+ */
+typedef enum content_encoding {
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE,
+  N_ENCODINGS
+} Content_Encoding;
+
+/* defaults for the size/latency trade-off
+ * level is the zlib compression level, 1 is fastest, 9 is smallest,
+ * 0 disables compression
+ * responses smaller than min size are not worth compressing
+ */
+#define COMPRESS_DEFAULT_LEVEL     6
+#define COMPRESS_DEFAULT_MIN_SIZE  1024
+
+
+/* prototypes */
+extern void compress_configure(int level, size_t min_size);
+extern Content_Encoding compress_negotiate(const char *accept_encoding, size_t size);
+extern const char *compress_encoding_name(Content_Encoding enc);
+extern char *compress_buffer(const char *input, size_t len, Content_Encoding enc,
+        size_t *out_len);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -4,96 +4,1810 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "dispatcher.h"
 #include "terminal.h"
+#include "arena.h"
+#include "pool.h"
+#include "compress.h"
+#include "header.h"
+#include "change_feed.h"
+#include "replica.h"
+#include "catalog.h"
+#include "admission.h"
+#include "trace.h"
+#include "job_pool.h"
+#include "export.h"
+#include "query.h"
+#include "mem.h"
 
 
-int terminals_get_handler( struct MHD_Connection *connection,
-        const char *url,
-        const char *method,
-        const char *upload_data,
-        size_t *upload_data_size ) {
-  static char *terminal_not_found = "{\n\
+/* error responses */
+static char *terminal_not_found = "{\n\
 \"error\": \"not found\",\n\
 \"error_description\": \"longer description, human-readable\"\n\
 }";
 
-  static char *unspecified_error = "{\n\
+static char *unspecified_error = "{\n\
 \"error\": \"unspecified error\",\n\
 \"error_description\": \"longer description, human-readable\"\n\
 \"error_uri\": \"URI to a detailed error description on the API developer website\"\n\
 }";
 
+static char *invalid_terminal = "{\n\
+\"error\": \"invalid terminal\",\n\
+\"error_description\": \"terminal data can not be decoded, or has invalid card or transaction types\"\n\
+}";
+
+static char *payload_too_large = "{\n\
+\"error\": \"payload too large\",\n\
+\"error_description\": \"the request body is bigger than the server accepts\"\n\
+}";
+
+static char *invalid_id_list = "{\n\
+\"error\": \"invalid id list\",\n\
+\"error_description\": \"ids should be a list of ids or ranges, like 1,2,10-20, with no more than 1000 ids\"\n\
+}";
+
+static char *invalid_query = "{\n\
+\"error\": \"invalid query\",\n\
+\"error_description\": \"q should be an expression like (CardType has Amex or JBC) and not TransactionType has Cheque, or id in 1-100, with types of the catalog, and it can not be used with ids\"\n\
+}";
+
+static char *table_full = "{\n\
+\"error\": \"insufficient storage\",\n\
+\"error_description\": \"the terminals table is full\"\n\
+}";
+
+static char *precondition_failed = "{\n\
+\"error\": \"precondition failed\",\n\
+\"error_description\": \"the terminal has changed, the version in If-Match is not the current one\"\n\
+}";
+
+static char *invalid_feed_request = "{\n\
+\"error\": \"invalid change feed request\",\n\
+\"error_description\": \"since should be a sequence number, and wait a number of seconds\"\n\
+}";
+
+static char *read_only_replica = "{\n\
+\"error\": \"read only replica\",\n\
+\"error_description\": \"this server is a follower of another one, changes should be sent to the primary\"\n\
+}";
+
+static char *service_unavailable = "{\n\
+\"error\": \"service unavailable\",\n\
+\"error_description\": \"the server is overloaded, try again after the time in Retry-After\"\n\
+}";
+
+static char *too_many_requests = "{\n\
+\"error\": \"too many requests\",\n\
+\"error_description\": \"the client is over it's rate limit, try again after the time in Retry-After\"\n\
+}";
+
+static char *invalid_catalog = "{\n\
+\"error\": \"invalid catalog\",\n\
+\"error_description\": \"the catalog file can not be read or is not valid, the catalog in use is kept\"\n\
+}";
+
+static char *no_space_for_types = "{\n\
+\"error\": \"no space\",\n\
+\"error_description\": \"there is no room for the card and transaction types of the terminal\"\n\
+}";
+
+static char *invalid_export_format = "{\n\
+\"error\": \"invalid export format\",\n\
+\"error_description\": \"format should be ndjson or msgpack\"\n\
+}";
+
+static char *export_range_not_satisfiable = "{\n\
+\"error\": \"range not satisfiable\",\n\
+\"error_description\": \"the range is past the end of the export, it's size is in Content-Range\"\n\
+}";
+
+
+/* representations of the resources
+ * JSON is the default. MessagePack is sent when the client asks for it in
+ * the Accept header, with type ids as integers instead of names
+ */
+typedef enum format {
+  FORMAT_JSON = 0,
+  FORMAT_MSGPACK,
+  N_FORMATS
+} Format;
+
+static const char *Format_Types[N_FORMATS] = {
+  "application/json",
+  "application/msgpack"
+};
+
+/* older name for the MessagePack media type, still common */
+#define MSGPACK_TYPE_OLD  "application/x-msgpack"
+
+
+/* the encoding of all terminals is cached as libmicrohttpd responses,
+ * one for every representation and content encoding. a response can be
+ * queued on any number of connections, libmicrohttpd keeps it alive
+ * until the last one is sent.
+ * the cache is valid while the generation of the terminals table doesn't
+ * change, so repeated requests cost no serialization and no compression
+ */
+static pthread_mutex_t Collection_Lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t Collection_Generation;
+static struct MHD_Response *Collection_Response[N_FORMATS][N_ENCODINGS];
+static char *Collection_Body[N_FORMATS];   /* the identity response buffers */
+static size_t Collection_Len[N_FORMATS];
+
+
+/* create a response from a pool buffer, that libmicrohttpd gives back to
+ * the pool when the response is destroyed
+ */
+static struct MHD_Response *create_pool_response(char *buf, size_t len,
+        Format format,
+        Content_Encoding enc) {
+  struct MHD_Response *response;
+
+  response = MHD_create_response_from_buffer_with_free_callback(len,
+                  (void *) buf,
+                  pool_free);
+  if (response == NULL) {
+    pool_free(buf);
+    return NULL;
+  }
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+      Format_Types[format]);
+  if (enc != ENCODING_IDENTITY) {
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING,
+        compress_encoding_name(enc));
+  }
+  MHD_add_response_header(response, MHD_HTTP_HEADER_VARY,
+      "Accept, Accept-Encoding");
+  return response;
+}
+
+/* create a response with a compressed copy of a buffer */
+static struct MHD_Response *create_compressed_response(const char *p, size_t len,
+        Format format,
+        Content_Encoding enc) {
+  char *buf;
+
+  if ((buf = compress_buffer(p, len, enc, &len)) == NULL) {
+    return NULL;
+  }
+  return create_pool_response(buf, len, format, enc);
+}
+
+/* get the encoding accepted by the client for a response of size len */
+static Content_Encoding accepted_encoding(struct MHD_Connection *connection,
+        size_t len) {
+  return compress_negotiate(MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_ACCEPT_ENCODING),
+              len);
+}
+
+/* get the representation asked by the client
+ * MessagePack must be listed in the Accept header, with a quality not
+ * lower than JSON. anything else gets JSON
+ */
+static Format accepted_format(struct MHD_Connection *connection) {
+  const char *accept;
+  double q_msgpack, q_json;
+
+  accept = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_ACCEPT);
+  if (accept == NULL) {
+    return FORMAT_JSON;
+  }
+  q_msgpack = header_quality(accept, Format_Types[FORMAT_MSGPACK]);
+  if (q_msgpack < 0) {
+    q_msgpack = header_quality(accept, MSGPACK_TYPE_OLD);
+  }
+  q_json = header_quality(accept, Format_Types[FORMAT_JSON]);
+  if (q_msgpack > 0 && q_msgpack >= q_json) {
+    return FORMAT_MSGPACK;
+  }
+  return FORMAT_JSON;
+}
+
+/* copy a string returned by the model JSON encoders to a pool buffer
+ * the string may live in the thread arena, that's reset once the handler
+ * returns, so it can't be given to libmicrohttpd
+ */
+static char *json_to_pool(char *p, size_t *len) {
+  char *buf;
+
+  if (p == NULL) {
+    return NULL;
+  }
+  *len = strlen(p);
+  if ((buf = pool_alloc(*len)) != NULL) {
+    memcpy(buf, p, *len);
+  }
+  terminal_free_json(p);
+  return buf;
+}
+
+/* create a response from a pool buffer, compressed if the client accepts
+ * it (accept_encoding is the Accept-Encoding header, or NULL)
+ * the version of a terminal, if it's not 0, is sent as the ETag
+ */
+static struct MHD_Response *create_buffer_response(char *buf,
+        size_t len,
+        Format format,
+        const char *accept_encoding,
+        const char *location,
+        uint32_t version) {
+  struct MHD_Response *response = NULL;
+  Content_Encoding enc;
+  uint64_t start;
+  char etag[16];
+
+  if (buf == NULL) {
+    return NULL;
+  }
+  enc = compress_negotiate(accept_encoding, len);
+  if (enc != ENCODING_IDENTITY) {
+    start = trace_start();
+    if ((response = create_compressed_response(buf, len, format, enc)) != NULL) {
+      pool_free(buf);
+    }
+    trace_end("compress", start);
+  }
+  if (response == NULL) {
+    /* not compressed */
+    if ((response = create_pool_response(buf, len, format, ENCODING_IDENTITY)) == NULL) {
+      return NULL;
+    }
+  }
+  if (location != NULL) {
+    MHD_add_response_header(response, MHD_HTTP_HEADER_LOCATION, location);
+  }
+  if (version != 0) {
+    snprintf(etag, sizeof(etag), "\"%u\"", version);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+  }
+  return response;
+}
+
+/* queue a response and let it go, libmicrohttpd keeps it until it's sent */
+static int queue_created_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        struct MHD_Response *response) {
+  uint64_t start;
+  int ret;
+
+  if (response == NULL) {
+    return MHD_NO;
+  }
+  start = trace_start();
+  ret = MHD_queue_response(connection, status_code, response);
+  trace_end("queue response", start);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+/* queue a response from a pool buffer, see create_buffer_response() */
+static int queue_pool_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        char *buf,
+        size_t len,
+        Format format,
+        const char *location,
+        uint32_t version) {
+  return queue_created_response(connection, status_code,
+      create_buffer_response(buf, len, format,
+          MHD_lookup_connection_value(connection,
+              MHD_HEADER_KIND,
+              MHD_HTTP_HEADER_ACCEPT_ENCODING),
+          location, version));
+}
+
+/* create a response from a JSON document (released here), see
+ * create_buffer_response(). the length is set by json_to_pool(), so it's
+ * copied first, and the length read after it
+ */
+static struct MHD_Response *json_response(char *json,
+        const char *accept_encoding) {
+  size_t len = 0;
+  char *buf;
+
+  buf = json_to_pool(json, &len);
+  return create_buffer_response(buf, len, FORMAT_JSON, accept_encoding,
+      NULL, 0);
+}
+
+/* queue a response from a JSON document, see json_response() */
+static int queue_json_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        char *json) {
+  return queue_created_response(connection, status_code,
+      json_response(json, MHD_lookup_connection_value(connection,
+              MHD_HEADER_KIND,
+              MHD_HTTP_HEADER_ACCEPT_ENCODING)));
+}
+
+/* queue the encoding of a terminal, in the representation asked by the client */
+static int queue_terminal_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        Terminal_Data *t,
+        const char *location,
+        uint32_t version) {
+  uint64_t start;
+  Format format;
+  char *buf;
+  size_t len;
+
+  format = accepted_format(connection);
+  start = trace_start();
+  if (format == FORMAT_MSGPACK) {
+    buf = terminal_to_msgpack(t, &len);
+  } else {
+    buf = json_to_pool(terminal_to_json(t), &len);
+  }
+  trace_end("encode", start);
+  return queue_pool_response(connection, status_code, buf, len, format,
+      location, version);
+}
+
+/* create a response with a constant body, like error responses */
+static struct MHD_Response *create_static_response(const char *body) {
+  struct MHD_Response *response;
+
+  response = MHD_create_response_from_buffer(strlen(body),
+                  (void*) body,
+                  MHD_RESPMEM_PERSISTENT);
+  if (response != NULL) {
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+        Format_Types[FORMAT_JSON]);
+  }
+  return response;
+}
+
+/* queue a response with a constant body */
+static int queue_static_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        const char *body) {
+  struct MHD_Response *response;
+  int ret;
+
+  if ((response = create_static_response(body)) == NULL) {
+    return MHD_NO;
+  }
+  ret = MHD_queue_response(connection, status_code, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+/* create a static response that tells when to try again, in seconds */
+static struct MHD_Response *create_retry_response(const char *body,
+        int seconds) {
+  struct MHD_Response *response;
+  char retry[16];
+
+  if ((response = create_static_response(body)) != NULL) {
+    snprintf(retry, sizeof(retry), "%d", seconds);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, retry);
+  }
+  return response;
+}
+
+/* queue a static response that tells when to try again */
+static int queue_retry_response(struct MHD_Connection *connection,
+        unsigned int status_code,
+        const char *body,
+        int seconds) {
+  struct MHD_Response *response;
+  int ret;
+
+  if ((response = create_retry_response(body, seconds)) == NULL) {
+    return MHD_NO;
+  }
+  ret = MHD_queue_response(connection, status_code, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+/* true if the encoding of all terminals the client asks for is cached */
+static bool collection_cached(struct MHD_Connection *connection) {
+  Format format;
+  bool st;
+
+  format = accepted_format(connection);
+  pthread_mutex_lock(&Collection_Lock);
+  st = Collection_Generation == terminal_generation() &&
+      Collection_Response[format][ENCODING_IDENTITY] != NULL &&
+      Collection_Response[format][accepted_encoding(connection,
+          Collection_Len[format])] != NULL;
+  pthread_mutex_unlock(&Collection_Lock);
+  return st;
+}
+
+/* drop the encodings of all terminals, they are not of generation */
+static void collection_drop(uint64_t generation) {
+  int i, j;
+
+  for (i = 0; i < N_FORMATS; i++) {
+    for (j = 0; j < N_ENCODINGS; j++) {
+      if (Collection_Response[i][j] != NULL) {
+        MHD_destroy_response(Collection_Response[i][j]);
+        Collection_Response[i][j] = NULL;
+      }
+    }
+    Collection_Body[i] = NULL;
+  }
+  Collection_Generation = generation;
+}
+
+/* get the encoding of all terminals, from the cache or encoded now and
+ * cached, in a representation and a content encoding (accept_encoding is
+ * the Accept-Encoding header) the client accepts
+ * the caller holds Collection_Lock, the response is the cached one and
+ * it's not destroyed by the caller. returns NULL if it can't be encoded
+ */
+static struct MHD_Response *collection_response(Format format,
+        const char *accept_encoding) {
+  struct MHD_Response *identity;
+  Content_Encoding enc;
+  uint64_t generation, start;
+  char *buf, *p;
+  size_t len;
+
+  /* the response is encoded from a scan of the table (terminal_scan()),
+   * so it's exactly the table at the generation it's cached for, and the
+   * table is not copied for it. it's encoded holding Collection_Lock, so
+   * generations are seen in order here
+   */
+  generation = terminal_generation();
+  if (generation != Collection_Generation) {
+    collection_drop(generation);
+  }
+
+  if (Collection_Response[format][ENCODING_IDENTITY] == NULL) {
+    fprintf(stderr, "encode all terminals as %s, generation %llu\n",
+      Format_Types[format],
+      (unsigned long long) generation);
+    start = trace_start();
+    if (format == FORMAT_MSGPACK) {
+      buf = terminal_all_to_msgpack(&len, &generation);
+    } else {
+      p = terminal_all_to_json(&generation);
+      buf = json_to_pool(p, &len);
+    }
+    trace_end("encode", start);
+    if (buf == NULL) {
+      return NULL;
+    }
+    /* the table changed meanwhile, the other encodings are older */
+    if (generation != Collection_Generation) {
+      collection_drop(generation);
+    }
+    if ((identity = create_pool_response(buf, len, format, ENCODING_IDENTITY)) == NULL) {
+      return NULL;
+    }
+    /* the buffer lives as long as the cached identity response */
+    Collection_Response[format][ENCODING_IDENTITY] = identity;
+    Collection_Body[format] = buf;
+    Collection_Len[format] = len;
+  }
+
+  enc = compress_negotiate(accept_encoding, Collection_Len[format]);
+  if (Collection_Response[format][enc] == NULL) {
+    /* compressed once per generation */
+    Collection_Response[format][enc] = create_compressed_response(
+        Collection_Body[format], Collection_Len[format], format, enc);
+    if (Collection_Response[format][enc] == NULL) {
+      enc = ENCODING_IDENTITY;
+    }
+  }
+  return Collection_Response[format][enc];
+}
+
+/* queue the encoding of all terminals, from the cache if possible */
+static int queue_collection_response(struct MHD_Connection *connection) {
+  struct MHD_Response *response;
+  int ret = MHD_NO;
+
+  pthread_mutex_lock(&Collection_Lock);
+  response = collection_response(accepted_format(connection),
+      MHD_lookup_connection_value(connection,
+          MHD_HEADER_KIND,
+          MHD_HTTP_HEADER_ACCEPT_ENCODING));
+  if (response != NULL) {
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  }
+  pthread_mutex_unlock(&Collection_Lock);
+  return ret;
+}
+
+/* most ids in a multi-get request, after expanding ranges */
+#define MAX_MULTI_GET  N_TERMINALS
+
+/* create the encoding of many terminals, for GET /terminals?ids=1,2,10-20
+ * all terminals are read in a single read section (terminal_get_many())
+ * and sent in one response, sorted by id. ids that don't exist are
+ * not in the response
+ * the status of the response is returned in status_code
+ */
+static struct MHD_Response *multi_get_response(const char *id_list,
+        Format format,
+        const char *accept_encoding,
+        unsigned int *status_code) {
+  struct MHD_Response *response;
+  terminal_id *ids;
+  Terminal_Data *ts;
+  uint64_t start;
+  char *buf;
+  size_t len;
+  int n;
+
+  *status_code = MHD_HTTP_OK;
+  ids = mem_malloc(MEM_RESPONSES, MAX_MULTI_GET * sizeof(terminal_id));
+  if (ids == NULL) {
+    return NULL;
+  }
+  if ((n = terminal_parse_id_list(id_list, ids, MAX_MULTI_GET)) < 0) {
+    mem_free(MEM_RESPONSES, ids);
+    *status_code = MHD_HTTP_BAD_REQUEST;
+    return create_static_response(invalid_id_list);
+  }
+  if ((ts = mem_malloc(MEM_RESPONSES, (n + 1) * sizeof(Terminal_Data))) == NULL) {
+    mem_free(MEM_RESPONSES, ids);
+    return NULL;
+  }
+  start = trace_start();
+  if (terminal_get_many(ids, n, ts) < 0) {
+    mem_free(MEM_RESPONSES, ts);
+    mem_free(MEM_RESPONSES, ids);
+    return NULL;
+  }
+  start = trace_end("store", start);
+
+  if (format == FORMAT_MSGPACK) {
+    buf = terminal_array_to_msgpack(ts, n, &len);
+  } else {
+    buf = json_to_pool(terminal_array_to_json(ts, n), &len);
+  }
+  trace_end("encode", start);
+  response = create_buffer_response(buf, len, format, accept_encoding, NULL, 0);
+
+  mem_free(MEM_RESPONSES, ts);
+  mem_free(MEM_RESPONSES, ids);
+  return response;
+}
+
+/* queue a response with no body, like the response to DELETE */
+static int queue_empty_response(struct MHD_Connection *connection,
+        unsigned int status_code) {
   struct MHD_Response *response;
   int ret;
+
+  response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+  if (response == NULL) {
+    return MHD_NO;
+  }
+  ret = MHD_queue_response(connection, status_code, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+/* get the terminal id of an URL like /terminals/1, 0 if it's not one */
+static terminal_id url_terminal_id(const char *url) {
+  unsigned long id;
+  char *end;
+
+  if (strncmp(url, "/terminals/", strlen("/terminals/")) != 0) {
+    return 0;
+  }
+  url += strlen("/terminals/");
+  if (!isdigit((unsigned char) *url)) {
+    return 0;
+  }
+  id = strtoul(url, &end, 10);
+  if (*end != '\0' || id > UINT32_MAX) {
+    return 0;
+  }
+  return id;
+}
+
+/* get the version in the If-Match header, that's the ETag sent with a
+ * terminal, like "3". no header, or *, match any version
+ * returns false if the header can't match any version
+ */
+static bool if_match_version(struct MHD_Connection *connection,
+        uint32_t *version) {
+  const char *p;
+  unsigned long v;
+  char *end;
+
+  *version = TERMINAL_ANY_VERSION;
+  p = MHD_lookup_connection_value(connection,
+          MHD_HEADER_KIND,
+          MHD_HTTP_HEADER_IF_MATCH);
+  if (p == NULL) {
+    return true;
+  }
+  while (*p == ' ') {
+    p++;
+  }
+  if (strcmp(p, "*") == 0) {
+    return true;
+  }
+  /* only strong tags can match */
+  if (*p++ != '"' || !isdigit((unsigned char) *p)) {
+    return false;
+  }
+  v = strtoul(p, &end, 10);
+  if (*end != '"' || v == 0 || v > UINT32_MAX) {
+    return false;
+  }
+  *version = v;
+  return true;
+}
+
+/* decode a terminal in the body, JSON or MessagePack as the Content-Type says */
+static bool load_terminal_body(struct MHD_Connection *connection,
+        Terminal_Data *t,
+        const char *upload_data,
+        size_t upload_data_size) {
+  const char *content_type;
+
+  content_type = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_CONTENT_TYPE);
+  if (content_type != NULL &&
+      (strncasecmp(content_type, Format_Types[FORMAT_MSGPACK],
+                   strlen(Format_Types[FORMAT_MSGPACK])) == 0 ||
+       strncasecmp(content_type, MSGPACK_TYPE_OLD,
+                   strlen(MSGPACK_TYPE_OLD)) == 0)) {
+    return terminal_load_msgpack(t, upload_data, upload_data_size);
+  }
+  /* the body is always NUL terminated */
+  return terminal_load_json(t, upload_data);
+}
+
+/* queue the response for a failed change of a terminal */
+static int queue_status_response(struct MHD_Connection *connection,
+        Terminal_Status st) {
+  switch (st) {
+  case TERMINAL_NOT_FOUND:
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  case TERMINAL_CONFLICT:
+    return queue_static_response(connection, MHD_HTTP_PRECONDITION_FAILED,
+        precondition_failed);
+  case TERMINAL_NO_SPACE:
+    return queue_static_response(connection, MHD_HTTP_INSUFFICIENT_STORAGE,
+        no_space_for_types);
+  default:
+    return queue_static_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+        unspecified_error);
+  }
+}
+
+/* the change feed, GET /terminals/changes?since=N
+ * returns the changes after the sequence number N (see change_feed.h)
+ * as a long-poll: if there are none, the request waits until there are
+ * some, or up to wait seconds (?wait=S, 30 by default, 0 doesn't wait).
+ * clients that send Accept: text/event-stream get a stream of server sent
+ * events instead, one event per change, that resumes after Last-Event-ID
+ * if they reconnect. both send a resync marker when the changes they ask
+ * for are not kept anymore
+ * waiting requests are suspended (MHD_suspend_connection()), so they hold
+ * no thread. they are resumed by feed_notify() when there's a change, or
+ * by the feed timer when their time is up
+ */
+#define FEED_BATCH          256   /* most changes in a long-poll response */
+#define FEED_SSE_BATCH      16    /* most changes in a write of the event stream */
+#define FEED_SSE_BLOCK      (16 * 1024)
+#define FEED_DEFAULT_WAIT   30    /* seconds */
+#define FEED_MAX_WAIT       300
+#define FEED_KEEPALIVE      15    /* seconds between keep-alive comments of the event stream */
+
+#define EVENT_STREAM_TYPE   "text/event-stream"
+
+/* a request of the change feed */
+typedef struct feed_waiter {
+  Dispatch_State state;                 /* the request state, must be first */
+  struct MHD_Connection *connection;
+  uint64_t since;                       /* last sequence number sent */
+  time_t deadline;                      /* when a long-poll stops waiting */
+  char *pending;                        /* an event larger than a write */
+  size_t pending_len, pending_pos;      /* it's size, and what's sent */
+  bool suspended;
+  struct feed_waiter *prev, *next;      /* in Waiters, while suspended */
+} Feed_Waiter;
+
+/* the suspended requests */
+static pthread_mutex_t Waiters_Lock = PTHREAD_MUTEX_INITIALIZER;
+static Feed_Waiter *Waiters;
+static bool Shutting_Down;
+
+/* take a request out of the list of suspended ones
+ * the caller should hold Waiters_Lock
+ */
+static void feed_unlink(Feed_Waiter *w) {
+  if (w->prev != NULL) {
+    w->prev->next = w->next;
+  } else {
+    Waiters = w->next;
+  }
+  if (w->next != NULL) {
+    w->next->prev = w->prev;
+  }
+  w->prev = w->next = NULL;
+  w->suspended = false;
+}
+
+/* resume a suspended request
+ * the caller should hold Waiters_Lock
+ */
+static void feed_resume(Feed_Waiter *w) {
+  feed_unlink(w);
+  MHD_resume_connection(w->connection);
+}
+
+/* suspend a request until there are changes after w->since
+ * returns false if there are changes already, then it's not suspended
+ * the check is done holding Waiters_Lock, so a change can't be missed
+ * between the check and the suspension
+ */
+static bool feed_suspend(Feed_Waiter *w) {
+  bool st = false;
+
+  pthread_mutex_lock(&Waiters_Lock);
+  if (!Shutting_Down && change_feed_last_seq() <= w->since) {
+    MHD_suspend_connection(w->connection);
+    w->suspended = true;
+    w->prev = NULL;
+    w->next = Waiters;
+    if (Waiters != NULL) {
+      Waiters->prev = w;
+    }
+    Waiters = w;
+    st = true;
+  }
+  pthread_mutex_unlock(&Waiters_Lock);
+  return st;
+}
+
+/* called by the change feed after every change, wakes up all the
+ * suspended requests
+ */
+static void feed_notify(void) {
+  pthread_mutex_lock(&Waiters_Lock);
+  while (Waiters != NULL) {
+    feed_resume(Waiters);
+  }
+  pthread_mutex_unlock(&Waiters_Lock);
+}
+
+/* the feed timer, wakes up the requests that waited long enough
+ * when the feed is shared by worker processes, it also wakes up the
+ * requests waiting for changes done by the other workers, that don't call
+ * feed_notify() in this one
+ */
+static void *feed_timer(void *arg) {
+  Feed_Waiter *w, *next;
+  uint64_t seen, last;
+  time_t now;
+
+  seen = change_feed_last_seq();
+  for (;;) {
+    if (change_feed_shared()) {
+      if ((last = change_feed_wait(seen, 1000)) != seen) {
+        seen = last;
+        feed_notify();
+      }
+    } else {
+      sleep(1);
+    }
+    now = time(NULL);
+    pthread_mutex_lock(&Waiters_Lock);
+    for (w = Waiters; w != NULL; w = next) {
+      next = w->next;
+      if (w->deadline <= now) {
+        feed_resume(w);
+      }
+    }
+    pthread_mutex_unlock(&Waiters_Lock);
+  }
+  return NULL;
+}
+
+/* release the state of a change feed request */
+static void feed_release(Dispatch_State *state) {
+  Feed_Waiter *w = (Feed_Waiter *) state;
+
+  pthread_mutex_lock(&Waiters_Lock);
+  if (w->suspended) {
+    feed_unlink(w);
+  }
+  pthread_mutex_unlock(&Waiters_Lock);
+  mem_free(MEM_CONNECTIONS, w->pending);
+  mem_free(MEM_CONNECTIONS, w);
+}
+
+/* write what fits of the event that was larger than a write */
+static ssize_t feed_sse_pending(Feed_Waiter *w, char *buf, size_t max) {
+  size_t len = w->pending_len - w->pending_pos;
+
+  if (len > max) {
+    len = max;
+  }
+  memcpy(buf, w->pending + w->pending_pos, len);
+  w->pending_pos += len;
+  if (w->pending_pos == w->pending_len) {
+    mem_free(MEM_CONNECTIONS, w->pending);
+    w->pending = NULL;
+  }
+  return len;
+}
+
+/* write an event of the stream in buf, or, if it's the first one of the
+ * write (len is 0) and it's larger than all of buf, keep it in
+ * w->pending to be sent in pieces
+ * returns the size of the event, 0 if it doesn't fit, or -1 if there's
+ * no memory
+ */
+static int feed_sse_event(Feed_Waiter *w, char *buf, size_t max, size_t len,
+        uint64_t id, const char *event, const char *data) {
+  static const char *format = "id: %llu\nevent: %s\ndata: %s\n\n";
+  int k;
+
+  k = snprintf(buf + len, max - len, format, (unsigned long long) id, event, data);
+  if (k < 0) {
+    return -1;
+  }
+  if ((size_t) k < max - len) {
+    return k;
+  }
+  if (len > 0) {
+    /* it's sent in the next write */
+    return 0;
+  }
+  if ((w->pending = mem_malloc(MEM_CONNECTIONS, k + 1)) == NULL) {
+    return -1;
+  }
+  snprintf(w->pending, k + 1, format, (unsigned long long) id, event, data);
+  w->pending_len = k;
+  w->pending_pos = 0;
+  return k;
+}
+
+/* write the changes after w->since as server sent events
+ * it's the content reader of the event stream, libmicrohttpd calls it
+ * every time it can send more. when there's nothing to send the request
+ * is suspended until there is. an event larger than a write (a terminal
+ * with many types) is sent in many writes, see feed_sse_event()
+ */
+static ssize_t feed_sse_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+  static const char *event_names[] = { "add", "update", "delete" };
+  Terminal_Change changes[FEED_SSE_BATCH];
+  Feed_Waiter *w = cls;
+  uint64_t next;
+  size_t len = 0;
+  int i, n, k;
   char *p;
-  int resource_id;
+
+  if (w->pending != NULL) {
+    return feed_sse_pending(w, buf, max);
+  }
+  for (;;) {
+    n = change_feed_read(w->since, changes, FEED_SSE_BATCH, &next);
+    if (n == CHANGE_FEED_RESYNC) {
+      p = terminal_resync_to_json(next);
+      k = feed_sse_event(w, buf, max, 0, next, "resync", p);
+      terminal_free_json(p);
+      arena_reset();
+      if (k < 0) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+      }
+      w->since = next;
+      return (w->pending != NULL) ? feed_sse_pending(w, buf, max) : k;
+    }
+    if (n > 0) {
+      catalog_read_begin();
+      for (i = 0; i < n && w->pending == NULL; i++) {
+        p = terminal_change_to_json(&changes[i]);
+        k = feed_sse_event(w, buf, max, len, changes[i].seq,
+              event_names[changes[i].op], p);
+        terminal_free_json(p);
+        if (k <= 0) {
+          break;
+        }
+        len += (w->pending == NULL) ? k : 0;
+        w->since = changes[i].seq;
+      }
+      catalog_read_end();
+      arena_reset();
+      if (w->pending != NULL) {
+        return feed_sse_pending(w, buf, max);
+      }
+      if (len == 0) {
+        /* no memory for the event */
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+      }
+      return len;
+    }
+    if (__atomic_load_n(&Shutting_Down, __ATOMIC_ACQUIRE)) {
+      return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+    if (time(NULL) >= w->deadline) {
+      /* a comment, so clients and proxies know the stream is alive */
+      w->deadline = time(NULL) + FEED_KEEPALIVE;
+      return snprintf(buf, max, ": keepalive\n\n");
+    }
+    if (feed_suspend(w)) {
+      /* called again when resumed */
+      return 0;
+    }
+  }
+}
+
+/* queue the response of GET /terminals/changes
+ * it's called again every time the request is resumed, with the same
+ * state
+ */
+static int queue_feed_response(struct MHD_Connection *connection,
+        Dispatch_State **state) {
+  struct MHD_Response *response;
+  Terminal_Change *changes;
+  Feed_Waiter *w = (Feed_Waiter *) *state;
+  const char *accept, *since, *wait;
+  unsigned long long v = 0;
+  unsigned long seconds = FEED_DEFAULT_WAIT;
+  uint64_t next;
+  char *end;
+  int n, ret;
+
+  if (w == NULL) {
+    /* first call, the state of the request is created */
+    accept = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_ACCEPT);
+    since = MHD_lookup_connection_value(connection,
+                  MHD_GET_ARGUMENT_KIND,
+                  "since");
+    if (since == NULL) {
+      /* an event stream resuming after a reconnection */
+      since = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  "Last-Event-ID");
+    }
+    wait = MHD_lookup_connection_value(connection,
+                  MHD_GET_ARGUMENT_KIND,
+                  "wait");
+    if (since != NULL) {
+      v = strtoull(since, &end, 10);
+      if (!isdigit((unsigned char) *since) || *end != '\0') {
+        return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+            invalid_feed_request);
+      }
+    }
+    if (wait != NULL) {
+      seconds = strtoul(wait, &end, 10);
+      if (!isdigit((unsigned char) *wait) || *end != '\0' || seconds > FEED_MAX_WAIT) {
+        return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+            invalid_feed_request);
+      }
+    }
+
+    if ((w = mem_calloc(MEM_CONNECTIONS, 1, sizeof(Feed_Waiter))) == NULL) {
+      return MHD_NO;
+    }
+    w->state.release = feed_release;
+    w->connection = connection;
+    w->since = v;
+    *state = &w->state;
+
+    if (accept != NULL && header_quality(accept, EVENT_STREAM_TYPE) > 0) {
+      /* event stream, written by feed_sse_reader() */
+      w->deadline = time(NULL) + FEED_KEEPALIVE;
+      response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+                      FEED_SSE_BLOCK,
+                      feed_sse_reader,
+                      w,
+                      NULL);
+      if (response == NULL) {
+        return MHD_NO;
+      }
+      MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+          EVENT_STREAM_TYPE);
+      MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL,
+          "no-cache");
+      ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+      MHD_destroy_response(response);
+      return ret;
+    }
+    w->deadline = time(NULL) + seconds;
+  }
+
+  /* long-poll */
+  if ((changes = arena_malloc(FEED_BATCH * sizeof(Terminal_Change))) == NULL) {
+    return MHD_NO;
+  }
+  for (;;) {
+    n = change_feed_read(w->since, changes, FEED_BATCH, &next);
+    if (n == CHANGE_FEED_RESYNC) {
+      return queue_json_response(connection, MHD_HTTP_OK,
+          terminal_resync_to_json(next));
+    }
+    if (n > 0 || __atomic_load_n(&Shutting_Down, __ATOMIC_ACQUIRE) ||
+        time(NULL) >= w->deadline) {
+      return queue_json_response(connection, MHD_HTTP_OK,
+          terminal_changes_to_json(changes, n, next));
+    }
+    if (feed_suspend(w)) {
+      /* called again when resumed */
+      return MHD_YES;
+    }
+  }
+}
+
+/* handlers with work too slow for the threads of libmicrohttpd, like
+ * encoding all the terminals, hand it to the job pool (see job_pool.h)
+ * the first call takes from the request what the work needs, the request
+ * can't be read by another thread, suspends it and submits the job. the
+ * job builds the response and resumes the request, and the next call
+ * queues it. the request keeps it's admission slot meanwhile
+ * (Dispatch_State.pending)
+ * with no pool (option -j 0) the work is done at once, as it used to
+ */
+typedef struct async_request {
+  Dispatch_State state;                 /* the request state, must be first */
+  Job job;
+  struct MHD_Connection *connection;
+  void (*work)(struct async_request *a);
+  /* queues the response, if it's not in response */
+  int (*finish)(struct MHD_Connection *connection, struct async_request *a);
+  uint32_t trace;                       /* the trace of the request */
+  uint64_t submitted;
+  Format format;
+  const char *accept_encoding;          /* kept by libmicrohttpd */
+  char *arg;                            /* a copy, or NULL */
+  unsigned int status;
+  struct MHD_Response *response;        /* NULL if the work failed */
+} Async_Request;
+
+static void async_release(Dispatch_State *state) {
+  Async_Request *a = (Async_Request *) state;
+
+  if (a->response != NULL) {
+    MHD_destroy_response(a->response);
+  }
+  mem_free(MEM_CONNECTIONS, a->arg);
+  mem_free(MEM_CONNECTIONS, a);
+}
+
+/* run on a thread of the pool
+ * the request is not touched once it's resumed, it may be done already
+ */
+static void async_run(Job *job) {
+  Async_Request *a = (Async_Request *) ((char *) job - offsetof(Async_Request, job));
+  uint64_t start;
+
+  trace_enter(a->trace);
+  start = trace_end("job queue", a->submitted);
+  catalog_read_begin();
+  a->work(a);
+  catalog_read_end();
+  trace_end("job", start);
+  trace_enter(0);
+  /* like the network threads, after every request */
+  arena_reset();
+  MHD_resume_connection(a->connection);
+}
+
+/* queue the response of the work of a request, on the next call */
+static int async_finish(struct MHD_Connection *connection, Async_Request *a) {
+  a->state.pending = false;
+  if (a->finish != NULL) {
+    return a->finish(connection, a);
+  }
+  if (a->response == NULL) {
+    return MHD_NO;
+  }
+  return MHD_queue_response(connection, a->status, a->response);
+}
+
+/* hand the work of a request to the job pool, arg is copied for it
+ * the state of the request is set, or it's done at once with no pool
+ */
+static int queue_async(struct MHD_Connection *connection,
+        Dispatch_State **state,
+        void (*work)(Async_Request *a),
+        int (*finish)(struct MHD_Connection *connection, Async_Request *a),
+        const char *arg) {
+  Async_Request *a;
+  int ret;
+
+  if ((a = mem_calloc(MEM_CONNECTIONS, 1, sizeof(Async_Request))) == NULL) {
+    return MHD_NO;
+  }
+  if (arg != NULL) {
+    if ((a->arg = mem_malloc(MEM_CONNECTIONS, strlen(arg) + 1)) == NULL) {
+      mem_free(MEM_CONNECTIONS, a);
+      return MHD_NO;
+    }
+    strcpy(a->arg, arg);
+  }
+  a->state.release = async_release;
+  a->job.run = async_run;
+  a->connection = connection;
+  a->work = work;
+  a->finish = finish;
+  a->format = accepted_format(connection);
+  a->accept_encoding = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_ACCEPT_ENCODING);
+  a->status = MHD_HTTP_OK;
+
+  if (!job_pool_running()) {
+    work(a);
+    ret = async_finish(connection, a);
+    async_release(&a->state);
+    return ret;
+  }
+
+  a->trace = trace_current();
+  a->submitted = trace_start();
+  a->state.pending = true;
+  *state = &a->state;
+  /* suspended before it's submitted, the job may resume it at once */
+  MHD_suspend_connection(connection);
+  if (!job_pool_submit(&a->job)) {
+    /* the pool is full, shed like admission control does */
+    a->finish = NULL;
+    a->status = MHD_HTTP_SERVICE_UNAVAILABLE;
+    a->response = create_retry_response(service_unavailable,
+        ADMISSION_RETRY_AFTER);
+    MHD_resume_connection(connection);
+  }
+  return MHD_YES;
+}
+
+static void multi_get_work(Async_Request *a) {
+  a->response = multi_get_response(a->arg, a->format, a->accept_encoding,
+      &a->status);
+}
+
+#define QUERY_CHUNK  256   /* terminals searched at once, the buffer has room for them */
+
+/* the terminals of a scan that match a query, in a buffer that grows */
+typedef struct query_scan {
+  Query *q;
+  Terminal_Data *ts;
+  int n;
+  int size;
+} Query_Scan;
+
+/* the batch is searched QUERY_CHUNK terminals at a time (a snapshot of
+ * the table in memory is a single batch), with room for all of them
+ */
+static bool query_scan_match(Terminal_Data *t, int n, void *arg) {
+  Query_Scan *qs = arg;
+  Terminal_Data *ts;
+  int i, m, size;
+
+  if (t == NULL) {
+    /* the scan starts over */
+    qs->n = 0;
+    return true;
+  }
+  for (i = 0; i < n; i += m) {
+    m = (n - i < QUERY_CHUNK) ? n - i : QUERY_CHUNK;
+    if (qs->n + m > qs->size) {
+      size = 2 * qs->size + QUERY_CHUNK;
+      if ((ts = mem_realloc(MEM_RESPONSES, qs->ts,
+              size * sizeof(Terminal_Data))) == NULL) {
+        return false;
+      }
+      qs->ts = ts;
+      qs->size = size;
+    }
+    qs->n += query_search(qs->q, t + i, m, qs->ts + qs->n);
+  }
+  return true;
+}
+
+/* the terminals that match an expression, GET /terminals?q= (see query.h)
+ * they are searched for in a scan of the table (terminal_scan()), so only
+ * the ones that match are copied, and sent like the ones of
+ * GET /terminals?ids=, in table order
+ */
+static void query_work(Async_Request *a) {
+  Terminal_Scan s;
+  Query_Scan qs;
+  uint64_t start;
+  Query *q;
+  size_t len;
+  char *buf;
+  int error;
+
+  if ((q = query_get(a->arg, &error)) == NULL) {
+    fprintf(stderr, "invalid query at %d: %s\n", error, a->arg);
+    a->status = MHD_HTTP_BAD_REQUEST;
+    a->response = create_static_response(invalid_query);
+    return;
+  }
+  start = trace_start();
+  memset(&qs, 0, sizeof(qs));
+  qs.q = q;
+  if (!terminal_scan(&s, query_scan_match, &qs)) {
+    mem_free(MEM_RESPONSES, qs.ts);
+    query_release(q);
+    return;
+  }
+  query_release(q);
+  start = trace_end("search", start);
+
+  if (a->format == FORMAT_MSGPACK) {
+    buf = terminal_array_to_msgpack(qs.ts, qs.n, &len);
+  } else {
+    buf = json_to_pool(terminal_array_to_json(qs.ts, qs.n), &len);
+  }
+  trace_end("encode", start);
+  a->response = create_buffer_response(buf, len, a->format,
+      a->accept_encoding, NULL, 0);
+  mem_free(MEM_RESPONSES, qs.ts);
+}
+
+/* the encoding is cached by the job, and queued from the cache */
+static void collection_work(Async_Request *a) {
+  pthread_mutex_lock(&Collection_Lock);
+  collection_response(a->format, a->accept_encoding);
+  pthread_mutex_unlock(&Collection_Lock);
+}
+
+static int collection_finish(struct MHD_Connection *connection,
+        Async_Request *a) {
+  return queue_collection_response(connection);
+}
+
+/* the spans of the requests traced, as Chrome trace events (see trace.h)
+ * they are written to a memory stream, that's copied to a pool buffer
+ */
+static void trace_work(Async_Request *a) {
+  char *p = NULL, *buf;
+  size_t len = 0;
+  FILE *f;
+  bool st;
+
+  if ((f = open_memstream(&p, &len)) == NULL) {
+    return;
+  }
+  st = trace_write(f);
+  if (fclose(f) != 0 || !st || (buf = pool_alloc(len)) == NULL) {
+    free(p);
+    return;
+  }
+  memcpy(buf, p, len);
+  free(p);
+  a->response = create_buffer_response(buf, len, FORMAT_JSON,
+      a->accept_encoding, NULL, 0);
+}
+
+/* read the catalog file again */
+static void catalog_reload_work(Async_Request *a) {
+  if (!catalog_reload()) {
+    a->status = MHD_HTTP_BAD_REQUEST;
+    a->response = create_static_response(invalid_catalog);
+    return;
+  }
+  a->response = json_response(catalog_to_json(), a->accept_encoding);
+}
+
+/* queue the export of all the terminals, the part of it asked for in the
+ * Range header, if any (see export.h)
+ * the file is sent from a descriptor with sendfile(), libmicrohttpd
+ * closes it when the response is done. If-Range with the ETag of an
+ * export before sends this one whole
+ */
+static int queue_export_response(struct MHD_Connection *connection,
+        Export_Format format) {
+  struct MHD_Response *response;
+  const char *if_range;
+  uint64_t generation, size, first = 0, last = 0;
+  unsigned int status_code = MHD_HTTP_OK;
+  char etag[32], range[64];
+  int fd, ret, st;
+
+  if ((fd = export_open(format, &generation, &size)) < 0) {
+    return MHD_NO;
+  }
+  snprintf(etag, sizeof(etag), "\"%llu\"", (unsigned long long) generation);
+  st = header_range(MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_RANGE),
+              size, &first, &last);
+  if_range = MHD_lookup_connection_value(connection,
+                  MHD_HEADER_KIND,
+                  MHD_HTTP_HEADER_IF_RANGE);
+  if (if_range != NULL && strcmp(if_range, etag) != 0) {
+    st = HEADER_RANGE_NONE;
+  }
+
+  if (st == HEADER_RANGE_UNSATISFIABLE) {
+    close(fd);
+    if ((response = create_static_response(export_range_not_satisfiable)) == NULL) {
+      return MHD_NO;
+    }
+    snprintf(range, sizeof(range), "bytes */%llu", (unsigned long long) size);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, range);
+    ret = MHD_queue_response(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE, response);
+    MHD_destroy_response(response);
+    return ret;
+  }
+  if (st == HEADER_RANGE_NONE) {
+    first = 0;
+    last = size - 1;
+  } else {
+    status_code = MHD_HTTP_PARTIAL_CONTENT;
+  }
+
+  response = MHD_create_response_from_fd_at_offset64(size == 0 ? 0 :
+      last - first + 1, fd, first);
+  if (response == NULL) {
+    close(fd);
+    return MHD_NO;
+  }
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+      export_content_type(format));
+  MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+  MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+  if (status_code == MHD_HTTP_PARTIAL_CONTENT) {
+    snprintf(range, sizeof(range), "bytes %llu-%llu/%llu",
+      (unsigned long long) first,
+      (unsigned long long) last,
+      (unsigned long long) size);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, range);
+  }
+  return queue_created_response(connection, status_code, response);
+}
+
+/* the export is written by the job, and queued once it's there */
+static void export_work(Async_Request *a) {
+  Export_Format format = EXPORT_NDJSON;
+  uint64_t generation, size;
+  int fd;
+
+  export_format(a->arg, &format);
+  if ((fd = export_open(format, &generation, &size)) >= 0) {
+    close(fd);
+  }
+}
+
+static int export_finish(struct MHD_Connection *connection, Async_Request *a) {
+  Export_Format format = EXPORT_NDJSON;
+
+  export_format(a->arg, &format);
+  return queue_export_response(connection, format);
+}
+
+/* start the parts of the dispatcher that run by themselves */
+void dispatch_init(void) {
+  pthread_t thread;
+
+  change_feed_set_notify(feed_notify);
+  if (pthread_create(&thread, NULL, feed_timer, NULL) == 0) {
+    pthread_detach(thread);
+  }
+}
+
+/* wake up all the suspended requests, before stopping the server
+ * they are answered with what they have, and not suspended again
+ */
+void dispatch_shutdown(void) {
+  pthread_mutex_lock(&Waiters_Lock);
+  __atomic_store_n(&Shutting_Down, true, __ATOMIC_RELEASE);
+  while (Waiters != NULL) {
+    feed_resume(Waiters);
+  }
+  pthread_mutex_unlock(&Waiters_Lock);
+}
+
+/* release the state a handler kept for a request */
+void dispatch_completed(Dispatch_State *state) {
+  if (state != NULL && state->release != NULL) {
+    state->release(state);
+  }
+}
+
+/* queue a response for an error status, used outside the handlers */
+int dispatch_error(struct MHD_Connection *connection, unsigned int status_code) {
+  if (status_code == MHD_HTTP_PAYLOAD_TOO_LARGE) {
+    return queue_static_response(connection, status_code, payload_too_large);
+  }
+  if (status_code == MHD_HTTP_SERVICE_UNAVAILABLE) {
+    /* shed by admission control, see admission.h */
+    return queue_retry_response(connection, status_code, service_unavailable,
+        ADMISSION_RETRY_AFTER);
+  }
+  return queue_static_response(connection, status_code, unspecified_error);
+}
+
+/* queue the response for a client over it's rate limit, see ratelimit.h */
+int dispatch_rate_limited(struct MHD_Connection *connection, int seconds) {
+  return queue_retry_response(connection, MHD_HTTP_TOO_MANY_REQUESTS,
+      too_many_requests, seconds);
+}
+
+int terminals_get_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  const char *id_list, *query;
+  Terminal_Data t;
+  terminal_id resource_id;
+  uint64_t start;
+  uint32_t version;
+  bool found;
 
   fprintf(stderr, "INSIDE terminals_get_handler\n");
 
    /* get the resource name */
-  if (strncmp(url, "/terminals/", strlen("/terminals/")) == 0) {
+  if (strcmp(url, "/terminals/changes") == 0) {
+    return queue_feed_response(connection, state);
+  } else if (strcmp(url, "/terminals/stats") == 0) {
+    /* aggregate counters, read without locking the table */
+    fprintf(stderr, "retrieve terminal stats\n");
+    return queue_json_response(connection, MHD_HTTP_OK,
+        terminal_stats_to_json());
+  } else if (strncmp(url, "/terminals/", strlen("/terminals/")) == 0) {
     /* now get the resource id */
-    resource_id = atoi(url + strlen("/terminals/"));
-    fprintf(stderr, "%s URL=%s resource=%d\n", method, url, resource_id);
+    resource_id = url_terminal_id(url);
+    fprintf(stderr, "%s URL=%s resource=%u\n", method, url, resource_id);
     /* get the data */
-    Terminal_Data *t = terminal_find_by_id(resource_id);
-    if (t == NULL) {
+    start = trace_start();
+    found = terminal_get_version(resource_id, &t, &version);
+    trace_end("store", start);
+    if (!found) {
       fprintf(stderr, "terminal not found");
       /* return error */
-      response = MHD_create_response_from_buffer(
-		      strlen(terminal_not_found),
-                      (void*) terminal_not_found,
-                      MHD_RESPMEM_PERSISTENT);
-      ret = MHD_queue_response(connection,
-                    404,
-                    response);
-    } else {
-      fprintf(stderr, "terminal found ");
-      p = terminal_to_json(t);
-      fprintf(stderr, "JSON=%s\n", p);
-      response = MHD_create_response_from_buffer(strlen(p),
-                  (void*) p,
-                  MHD_RESPMEM_MUST_FREE);
-      ret = MHD_queue_response(connection,
-                    MHD_HTTP_OK,
-                    response);
+      return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+          terminal_not_found);
     }
+    fprintf(stderr, "terminal found\n");
+    return queue_terminal_response(connection, MHD_HTTP_OK, &t, NULL, version);
   } else if (strcmp(url, "/terminals") == 0) {
+    /* many terminals by id */
+    id_list = MHD_lookup_connection_value(connection,
+                  MHD_GET_ARGUMENT_KIND,
+                  "ids");
+    /* or the ones that match an expression */
+    query = MHD_lookup_connection_value(connection,
+                  MHD_GET_ARGUMENT_KIND,
+                  "q");
+    if (query != NULL) {
+      if (id_list != NULL) {
+        return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+            invalid_query);
+      }
+      fprintf(stderr, "search terminals %s\n", query);
+      return queue_async(connection, state, query_work, NULL, query);
+    }
+    if (id_list != NULL) {
+      fprintf(stderr, "retrieve terminals %s\n", id_list);
+      return queue_async(connection, state, multi_get_work, NULL, id_list);
+    }
     fprintf(stderr, "retrieve all terminals\n");
-    p = terminal_all_to_json();
-    fprintf(stderr, "JSON=%s\n", p);
-    response = MHD_create_response_from_buffer(strlen(p),
-                  (void*) p,
-                  MHD_RESPMEM_MUST_FREE);
-    ret = MHD_queue_response(connection,
-                    MHD_HTTP_OK,
-                    response);
-  } else {
-    /* return error */
-    response = MHD_create_response_from_buffer(strlen(unspecified_error),
-                  (void*) unspecified_error,
-		  MHD_RESPMEM_PERSISTENT);
-    ret = MHD_queue_response(connection,
-                    400,
-                    response);
+    /* only encoding them is slow */
+    if (!job_pool_running() || collection_cached(connection)) {
+      return queue_collection_response(connection);
+    }
+    return queue_async(connection, state, collection_work, collection_finish,
+        NULL);
   }
 
-  MHD_destroy_response(response);
+  /* return error */
+  return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+      unspecified_error);
+}
 
-  return ret;
+/* create a terminal
+ * the body is JSON, or MessagePack when the Content-Type says so.
+ * the new terminal is returned, with it's URL in the Location header
+ */
+int terminals_post_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  char location[64];
+  Terminal_Data t;
+  uint64_t start;
+  uint32_t version;
+  bool added;
+
+  fprintf(stderr, "INSIDE terminals_post_handler\n");
+
+  /* terminals are only created on the collection */
+  if (strcmp(url, "/terminals") != 0) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        unspecified_error);
+  }
+  if (upload_data == NULL || *upload_data_size == 0) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        invalid_terminal);
+  }
+
+  /* decode the body */
+  start = trace_start();
+  if (!load_terminal_body(connection, &t, upload_data, *upload_data_size)) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        invalid_terminal);
+  }
+  start = trace_end("decode", start);
+
+  added = terminal_add_version(&t, &version);
+  trace_end("store", start);
+  if (!added) {
+    return queue_static_response(connection, MHD_HTTP_INSUFFICIENT_STORAGE,
+        table_full);
+  }
+  fprintf(stderr, "terminal %u created\n", t.id);
+
+  snprintf(location, sizeof(location), "/terminals/%u", t.id);
+  return queue_terminal_response(connection, MHD_HTTP_CREATED, &t, location,
+      version);
+}
+
+/* replace the card and transaction types of a terminal
+ * the body is a terminal, like the one sent to POST. with an If-Match
+ * header, the terminal is only changed if it's still that version
+ */
+int terminals_put_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  Terminal_Status st;
+  Terminal_Data t;
+  terminal_id resource_id;
+  uint64_t start;
+  uint32_t version;
+
+  fprintf(stderr, "INSIDE terminals_put_handler\n");
+
+  if ((resource_id = url_terminal_id(url)) == 0) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        unspecified_error);
+  }
+  if (!if_match_version(connection, &version)) {
+    return queue_status_response(connection, TERMINAL_CONFLICT);
+  }
+  start = trace_start();
+  if (upload_data == NULL || *upload_data_size == 0 ||
+      !load_terminal_body(connection, &t, upload_data, *upload_data_size)) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        invalid_terminal);
+  }
+  start = trace_end("decode", start);
+
+  st = terminal_update(resource_id, &t, version, &version);
+  trace_end("store", start);
+  if (st != TERMINAL_OK) {
+    return queue_status_response(connection, st);
+  }
+  fprintf(stderr, "terminal %u updated\n", t.id);
+  return queue_terminal_response(connection, MHD_HTTP_OK, &t, NULL, version);
+}
+
+/* add and remove card and transaction types of a terminal
+ * the body is JSON, see terminal_load_patch_json(). If-Match works as
+ * in PUT
+ */
+int terminals_patch_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  Terminal_Status st;
+  Terminal_Data add, remove, t;
+  terminal_id resource_id;
+  uint64_t start;
+  uint32_t version;
+
+  fprintf(stderr, "INSIDE terminals_patch_handler\n");
+
+  if ((resource_id = url_terminal_id(url)) == 0) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        unspecified_error);
+  }
+  if (!if_match_version(connection, &version)) {
+    return queue_status_response(connection, TERMINAL_CONFLICT);
+  }
+  /* the body is always NUL terminated */
+  start = trace_start();
+  if (upload_data == NULL || *upload_data_size == 0 ||
+      !terminal_load_patch_json(&add, &remove, upload_data)) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        invalid_terminal);
+  }
+  start = trace_end("decode", start);
+
+  st = terminal_patch(resource_id, &add, &remove, version, &t, &version);
+  trace_end("store", start);
+  if (st != TERMINAL_OK) {
+    return queue_status_response(connection, st);
+  }
+  fprintf(stderr, "terminal %u patched\n", t.id);
+  return queue_terminal_response(connection, MHD_HTTP_OK, &t, NULL, version);
+}
+
+/* delete a terminal. If-Match works as in PUT */
+int terminals_delete_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  Terminal_Status st;
+  terminal_id resource_id;
+  uint64_t start;
+  uint32_t version;
+
+  fprintf(stderr, "INSIDE terminals_delete_handler\n");
+
+  if ((resource_id = url_terminal_id(url)) == 0) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        unspecified_error);
+  }
+  if (!if_match_version(connection, &version)) {
+    return queue_status_response(connection, TERMINAL_CONFLICT);
+  }
+  start = trace_start();
+  st = terminal_delete(resource_id, version);
+  trace_end("store", start);
+  if (st != TERMINAL_OK) {
+    return queue_status_response(connection, st);
+  }
+  fprintf(stderr, "terminal %u deleted\n", resource_id);
+  return queue_empty_response(connection, MHD_HTTP_NO_CONTENT);
+}
+
+/* the card and transaction types catalog, see catalog.h */
+int catalog_get_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  if (strcmp(url, "/catalog") != 0) {
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  }
+  return queue_json_response(connection, MHD_HTTP_OK, catalog_to_json());
+}
+
+/* read the catalog file again, the body is ignored */
+int catalog_post_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  fprintf(stderr, "INSIDE catalog_post_handler\n");
+
+  if (strcmp(url, "/catalog") != 0) {
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  }
+  return queue_async(connection, state, catalog_reload_work, NULL, NULL);
+}
+
+/* the spans of the requests traced, see trace_work() */
+int trace_get_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  if (strcmp(url, "/trace") != 0) {
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  }
+  return queue_async(connection, state, trace_work, NULL, NULL);
+}
+
+/* the memory in use, by subsystem, see mem.h */
+int memory_get_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  if (strcmp(url, "/memory") != 0) {
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  }
+  return queue_json_response(connection, MHD_HTTP_OK, mem_to_json());
+}
+
+/* all the terminals as a file, for backups and analytics, see export.h
+ * GET /export?format=ndjson (the default) or msgpack, with Range
+ */
+int export_get_handler( struct MHD_Connection *connection,
+        const char *url,
+        const char *method,
+        const char *upload_data,
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
+  Export_Format format = EXPORT_NDJSON;
+  const char *name;
+
+  if (strcmp(url, "/export") != 0) {
+    return queue_static_response(connection, MHD_HTTP_NOT_FOUND,
+        terminal_not_found);
+  }
+  name = MHD_lookup_connection_value(connection,
+                  MHD_GET_ARGUMENT_KIND,
+                  "format");
+  if (name != NULL && !export_format(name, &format)) {
+    return queue_static_response(connection, MHD_HTTP_BAD_REQUEST,
+        invalid_export_format);
+  }
+  /* only writing it is slow */
+  if (!job_pool_running() || export_current(format)) {
+    return queue_export_response(connection, format);
+  }
+  return queue_async(connection, state, export_work, export_finish,
+      name != NULL ? name : "ndjson");
 }
 
 static Dispatcher_Entry Dispatch_Table[] = {
   { "/terminals",
      { terminals_get_handler, 
-       NULL, 
-       NULL, 
-       NULL, 
-       NULL 
+       terminals_post_handler, 
+       terminals_put_handler, 
+       terminals_patch_handler, 
+       terminals_delete_handler 
+     }
+  },
+  { "/catalog",
+     { catalog_get_handler,
+       catalog_post_handler,
+       NULL,
+       NULL,
+       NULL
+     }
+  },
+  { "/trace",
+     { trace_get_handler,
+       NULL,
+       NULL,
+       NULL,
+       NULL
+     }
+  },
+  { "/export",
+     { export_get_handler,
+       NULL,
+       NULL,
+       NULL,
+       NULL
+     }
+  },
+  { "/memory",
+     { memory_get_handler,
+       NULL,
+       NULL,
+       NULL,
+       NULL
      }
   },
   { 0, { NULL, NULL, NULL, NULL } }
@@ -121,25 +1835,33 @@ int dispatch( struct MHD_Connection *connection,
         const char *url,
         const char *method,
         const char *upload_data,
-        size_t *upload_data_size ) {
+        size_t *upload_data_size,
+        Dispatch_State **state ) {
   int i;
   int idx;
-  char *p;
-  char url_base[BUFSIZ];
+  int ret;
+  const char *p;
+  size_t base_len;
+  size_t len;
+  uint64_t start;
 
-  /* get the base URL */
-  strncpy(url_base, url, BUFSIZ);
-  url_base[BUFSIZ - 1] = '\0';
-  if ((p = strrchr(url_base, '/')) != NULL) {
-    if (p != url_base) {
-      *p = '\0';
+  start = trace_start();
+
+  /* get the length of the base URL, that's the URL without the last
+   * component. the URL is not copied, the base is compared in place
+   */
+  base_len = strlen(url);
+  if ((p = strrchr(url, '/')) != NULL) {
+    if (p != url) {
+      base_len = p - url;
     }
   }
 
   /* search the dispatch table */
   for (i = 0; Dispatch_Table[i].url != NULL; i++ ) {
     /* url should match */
-    if (strncmp(Dispatch_Table[i].url, url_base, strlen(Dispatch_Table[i].url)) == 0 ) {
+    len = strlen(Dispatch_Table[i].url);
+    if (len <= base_len && strncmp(Dispatch_Table[i].url, url, len) == 0 ) {
       /* get http verb */
       idx = method_to_idx(method);
       if (idx == -1) {
@@ -150,14 +1872,33 @@ int dispatch( struct MHD_Connection *connection,
 	/* no function configured for this verb */
         return MHD_NO;
       }
+      /* a follower gets it's changes from the primary only */
+      if (idx != 0 && replica_read_only()) {
+        return queue_static_response(connection, MHD_HTTP_FORBIDDEN,
+            read_only_replica);
+      }
+      start = trace_end("route", start);
+      if (*state != NULL && (*state)->release == async_release) {
+        /* called again, the work was done by the job pool */
+        ret = async_finish(connection, (Async_Request *) *state);
+        trace_end("handler", start);
+        return ret;
+      }
       /* call the function */
-      return (Dispatch_Table[i].dispatch_function[idx])(
+      ret = (Dispatch_Table[i].dispatch_function[idx])(
          connection,
          url,
          method,
          upload_data,
-         upload_data_size
+         upload_data_size,
+         state
 	 );
+      trace_end("handler", start);
+      /* the response is queued, all the memory used to build it
+       * can be given back at once
+       */
+      arena_reset();
+      return ret;
     }
   }
   return MHD_NO;
@@ -10,6 +10,20 @@
 #include <stdint.h>
 #include "microhttpd.h"
 
+/* per request state that a handler keeps between calls for the same
+ * request, like a request that waits for something (suspended) and is
+ * called again later. the handler sets it on the first call, it's given
+ * back on the next ones, and release() is called when the request is done
+ * handlers put this as the first member of their own state
+ * pending is true while the work of the request is done by the job pool
+ * (see job_pool.h), the request keeps it's admission slot until the
+ * response is queued
+ */
+typedef struct dispatch_state {
+  void (*release)(struct dispatch_state *state);
+  bool pending;
+} Dispatch_State;
+
 /* this is dispatch structure
  * for every URL base, we have 5 function pointers, one for every HTTP verb
  * one for GET to handle READ actions
@@ -25,16 +39,25 @@ typedef struct  {
         const char *url,
         const char *method,
         const char *upload_data,
-        size_t *upload_data_size );
+        size_t *upload_data_size,
+        Dispatch_State **state );
 } Dispatcher_Entry;
 
 
 /* prototypes */
+extern void dispatch_init( void );
+extern void dispatch_shutdown( void );
 extern int dispatch( struct MHD_Connection *connection,
         const char *url,
         const char *method,
         const char *upload_data,
-        size_t *upload_data_size );
+        size_t *upload_data_size,
+        Dispatch_State **state );
+extern void dispatch_completed( Dispatch_State *state );
+extern int dispatch_error( struct MHD_Connection *connection,
+        unsigned int status_code );
+extern int dispatch_rate_limited( struct MHD_Connection *connection,
+        int seconds );
 
 #endif
 
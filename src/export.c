@@ -0,0 +1,259 @@
+/*
+ * export.c
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "export.h"
+#include "terminal.h"
+#include "pool.h"
+#include "msgpack.h"
+
+#define EXPORT_FILE  "%s/terminals-export-XXXXXX"
+
+static const char *Format_Names[N_EXPORT_FORMATS] = {
+  "ndjson",
+  "msgpack"
+};
+
+static const char *Content_Types[N_EXPORT_FORMATS] = {
+  "application/x-ndjson",
+  "application/msgpack"
+};
+
+/* the export of every format, written one at a time */
+static pthread_mutex_t Export_Lock = PTHREAD_MUTEX_INITIALIZER;
+static char Dir[256] = EXPORT_DEFAULT_DIR;
+static int Fd[N_EXPORT_FORMATS] = { -1, -1 };
+static uint64_t Generation[N_EXPORT_FORMATS];
+static uint64_t Size[N_EXPORT_FORMATS];
+static Export_Stats Stats;
+
+/* set the directory for the files, it should be writable */
+bool export_configure(const char *dir) {
+  if (dir == NULL) {
+    return true;
+  }
+  if (strlen(dir) >= sizeof(Dir) - 32 || access(dir, W_OK | X_OK) != 0) {
+    return false;
+  }
+  pthread_mutex_lock(&Export_Lock);
+  strcpy(Dir, dir);
+  pthread_mutex_unlock(&Export_Lock);
+  return true;
+}
+
+/* get a format by it's name, like "ndjson" */
+bool export_format(const char *name, Export_Format *format) {
+  int i;
+
+  for (i = 0; i < N_EXPORT_FORMATS; i++) {
+    if (strcmp(name, Format_Names[i]) == 0) {
+      *format = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *export_content_type(Export_Format format) {
+  assert(format >= 0 && format < N_EXPORT_FORMATS);
+  return Content_Types[format];
+}
+
+/* the export being written as the table is scanned */
+typedef struct export_scan {
+  Terminal_Scan s;
+  FILE *f;
+  int found;
+  bool started;           /* the MessagePack array is written */
+} Export_Scan;
+
+/* drop what's written, the scan starts over */
+static bool write_restart(Export_Scan *es) {
+  es->found = 0;
+  es->started = false;
+  return fflush(es->f) == 0 && ftruncate(fileno(es->f), 0) == 0 &&
+      fseek(es->f, 0, SEEK_SET) == 0;
+}
+
+/* the terminals of a scan, a line each */
+static bool write_lines(Terminal_Data *t, int n, void *arg) {
+  Export_Scan *es = arg;
+  char *p;
+  bool st = true;
+  int i;
+
+  if (t == NULL) {
+    return write_restart(es);
+  }
+  for (i = 0; i < n && st; i++) {
+    if (t[i].id == 0) {
+      continue;
+    }
+    if ((p = terminal_to_json_line(&t[i])) == NULL) {
+      return false;
+    }
+    st = fputs(p, es->f) != EOF && fputc('\n', es->f) != EOF;
+    terminal_free_json(p);
+    es->found++;
+  }
+  return st;
+}
+
+/* the head of the MessagePack array, of the terminals of the scan */
+static bool write_array(Export_Scan *es) {
+  Msgpack_Buffer b;
+  bool st;
+
+  msgpack_buffer_init(&b, 8);
+  msgpack_pack_array(&b, es->s.n);
+  st = !b.error && fwrite(b.data, 1, b.len, es->f) == b.len;
+  pool_free(b.data);
+  es->started = true;
+  return st;
+}
+
+/* the terminals of a scan, packed one after the other in the array, like
+ * terminal_all_to_msgpack() encodes them
+ */
+static bool write_packed(Terminal_Data *t, int n, void *arg) {
+  Export_Scan *es = arg;
+  size_t len;
+  char *p;
+  bool st = true;
+  int i;
+
+  if (t == NULL) {
+    return write_restart(es);
+  }
+  if (!es->started && !write_array(es)) {
+    return false;
+  }
+  for (i = 0; i < n && st; i++) {
+    if (t[i].id == 0) {
+      continue;
+    }
+    if ((p = terminal_to_msgpack(&t[i], &len)) == NULL) {
+      return false;
+    }
+    st = fwrite(p, 1, len, es->f) == len;
+    pool_free(p);
+    es->found++;
+  }
+  return st;
+}
+
+/* write the export as the table is scanned, so only a batch of terminals
+ * is encoded at a time, with the generation it's of
+ */
+static bool write_scan(int fd, Export_Format format, uint64_t *generation) {
+  Export_Scan es;
+  bool st;
+
+  memset(&es, 0, sizeof(es));
+  if ((es.f = fdopen(dup(fd), "w")) == NULL) {
+    return false;
+  }
+  if (format == EXPORT_MSGPACK) {
+    /* an empty table has no batch to write the array */
+    st = terminal_scan(&es.s, write_packed, &es) &&
+        (es.started || write_array(&es));
+  } else {
+    st = terminal_scan(&es.s, write_lines, &es);
+  }
+  *generation = es.s.generation;
+  return fclose(es.f) == 0 && st && es.found == es.s.n;
+}
+
+/* write the export of the table to a new file, that's unlinked at once,
+ * with the generation it's of
+ * returns it's descriptor, or -1
+ */
+static int write_file(Export_Format format, uint64_t *generation,
+        uint64_t *size) {
+  char path[sizeof(Dir) + 32];
+  off_t end;
+  bool st;
+  int fd;
+
+  snprintf(path, sizeof(path), EXPORT_FILE, Dir);
+  if ((fd = mkstemp(path)) < 0) {
+    return -1;
+  }
+  unlink(path);
+  st = write_scan(fd, format, generation);
+  if (!st || (end = lseek(fd, 0, SEEK_END)) < 0) {
+    close(fd);
+    return -1;
+  }
+  *size = end;
+  return fd;
+}
+
+/* true if the export of the table as it's now is written already */
+bool export_current(Export_Format format) {
+  bool st;
+
+  assert(format >= 0 && format < N_EXPORT_FORMATS);
+
+  pthread_mutex_lock(&Export_Lock);
+  st = Fd[format] >= 0 && Generation[format] == terminal_generation();
+  pthread_mutex_unlock(&Export_Lock);
+  return st;
+}
+
+/* open the export of the table, written now if the table changed since
+ * the last one
+ * returns a descriptor of it's own, for the caller to close, with the
+ * generation of the scan and the size of the file, or -1
+ */
+int export_open(Export_Format format, uint64_t *generation, uint64_t *size) {
+  uint64_t len, written;
+  int fd;
+
+  assert(format >= 0 && format < N_EXPORT_FORMATS);
+  assert(generation != NULL && size != NULL);
+
+  pthread_mutex_lock(&Export_Lock);
+  if (Fd[format] < 0 || Generation[format] != terminal_generation()) {
+    if ((fd = write_file(format, &written, &len)) < 0) {
+      pthread_mutex_unlock(&Export_Lock);
+      return -1;
+    }
+    fprintf(stderr, "export all terminals as %s, generation %llu\n",
+      Format_Names[format],
+      (unsigned long long) written);
+    /* downloads of the one before keep it open until they are done */
+    if (Fd[format] >= 0) {
+      close(Fd[format]);
+    }
+    Fd[format] = fd;
+    Generation[format] = written;
+    Size[format] = len;
+    Stats.written++;
+    Stats.bytes += len;
+  } else {
+    Stats.reused++;
+  }
+  fd = dup(Fd[format]);
+  *generation = Generation[format];
+  *size = Size[format];
+  pthread_mutex_unlock(&Export_Lock);
+  return fd;
+}
+
+void export_get_stats(Export_Stats *st) {
+  assert(st != NULL);
+
+  pthread_mutex_lock(&Export_Lock);
+  *st = Stats;
+  pthread_mutex_unlock(&Export_Lock);
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,50 @@
+/*
+ * export.h
+ *
+ */
+
+#ifndef __EXPORT_H
+#define __EXPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* snapshot exports of all the terminals, for backups and analytics
+ * (GET /export). an export is a file written from a scan of the table
+ * (terminal_scan()), so it's a single generation, in NDJSON (a terminal
+ * on every line, as compact JSON) or MessagePack (an array of terminals,
+ * like GET /terminals)
+ * the file of every format is kept open, and used again while the
+ * generation doesn't change. it's unlinked at once, in the directory of
+ * option -E, so nothing is left behind. responses are sent from a
+ * descriptor of their own (MHD_create_response_from_fd), by the kernel
+ * with sendfile(), and a download keeps the file it started with when a
+ * new generation is exported, so it can resume it with Range and If-Range
+ */
+#define EXPORT_DEFAULT_DIR  "/tmp"
+
+typedef enum export_format {
+  EXPORT_NDJSON,
+  EXPORT_MSGPACK,
+  N_EXPORT_FORMATS
+} Export_Format;
+
+typedef struct export_stats {
+  uint64_t written;       /* files */
+  uint64_t reused;        /* opens with no file written */
+  uint64_t bytes;         /* written */
+} Export_Stats;
+
+
+/* prototypes */
+extern bool export_configure(const char *dir);
+extern bool export_format(const char *name, Export_Format *format);
+extern const char *export_content_type(Export_Format format);
+extern bool export_current(Export_Format format);
+extern int export_open(Export_Format format, uint64_t *generation,
+                uint64_t *size);
+extern void export_get_stats(Export_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
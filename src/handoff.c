@@ -0,0 +1,293 @@
+/*
+ * handoff.c
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "shm.h"
+
+#define HANDOFF_MAGIC  0x68616e64
+#define HANDOFF_VERSION  1
+#define HANDOFF_MAX_FDS  4
+
+/* a process that doesn't answer on the control socket for this long is
+ * given up
+ */
+#define HANDOFF_TIMEOUT  5
+
+typedef struct handoff_message {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t type;
+} Handoff_Message;
+
+static int Control = -1;              /* the control socket, listening */
+static int Done[2] = { -1, -1 };      /* readable after the handoff */
+static int (*Listening)(void);
+static int (*Quiesce)(void);
+
+/* send a message, with n descriptors */
+bool handoff_send(int sock, Handoff_Message_Type type, const int *fds, int n) {
+  Handoff_Message m;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+
+  assert(n >= 0 && n <= HANDOFF_MAX_FDS);
+  assert(fds != NULL || n == 0);
+
+  m.magic = HANDOFF_MAGIC;
+  m.version = HANDOFF_VERSION;
+  m.type = type;
+  iov.iov_base = &m;
+  iov.iov_len = sizeof(m);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(m);
+}
+
+/* receive a message of the given type, and up to max descriptors
+ * returns the number of descriptors, or -1 if it's not that message
+ * descriptors beyond max are closed
+ */
+int handoff_recv(int sock, Handoff_Message_Type type, int *fds, int max) {
+  Handoff_Message m;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  int got[HANDOFF_MAX_FDS];
+  int i, n = 0;
+  bool valid;
+
+  assert(fds != NULL || max == 0);
+
+  iov.iov_base = &m;
+  iov.iov_len = sizeof(m);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof(m)) {
+    return -1;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(got, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+  }
+  valid = m.magic == HANDOFF_MAGIC && m.version == HANDOFF_VERSION && m.type == type;
+  for (i = 0; i < n; i++) {
+    if (valid && i < max) {
+      fds[i] = got[i];
+    } else {
+      close(got[i]);
+    }
+  }
+  if (!valid) {
+    return -1;
+  }
+  return (n < max) ? n : max;
+}
+
+static void set_timeout(int sock) {
+  struct timeval tv;
+
+  tv.tv_sec = HANDOFF_TIMEOUT;
+  tv.tv_usec = 0;
+  (void) setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  (void) setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool control_address(const char *path, struct sockaddr_un *sun) {
+  if (strlen(path) >= sizeof(sun->sun_path)) {
+    return false;
+  }
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  strcpy(sun->sun_path, path);
+  return true;
+}
+
+/* take the place of the server running on the control socket at path
+ * adopt() is called when the shared memory of that server is attached,
+ * to take the pieces of it (see shm_attach())
+ * returns 1 and the listening socket in *listen_fd if it's done, 0 if
+ * there's no server there, and -1 if it failed
+ */
+int handoff_take(const char *path, bool (*adopt)(void), int *listen_fd) {
+  struct sockaddr_un sun;
+  int sock, fd;
+  int st = -1;
+
+  assert(path != NULL);
+  assert(adopt != NULL);
+  assert(listen_fd != NULL);
+
+  if (!control_address(path, &sun) ||
+      (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+    st = (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+    close(sock);
+    return st;
+  }
+  set_timeout(sock);
+
+  if (handoff_send(sock, HANDOFF_HELLO, NULL, 0) &&
+      handoff_recv(sock, HANDOFF_SEGMENT, &fd, 1) == 1) {
+    if (!shm_attach(fd) || !adopt()) {
+      fprintf(stderr, "handoff: the shared memory of the running server doesn't match this release\n");
+    } else if (handoff_send(sock, HANDOFF_READY, NULL, 0) &&
+        handoff_recv(sock, HANDOFF_LISTEN, &fd, 1) == 1) {
+      /* the old one keeps accepting connections until it knows */
+      if (handoff_send(sock, HANDOFF_TAKEN, NULL, 0)) {
+        *listen_fd = fd;
+        st = 1;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  close(sock);
+  return st;
+}
+
+/* give the shared memory and the listening socket to a new release
+ * returns true if this process doesn't accept connections anymore, false
+ * if it keeps serving: the new release didn't get the listening socket
+ */
+static bool give(int sock) {
+  int fd;
+
+  if (handoff_recv(sock, HANDOFF_HELLO, NULL, 0) != 0) {
+    return false;
+  }
+  fd = shm_fd();
+  if (!handoff_send(sock, HANDOFF_SEGMENT, &fd, 1) ||
+      handoff_recv(sock, HANDOFF_READY, NULL, 0) != 0) {
+    return false;
+  }
+
+  /* the new release has the terminals, it gets the listening socket, and
+   * from when it says it has it, it takes the new connections
+   */
+  if ((fd = Listening()) < 0) {
+    handoff_send(sock, HANDOFF_LISTEN, NULL, 0);
+    return false;
+  }
+  if (!handoff_send(sock, HANDOFF_LISTEN, &fd, 1) ||
+      handoff_recv(sock, HANDOFF_TAKEN, NULL, 0) != 0) {
+    fprintf(stderr, "handoff: the new release didn't take the listening socket, still serving\n");
+    return false;
+  }
+  if ((fd = Quiesce()) >= 0) {
+    close(fd);
+  }
+  return true;
+}
+
+/* the control socket, waits for a new release */
+static void *handoff_thread(void *arg) {
+  int sock;
+
+  for (;;) {
+    if ((sock = accept4(Control, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        sleep(1);
+      }
+      continue;
+    }
+    set_timeout(sock);
+    if (give(sock)) {
+      break;
+    }
+    close(sock);
+  }
+  close(sock);
+  close(Control);
+  Control = -1;
+  if (write(Done[1], "", 1) != 1) {
+    fprintf(stderr, "handoff: can not tell the main thread\n");
+  }
+  return NULL;
+}
+
+/* listen on the control socket at path, for the next release
+ * listening() returns the listening socket, -1 if there's none, and
+ * quiesce() stops accepting connections on it and returns it, to be
+ * closed, or -1
+ * returns false if the control socket can't be created
+ */
+bool handoff_serve(const char *path, int (*listening)(void),
+        int (*quiesce)(void)) {
+  struct sockaddr_un sun;
+  pthread_t thread;
+
+  assert(path != NULL);
+  assert(listening != NULL && quiesce != NULL);
+
+  if (!control_address(path, &sun) ||
+      (Control = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return false;
+  }
+  /* the socket of the release before, that's gone or leaving */
+  unlink(path);
+  if (bind(Control, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+      listen(Control, 1) != 0 ||
+      pipe2(Done, O_CLOEXEC) != 0) {
+    close(Control);
+    Control = -1;
+    return false;
+  }
+  Listening = listening;
+  Quiesce = quiesce;
+  if (pthread_create(&thread, NULL, handoff_thread, NULL) != 0) {
+    close(Control);
+    Control = -1;
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+/* a descriptor that's readable after the handoff, when this process
+ * should answer the requests it has and exit. -1 before handoff_serve()
+ */
+int handoff_done_fd(void) {
+  return Done[0];
+}
+
+/* vim: set et sm ai ts=2: */
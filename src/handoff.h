@@ -0,0 +1,54 @@
+/*
+ * handoff.h
+ *
+ */
+
+#ifndef __HANDOFF_H
+#define __HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* hot restart
+ * a new release of the server takes the place of the running one, with
+ * no downtime and no lost terminals. both run with the same control
+ * socket (option -H path), a Unix socket:
+ *  - the new one connects to it before it starts it's own server, and the
+ *    old one sends it the shared memory segment with the terminals (see
+ *    shm.h). the new one attaches to it, so it has the terminals as they
+ *    are, with no copy, and the old one keeps serving meanwhile
+ *  - when the new one is ready, the old one sends it the listening
+ *    socket, and when the new one says it has it, the old one stops
+ *    accepting connections (MHD_quiesce_daemon()). the new one starts it's
+ *    server on it. connections that come in meanwhile wait in the backlog
+ *    of the socket, none is refused
+ *  - the old one answers the requests it has, and exits
+ * if anything fails before the new one has the listening socket, the old
+ * one keeps serving, and waits for another release
+ * then the new one listens on the control socket, for the next release
+ * the descriptors are sent with SCM_RIGHTS. if there's nobody on the
+ * control socket, the server starts with an empty table
+ */
+#define HANDOFF_DRAIN_TIMEOUT  10   /* seconds to answer the requests left */
+
+/* messages on the control socket, in this order */
+typedef enum handoff_message_type {
+  HANDOFF_HELLO = 1,        /* new to old */
+  HANDOFF_SEGMENT,          /* old to new, with the shared memory */
+  HANDOFF_READY,            /* new to old, attached to it */
+  HANDOFF_LISTEN,           /* old to new, with the listening socket */
+  HANDOFF_TAKEN             /* new to old, it has it */
+} Handoff_Message_Type;
+
+
+/* prototypes */
+extern int handoff_take(const char *path, bool (*adopt)(void), int *listen_fd);
+extern bool handoff_serve(const char *path, int (*listening)(void),
+                int (*quiesce)(void));
+extern int handoff_done_fd(void);
+extern bool handoff_send(int sock, Handoff_Message_Type type, const int *fds, int n);
+extern int handoff_recv(int sock, Handoff_Message_Type type, int *fds, int max);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,143 @@
+/*
+ * header.c
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "header.h"
+
+/* get the quality from the parameters of a list element, the part after
+ * the token, like ";q=0.5". no quality means 1
+ */
+static double element_quality(const char *p, const char *end) {
+  while (p < end) {
+    /* skip to the next parameter */
+    while (p < end && *p != ';') {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    p++;
+    while (p < end && isspace((unsigned char) *p)) {
+      p++;
+    }
+    if (end - p > 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+      return atof(p + 2);
+    }
+  }
+  return 1.0;
+}
+
+/* get the quality of a token in a header list, -1 if it's not listed
+ * tokens are compared without case
+ */
+double header_quality(const char *header, const char *token) {
+  const char *p, *end, *token_end;
+  size_t n = strlen(token);
+
+  if (header == NULL) {
+    return -1.0;
+  }
+  for (p = header; *p != '\0'; p = (*end == ',') ? end + 1 : end) {
+    while (isspace((unsigned char) *p)) {
+      p++;
+    }
+    if ((end = strchr(p, ',')) == NULL) {
+      end = p + strlen(p);
+    }
+    for (token_end = p; token_end < end && *token_end != ';' &&
+            !isspace((unsigned char) *token_end); token_end++) {
+      ;
+    }
+    if (token_end - p == n && strncasecmp(p, token, n) == 0) {
+      return element_quality(token_end, end);
+    }
+  }
+  return -1.0;
+}
+
+/* read a number of bytes, digits only */
+static bool range_number(const char **p, uint64_t *n) {
+  char *end;
+
+  if (!isdigit((unsigned char) **p)) {
+    return false;
+  }
+  errno = 0;
+  *n = strtoull(*p, &end, 10);
+  *p = end;
+  return errno == 0;
+}
+
+/* get the range of a body of size bytes asked for in a Range header, like
+ * "bytes=100-199", "bytes=100-" or "bytes=-100" (the last 100). first and
+ * last are the first and the last byte of it
+ * a header that's not valid, or that asks for more than one range, is
+ * ignored: the whole body is sent then, as a server can do
+ */
+int header_range(const char *header, uint64_t size, uint64_t *first,
+        uint64_t *last) {
+  const char *p = header;
+  uint64_t a, b;
+
+  if (p == NULL) {
+    return HEADER_RANGE_NONE;
+  }
+  while (isspace((unsigned char) *p)) {
+    p++;
+  }
+  if (strncasecmp(p, "bytes=", 6) != 0) {
+    return HEADER_RANGE_NONE;
+  }
+  p += 6;
+  if (*p == '-') {
+    /* the last b bytes */
+    p++;
+    if (!range_number(&p, &b)) {
+      return HEADER_RANGE_NONE;
+    }
+    a = b >= size ? 0 : size - b;
+    b = size - 1;
+    if (size == 0 || a > b) {
+      goto unsatisfiable;
+    }
+  } else {
+    if (!range_number(&p, &a) || *p++ != '-') {
+      return HEADER_RANGE_NONE;
+    }
+    b = UINT64_MAX;
+    if (isdigit((unsigned char) *p) && (!range_number(&p, &b) || b < a)) {
+      return HEADER_RANGE_NONE;
+    }
+    if (a >= size) {
+      goto unsatisfiable;
+    }
+    if (b >= size) {
+      b = size - 1;
+    }
+  }
+  while (isspace((unsigned char) *p)) {
+    p++;
+  }
+  if (*p != '\0') {
+    /* more than one range */
+    return HEADER_RANGE_NONE;
+  }
+  *first = a;
+  *last = b;
+  return HEADER_RANGE_OK;
+
+unsatisfiable:
+  /* unless there are more ranges, any of them could be */
+  p += strspn(p, " \t");
+  return *p == '\0' ? HEADER_RANGE_UNSATISFIABLE : HEADER_RANGE_NONE;
+}
+
+
+/* vim: set et sm ai ts=2: */
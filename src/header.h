@@ -0,0 +1,28 @@
+/*
+ * header.h
+ *
+ */
+
+#ifndef __HEADER_H
+#define __HEADER_H
+
+#include <stdint.h>
+
+/* helpers for HTTP request headers that are lists of tokens with a
+ * quality, like Accept ("application/json, text/plain;q=0.5") or
+ * Accept-Encoding ("gzip, deflate;q=0.5"), and for Range
+ */
+
+/* what header_range() found, a range of bytes of the body or not */
+#define HEADER_RANGE_NONE           0   /* send it all */
+#define HEADER_RANGE_OK             1
+#define HEADER_RANGE_UNSATISFIABLE  (-1)  /* 416 */
+
+/* prototypes */
+extern double header_quality(const char *header, const char *token);
+extern int header_range(const char *header, uint64_t size, uint64_t *first,
+                uint64_t *last);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,239 @@
+/*
+ * id_lease.c
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "id_lease.h"
+#include "shm.h"
+
+/* the shared state, only used to take a new block
+ * it's moved to shared memory when there are many worker processes (see
+ * id_lease_share()), so blocks are unique across all of them
+ */
+typedef struct lease_state {
+  pthread_mutex_t lock;
+  uint32_t high_water;                /* last id given in any block */
+} Lease_State;
+
+static Lease_State Local_Lease = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static Lease_State *Lease = &Local_Lease;
+static uint32_t Block_Size = ID_LEASE_DEFAULT_BLOCK;
+static char *Path;                    /* file with the high-water mark, or NULL */
+
+/* the block of the thread, ids from Next to End (included) are free
+ * Next > End when the block is used up
+ */
+static __thread uint32_t Next = 1;
+static __thread uint32_t End = 0;
+
+/* sync the directory of a file, so a rename() in it is on disk */
+static bool sync_dir(const char *path) {
+  char dir[FILENAME_MAX];
+  int fd;
+  bool st;
+
+  if (snprintf(dir, sizeof(dir), "%s", path) >= (int) sizeof(dir)) {
+    return false;
+  }
+  if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0) {
+    return false;
+  }
+  st = fsync(fd) == 0;
+  close(fd);
+  return st;
+}
+
+/* write the high-water mark to the file
+ * it's written to a temporary file that's renamed over the old one, so a
+ * crash leaves either the old or the new value, never a partial one. the
+ * directory is synced after the rename, or else a power failure could
+ * lose the rename and bring back the old value
+ */
+static bool save_high_water(uint32_t high_water) {
+  char tmp[FILENAME_MAX];
+  FILE *f;
+  bool st;
+
+  if (Path == NULL) {
+    return true;
+  }
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", Path) >= (int) sizeof(tmp)) {
+    return false;
+  }
+  if ((f = fopen(tmp, "w")) == NULL) {
+    return false;
+  }
+  st = fprintf(f, "%u\n", high_water) > 0 &&
+    fflush(f) == 0 &&
+    fsync(fileno(f)) == 0;
+  st = (fclose(f) == 0) && st;
+  if (!st || rename(tmp, Path) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  /* the new value may be lost, no block is given with it */
+  return sync_dir(Path);
+}
+
+/* set the file for the high-water mark, and the number of ids in a block
+ * the high-water mark is read from the file, if it exists
+ * a NULL path keeps the high-water mark only in memory
+ * returns false if the file exists but can't be read
+ */
+bool id_lease_configure(const char *path, uint32_t block_size) {
+  unsigned long v;
+  FILE *f;
+  bool st = true;
+
+  pthread_mutex_lock(&Lease->lock);
+  if (block_size > 0) {
+    Block_Size = (block_size > ID_LEASE_MAX_BLOCK) ? ID_LEASE_MAX_BLOCK : block_size;
+  }
+  free(Path);
+  Path = NULL;
+  if (path != NULL) {
+    if ((Path = strdup(path)) == NULL) {
+      st = false;
+    } else if ((f = fopen(path, "r")) != NULL) {
+      if (fscanf(f, "%lu", &v) == 1 && v <= UINT32_MAX) {
+        if (v > Lease->high_water) {
+          Lease->high_water = v;
+        }
+      } else {
+        st = false;
+      }
+      fclose(f);
+    }
+  }
+  pthread_mutex_unlock(&Lease->lock);
+  return st;
+}
+
+/* a process started with fork() has a copy of the block of the thread
+ * that started it, the other process gives the same ids. it starts with
+ * no block, and takes a new one
+ */
+static void forget_block(void) {
+  Next = 1;
+  End = 0;
+}
+
+/* move the high-water mark to shared memory (see shm.h), so worker
+ * processes take their blocks from the same one. it should be called after
+ * id_lease_configure(), and before any other thread takes ids
+ * returns false if there's no room for it in shared memory
+ */
+bool id_lease_share(void) {
+  Lease_State *l;
+
+  if ((l = shm_alloc(sizeof(Lease_State))) == NULL ||
+      pthread_atfork(NULL, NULL, forget_block) != 0) {
+    return false;
+  }
+  if (shm_attached()) {
+    Lease = l;
+    return true;
+  }
+  l->high_water = Lease->high_water;
+  if (!shm_mutex_init(&l->lock)) {
+    return false;
+  }
+  Lease = l;
+  return true;
+}
+
+/* true if the lock of the high-water mark is not held for more than
+ * timeout_ms, see terminal_locks_free()
+ */
+bool id_lease_locks_free(int timeout_ms) {
+  return shm_mutex_free(&Lease->lock, timeout_ms);
+}
+
+/* repair the shared high-water mark after a worker process died holding
+ * it's lock, with no worker running (see terminal_repair()). the worker
+ * may have saved a block to the file and died before it was in memory,
+ * so the mark is read again from the file
+ * returns false if the lock can't be initialized
+ */
+bool id_lease_repair(void) {
+  unsigned long v;
+  FILE *f;
+
+  if (!shm_mutex_init(&Lease->lock)) {
+    return false;
+  }
+  if (Path != NULL && (f = fopen(Path, "r")) != NULL) {
+    if (fscanf(f, "%lu", &v) == 1 && v <= UINT32_MAX && v > Lease->high_water) {
+      Lease->high_water = v;
+    }
+    fclose(f);
+  }
+  return true;
+}
+
+/* take a new block for this thread
+ * returns false if the ids are exhausted, or the high-water mark can't
+ * be saved (the ids could be given again after a restart)
+ */
+static bool lease_block(void) {
+  uint32_t first, last;
+  bool st = false;
+
+  pthread_mutex_lock(&Lease->lock);
+  /* the last id of a block is never UINT32_MAX, so Next can't wrap */
+  if (Lease->high_water < UINT32_MAX - Block_Size) {
+    first = Lease->high_water + 1;
+    last = Lease->high_water + Block_Size;
+    if (save_high_water(last)) {
+      Lease->high_water = last;
+      Next = first;
+      End = last;
+      st = true;
+    }
+  }
+  pthread_mutex_unlock(&Lease->lock);
+  return st;
+}
+
+/* get a new id, unique in this run and in all the previous ones that
+ * used the same file. returns 0 if no id can be given
+ */
+uint32_t id_lease_next(void) {
+  if (Next > End && !lease_block()) {
+    return 0;
+  }
+  return Next++;
+}
+
+/* get the high-water mark, the last id leased to any thread */
+uint32_t id_lease_high_water(void) {
+  uint32_t high_water;
+
+  pthread_mutex_lock(&Lease->lock);
+  high_water = Lease->high_water;
+  pthread_mutex_unlock(&Lease->lock);
+  return high_water;
+}
+
+/* raise the high-water mark to id, if it's below, so the ids up to it
+ * are not given by the blocks taken after this (like the ids of a store
+ * that's opened, see terminal_open_store()). it's saved with the next
+ * block. blocks leased already are not changed
+ */
+void id_lease_reserve(uint32_t id) {
+  pthread_mutex_lock(&Lease->lock);
+  if (id > Lease->high_water) {
+    Lease->high_water = id;
+  }
+  pthread_mutex_unlock(&Lease->lock);
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,36 @@
+/*
+ * id_lease.h
+ *
+ */
+
+#ifndef __ID_LEASE_H
+#define __ID_LEASE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* id allocation with per thread leases
+ * every thread takes blocks of consecutive ids (a lease) from a shared
+ * high-water mark, and then hands out ids from it's block with no locks
+ * and no shared cache lines. the high-water mark is written to a file
+ * before a block is used, so after a restart new ids start above any id
+ * given before. ids left in the blocks of finished threads, or of the
+ * previous run, are never used
+ * ids start at 1, 0 is never a valid id
+ */
+#define ID_LEASE_DEFAULT_BLOCK  64
+#define ID_LEASE_MAX_BLOCK      65536
+
+
+/* prototypes */
+extern bool id_lease_configure(const char *path, uint32_t block_size);
+extern uint32_t id_lease_next(void);
+extern uint32_t id_lease_high_water(void);
+extern void id_lease_reserve(uint32_t id);
+extern bool id_lease_share(void);
+extern bool id_lease_locks_free(int timeout_ms);
+extern bool id_lease_repair(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
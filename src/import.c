@@ -0,0 +1,449 @@
+/*
+ * import.c
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "import.h"
+#include "terminal.h"
+#include "catalog.h"
+#include "arena.h"
+
+#define CSV_CARDS   "CardType"
+#define CSV_TRXS    "TransactionType"
+
+/* a line with an error, the line number is in the chunk */
+typedef struct import_error {
+  uint64_t line;
+  const char *reason;
+} Import_Error;
+
+/* the part of the file of a thread, and what it did with it */
+typedef struct chunk {
+  struct import *import;
+  const char *start;
+  const char *end;
+  uint64_t all_lines;           /* every line, for the line numbers */
+  uint64_t lines;
+  uint64_t added;
+  uint64_t errors;
+  uint64_t not_added;
+  uint64_t done;                /* bytes, read while it runs */
+  int n_errors;
+  Import_Error error[IMPORT_ERRORS];
+  Terminal_Data batch[IMPORT_BATCH];
+} Chunk;
+
+typedef struct import {
+  Import_Format format;
+  int card_col;                 /* the CSV columns */
+  int trx_col;
+  bool dry_run;
+  bool full;                    /* the table is, all threads stop */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+} Import;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the threads used when none are given, one for every CPU */
+int import_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1) {
+    return 1;
+  }
+  return n > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : (int) n;
+}
+
+/* the next field of a CSV line, with the spaces around it trimmed
+ * returns where the field after it starts, or NULL if it's the last one
+ */
+static const char *next_field(const char *p, const char *end, char sep,
+        const char **field, size_t *len) {
+  const char *q;
+
+  if ((q = memchr(p, sep, end - p)) == NULL) {
+    q = end;
+  }
+  while (p < q && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  *field = p;
+  for (p = q; p > *field && (p[-1] == ' ' || p[-1] == '\t'); p--) {
+  }
+  *len = p - *field;
+  return q == end ? NULL : q + 1;
+}
+
+/* add the types of a CSV field, separated by '|' */
+static bool load_csv_types(Terminal_Data *t, const char *p, size_t len,
+        bool (*add)(Terminal_Data *t, const char *name)) {
+  char name[CATALOG_NAME_SIZE];
+  const char *end = p + len, *field;
+  size_t n;
+
+  while (p != NULL && len > 0) {
+    p = next_field(p, end, '|', &field, &n);
+    if (n == 0) {
+      continue;
+    }
+    if (n >= sizeof(name)) {
+      return false;
+    }
+    memcpy(name, field, n);
+    name[n] = '\0';
+    if (!add(t, name)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* read a terminal from a CSV line
+ * returns NULL, or what's wrong with it
+ */
+static const char *load_csv(Import *im, Terminal_Data *t, const char *p,
+        size_t len) {
+  const char *end = p + len, *field;
+  bool cards = false, trxs = false;
+  size_t n;
+  int col;
+
+  terminal_init_data(t);
+  for (col = 0; p != NULL; col++) {
+    p = next_field(p, end, ',', &field, &n);
+    if (col == im->card_col) {
+      if (!load_csv_types(t, field, n, terminal_add_card_type)) {
+        return "unknown card type";
+      }
+      cards = true;
+    } else if (col == im->trx_col) {
+      if (!load_csv_types(t, field, n, terminal_add_transaction_type)) {
+        return "unknown transaction type";
+      }
+      trxs = true;
+    }
+  }
+  if (!cards || !trxs) {
+    return "missing column";
+  }
+  return NULL;
+}
+
+static bool blank(const char *p, size_t len) {
+  while (len > 0 && (*p == ' ' || *p == '\t')) {
+    p++;
+    len--;
+  }
+  return len == 0;
+}
+
+/* add the terminals of the batch to the table */
+static void flush(Chunk *c, int n) {
+  int added = n;
+
+  if (n == 0) {
+    return;
+  }
+  if (!c->import->dry_run) {
+    added = terminal_add_many(c->batch, n);
+  }
+  __atomic_add_fetch(&c->added, added, __ATOMIC_RELAXED);
+  if (added < n) {
+    c->not_added += n - added;
+    __atomic_store_n(&c->import->full, true, __ATOMIC_RELAXED);
+  }
+  /* the memory jansson took for the batch */
+  arena_reset();
+}
+
+/* the lines of the chunk from p on, when the table is full: they are
+ * counted, for the line numbers of the chunks after it, and the terminals
+ * in them are not added, with no check
+ */
+static void skip_rest(Chunk *c, const char *p) {
+  const char *eol;
+  size_t len;
+
+  for (; p < c->end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', c->end - p)) == NULL) {
+      eol = c->end;
+    }
+    c->all_lines++;
+    len = eol - p;
+    if (len > 0 && p[len - 1] == '\r') {
+      len--;
+    }
+    if (!blank(p, len)) {
+      c->lines++;
+      c->not_added++;
+    }
+  }
+}
+
+static void *import_thread(void *arg) {
+  Chunk *c = arg;
+  Import *im = c->import;
+  const char *p, *eol, *reason;
+  size_t len;
+  int n = 0;
+
+  /* the types are found by name in the catalog (see catalog.h) */
+  catalog_read_begin();
+  for (p = c->start; p < c->end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', c->end - p)) == NULL) {
+      eol = c->end;
+    }
+    c->all_lines++;
+    len = eol - p;
+    if (len > 0 && p[len - 1] == '\r') {
+      len--;
+    }
+    if (blank(p, len)) {
+      continue;
+    }
+    c->lines++;
+    if (im->format == IMPORT_NDJSON) {
+      reason = terminal_load_jsonb(&c->batch[n], p, len) ? NULL :
+          "invalid terminal";
+    } else {
+      reason = load_csv(im, &c->batch[n], p, len);
+    }
+    if (reason != NULL) {
+      if (c->n_errors < IMPORT_ERRORS) {
+        c->error[c->n_errors].line = c->all_lines;
+        c->error[c->n_errors].reason = reason;
+        c->n_errors++;
+      }
+      c->errors++;
+      continue;
+    }
+    if (++n == IMPORT_BATCH) {
+      flush(c, n);
+      n = 0;
+      __atomic_store_n(&c->done, eol - c->start, __ATOMIC_RELAXED);
+      if (__atomic_load_n(&im->full, __ATOMIC_RELAXED)) {
+        skip_rest(c, eol + 1);
+        break;
+      }
+    }
+  }
+  flush(c, n);
+  catalog_read_end();
+  __atomic_store_n(&c->done, c->end - c->start, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&im->lock);
+  im->running--;
+  pthread_cond_signal(&im->cond);
+  pthread_mutex_unlock(&im->lock);
+  return NULL;
+}
+
+/* the columns with the types, from the CSV header
+ * returns false if it's not a header
+ */
+static bool load_csv_header(Import *im, const char *p, size_t len) {
+  const char *end = p + len, *field;
+  size_t n;
+  int col;
+
+  im->card_col = im->trx_col = -1;
+  for (col = 0; p != NULL; col++) {
+    p = next_field(p, end, ',', &field, &n);
+    if (n == strlen(CSV_CARDS) && memcmp(field, CSV_CARDS, n) == 0) {
+      im->card_col = col;
+    } else if (n == strlen(CSV_TRXS) && memcmp(field, CSV_TRXS, n) == 0) {
+      im->trx_col = col;
+    }
+  }
+  if (im->card_col < 0 && im->trx_col < 0) {
+    /* no header, the types are the first columns */
+    im->card_col = 0;
+    im->trx_col = 1;
+    return false;
+  }
+  return true;
+}
+
+/* where the line after the one at p starts, end if there's none */
+static const char *next_line(const char *p, const char *end) {
+  const char *nl;
+
+  if ((nl = memchr(p, '\n', end - p)) == NULL) {
+    return end;
+  }
+  return nl + 1;
+}
+
+static void progress(const char *fname, Chunk *chunks, int n, size_t size,
+        double started) {
+  uint64_t done = 0, added = 0;
+  double elapsed = now() - started;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    done += __atomic_load_n(&chunks[i].done, __ATOMIC_RELAXED);
+    added += __atomic_load_n(&chunks[i].added, __ATOMIC_RELAXED);
+  }
+  fprintf(stderr, "import %s: %3.0f%%, %llu terminals, %.0f MB/s\n",
+    fname,
+    100.0 * done / size,
+    (unsigned long long) added,
+    done / elapsed / 1e6);
+}
+
+/* import the terminals of a seed file, with threads threads
+ * with dry_run the file is only read and checked, nothing is added
+ * returns false if the file can't be read, lines with errors are
+ * reported and skipped, see import.h
+ */
+bool import_file(const char *fname, int threads, bool dry_run,
+        Import_Stats *st) {
+  pthread_t thread[IMPORT_MAX_THREADS];
+  struct timespec deadline;
+  struct stat sb;
+  Chunk *chunks;
+  Import im;
+  const char *data, *end, *p, *split;
+  uint64_t base;
+  double started;
+  size_t len;
+  int fd, i, j, n;
+
+  assert(fname != NULL && st != NULL);
+  assert(threads > 0 && threads <= IMPORT_MAX_THREADS);
+
+  memset(st, 0, sizeof(Import_Stats));
+  if ((fd = open(fname, O_RDONLY)) < 0) {
+    return false;
+  }
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return false;
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return true;
+  }
+  data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  /* read once, front to back */
+  madvise((void *) data, sb.st_size, MADV_SEQUENTIAL);
+  end = data + sb.st_size;
+  started = now();
+
+  memset(&im, 0, sizeof(Import));
+  pthread_mutex_init(&im.lock, NULL);
+  pthread_cond_init(&im.cond, NULL);
+  im.dry_run = dry_run;
+
+  /* NDJSON if the first thing in it is an object */
+  for (p = data; p < end && *p != '\0' && strchr(" \t\r\n", *p) != NULL; p++) {
+  }
+  im.format = p < end && *p == '{' ? IMPORT_NDJSON : IMPORT_CSV;
+  p = data;
+  base = 0;
+  if (im.format == IMPORT_CSV) {
+    p = next_line(data, end);
+    for (len = p - data; len > 0 &&
+        (data[len - 1] == '\n' || data[len - 1] == '\r'); len--) {
+    }
+    if (load_csv_header(&im, data, len)) {
+      base = 1;
+    } else {
+      p = data;
+    }
+  }
+
+  /* a chunk for every thread, from a line to a line, the same size but
+   * for a line. a small file may leave some with nothing
+   */
+  if ((chunks = calloc(threads, sizeof(Chunk))) == NULL) {
+    munmap((void *) data, sb.st_size);
+    return false;
+  }
+  for (i = 0; i < threads; i++) {
+    chunks[i].import = &im;
+    chunks[i].start = i == 0 ? p : chunks[i - 1].end;
+    split = p + (end - p) * (i + 1) / threads;
+    if (i == threads - 1) {
+      chunks[i].end = end;
+    } else if (split <= chunks[i].start) {
+      chunks[i].end = chunks[i].start;
+    } else {
+      chunks[i].end = next_line(split - 1, end);
+    }
+  }
+
+  im.running = threads;
+  for (n = 0; n < threads; n++) {
+    if (pthread_create(&thread[n], NULL, import_thread, &chunks[n]) != 0) {
+      break;
+    }
+  }
+  if (n < threads) {
+    /* the ones started are stopped at once */
+    __atomic_store_n(&im.full, true, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&im.lock);
+  im.running -= threads - n;
+  while (im.running > 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += IMPORT_PROGRESS;
+    if (pthread_cond_timedwait(&im.cond, &im.lock, &deadline) == ETIMEDOUT) {
+      progress(fname, chunks, n, sb.st_size, started);
+    }
+  }
+  pthread_mutex_unlock(&im.lock);
+  for (i = 0; i < n; i++) {
+    pthread_join(thread[i], NULL);
+  }
+
+  /* the errors, by line of the file */
+  st->format = im.format;
+  st->threads = threads;
+  st->bytes = sb.st_size;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < chunks[i].n_errors; j++) {
+      fprintf(stderr, "%s:%llu: %s\n",
+        fname,
+        (unsigned long long) (base + chunks[i].error[j].line),
+        chunks[i].error[j].reason);
+    }
+    base += chunks[i].all_lines;
+    st->lines += chunks[i].lines;
+    st->added += chunks[i].added;
+    st->errors += chunks[i].errors;
+    st->not_added += chunks[i].not_added;
+  }
+  st->seconds = now() - started;
+
+  free(chunks);
+  munmap((void *) data, sb.st_size);
+  pthread_mutex_destroy(&im.lock);
+  pthread_cond_destroy(&im.cond);
+  return n == threads;
+}
+
+/* vim: set et sm ai ts=2: */
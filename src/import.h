@@ -0,0 +1,58 @@
+/*
+ * import.h
+ *
+ */
+
+#ifndef __IMPORT_H
+#define __IMPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* bulk import of terminals at startup, from a seed file (option -S)
+ * the file is NDJSON, a terminal like the body of POST /terminals on every
+ * line, or CSV, with the card types and the transaction types of a
+ * terminal separated by '|':
+ *   CardType,TransactionType
+ *   Visa|MasterCard,Cheque|Credit
+ * the header is optional, it tells the columns with the types, any other
+ * column (like an id) is ignored. there's no quoting. the ids in the file
+ * are not kept, the table gives new ones, as it does for POST
+ * the file is mapped, and split at line boundaries in a chunk for every
+ * thread. threads parse and validate their lines with no lock, and add
+ * them to the table IMPORT_BATCH at a time (terminal_add_many()). lines
+ * with errors are skipped, and the first IMPORT_ERRORS of every thread
+ * are reported with their line number. the import stops when the table
+ * is full, the lines left are counted as not added, with no check.
+ * progress is reported every IMPORT_PROGRESS seconds
+ */
+#define IMPORT_MAX_THREADS  64
+#define IMPORT_BATCH        256     /* terminals added at once */
+#define IMPORT_ERRORS       10      /* reported, of every thread */
+#define IMPORT_PROGRESS     1       /* seconds */
+
+typedef enum import_format {
+  IMPORT_NDJSON,
+  IMPORT_CSV
+} Import_Format;
+
+typedef struct import_stats {
+  Import_Format format;
+  int threads;
+  uint64_t bytes;
+  uint64_t lines;         /* terminals, not blank lines nor the header */
+  uint64_t added;
+  uint64_t errors;        /* lines skipped */
+  uint64_t not_added;     /* valid, with no room left in the table */
+  double seconds;
+} Import_Stats;
+
+
+/* prototypes */
+extern int import_default_threads(void);
+extern bool import_file(const char *fname, int threads, bool dry_run,
+                Import_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
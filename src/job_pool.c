@@ -0,0 +1,249 @@
+/*
+ * job_pool.c
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include "job_pool.h"
+
+/* the queue of a thread, a ring
+ * it has a lock of it's own, the thread that owns it and the ones that
+ * submit to it or steal from it share nothing else but the counters,
+ * that are atomic. Pending_Lock is taken only to go to sleep when there's
+ * nothing to do, to wake up a thread that sleeps, and to stop
+ */
+typedef struct job_queue {
+  pthread_mutex_t lock;
+  unsigned int head;      /* the oldest job */
+  unsigned int tail;      /* where the next one goes */
+  Job *jobs[JOB_POOL_QUEUE];
+} __attribute__((aligned(64))) Job_Queue;
+
+static Job_Queue Queues[JOB_POOL_MAX_THREADS] = {
+  [0 ... JOB_POOL_MAX_THREADS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static pthread_t Threads[JOB_POOL_MAX_THREADS];
+static int Thread_Count;        /* 0 if the pool is not running */
+
+/* jobs in the queues not taken by a thread yet, a thread sleeps until
+ * there's one. a job is counted before it's queued, so a thread can see
+ * it for a moment before it's in a queue. Sleeping threads wait for
+ * Pending_Cond, that's signaled holding Pending_Lock, so a submit that
+ * sees nobody sleeping takes no lock. Idle_Cond is signaled when there
+ * are no jobs left
+ */
+static pthread_mutex_t Pending_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Pending_Cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Idle_Cond = PTHREAD_COND_INITIALIZER;
+static int Pending;
+static int Running;
+static int Sleeping;
+static bool Stopping;
+
+static uint64_t Done;
+static uint64_t Stolen;
+static uint64_t Rejected;
+
+/* the queue of the calling thread, taken the first time it submits */
+static unsigned int Next_Queue;
+static __thread int My_Queue = -1;
+
+static bool push(Job_Queue *q, Job *job) {
+  pthread_mutex_lock(&q->lock);
+  if (q->tail - q->head == JOB_POOL_QUEUE) {
+    pthread_mutex_unlock(&q->lock);
+    return false;
+  }
+  q->jobs[q->tail++ & (JOB_POOL_QUEUE - 1)] = job;
+  pthread_mutex_unlock(&q->lock);
+  return true;
+}
+
+/* take a job of a queue, the oldest or the newest one */
+static Job *take(Job_Queue *q, bool oldest) {
+  Job *job = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head != q->tail) {
+    if (oldest) {
+      job = q->jobs[q->head++ & (JOB_POOL_QUEUE - 1)];
+    } else {
+      job = q->jobs[--q->tail & (JOB_POOL_QUEUE - 1)];
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+/* wake up job_pool_shutdown() if there's nothing left to do */
+static void idle_check(void) {
+  if (__atomic_load_n(&Running, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&Pending, __ATOMIC_SEQ_CST) == 0) {
+    pthread_mutex_lock(&Pending_Lock);
+    pthread_cond_broadcast(&Idle_Cond);
+    pthread_mutex_unlock(&Pending_Lock);
+  }
+}
+
+/* sleep until there's a job, returns false when the pool stops
+ * Sleeping is counted before Pending is read, and a submit counts Pending
+ * before it reads Sleeping, so one of them sees the other
+ */
+static bool job_wait(void) {
+  bool st = true;
+
+  pthread_mutex_lock(&Pending_Lock);
+  __atomic_add_fetch(&Sleeping, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&Pending, __ATOMIC_SEQ_CST) == 0 && !Stopping) {
+    pthread_cond_wait(&Pending_Cond, &Pending_Lock);
+  }
+  __atomic_sub_fetch(&Sleeping, 1, __ATOMIC_SEQ_CST);
+  if (Stopping && __atomic_load_n(&Pending, __ATOMIC_SEQ_CST) == 0) {
+    st = false;
+  }
+  pthread_mutex_unlock(&Pending_Lock);
+  return st;
+}
+
+static void *job_thread(void *arg) {
+  int self = (int) (intptr_t) arg;
+  Job *job;
+  int i;
+
+  My_Queue = self;
+  for (;;) {
+    /* the oldest of it's own queue, or the newest of another's */
+    if ((job = take(&Queues[self], true)) == NULL) {
+      for (i = 1; job == NULL && i < Thread_Count; i++) {
+        job = take(&Queues[(self + i) % Thread_Count], false);
+      }
+      if (job == NULL) {
+        if (__atomic_load_n(&Pending, __ATOMIC_SEQ_CST) > 0) {
+          /* counted, and about to be queued */
+          sched_yield();
+        } else if (!job_wait()) {
+          return NULL;
+        }
+        continue;
+      }
+      __atomic_add_fetch(&Stolen, 1, __ATOMIC_RELAXED);
+    }
+    /* it's running before it's not pending, so the pool is never seen
+     * idle with a job
+     */
+    __atomic_add_fetch(&Running, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&Pending, 1, __ATOMIC_SEQ_CST);
+    job->run(job);
+    __atomic_add_fetch(&Done, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&Running, 1, __ATOMIC_SEQ_CST) == 0) {
+      idle_check();
+    }
+  }
+}
+
+/* start the threads of the pool
+ * returns false if they can't be started, the pool is not running then
+ */
+bool job_pool_start(int threads) {
+  int i;
+
+  assert(threads > 0 && threads <= JOB_POOL_MAX_THREADS);
+  assert(Thread_Count == 0);
+
+  Stopping = false;
+  for (i = 0; i < threads; i++) {
+    Queues[i].head = Queues[i].tail = 0;
+  }
+  Thread_Count = threads;
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&Threads[i], NULL, job_thread, (void *) (intptr_t) i) != 0) {
+      /* the ones started stop at once, there are no jobs */
+      Thread_Count = i;
+      job_pool_shutdown();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool job_pool_running(void) {
+  return __atomic_load_n(&Thread_Count, __ATOMIC_RELAXED) > 0;
+}
+
+/* queue a job, to be run by a thread of the pool
+ * returns false if the pool is not running or the queue is full, then
+ * the job is not run
+ */
+bool job_pool_submit(Job *job) {
+  int threads;
+
+  assert(job != NULL && job->run != NULL);
+
+  /* counted before Stopping is read, job_pool_shutdown() sets Stopping
+   * before it reads Pending, so it waits for this one or it's rejected
+   */
+  __atomic_add_fetch(&Pending, 1, __ATOMIC_SEQ_CST);
+  threads = __atomic_load_n(&Thread_Count, __ATOMIC_RELAXED);
+  if (threads == 0 || __atomic_load_n(&Stopping, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&Pending, 1, __ATOMIC_SEQ_CST);
+    idle_check();
+    __atomic_add_fetch(&Rejected, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  if (My_Queue < 0) {
+    My_Queue = __atomic_fetch_add(&Next_Queue, 1, __ATOMIC_RELAXED);
+  }
+  if (!push(&Queues[My_Queue % threads], job)) {
+    __atomic_sub_fetch(&Pending, 1, __ATOMIC_SEQ_CST);
+    idle_check();
+    __atomic_add_fetch(&Rejected, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  if (__atomic_load_n(&Sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&Pending_Lock);
+    pthread_cond_signal(&Pending_Cond);
+    pthread_mutex_unlock(&Pending_Lock);
+  }
+  return true;
+}
+
+/* stop the pool, after the jobs queued and running are done
+ * no job is taken from here on
+ */
+void job_pool_shutdown(void) {
+  int i, n;
+
+  pthread_mutex_lock(&Pending_Lock);
+  __atomic_store_n(&Stopping, true, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&Pending, __ATOMIC_SEQ_CST) > 0 ||
+      __atomic_load_n(&Running, __ATOMIC_SEQ_CST) > 0) {
+    pthread_cond_wait(&Idle_Cond, &Pending_Lock);
+  }
+  n = Thread_Count;
+  pthread_cond_broadcast(&Pending_Cond);
+  pthread_mutex_unlock(&Pending_Lock);
+
+  for (i = 0; i < n; i++) {
+    pthread_join(Threads[i], NULL);
+  }
+  pthread_mutex_lock(&Pending_Lock);
+  __atomic_store_n(&Thread_Count, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&Pending_Lock);
+}
+
+/* the counters, they are not read all at the same time */
+void job_pool_get_stats(Job_Pool_Stats *st) {
+  assert(st != NULL);
+
+  st->threads = __atomic_load_n(&Thread_Count, __ATOMIC_RELAXED);
+  st->queued = __atomic_load_n(&Pending, __ATOMIC_RELAXED);
+  st->running = __atomic_load_n(&Running, __ATOMIC_RELAXED);
+  st->done = __atomic_load_n(&Done, __ATOMIC_RELAXED);
+  st->stolen = __atomic_load_n(&Stolen, __ATOMIC_RELAXED);
+  st->rejected = __atomic_load_n(&Rejected, __ATOMIC_RELAXED);
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,60 @@
+/*
+ * job_pool.h
+ *
+ */
+
+#ifndef __JOB_POOL_H
+#define __JOB_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* a pool of threads for the work of handlers that's too slow for the
+ * threads of libmicrohttpd, like encoding all the terminals or reading
+ * the catalog file. the handler suspends the request and hands the work
+ * over as a job, and the job resumes the request when the response is
+ * ready (see dispatcher.c), so the network threads keep answering the
+ * cheap requests meanwhile
+ * every thread of the pool has a queue of it's own. a thread that submits
+ * jobs always uses the same queue, and a thread of the pool with nothing
+ * in it's queue takes the jobs of the others (work stealing): the oldest
+ * of it's own queue, the newest of the others'. only the lock of the queue
+ * is taken to submit or take a job, a lock of the pool only to sleep or
+ * wake up when there's nothing to do, and to stop
+ * the pool is bounded, a queue has room for JOB_POOL_QUEUE jobs. a job
+ * that doesn't fit is not taken, and the request is answered 503
+ */
+#define JOB_POOL_QUEUE        64    /* jobs waiting in a queue, a power of 2 */
+#define JOB_POOL_MAX_THREADS  64
+#define JOB_POOL_DEFAULT_THREADS  4
+
+_Static_assert((JOB_POOL_QUEUE & (JOB_POOL_QUEUE - 1)) == 0,
+    "JOB_POOL_QUEUE should be a power of 2");
+
+/* a job, put it in the state of the request and get it back with
+ * offsetof() in run()
+ */
+typedef struct job {
+  void (*run)(struct job *job);
+} Job;
+
+typedef struct job_pool_stats {
+  int threads;
+  int queued;             /* waiting now */
+  int running;
+  uint64_t done;
+  uint64_t stolen;        /* run by a thread from the queue of another */
+  uint64_t rejected;      /* the queue was full */
+} Job_Pool_Stats;
+
+
+/* prototypes */
+extern bool job_pool_start(int threads);
+extern bool job_pool_running(void);
+extern bool job_pool_submit(Job *job);
+extern void job_pool_shutdown(void);
+extern void job_pool_get_stats(Job_Pool_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
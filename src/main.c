@@ -10,28 +10,87 @@
 #include  <signal.h>
 #include  <errno.h>
 #include  <time.h>
+#include  <poll.h>
+#include  <pthread.h>
+#include  <sys/types.h>
+#include  <sys/wait.h>
 
 
 #include "microhttpd.h"
 #include "terminal.h"
 #include "dispatcher.h"
+#include "arena.h"
+#include "pool.h"
+#include "compress.h"
+#include "id_lease.h"
+#include "replica.h"
+#include "shm.h"
+#include "change_feed.h"
+#include "handoff.h"
+#include "catalog.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "job_pool.h"
+#include "import.h"
+#include "export.h"
+#include "store.h"
+#include "mem.h"
 
 #ifndef FILENAME_MAX
 #define  FILENAME_MAX  250
 #endif
 
 #define DEFAULT_SERVER_PORT  8080
+#define DEFAULT_THREADS  4
 
 /* variables globales */
 char  *pgm_name;                /* program name */
 char  *log_fname;               /* a file to use to log debug messages and errors */
 int   server_port_number = DEFAULT_SERVER_PORT; /* this is the port for the server to receive connections */
+int   server_threads = DEFAULT_THREADS; /* threads of libmicrohttpd to handle requests */
+int   server_workers = 1;       /* processes sharing the port and the terminals table */
+int   job_threads = JOB_POOL_DEFAULT_THREADS; /* threads for the slow handlers, 0 runs them on the server threads */
+int   compress_level = COMPRESS_DEFAULT_LEVEL; /* zlib level for compressed responses, 0 disables compression */
+size_t compress_min_size = COMPRESS_DEFAULT_MIN_SIZE; /* smaller responses are not compressed */
+char  *id_fname;                /* a file to keep the terminal ids high-water mark */
+uint32_t id_block_size = ID_LEASE_DEFAULT_BLOCK; /* terminal ids leased to a thread at once */
+char  *replica_listen;          /* address where a primary listens for followers */
+char  *replica_primary;         /* address of the primary, for a follower */
+char  *handoff_path;            /* control socket for hot restarts */
+char  *catalog_fname;           /* card and transaction types, reloaded on SIGHUP */
+char  *seed_fname;              /* terminals to start with, NDJSON or CSV */
+char  *export_dir;              /* where the files of GET /export are written */
+char  *store_fname;             /* on-disk store of the terminals, instead of memory */
+uint32_t store_cache = STORE_DEFAULT_CACHE; /* terminals of the store cached in memory */
+unsigned int rate_limit;        /* requests a second of a client, 0 is no limit */
+unsigned int rate_burst;        /* requests at once of a client */
+unsigned int trace_every;       /* trace one of every n requests, 0 is none */
+int   inherited_listen_fd = -1; /* listening socket of the release before */
 
 /* to explain command use */
 static char  *use[] = {
   "",
   "Options: -l  log file name (default is stdout)",
+  "         -i  file to keep the last terminal id across restarts (default is none)",
+  "         -I  terminal ids leased to a thread at once (default is 64)",
+  "         -j  threads for slow requests, like all the terminals (default is 4, 0 is none)",
+  "         -K  terminals of the -D store cached in memory (default is 65536)",
+  "         -F  follow the primary at host:port or unix:/path, read only",
+  "         -b  requests a client can make at once (default is the -r rate)",
+  "         -C  card and transaction types catalog file, JSON, reloaded on SIGHUP",
+  "         -D  keep the terminals in an on-disk store file, created if it doesn't exist",
+  "         -E  directory for the files of GET /export (default is /tmp)",
+  "         -H  control socket path for hot restarts, takes over from the server on it",
   "         -p  tcp binding port (default is 8080)",
+  "         -r  requests a second of a client, by API key or IP (default is 0, no limit)",
+  "         -R  listen for followers on host:port or unix:/path",
+  "         -S  seed file with the terminals to start with, NDJSON or CSV",
+  "         -t  threads to handle requests (default is 4)",
+  "         -T  trace one of every n requests, GET /trace or SIGUSR2 (default is 0, none)",
+  "         -w  worker processes sharing the port and the terminals (default is 1)",
+  "         -z  compression level 0-9 (default is 6, 0 disables compression)",
+  "         -Z  minimum response size to compress (default is 1024)",
   "         -V  tool version number",
   (char *) NULL
 };
@@ -42,9 +101,36 @@ static int parse_cmd_line( int argc, char *argv[] );
 static void usage( void );
 static void cleanup( void );
 static int init_all( void );
+static bool seed_all( void );
+static bool share_modules( void );
+static int share_all( void );
+static bool shared_locks_free( void );
+static bool repair_modules( void );
+static int serve( bool worker );
+static int run_workers( void );
 
 
 
+/* request bodies bigger than this are rejected */
+#define MAX_BODY_SIZE  (1024 * 1024)
+
+/* per request state
+ * libmicrohttpd keeps it between the calls to the handler for the same
+ * request, and request_completed() releases it
+ */
+typedef struct request_context {
+  char *body;           /* pool buffer, always NUL terminated */
+  size_t body_len;
+  bool too_large;
+  Dispatch_State *state;  /* kept by the handler between calls */
+  Admission_Ticket ticket;
+  bool body_done;         /* the body is complete, it's been checked */
+  uint32_t trace;         /* the request in the trace, 0 if not traced */
+  uint64_t arrived;       /* ns, when traced */
+  uint64_t mark;          /* ns, the end of the last stage traced */
+} Request_Context;
+
+
 /*
  * processing callback funtion for new data received
  */
@@ -56,39 +142,126 @@ static int ahc_handler(void *cls,
         const char *upload_data,
         size_t *upload_data_size,
         void **ptr) {
-  static int dummy;
-  const char * page = cls;
-  struct MHD_Response * response;
-  int ret;
-  int resource_id;
+  Request_Context *ctx = *ptr;
+  Admission_State st;
+  size_t body_len;
+  int retry;
   char *p;
+  int ret;
 
   fprintf(stderr, "Handler %s URL=%s\n", method, url);
 
-  if (&dummy != *ptr) {
+  if (ctx == NULL) {
       /* The first time only the headers are valid,
          do not respond in the first round... */
-      *ptr = &dummy;
+      if ((ctx = mem_calloc(MEM_CONNECTIONS, 1, sizeof(Request_Context))) == NULL) {
+        return MHD_NO;
+      }
+      *ptr = ctx;
+      /* a request traced is timed from here, see trace.h */
+      ctx->trace = trace_sample();
+      trace_enter(ctx->trace);
+      ctx->arrived = ctx->mark = trace_start();
       return MHD_YES;
   }
+  trace_enter(ctx->trace);
+
+  if (*upload_data_size != 0) {
+    /* the body comes in pieces, it's kept until it's complete so
+     * handlers get it all at once
+     */
+    if (!ctx->too_large) {
+      if (ctx->body_len + *upload_data_size > MAX_BODY_SIZE ||
+          (p = pool_realloc(ctx->body, ctx->body_len + *upload_data_size + 1)) == NULL) {
+        ctx->too_large = true;
+      } else {
+        ctx->body = p;
+        memcpy(ctx->body + ctx->body_len, upload_data, *upload_data_size);
+        ctx->body_len += *upload_data_size;
+        ctx->body[ctx->body_len] = '\0';
+      }
+    }
+    *upload_data_size = 0;
+    return MHD_YES;
+  }
 
-#if 0
-  if (0 != strcmp(method, "GET")) {
-    return MHD_NO; /* unexpected method */
+  if (ctx->too_large) {
+    return dispatch_error(connection, MHD_HTTP_PAYLOAD_TOO_LARGE);
   }
 
-  /* these are all GETs */
-#endif
+  /* once the body is complete, even if the request is suspended later */
+  if (!ctx->body_done) {
+    ctx->body_done = true;
+    ctx->mark = trace_end("read body", ctx->mark);
+
+    /* per client rate limits, before the request takes a slot (see
+     * ratelimit.h)
+     */
+    if (ratelimit_enabled() &&
+        (retry = ratelimit_check(
+            MHD_lookup_connection_value(connection, MHD_HEADER_KIND, RATELIMIT_KEY_HEADER),
+            MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr)) > 0) {
+      return dispatch_rate_limited(connection, retry);
+    }
+  }
+
+  /* admission control, by route class (see admission.h)
+   * a request over the limit waits suspended, and it's called again when
+   * it's admitted or rejected
+   */
+  if ((st = admission_state(&ctx->ticket)) == ADMISSION_IDLE) {
+    st = admission_enter(&ctx->ticket, admission_classify(method, url), connection);
+  }
+  if (st == ADMISSION_WAITING) {
+    return MHD_YES;
+  }
+  if (st == ADMISSION_REJECTED) {
+    return dispatch_error(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+  }
 
   fprintf(stderr, "Before dispatch %s URL=%s\n", method, url);
-  ret = dispatch(connection, url, method, upload_data, upload_data_size);
+  ctx->mark = trace_end("admission", ctx->mark);
+  body_len = ctx->body_len;
+  /* the catalog a request reads is not freed under it (see catalog.h) */
+  catalog_read_begin();
+  ret = dispatch(connection, url, method, ctx->body, &body_len, &ctx->state);
+  catalog_read_end();
+  ctx->mark = trace_end("dispatch", ctx->mark);
+  /* the job pool has the work of the request, it's called again for the
+   * response
+   */
+  if (ctx->state == NULL || !ctx->state->pending) {
+    admission_leave(&ctx->ticket);
+  }
   fprintf(stderr, "After dispatch %s URL=%s  ret=%d\n", method, url, ret);
   return ret;
 }
 
 
+/*
+ * called by libmicrohttpd when a request is done, to release it's state
+ */
+static void request_completed(void *cls,
+        struct MHD_Connection *connection,
+        void **ptr,
+        enum MHD_RequestTerminationCode toe) {
+  Request_Context *ctx = *ptr;
+
+  if (ctx != NULL) {
+    /* the whole request, until the response is sent */
+    trace_enter(ctx->trace);
+    trace_end("request", ctx->arrived);
+    trace_enter(0);
+    admission_cancel(&ctx->ticket);
+    dispatch_completed(ctx->state);
+    pool_free(ctx->body);
+    mem_free(MEM_CONNECTIONS, ctx);
+    *ptr = NULL;
+  }
+}
+
+
 int main( int argc, char *argv[] ) {
-  struct MHD_Daemon *d;
 
   /* parse command line arguments */
   if ( parse_cmd_line( argc, argv ) == 0 ) {
@@ -115,21 +288,187 @@ int main( int argc, char *argv[] ) {
     exit( EXIT_FAILURE );
   }
 
+  /* with many workers, this process only starts them, and starts again
+   * the ones that die
+   */
+  if ( server_workers > 1 ) {
+    if ( share_all() == 0 ) {
+      exit( EXIT_FAILURE );
+    }
+    exit( run_workers() ? EXIT_SUCCESS : EXIT_FAILURE );
+  }
+
+  exit( serve( false ) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+
+/*
+ *  run the libmicrohttpd server, until it's stopped
+ *  a worker stops with SIGTERM, else it stops with some input
+ */
+static struct MHD_Daemon *daemon_running;
+static pid_t *worker_pids;
+
+/*
+ *  every worker has it's own catalog, a reload is done by all of them
+ *  the first process sends SIGHUP to the workers, and a worker that
+ *  reloaded for POST /catalog sends it to the first process
+ */
+static void reload_workers( bool signaled ) {
+  int i;
+
+  for (i = 0; i < server_workers; i++) {
+    if (worker_pids[i] > 0) {
+      kill(worker_pids[i], SIGHUP);
+    }
+  }
+}
+
+static void reload_all( bool signaled ) {
+  if (!signaled) {
+    kill(getppid(), SIGHUP);
+  }
+}
+
+/*
+ *  requests waiting for admission are suspended, see admission.h
+ */
+static void suspend_request( void *arg ) {
+  MHD_suspend_connection(arg);
+}
+
+static void resume_request( void *arg ) {
+  MHD_resume_connection(arg);
+}
+
+/*
+ *  the listening socket, for a new release (see handoff.h)
+ */
+static int listening( void ) {
+  const union MHD_DaemonInfo *info;
+
+  info = MHD_get_daemon_info(daemon_running, MHD_DAEMON_INFO_LISTEN_FD);
+  return info != NULL ? info->listen_fd : -1;
+}
+
+/*
+ *  stop accepting connections, once the new release has the listening
+ *  socket (see handoff.h)
+ *  returns the listening socket
+ */
+static int quiesce( void ) {
+  return MHD_quiesce_daemon(daemon_running);
+}
+
+/*
+ *  wait for some input, or for the handoff to a new release
+ *  returns true if it's the handoff
+ */
+static bool wait_stop( void ) {
+  struct pollfd fds[2];
+
+  fds[0].fd = fileno(stdin);
+  fds[0].events = POLLIN;
+  fds[1].fd = handoff_done_fd();    /* -1 is ignored by poll() */
+  fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) <= 0) {
+    ;
+  }
+  return fds[1].revents != 0;
+}
+
+/*
+ *  after the handoff, wait until the requests left are answered, up to
+ *  HANDOFF_DRAIN_TIMEOUT seconds. idle keep-alive connections are closed
+ *  after that
+ */
+static void drain( struct MHD_Daemon *d ) {
+  const union MHD_DaemonInfo *info;
+  int i;
+
+  for (i = 0; i < HANDOFF_DRAIN_TIMEOUT * 10; i++) {
+    info = MHD_get_daemon_info(d, MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+    if (info == NULL || info->num_connections == 0) {
+      break;
+    }
+    usleep(100000);
+  }
+}
+
+static int serve( bool worker ) {
+  struct MHD_Daemon *d;
+  struct MHD_OptionItem options[3];
+  sigset_t set;
+  bool handed_off = false;
+  int sig;
+  int n = 0;
+
+  if (worker) {
+    /* workers listen on the same port, the kernel spreads the connections
+     * among them (SO_REUSEPORT)
+     */
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL };
+  }
+  if (inherited_listen_fd >= 0) {
+    /* the listening socket of the release before, see handoff.h */
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_LISTEN_SOCKET, inherited_listen_fd, NULL };
+  }
+  options[n] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+
+  /* a worker waits for SIGTERM, the threads started from here on don't
+   * take it
+   */
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  if (worker) {
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (!catalog_watch() || !trace_watch()) {
+      return 0;
+    }
+    catalog_set_reload_hook(reload_all);
+  }
+
+  /* the change feed wakes up the requests waiting for changes */
+  dispatch_init();
+
+  /* the limits of every route class are set for the thread pool */
+  admission_configure(server_threads, suspend_request, resume_request);
+  if (!admission_start()) {
+    return 0;
+  }
+
+  /* the slow handlers run on the job pool, see job_pool.h */
+  if (job_threads > 0 && !job_pool_start(job_threads)) {
+    fprintf(stderr, "%s: can not start the job pool\n", pgm_name);
+  }
+
   /* start the libmicrohttpd server
-   * i think the best configuration is to use a thread pool to
-   * handle requests. this will help with scalability, to sustain
-   * a certain processing level. this mode is like the "reactor" pattern
+   * it uses a thread pool to handle requests. this will help with
+   * scalability, to sustain a certain processing level. this mode is
+   * like the "reactor" pattern
+   * requests that wait (like the change feed) are suspended, so they
+   * don't hold a thread of the pool while they wait
    */
-  d = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
+  d = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME,
                   server_port_number,
                   NULL,
                   NULL,
                   &ahc_handler,
                   NULL,
+                  MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) server_threads,
+                  MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+                  MHD_OPTION_ARRAY, options,
                   MHD_OPTION_END);
 
   if (d == NULL) {
-    return 1;
+    return 0;
+  }
+  daemon_running = d;
+
+  /* the next release takes over through the control socket */
+  if (handoff_path != NULL && !handoff_serve(handoff_path, listening, quiesce)) {
+    fprintf(stderr, "%s: can not create the control socket %s\n",
+      pgm_name, handoff_path);
   }
 
   /* just wait for some input to stop the server
@@ -139,12 +478,191 @@ int main( int argc, char *argv[] ) {
    * it's common also to capture signals to use as simple IPC for
    * the server
    */
-  (void) getc(stdin);
+  if (worker) {
+    sigwait(&set, &sig);
+  } else {
+    handed_off = wait_stop();
+  }
 
-  /* stop the libmicrohttpd server */
+  /* stop the libmicrohttpd server
+   * suspended requests are resumed first, libmicrohttpd can't stop with
+   * suspended connections
+   * after a handoff the new release is already accepting, this one only
+   * answers the requests it has
+   */
+  dispatch_shutdown();
+  admission_shutdown();
+  if (job_pool_running()) {
+    job_pool_shutdown();
+  }
+  if (handed_off) {
+    drain(d);
+  }
   MHD_stop_daemon(d);
+  return 1;
+}
+
 
-  exit( EXIT_SUCCESS );
+/*
+ *  move the state shared by the workers to shared memory
+ *  the terminals table, the change feed and the terminal ids high-water
+ *  mark, so a change done by any worker is seen by all of them
+ */
+static bool share_modules( void ) {
+  return terminal_share() && change_feed_share() && id_lease_share() &&
+    ratelimit_share();
+}
+
+static int share_all( void ) {
+  if (!shm_init(SHM_DEFAULT_SIZE) || !share_modules()) {
+    fprintf(stderr, "%s: can not create the shared memory for the workers\n",
+      pgm_name);
+    return 0;
+  }
+  return 1;
+}
+
+
+/*
+ *  a worker that dies holding a lock of the shared state never lets it
+ *  go, the locks of pthreads are not robust. a lock that can't be taken
+ *  for WORKER_LOCK_WAIT ms is taken as one of those
+ */
+#define WORKER_LOCK_WAIT  1000
+#define WORKER_STOP_WAIT  5       /* seconds a worker has to stop, before SIGKILL */
+
+static bool shared_locks_free( void ) {
+  return terminal_locks_free(WORKER_LOCK_WAIT) &&
+    change_feed_locks_free(WORKER_LOCK_WAIT) &&
+    id_lease_locks_free(WORKER_LOCK_WAIT);
+}
+
+/*
+ *  build the shared state again, with no worker running
+ */
+static bool repair_modules( void ) {
+  return terminal_repair() && change_feed_repair() && id_lease_repair();
+}
+
+
+/*
+ *  start a worker process, returns it's pid or -1
+ */
+static pid_t start_worker( void ) {
+  pid_t pid;
+
+  if ((pid = fork()) == 0) {
+    _exit(serve(true) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  if (pid < 0) {
+    fprintf(stderr, "%s: can not start a worker\n", pgm_name);
+  }
+  return pid;
+}
+
+
+/*
+ *  stop all the workers, with SIGTERM, and SIGKILL for the ones that
+ *  don't stop in WORKER_STOP_WAIT seconds (waiting for a lock that's
+ *  never let go)
+ */
+static void stop_workers( void ) {
+  time_t deadline;
+  pid_t pid;
+  int i, left, status;
+
+  left = 0;
+  for (i = 0; i < server_workers; i++) {
+    if (worker_pids[i] > 0) {
+      kill(worker_pids[i], SIGTERM);
+      left++;
+    }
+  }
+  deadline = time(NULL) + WORKER_STOP_WAIT;
+  while (left > 0) {
+    if ((pid = waitpid(-1, &status, WNOHANG)) == 0) {
+      for (i = 0; i < server_workers && time(NULL) >= deadline; i++) {
+        if (worker_pids[i] > 0) {
+          kill(worker_pids[i], SIGKILL);
+        }
+      }
+      usleep(100000);
+      continue;
+    }
+    if (pid < 0) {
+      break;
+    }
+    for (i = 0; i < server_workers; i++) {
+      if (worker_pids[i] == pid) {
+        worker_pids[i] = -1;
+        left--;
+      }
+    }
+  }
+}
+
+/*
+ *  run the workers
+ *  every worker is a process with it's own libmicrohttpd server and
+ *  thread pool, so the workers don't share an allocator, nor fight for
+ *  the same scheduler queues. they share only the terminals, in shared
+ *  memory. a worker that dies is started again, and the other ones keep
+ *  serving in the meantime
+ *  unless it died holding a lock of the shared state: then it may be half
+ *  changed, and the other workers would wait for the lock for ever. all
+ *  of them are stopped, the shared state is built again from the
+ *  terminals in it (see terminal_repair()), and they are started again
+ *  some input stops them all
+ */
+static int run_workers( void ) {
+  struct pollfd in;
+  pid_t pid;
+  bool died;
+  int i, status;
+
+  if ((worker_pids = calloc(server_workers, sizeof(pid_t))) == NULL) {
+    return 0;
+  }
+  for (i = 0; i < server_workers; i++) {
+    worker_pids[i] = start_worker();
+  }
+  catalog_set_reload_hook(reload_workers);
+
+  in.fd = fileno(stdin);
+  in.events = POLLIN;
+  while (poll(&in, 1, 1000) <= 0) {
+    died = false;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < server_workers; i++) {
+        if (worker_pids[i] == pid) {
+          fprintf(stderr, "%s: worker %d ended (status %d), starting it again\n",
+            pgm_name, (int) pid, status);
+          worker_pids[i] = -1;
+          died = true;
+        }
+      }
+    }
+    if (died && !shared_locks_free()) {
+      fprintf(stderr, "%s: a worker died holding the shared terminals, "
+        "restarting all the workers\n", pgm_name);
+      stop_workers();
+      if (!repair_modules()) {
+        fprintf(stderr, "%s: can not repair the shared terminals\n", pgm_name);
+        free(worker_pids);
+        return 0;
+      }
+    }
+    for (i = 0; i < server_workers; i++) {
+      if (worker_pids[i] < 0) {
+        worker_pids[i] = start_worker();
+      }
+    }
+  }
+
+  stop_workers();
+  catalog_set_reload_hook(NULL);
+  free(worker_pids);
+  return 1;
 }
 
 
@@ -152,27 +670,120 @@ int main( int argc, char *argv[] ) {
  *  init all
  */
 static int init_all( void ) {
+  bool taken_over = false;
+
   /*
    * this is the typical place where configuration files can be read to
    * populate structures
    * or can restore saved state from another run
    * for example: the sequence number for the terminals table
-   * empty for now
    */
 
-  /* add some terminals to the terminals db so it's not empty
-   * as the code for POST is not ready yet, this is a way to
-   * have some data to test the other code
+  /* terminal ids continue from the high-water mark saved by the last run */
+  if (!id_lease_configure(id_fname, id_block_size)) {
+    fprintf(stderr, "%s: can not read terminal ids file %s\n",
+      pgm_name, id_fname);
+    return 0;
+  }
+
+  /* jansson allocates from per thread arenas that are reset after every
+   * request. this must be done before any other use of jansson
+   */
+  arena_install_json();
+
+  /* the catalog is reloaded by a thread of it's own, on SIGHUP. the
+   * threads started after this one don't take the signal
+   */
+  if (!catalog_watch() || !catalog_configure(catalog_fname)) {
+    fprintf(stderr, "%s: can not read catalog file %s\n",
+      pgm_name, catalog_fname);
+    return 0;
+  }
+
+  /* request tracing, the spans are written by a thread of it's own on
+   * TRACE_SIGNAL
    */
-  bool st;
+  trace_configure(trace_every);
+  if (!trace_watch()) {
+    fprintf(stderr, "%s: can not start tracing\n", pgm_name);
+    return 0;
+  }
 
-  Terminal_Data t;
-  terminal_init_data(&t);
-  terminal_add_card_type(&t, "Visa" );
-  terminal_add_transaction_type(&t, "Credit" );
-  terminal_add(&t);
+  /* per client rate limits */
+  if (!ratelimit_configure(rate_limit, rate_burst)) {
+    fprintf(stderr, "%s: -r and -b should be up to %d\n", pgm_name, RATELIMIT_MAX);
+    return 0;
+  }
 
-  char *p = "{\n\
+  /* size/latency trade-off for compressed responses */
+  compress_configure(compress_level, compress_min_size);
+
+  /* the snapshot exports are written there, see export.h */
+  if (!export_configure(export_dir)) {
+    fprintf(stderr, "%s: can not write exports to %s\n", pgm_name, export_dir);
+    return 0;
+  }
+
+  /* the terminals are kept on disk, with a cache in memory (see store.h)
+   * the ones in the store are there when the server starts
+   */
+  if (store_fname != NULL &&
+      !terminal_open_store(store_fname, STORE_DEFAULT_CAPACITY, store_cache)) {
+    fprintf(stderr, "%s: can not open the store %s\n", pgm_name, store_fname);
+    return 0;
+  }
+  /* the table is in the memory accounting (see mem.h) with the backend */
+  terminal_account_memory();
+
+  /* a hot restart takes the terminals of the release that's running,
+   * as they are in it's shared memory, and starts like it did
+   */
+  if (handoff_path != NULL) {
+    switch (handoff_take(handoff_path, share_modules, &inherited_listen_fd)) {
+      case 1:
+        taken_over = true;
+        break;
+      case 0:
+        /* nobody there, start from scratch */
+        break;
+      default:
+        fprintf(stderr, "%s: can not take over from the server at %s\n",
+          pgm_name, handoff_path);
+        return 0;
+    }
+  }
+
+  if (replica_listen != NULL && !replica_primary_start(replica_listen)) {
+    fprintf(stderr, "%s: can not listen for followers on %s\n",
+      pgm_name, replica_listen);
+    return 0;
+  }
+
+  /* the terminals of a seed file, read by a thread for every CPU
+   * a follower gets them from the primary, and after a hot restart they
+   * are there already
+   */
+  if (replica_primary != NULL || taken_over) {
+    /* nothing to add */
+  } else if (seed_fname != NULL) {
+    if (!seed_all()) {
+      return 0;
+    }
+  } else if (store_fname == NULL) {
+    /* add some terminals to the terminals db so it's not empty
+     * new terminals can be created with POST /terminals
+     * a store has the terminals it had
+     */
+    bool st;
+
+    catalog_read_begin();
+    Terminal_Data t;
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, "Visa" );
+    terminal_add_transaction_type(&t, "Credit" );
+    terminal_add(&t);
+
+    char *p = "{\n\
  \"id\": 99,\n\
  \"CardType\": [\n\
   \"Visa\",\n\
@@ -184,17 +795,61 @@ static int init_all( void ) {
   \"Credit\"\n\
  ]\n\
 }";
-  st = terminal_load_json(&t, p);
-  if (st) {
-    terminal_add(&t);
-  } else {
-    fprintf(stderr, "error loading from JSON\n");
+    st = terminal_load_json(&t, p);
+    if (st) {
+      terminal_add(&t);
+    } else {
+      fprintf(stderr, "error loading from JSON\n");
+    }
+    catalog_read_end();
+    arena_reset();
+  }
+
+  /* the terminals are kept in shared memory, for the next release
+   * after a hot restart they are in it already
+   */
+  if (handoff_path != NULL && !taken_over && share_all() == 0) {
+    return 0;
+  }
+
+  /* a follower gets all the terminals from the primary */
+  if (replica_primary != NULL && !replica_follower_start(replica_primary)) {
+    fprintf(stderr, "%s: can not follow %s\n", pgm_name, replica_primary);
+    return 0;
   }
 
   return 1;
 }
 
 
+/*
+ *  import the terminals of the seed file, see import.h
+ *  lines with errors are reported and skipped
+ */
+static bool seed_all( void ) {
+  Import_Stats st;
+
+  if (!import_file(seed_fname, import_default_threads(), false, &st)) {
+    fprintf(stderr, "%s: can not read seed file %s\n", pgm_name, seed_fname);
+    return false;
+  }
+  fprintf(stderr, "%s: %llu terminals from %s in %.1f s (%.0f/s, %d threads), "
+    "%llu lines with errors\n",
+    pgm_name,
+    (unsigned long long) st.added,
+    seed_fname,
+    st.seconds,
+    st.seconds > 0 ? st.added / st.seconds : 0.0,
+    st.threads,
+    (unsigned long long) st.errors);
+  if (st.not_added > 0) {
+    fprintf(stderr, "%s: the table is full, %llu terminals not added\n",
+      pgm_name, (unsigned long long) st.not_added);
+  }
+  return true;
+}
+
+
 /*
  *  cleanup
  */
@@ -224,8 +879,44 @@ static int parse_cmd_line( int argc, char *argv[] ) {
   }
 
   log_fname = (char *) NULL;
-  while ( (c = getopt( argc, argv, "l:p:V" )) != EOF ) {
+  while ( (c = getopt( argc, argv, "b:C:D:E:F:H:i:I:j:K:l:p:r:R:S:t:T:Vw:z:Z:" )) != EOF ) {
     switch ( c ) {
+      case 'b':
+        rate_burst = atoi(optarg);
+        break;
+
+      case 'C':
+        catalog_fname = optarg;
+        break;
+
+      case 'D':
+        store_fname = optarg;
+        break;
+
+      case 'E':
+        export_dir = optarg;
+        break;
+
+      case 'F':
+        replica_primary = optarg;
+        break;
+
+      case 'H':
+        handoff_path = optarg;
+        break;
+
+      case 'i':
+        id_fname = optarg;
+        break;
+
+      case 'I':
+        id_block_size = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'K':
+        store_cache = strtoul(optarg, NULL, 10);
+        break;
+
       case 'l':
         log_fname = optarg;
         break;
@@ -233,7 +924,52 @@ static int parse_cmd_line( int argc, char *argv[] ) {
       case 'p':
         server_port_number = atoi(optarg);
         break;
+
+      case 'r':
+        rate_limit = atoi(optarg);
+        break;
+
+      case 'R':
+        replica_listen = optarg;
+        break;
+
+      case 't':
+        server_threads = atoi(optarg);
+        if (server_threads < 1) {
+          return 0;
+        }
+        break;
       
+      case 'j':
+        job_threads = atoi(optarg);
+        if (job_threads < 0 || job_threads > JOB_POOL_MAX_THREADS) {
+          return 0;
+        }
+        break;
+
+      case 'w':
+        server_workers = atoi(optarg);
+        if (server_workers < 1) {
+          return 0;
+        }
+        break;
+
+      case 'z':
+        compress_level = atoi(optarg);
+        break;
+
+      case 'Z':
+        compress_min_size = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'T':
+        trace_every = atoi(optarg);
+        break;
+
+      case 'S':
+        seed_fname = optarg;
+        break;
+
       case 'V':
         fprintf( stderr, "%s: REST Server\n",
           pgm_name );
@@ -246,6 +982,29 @@ static int parse_cmd_line( int argc, char *argv[] ) {
     }
   }
 
+  /* replication runs threads of it's own, that workers started with
+   * fork() wouldn't have
+   */
+  if (server_workers > 1 && (replica_listen != NULL || replica_primary != NULL)) {
+    fprintf( stderr, "%s: -w can not be used with -R or -F\n", pgm_name );
+    return 0;
+  }
+  /* workers can be replaced one by one, they share the port already. a
+   * primary's replication address is not handed over, a follower's
+   * connection to the primary is made again after the takeover
+   */
+  if (handoff_path != NULL && (server_workers > 1 || replica_listen != NULL)) {
+    fprintf( stderr, "%s: -H can not be used with -w or -R\n", pgm_name );
+    return 0;
+  }
+  /* the cache of the store is in the memory of the process, workers
+   * wouldn't see the changes of the others
+   */
+  if (store_fname != NULL && (server_workers > 1 || handoff_path != NULL)) {
+    fprintf( stderr, "%s: -D can not be used with -w or -H\n", pgm_name );
+    return 0;
+  }
+
   return 1;
 }
 
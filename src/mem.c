@@ -0,0 +1,228 @@
+/*
+ * mem.c
+ *
+ */
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mem.h"
+#include "jansson.h"
+
+#define MEM_LIVE_JSON     "live"
+#define MEM_PEAK_JSON     "peak"
+#define MEM_ALLOCS_JSON   "allocs"
+#define MEM_FREES_JSON    "frees"
+#define MEM_BYTES_JSON    "bytes"
+#define MEM_ALLOC_RATE_JSON  "allocs_per_sec"
+#define MEM_BYTE_RATE_JSON   "bytes_per_sec"
+#define MEM_TAGS_JSON     "tags"
+
+/* the rates are over the time since the sample before, taken by
+ * mem_to_json() at most once every MEM_RATE_PERIOD seconds
+ */
+#define MEM_RATE_PERIOD   1.0
+
+static const char *Tag_Names[N_MEM_TAGS] = {
+  "store",
+  "index",
+  "snapshots",
+  "serializer",
+  "responses",
+  "connections",
+  "catalog"
+};
+
+/* the counters of a tag, in a cache line of their own so subsystems
+ * don't fight for the same line
+ */
+typedef struct mem_counters {
+  int64_t live;
+  int64_t peak;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;
+} __attribute__((aligned(64))) Mem_Counters;
+
+static Mem_Counters Counters[N_MEM_TAGS];
+
+/* the last sample, for the rates */
+static pthread_mutex_t Sample_Lock = PTHREAD_MUTEX_INITIALIZER;
+static double Sample_Time;
+static uint64_t Sample_Allocs[N_MEM_TAGS];
+static uint64_t Sample_Bytes[N_MEM_TAGS];
+static double Alloc_Rate[N_MEM_TAGS];
+static double Byte_Rate[N_MEM_TAGS];
+
+/* count an allocation of size bytes, the peak is only written when it's
+ * passed
+ */
+static void count_alloc(Mem_Tag tag, size_t size) {
+  Mem_Counters *c = &Counters[tag];
+  int64_t live, peak;
+
+  live = __atomic_add_fetch(&c->live, (int64_t) size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&c->peak, &peak, live, false,
+             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    ;
+  }
+}
+
+static void count_free(Mem_Tag tag, size_t size) {
+  Mem_Counters *c = &Counters[tag];
+
+  __atomic_sub_fetch(&c->live, (int64_t) size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->frees, 1, __ATOMIC_RELAXED);
+}
+
+void *mem_malloc(Mem_Tag tag, size_t size) {
+  void *p;
+
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+
+  if ((p = malloc(size)) != NULL) {
+    count_alloc(tag, malloc_usable_size(p));
+  }
+  return p;
+}
+
+void *mem_calloc(Mem_Tag tag, size_t n, size_t size) {
+  void *p;
+
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+
+  if ((p = calloc(n, size)) != NULL) {
+    count_alloc(tag, malloc_usable_size(p));
+  }
+  return p;
+}
+
+/* like realloc(), the block keeps it's tag */
+void *mem_realloc(Mem_Tag tag, void *p, size_t size) {
+  size_t old;
+  void *q;
+
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+
+  if (p == NULL) {
+    return mem_malloc(tag, size);
+  }
+  old = malloc_usable_size(p);
+  if ((q = realloc(p, size)) != NULL) {
+    count_free(tag, old);
+    count_alloc(tag, malloc_usable_size(q));
+  }
+  return q;
+}
+
+/* free a block allocated with the same tag */
+void mem_free(Mem_Tag tag, void *p) {
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+
+  if (p != NULL) {
+    count_free(tag, malloc_usable_size(p));
+    free(p);
+  }
+}
+
+/* add memory that's not from malloc, and is never freed, like static
+ * tables or shared memory
+ */
+void mem_fixed(Mem_Tag tag, size_t size) {
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+  count_alloc(tag, size);
+}
+
+const char *mem_tag_name(Mem_Tag tag) {
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+  return Tag_Names[tag];
+}
+
+/* get the counters of a tag
+ * every counter is read atomically, but not all at the same time
+ */
+void mem_get_stats(Mem_Tag tag, Mem_Stats *st) {
+  Mem_Counters *c;
+
+  assert(tag >= 0 && tag < N_MEM_TAGS);
+  assert(st != NULL);
+
+  c = &Counters[tag];
+  st->live = __atomic_load_n(&c->live, __ATOMIC_RELAXED);
+  st->peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  st->allocs = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+  st->frees = __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+  st->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* encode as json the counters of every tag, with the rates of
+ * allocation, and the bytes in use of all of them
+ * the returned pointer must be released by the caller with
+ * terminal_free_json(), like the other encoders
+ */
+char *mem_to_json(void) {
+  Mem_Stats st[N_MEM_TAGS];
+  json_t *json, *tags, *tag;
+  int64_t live = 0;
+  double t, elapsed;
+  char *p;
+  int i;
+
+  for (i = 0; i < N_MEM_TAGS; i++) {
+    mem_get_stats(i, &st[i]);
+    live += st[i].live;
+  }
+
+  pthread_mutex_lock(&Sample_Lock);
+  t = now();
+  if ((elapsed = t - Sample_Time) >= MEM_RATE_PERIOD) {
+    for (i = 0; i < N_MEM_TAGS; i++) {
+      /* there's no rate until there's a sample before */
+      Alloc_Rate[i] = (Sample_Time == 0) ? 0 :
+          (st[i].allocs - Sample_Allocs[i]) / elapsed;
+      Byte_Rate[i] = (Sample_Time == 0) ? 0 :
+          (st[i].bytes - Sample_Bytes[i]) / elapsed;
+      Sample_Allocs[i] = st[i].allocs;
+      Sample_Bytes[i] = st[i].bytes;
+    }
+    Sample_Time = t;
+  }
+
+  json = json_object();
+  json_object_set_new(json, MEM_LIVE_JSON, json_integer(live));
+  tags = json_object();
+  for (i = 0; i < N_MEM_TAGS; i++) {
+    tag = json_object();
+    json_object_set_new(tag, MEM_LIVE_JSON, json_integer(st[i].live));
+    json_object_set_new(tag, MEM_PEAK_JSON, json_integer(st[i].peak));
+    json_object_set_new(tag, MEM_ALLOCS_JSON, json_integer(st[i].allocs));
+    json_object_set_new(tag, MEM_FREES_JSON, json_integer(st[i].frees));
+    json_object_set_new(tag, MEM_BYTES_JSON, json_integer(st[i].bytes));
+    json_object_set_new(tag, MEM_ALLOC_RATE_JSON, json_real(Alloc_Rate[i]));
+    json_object_set_new(tag, MEM_BYTE_RATE_JSON, json_real(Byte_Rate[i]));
+    json_object_set_new(tags, Tag_Names[i], tag);
+  }
+  pthread_mutex_unlock(&Sample_Lock);
+  json_object_set_new(json, MEM_TAGS_JSON, tags);
+
+  p = json_dumps(json, JSON_INDENT(1));
+  json_decref(json);
+  return p;
+}
+
+/* vim: set et sm ai ts=2: */
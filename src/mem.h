@@ -0,0 +1,59 @@
+/*
+ * mem.h
+ *
+ */
+
+#ifndef __MEM_H
+#define __MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* memory accounting, by subsystem (GET /memory)
+ * the allocations of a subsystem go through wrappers of malloc that take
+ * it's tag, and count the bytes in use, the most there ever were, and how
+ * many allocations and frees there were. a free takes the size from
+ * malloc (malloc_usable_size()), so nothing is added to the blocks
+ * the counters of a tag are in a cache line of their own, and they are
+ * updated with relaxed atomic operations, with no lock. the wrappers are
+ * used where memory comes from malloc, that's a slow path already: the
+ * arenas count their chunks, not the nodes of jansson (see arena.h), the
+ * pools their buffers, not every response (see pool.h), so it can be
+ * always on
+ * memory that's not from malloc, like the terminals table, static or in
+ * shared memory, is added once with mem_fixed()
+ * with many worker processes (option -w) every one counts it's own
+ */
+typedef enum mem_tag {
+  MEM_STORE = 0,      /* the terminals table, the cache of the disk store */
+  MEM_INDEX,          /* the indexes of the table, compiled queries */
+  MEM_SNAPSHOTS,      /* snapshots of the table, for readers of all of it */
+  MEM_SERIALIZER,     /* the arenas of jansson and the encoders */
+  MEM_RESPONSES,      /* the pools of response (and request) bodies */
+  MEM_CONNECTIONS,    /* the state of the requests */
+  MEM_CATALOG,        /* the catalogs loaded, and the replaced ones kept */
+  N_MEM_TAGS
+} Mem_Tag;
+
+typedef struct mem_stats {
+  int64_t live;           /* bytes in use */
+  int64_t peak;           /* the most bytes there were in use */
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;         /* allocated, in all */
+} Mem_Stats;
+
+
+/* prototypes */
+extern void *mem_malloc(Mem_Tag tag, size_t size);
+extern void *mem_calloc(Mem_Tag tag, size_t n, size_t size);
+extern void *mem_realloc(Mem_Tag tag, void *p, size_t size);
+extern void mem_free(Mem_Tag tag, void *p);
+extern void mem_fixed(Mem_Tag tag, size_t size);
+extern const char *mem_tag_name(Mem_Tag tag);
+extern void mem_get_stats(Mem_Tag tag, Mem_Stats *st);
+extern char *mem_to_json(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,308 @@
+/*
+ * msgpack.c
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "msgpack.h"
+#include "pool.h"
+
+/* limit for nested maps and arrays when skipping values */
+#define MAX_DEPTH  32
+
+/* make room for n more bytes */
+static bool buffer_reserve(Msgpack_Buffer *b, size_t n) {
+  char *p;
+
+  if (b->error) {
+    return false;
+  }
+  if (b->data != NULL && b->len + n <= pool_size(b->data)) {
+    return true;
+  }
+  if ((p = pool_realloc(b->data, 2 * (b->len + n))) == NULL) {
+    b->error = true;
+    return false;
+  }
+  b->data = p;
+  return true;
+}
+
+static void put_byte(Msgpack_Buffer *b, unsigned char c) {
+  if (buffer_reserve(b, 1)) {
+    b->data[b->len++] = c;
+  }
+}
+
+/* a type byte followed by a big endian integer of size bytes */
+static void put_be(Msgpack_Buffer *b, unsigned char type, uint64_t v, int size) {
+  int i;
+
+  if (buffer_reserve(b, 1 + size)) {
+    b->data[b->len++] = type;
+    for (i = size - 1; i >= 0; i--) {
+      b->data[b->len++] = (v >> (8 * i)) & 0xff;
+    }
+  }
+}
+
+void msgpack_buffer_init(Msgpack_Buffer *b, size_t size_hint) {
+  assert(b != NULL);
+  b->len = 0;
+  b->error = false;
+  if ((b->data = pool_alloc(size_hint)) == NULL) {
+    b->error = true;
+  }
+}
+
+void msgpack_pack_map(Msgpack_Buffer *b, uint32_t n) {
+  if (n < 16) {
+    put_byte(b, 0x80 | n);
+  } else if (n <= 0xffff) {
+    put_be(b, 0xde, n, 2);
+  } else {
+    put_be(b, 0xdf, n, 4);
+  }
+}
+
+void msgpack_pack_array(Msgpack_Buffer *b, uint32_t n) {
+  if (n < 16) {
+    put_byte(b, 0x90 | n);
+  } else if (n <= 0xffff) {
+    put_be(b, 0xdc, n, 2);
+  } else {
+    put_be(b, 0xdd, n, 4);
+  }
+}
+
+/* integers use the smallest representation */
+void msgpack_pack_uint(Msgpack_Buffer *b, uint64_t v) {
+  if (v < 0x80) {
+    put_byte(b, v);
+  } else if (v <= 0xff) {
+    put_be(b, 0xcc, v, 1);
+  } else if (v <= 0xffff) {
+    put_be(b, 0xcd, v, 2);
+  } else if (v <= 0xffffffff) {
+    put_be(b, 0xce, v, 4);
+  } else {
+    put_be(b, 0xcf, v, 8);
+  }
+}
+
+void msgpack_pack_str(Msgpack_Buffer *b, const char *s) {
+  size_t n = strlen(s);
+
+  if (n < 32) {
+    put_byte(b, 0xa0 | n);
+  } else if (n <= 0xff) {
+    put_be(b, 0xd9, n, 1);
+  } else if (n <= 0xffff) {
+    put_be(b, 0xda, n, 2);
+  } else {
+    put_be(b, 0xdb, n, 4);
+  }
+  if (buffer_reserve(b, n)) {
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+  }
+}
+
+
+void msgpack_reader_init(Msgpack_Reader *r, const char *data, size_t len) {
+  assert(r != NULL);
+  r->p = (const unsigned char *) data;
+  r->end = r->p + len;
+}
+
+/* read a big endian integer of size bytes after the type byte */
+static bool get_be(Msgpack_Reader *r, int size, uint64_t *v) {
+  int i;
+
+  if (r->end - r->p < 1 + size) {
+    return false;
+  }
+  *v = 0;
+  for (i = 1; i <= size; i++) {
+    *v = (*v << 8) | r->p[i];
+  }
+  r->p += 1 + size;
+  return true;
+}
+
+/* the read functions return false, without consuming anything, when the
+ * next value is not of the expected type
+ */
+bool msgpack_read_map(Msgpack_Reader *r, uint32_t *n) {
+  uint64_t v;
+
+  if (r->p >= r->end) {
+    return false;
+  }
+  if ((*r->p & 0xf0) == 0x80) {
+    *n = *r->p++ & 0x0f;
+    return true;
+  }
+  if ((*r->p == 0xde && get_be(r, 2, &v)) || (*r->p == 0xdf && get_be(r, 4, &v))) {
+    *n = v;
+    return true;
+  }
+  return false;
+}
+
+bool msgpack_read_array(Msgpack_Reader *r, uint32_t *n) {
+  uint64_t v;
+
+  if (r->p >= r->end) {
+    return false;
+  }
+  if ((*r->p & 0xf0) == 0x90) {
+    *n = *r->p++ & 0x0f;
+    return true;
+  }
+  if ((*r->p == 0xdc && get_be(r, 2, &v)) || (*r->p == 0xdd && get_be(r, 4, &v))) {
+    *n = v;
+    return true;
+  }
+  return false;
+}
+
+bool msgpack_read_uint(Msgpack_Reader *r, uint64_t *v) {
+  if (r->p >= r->end) {
+    return false;
+  }
+  if (*r->p < 0x80) {
+    *v = *r->p++;
+    return true;
+  }
+  switch (*r->p) {
+    case 0xcc: return get_be(r, 1, v);
+    case 0xcd: return get_be(r, 2, v);
+    case 0xce: return get_be(r, 4, v);
+    case 0xcf: return get_be(r, 8, v);
+  }
+  return false;
+}
+
+/* the string is not copied, nor NUL terminated */
+bool msgpack_read_str(Msgpack_Reader *r, const char **s, uint32_t *len) {
+  const unsigned char *start = r->p;
+  uint64_t v;
+
+  if (r->p >= r->end) {
+    return false;
+  }
+  if ((*r->p & 0xe0) == 0xa0) {
+    v = *r->p++ & 0x1f;
+  } else if (!((*r->p == 0xd9 && get_be(r, 1, &v)) ||
+               (*r->p == 0xda && get_be(r, 2, &v)) ||
+               (*r->p == 0xdb && get_be(r, 4, &v)))) {
+    return false;
+  }
+  if ((uint64_t) (r->end - r->p) < v) {
+    r->p = start;
+    return false;
+  }
+  *s = (const char *) r->p;
+  *len = v;
+  r->p += v;
+  return true;
+}
+
+static bool skip_value(Msgpack_Reader *r, int depth) {
+  unsigned char c;
+  uint64_t n, i;
+
+  if (r->p >= r->end || depth > MAX_DEPTH) {
+    return false;
+  }
+  c = *r->p;
+
+  /* fixint, negative fixint, nil, false, true */
+  if (c < 0x80 || c >= 0xe0 || c == 0xc0 || c == 0xc2 || c == 0xc3) {
+    r->p++;
+    return true;
+  }
+  /* containers */
+  if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf) {
+    uint32_t m;
+    if (!msgpack_read_map(r, &m)) {
+      return false;
+    }
+    for (i = 0; i < 2 * (uint64_t) m; i++) {
+      if (!skip_value(r, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if ((c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd) {
+    uint32_t m;
+    if (!msgpack_read_array(r, &m)) {
+      return false;
+    }
+    for (i = 0; i < m; i++) {
+      if (!skip_value(r, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  /* fixstr */
+  if ((c & 0xe0) == 0xa0) {
+    n = c & 0x1f;
+    r->p++;
+  } else {
+    switch (c) {
+      /* bin and str with a length */
+      case 0xc4: case 0xd9:
+        if (!get_be(r, 1, &n)) return false;
+        break;
+      case 0xc5: case 0xda:
+        if (!get_be(r, 2, &n)) return false;
+        break;
+      case 0xc6: case 0xdb:
+        if (!get_be(r, 4, &n)) return false;
+        break;
+      /* ext with a length, plus the type byte */
+      case 0xc7:
+        if (!get_be(r, 1, &n)) return false;
+        n++;
+        break;
+      case 0xc8:
+        if (!get_be(r, 2, &n)) return false;
+        n++;
+        break;
+      case 0xc9:
+        if (!get_be(r, 4, &n)) return false;
+        n++;
+        break;
+      /* fixed size values */
+      case 0xcc: case 0xd0: n = 1; r->p++; break;
+      case 0xcd: case 0xd1: n = 2; r->p++; break;
+      case 0xca: case 0xce: case 0xd2: n = 4; r->p++; break;
+      case 0xcb: case 0xcf: case 0xd3: n = 8; r->p++; break;
+      case 0xd4: n = 2; r->p++; break;
+      case 0xd5: n = 3; r->p++; break;
+      case 0xd6: n = 5; r->p++; break;
+      case 0xd7: n = 9; r->p++; break;
+      case 0xd8: n = 17; r->p++; break;
+      default:
+        return false;
+    }
+  }
+  if ((uint64_t) (r->end - r->p) < n) {
+    return false;
+  }
+  r->p += n;
+  return true;
+}
+
+/* skip the next value, whatever it's type */
+bool msgpack_skip(Msgpack_Reader *r) {
+  return skip_value(r, 0);
+}
+
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,50 @@
+/*
+ * msgpack.h
+ *
+ */
+
+#ifndef __MSGPACK_H
+#define __MSGPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a minimal MessagePack (https://msgpack.org) encoder and decoder
+ * only what's needed for terminal resources is implemented: maps, arrays,
+ * unsigned integers and strings. the decoder can skip any other value
+ */
+
+/* encoder output, the data is a pool buffer (see pool.h) that grows as
+ * needed. if memory runs out, error is set and the rest is ignored
+ */
+typedef struct msgpack_buffer {
+  char *data;
+  size_t len;
+  bool error;
+} Msgpack_Buffer;
+
+/* decoder input */
+typedef struct msgpack_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+} Msgpack_Reader;
+
+
+/* prototypes */
+extern void msgpack_buffer_init(Msgpack_Buffer *b, size_t size_hint);
+extern void msgpack_pack_map(Msgpack_Buffer *b, uint32_t n);
+extern void msgpack_pack_array(Msgpack_Buffer *b, uint32_t n);
+extern void msgpack_pack_uint(Msgpack_Buffer *b, uint64_t v);
+extern void msgpack_pack_str(Msgpack_Buffer *b, const char *s);
+
+extern void msgpack_reader_init(Msgpack_Reader *r, const char *data, size_t len);
+extern bool msgpack_read_map(Msgpack_Reader *r, uint32_t *n);
+extern bool msgpack_read_array(Msgpack_Reader *r, uint32_t *n);
+extern bool msgpack_read_uint(Msgpack_Reader *r, uint64_t *v);
+extern bool msgpack_read_str(Msgpack_Reader *r, const char **s, uint32_t *len);
+extern bool msgpack_skip(Msgpack_Reader *r);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,172 @@
+/*
+ * pool.c
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+#include "mem.h"
+
+/* smallest class is 1K, every class is 4 times the previous one */
+#define POOL_MIN_SHIFT   10
+#define POOL_CLASS_SHIFT 2
+#define POOL_NO_CLASS    POOL_N_CLASSES
+
+/* no more than this number of free buffers are kept in a class
+ * the rest go back to malloc, this bounds the memory held by the pools
+ */
+#define POOL_MAX_CACHED  64
+
+/* every buffer has a small header before the data, to know where to
+ * return it. the header keeps the data aligned to 16 bytes
+ */
+typedef union pool_block {
+  struct {
+    union pool_block *next;   /* link in the free list */
+    uint32_t class;
+    size_t size;              /* usable bytes */
+  } h;
+  char align[32];
+} Pool_Block;
+
+typedef struct pool_class {
+  pthread_mutex_t lock;
+  Pool_Block *free_list;
+  size_t cached;
+} Pool_Class;
+
+static Pool_Class Classes[POOL_N_CLASSES] = {
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+  { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static size_t Pool_Allocs;
+static size_t Pool_Hits;
+
+static size_t class_size(uint32_t class) {
+  return (size_t) 1 << (POOL_MIN_SHIFT + class * POOL_CLASS_SHIFT);
+}
+
+static uint32_t size_to_class(size_t size) {
+  uint32_t class;
+
+  for (class = 0; class < POOL_N_CLASSES; class++) {
+    if (size <= class_size(class)) {
+      return class;
+    }
+  }
+  return POOL_NO_CLASS;
+}
+
+/* get a buffer of at least size bytes */
+void *pool_alloc(size_t size) {
+  Pool_Block *b = NULL;
+  uint32_t class;
+  size_t n;
+
+  class = size_to_class(size);
+  __atomic_add_fetch(&Pool_Allocs, 1, __ATOMIC_RELAXED);
+
+  if (class != POOL_NO_CLASS) {
+    pthread_mutex_lock(&Classes[class].lock);
+    if ((b = Classes[class].free_list) != NULL) {
+      Classes[class].free_list = b->h.next;
+      Classes[class].cached--;
+    }
+    pthread_mutex_unlock(&Classes[class].lock);
+    if (b != NULL) {
+      __atomic_add_fetch(&Pool_Hits, 1, __ATOMIC_RELAXED);
+      return b + 1;
+    }
+    n = class_size(class);
+  } else {
+    n = size;
+  }
+
+  if ((b = mem_malloc(MEM_RESPONSES, sizeof(Pool_Block) + n)) == NULL) {
+    return NULL;
+  }
+  b->h.next = NULL;
+  b->h.class = class;
+  b->h.size = n;
+  return b + 1;
+}
+
+/* grow a buffer, keeping it's content
+ * as buffers are rounded up to the class size, this is usually a no-op
+ */
+void *pool_realloc(void *p, size_t size) {
+  void *q;
+
+  if (p == NULL) {
+    return pool_alloc(size);
+  }
+  if (size <= pool_size(p)) {
+    return p;
+  }
+  if ((q = pool_alloc(size)) == NULL) {
+    return NULL;
+  }
+  memcpy(q, p, pool_size(p));
+  pool_free(p);
+  return q;
+}
+
+/* return a buffer to it's pool
+ * the signature matches the libmicrohttpd free callback, so responses
+ * can be created directly from pool buffers
+ */
+void pool_free(void *p) {
+  Pool_Block *b;
+  Pool_Class *c;
+
+  if (p == NULL) {
+    return;
+  }
+  b = (Pool_Block *) p - 1;
+  if (b->h.class == POOL_NO_CLASS) {
+    mem_free(MEM_RESPONSES, b);
+    return;
+  }
+
+  c = &Classes[b->h.class];
+  pthread_mutex_lock(&c->lock);
+  if (c->cached < POOL_MAX_CACHED) {
+    b->h.next = c->free_list;
+    c->free_list = b;
+    c->cached++;
+    b = NULL;
+  }
+  pthread_mutex_unlock(&c->lock);
+  mem_free(MEM_RESPONSES, b);
+}
+
+/* usable size of a buffer */
+size_t pool_size(void *p) {
+  assert(p != NULL);
+  return ((Pool_Block *) p - 1)->h.size;
+}
+
+void pool_get_stats(Pool_Stats *st) {
+  int i;
+
+  assert(st != NULL);
+  st->allocs = __atomic_load_n(&Pool_Allocs, __ATOMIC_RELAXED);
+  st->hits = __atomic_load_n(&Pool_Hits, __ATOMIC_RELAXED);
+  for (i = 0; i < POOL_N_CLASSES; i++) {
+    pthread_mutex_lock(&Classes[i].lock);
+    st->cached[i] = Classes[i].cached;
+    pthread_mutex_unlock(&Classes[i].lock);
+  }
+}
+
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,36 @@
+/*
+ * pool.h
+ *
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+
+/* size class pools for response buffers
+ * buffers are rounded up to a size class (1K, 4K, 16K, 64K, 256K, 1M)
+ * and freed buffers are kept in a per class free list, so the same
+ * memory is reused by the next responses instead of going back to malloc
+ * buffers bigger than the largest class are plain malloc/free
+ */
+#define POOL_N_CLASSES  6
+
+/* statistics for the pools */
+typedef struct pool_stats {
+  size_t allocs;           /* number of pool_alloc() calls */
+  size_t hits;             /* served from a free list */
+  size_t cached[POOL_N_CLASSES]; /* buffers waiting in each free list */
+} Pool_Stats;
+
+
+/* prototypes */
+extern void *pool_alloc(size_t size);
+extern void *pool_realloc(void *p, size_t size);
+extern void pool_free(void *p);
+extern size_t pool_size(void *p);
+extern void pool_get_stats(Pool_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,554 @@
+/*
+ * query.c
+ *
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "query.h"
+#include "catalog.h"
+#include "mem.h"
+
+/* the tokens of an expression */
+typedef enum token_type {
+  TOKEN_END = 0,
+  TOKEN_ERROR,
+  TOKEN_LPAREN,
+  TOKEN_RPAREN,
+  TOKEN_MINUS,
+  TOKEN_EQ,
+  TOKEN_LT,
+  TOKEN_LE,
+  TOKEN_GT,
+  TOKEN_GE,
+  TOKEN_NUMBER,
+  TOKEN_NAME,             /* a word that's not a keyword, or a quoted one */
+  /* keywords */
+  TOKEN_AND,
+  TOKEN_OR,
+  TOKEN_NOT,
+  TOKEN_HAS,
+  TOKEN_IN,
+  TOKEN_ID,
+  TOKEN_CARDS,
+  TOKEN_TRXS
+} Token_Type;
+
+static const struct {
+  const char *word;
+  Token_Type type;
+} Keywords[] = {
+  { "and", TOKEN_AND },
+  { "or", TOKEN_OR },
+  { "not", TOKEN_NOT },
+  { "has", TOKEN_HAS },
+  { "in", TOKEN_IN },
+  { "id", TOKEN_ID },
+  { "CardType", TOKEN_CARDS },
+  { "TransactionType", TOKEN_TRXS }
+};
+
+typedef struct token {
+  Token_Type type;
+  const char *start;      /* in the expression, past the quote of a name */
+  size_t len;
+  uint64_t number;
+  const char *next;       /* where the next token starts */
+} Token;
+
+typedef struct parser {
+  const char *expr;
+  const char *p;          /* the next token */
+  Query *q;
+  int depth;              /* values on the stack as the program runs */
+  int error;              /* where the error is, in the expression */
+} Parser;
+
+/* the cache of compiled expressions */
+static pthread_mutex_t Cache_Lock = PTHREAD_MUTEX_INITIALIZER;
+static Query *Cache[QUERY_CACHE];
+static uint64_t Uses;
+
+/* read the token at p */
+static void lex(const char *p, Token *t) {
+  const char *start;
+  size_t i;
+
+  while (isspace((unsigned char) *p)) {
+    p++;
+  }
+  t->start = p;
+  t->len = 1;
+  t->next = p + 1;
+  switch (*p) {
+  case '\0':
+    t->type = TOKEN_END;
+    t->next = p;
+    return;
+  case '(':
+    t->type = TOKEN_LPAREN;
+    return;
+  case ')':
+    t->type = TOKEN_RPAREN;
+    return;
+  case '-':
+    t->type = TOKEN_MINUS;
+    return;
+  case '=':
+    t->type = TOKEN_EQ;
+    return;
+  case '<':
+  case '>':
+    t->type = (*p == '<') ? TOKEN_LT : TOKEN_GT;
+    if (p[1] == '=') {
+      t->type = (*p == '<') ? TOKEN_LE : TOKEN_GE;
+      t->len = 2;
+      t->next = p + 2;
+    }
+    return;
+  case '"':
+    start = ++p;
+    while (*p != '"' && *p != '\0') {
+      p++;
+    }
+    if (*p != '"') {
+      /* the error is at the quote */
+      t->type = TOKEN_ERROR;
+      return;
+    }
+    t->type = TOKEN_NAME;
+    t->start = start;
+    t->len = p - start;
+    t->next = p + 1;
+    return;
+  }
+
+  if (isdigit((unsigned char) *p)) {
+    t->type = TOKEN_NUMBER;
+    t->number = 0;
+    for (; isdigit((unsigned char) *p); p++) {
+      /* more than an id can be is an error */
+      if ((t->number = t->number * 10 + (*p - '0')) > UINT32_MAX) {
+        t->type = TOKEN_ERROR;
+      }
+    }
+    t->len = p - t->start;
+    t->next = p;
+    return;
+  }
+  if (isalpha((unsigned char) *p) || *p == '_') {
+    while (isalnum((unsigned char) *p) || *p == '_' || *p == '.') {
+      p++;
+    }
+    t->type = TOKEN_NAME;
+    t->len = p - t->start;
+    t->next = p;
+    for (i = 0; i < sizeof(Keywords) / sizeof(Keywords[0]); i++) {
+      if (strlen(Keywords[i].word) == t->len &&
+          strncasecmp(Keywords[i].word, t->start, t->len) == 0) {
+        t->type = Keywords[i].type;
+        break;
+      }
+    }
+    return;
+  }
+  t->type = TOKEN_ERROR;
+}
+
+static void peek(Parser *P, Token *t) {
+  lex(P->p, t);
+}
+
+static void take(Parser *P, Token *t) {
+  lex(P->p, t);
+  P->p = t->next;
+}
+
+/* fail at the token t, always returns false */
+static bool fail(Parser *P, Token *t) {
+  P->error = t->start - P->expr;
+  return false;
+}
+
+/* add an instruction, it leaves push more values on the stack, fewer when
+ * push is negative
+ */
+static bool emit(Parser *P, Token *t, Query_Op op, uint32_t a, uint32_t b,
+        int push) {
+  Query *q = P->q;
+
+  if (q->n == QUERY_MAX_CODE || P->depth + push > QUERY_MAX_DEPTH) {
+    return fail(P, t);
+  }
+  q->code[q->n].op = op;
+  q->code[q->n].a = a;
+  q->code[q->n].b = b;
+  q->n++;
+  P->depth += push;
+  return true;
+}
+
+/* the bit of the type with a name, the position in the catalog */
+static bool type_bit(Parser *P, Token *t, Token_Type kind, uint32_t *bit) {
+  char name[CATALOG_NAME_SIZE];
+  Transaction_Type *tt;
+  Card_Type *ct;
+
+  if (t->type != TOKEN_NAME || t->len >= sizeof(name)) {
+    return fail(P, t);
+  }
+  memcpy(name, t->start, t->len);
+  name[t->len] = '\0';
+  if (kind == TOKEN_CARDS) {
+    if ((ct = card_type_find_by_name(name)) == NULL) {
+      return fail(P, t);
+    }
+    *bit = 1u << card_type_index(ct->id);
+  } else {
+    if ((tt = transaction_type_find_by_name(name)) == NULL) {
+      return fail(P, t);
+    }
+    *bit = 1u << transaction_type_index(tt->id);
+  }
+  return true;
+}
+
+/* CardType has NAME [or NAME ...], or with and, and the same for
+ * TransactionType
+ * the and / or after a name go with the list when a name follows them,
+ * a keyword or ( after them starts another predicate
+ */
+static bool parse_types(Parser *P, Token_Type kind) {
+  Token t, join, after;
+  Token_Type joined = TOKEN_END;
+  uint32_t mask, bit;
+  Query_Op op;
+
+  take(P, &t);
+  if (t.type != TOKEN_HAS) {
+    return fail(P, &t);
+  }
+  take(P, &t);
+  if (!type_bit(P, &t, kind, &mask)) {
+    return false;
+  }
+  for (;;) {
+    peek(P, &join);
+    if (join.type != TOKEN_AND && join.type != TOKEN_OR) {
+      break;
+    }
+    lex(join.next, &after);
+    if (after.type != TOKEN_NAME) {
+      break;
+    }
+    if (joined != TOKEN_END && joined != join.type) {
+      /* any of them and all of them, it needs parentheses */
+      return fail(P, &join);
+    }
+    joined = join.type;
+    P->p = after.next;
+    if (!type_bit(P, &after, kind, &bit)) {
+      return false;
+    }
+    mask |= bit;
+  }
+  if (kind == TOKEN_CARDS) {
+    op = (joined == TOKEN_AND) ? QUERY_CARDS_ALL : QUERY_CARDS_ANY;
+  } else {
+    op = (joined == TOKEN_AND) ? QUERY_TRXS_ALL : QUERY_TRXS_ANY;
+  }
+  return emit(P, &t, op, mask, 0, 1);
+}
+
+/* id in N-M, id in N, or id compared to N */
+static bool parse_id(Parser *P) {
+  Token op, n, m;
+  uint32_t lo = 1, hi = UINT32_MAX;
+
+  take(P, &op);
+  if (op.type != TOKEN_IN && (op.type < TOKEN_EQ || op.type > TOKEN_GE)) {
+    return fail(P, &op);
+  }
+  take(P, &n);
+  if (n.type != TOKEN_NUMBER) {
+    return fail(P, &n);
+  }
+  switch (op.type) {
+  case TOKEN_IN:
+    lo = hi = n.number;
+    peek(P, &m);
+    if (m.type == TOKEN_MINUS) {
+      P->p = m.next;
+      take(P, &m);
+      if (m.type != TOKEN_NUMBER || m.number < n.number) {
+        return fail(P, &m);
+      }
+      hi = m.number;
+    }
+    break;
+  case TOKEN_EQ:
+    lo = hi = n.number;
+    break;
+  case TOKEN_LT:
+    /* id < 0 is nothing, an empty range */
+    lo = (n.number == 0) ? 2 : 1;
+    hi = (n.number == 0) ? 1 : n.number - 1;
+    break;
+  case TOKEN_LE:
+    hi = n.number;
+    break;
+  case TOKEN_GT:
+    /* and so is id > 4294967295 */
+    lo = (n.number == UINT32_MAX) ? 2 : n.number + 1;
+    hi = (n.number == UINT32_MAX) ? 1 : UINT32_MAX;
+    break;
+  case TOKEN_GE:
+    lo = n.number;
+    break;
+  default:
+    return fail(P, &op);
+  }
+  return emit(P, &op, QUERY_ID, lo, hi, 1);
+}
+
+static bool parse_or(Parser *P);
+
+static bool parse_unary(Parser *P) {
+  Token t;
+
+  take(P, &t);
+  switch (t.type) {
+  case TOKEN_NOT:
+    return parse_unary(P) && emit(P, &t, QUERY_NOT, 0, 0, 0);
+  case TOKEN_LPAREN:
+    if (!parse_or(P)) {
+      return false;
+    }
+    take(P, &t);
+    return (t.type == TOKEN_RPAREN) ? true : fail(P, &t);
+  case TOKEN_CARDS:
+  case TOKEN_TRXS:
+    return parse_types(P, t.type);
+  case TOKEN_ID:
+    return parse_id(P);
+  default:
+    return fail(P, &t);
+  }
+}
+
+static bool parse_and(Parser *P) {
+  Token t;
+
+  if (!parse_unary(P)) {
+    return false;
+  }
+  for (peek(P, &t); t.type == TOKEN_AND; peek(P, &t)) {
+    P->p = t.next;
+    if (!parse_unary(P) || !emit(P, &t, QUERY_AND, 0, 0, -1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool parse_or(Parser *P) {
+  Token t;
+
+  if (!parse_and(P)) {
+    return false;
+  }
+  for (peek(P, &t); t.type == TOKEN_OR; peek(P, &t)) {
+    P->p = t.next;
+    if (!parse_and(P) || !emit(P, &t, QUERY_OR, 0, 0, -1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* compile an expression, with the catalog in use
+ * returns a new query with a reference, for query_release(), or NULL with
+ * the position of the error in error
+ */
+Query *query_compile(const char *expr, int *error) {
+  Parser P;
+  Token t;
+  size_t len;
+
+  assert(expr != NULL && error != NULL);
+
+  if ((len = strlen(expr)) > QUERY_MAX_LEN) {
+    *error = QUERY_MAX_LEN;
+    return NULL;
+  }
+  if ((P.q = mem_malloc(MEM_INDEX, sizeof(Query) + len + 1)) == NULL) {
+    *error = 0;
+    return NULL;
+  }
+  P.q->refs = 1;
+  P.q->catalog = catalog_current()->generation;
+  P.q->used = 0;
+  P.q->n = 0;
+  memcpy(P.q->expr, expr, len + 1);
+  P.expr = P.p = expr;
+  P.depth = 0;
+  P.error = 0;
+
+  if (!parse_or(&P)) {
+    *error = P.error;
+    mem_free(MEM_INDEX, P.q);
+    return NULL;
+  }
+  take(&P, &t);
+  if (t.type != TOKEN_END) {
+    *error = t.start - expr;
+    mem_free(MEM_INDEX, P.q);
+    return NULL;
+  }
+  return P.q;
+}
+
+/* get the compiled expression from the cache, compiled now if it's not
+ * there or the catalog changed since. the least used one is let go
+ * returns it with a reference, for query_release(), or NULL with the
+ * position of the error in error
+ */
+Query *query_get(const char *expr, int *error) {
+  uint64_t catalog = catalog_current()->generation;
+  Query *q;
+  int i, victim = 0;
+
+  assert(expr != NULL && error != NULL);
+
+  pthread_mutex_lock(&Cache_Lock);
+  for (i = 0; i < QUERY_CACHE; i++) {
+    if (Cache[i] == NULL) {
+      victim = i;
+      continue;
+    }
+    if (Cache[i]->catalog == catalog && strcmp(Cache[i]->expr, expr) == 0) {
+      q = Cache[i];
+      q->used = ++Uses;
+      __atomic_add_fetch(&q->refs, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&Cache_Lock);
+      return q;
+    }
+    if (Cache[victim] != NULL && Cache[i]->used < Cache[victim]->used) {
+      victim = i;
+    }
+  }
+
+  if ((q = query_compile(expr, error)) != NULL) {
+    if (Cache[victim] != NULL) {
+      query_release(Cache[victim]);
+    }
+    q->refs = 2;
+    q->used = ++Uses;
+    Cache[victim] = q;
+  }
+  pthread_mutex_unlock(&Cache_Lock);
+  return q;
+}
+
+void query_release(Query *q) {
+  if (q != NULL && __atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    mem_free(MEM_INDEX, q);
+  }
+}
+
+/* run the program on a terminal, the masks have a bit for every type it
+ * has. the stack is a bit for every value, the top one is bit 0
+ */
+static bool run(const Query *q, terminal_id id, uint32_t cards, uint32_t trxs) {
+  const Query_Insn *i, *end = q->code + q->n;
+  uint64_t s = 0;
+
+  for (i = q->code; i < end; i++) {
+    switch (i->op) {
+    case QUERY_CARDS_ANY:
+      s = s << 1 | ((cards & i->a) != 0);
+      break;
+    case QUERY_CARDS_ALL:
+      s = s << 1 | ((cards & i->a) == i->a);
+      break;
+    case QUERY_TRXS_ANY:
+      s = s << 1 | ((trxs & i->a) != 0);
+      break;
+    case QUERY_TRXS_ALL:
+      s = s << 1 | ((trxs & i->a) == i->a);
+      break;
+    case QUERY_ID:
+      s = s << 1 | (id >= i->a && id <= i->b);
+      break;
+    case QUERY_NOT:
+      s ^= 1;
+      break;
+    case QUERY_AND:
+      s = (s >> 1) & (s | ~(uint64_t) 1);
+      break;
+    case QUERY_OR:
+      s = (s >> 1) | (s & 1);
+      break;
+    }
+  }
+  return s & 1;
+}
+
+/* the masks of the types of a terminal, with the positions of a catalog
+ * the types of a terminal in the table are in the catalog, retired ones
+ * too, and keep their positions. small ids are looked up in the catalog
+ * loaded once by the caller, like card_type_index() does
+ */
+static void type_masks(Catalog *c, Terminal_Data *t, uint32_t *cards,
+        uint32_t *trxs) {
+  uint32_t id;
+  int i, pos;
+
+  *cards = 0;
+  for (i = 0; i < N_CARDS && (id = t->cards[i]) != 0; i++) {
+    pos = (id < CATALOG_FAST_IDS) ? c->card_pos[id] - 1 : card_type_index(id);
+    if (pos >= 0) {
+      *cards |= 1u << pos;
+    }
+  }
+  *trxs = 0;
+  for (i = 0; i < N_TRXS && (id = t->trxs[i]) != 0; i++) {
+    pos = (id < CATALOG_FAST_IDS) ? c->trx_pos[id] - 1 : transaction_type_index(id);
+    if (pos >= 0) {
+      *trxs |= 1u << pos;
+    }
+  }
+}
+
+/* the terminals of an array that match, like a batch of a scan of the
+ * table (terminal_scan()), copied to out in the order they are. empty
+ * ones (id 0) are skipped. the catalog is loaded once for all of them
+ * out should have room for all of them, n
+ * returns how many there are
+ */
+int query_search(const Query *q, Terminal_Data *ts, int n, Terminal_Data *out) {
+  Catalog *c = catalog_current();
+  Terminal_Data *t, *end;
+  uint32_t cards, trxs;
+  int found = 0;
+
+  assert(q != NULL && (ts != NULL || n == 0) && out != NULL);
+
+  end = ts + n;
+  for (t = ts; t < end; t++) {
+    if (t->id == 0) {
+      continue;
+    }
+    type_masks(c, t, &cards, &trxs);
+    if (run(q, t->id, cards, trxs)) {
+      out[found++] = *t;
+    }
+  }
+  return found;
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,76 @@
+/*
+ * query.h
+ *
+ */
+
+#ifndef __QUERY_H
+#define __QUERY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "terminal.h"
+
+/* search expressions for the terminals, GET /terminals?q=
+ *   (CardType has Amex or JBC) and not TransactionType has Cheque
+ *   id in 100-200 or id >= 5000
+ * a predicate is one of
+ *   CardType has NAME [or NAME ...]          any of the types
+ *   CardType has NAME and NAME [and ...]     all of them
+ *   TransactionType has ...                  the same, for transactions
+ *   id in N-M, id in N, id = N, id < N, id <= N, id > N, id >= N
+ * joined with and, or, not and parentheses. keywords are not case
+ * sensitive, names are, and a name that's a keyword or has spaces is
+ * written in double quotes. only the types of the catalog in use can be
+ * named, not the retired ones
+ * an expression is compiled once to a short program in postfix, with the
+ * names of the types turned into bitmasks of their catalog positions, so
+ * a terminal is matched with a mask of it's types and a loop over the
+ * program, with no names and no parsing. compiled expressions are kept
+ * in a cache of QUERY_CACHE, by expression and catalog generation
+ */
+#define QUERY_MAX_LEN    1024    /* characters of an expression */
+#define QUERY_MAX_CODE   128     /* instructions of a program */
+#define QUERY_MAX_DEPTH  64      /* values on the stack of a program */
+#define QUERY_CACHE      64      /* compiled expressions kept */
+
+_Static_assert(MAX_CARD_TYPES <= 32 && MAX_TRANSACTION_TYPES <= 32,
+    "the types of a terminal should fit in a 32 bit mask");
+
+typedef enum query_op {
+  QUERY_CARDS_ANY = 0,    /* push (cards & mask) != 0 */
+  QUERY_CARDS_ALL,        /* push (cards & mask) == mask */
+  QUERY_TRXS_ANY,
+  QUERY_TRXS_ALL,
+  QUERY_ID,               /* push lo <= id <= hi */
+  QUERY_NOT,
+  QUERY_AND,
+  QUERY_OR
+} Query_Op;
+
+typedef struct query_insn {
+  uint32_t op;
+  uint32_t a;             /* the mask, or lo */
+  uint32_t b;             /* hi */
+} Query_Insn;
+
+typedef struct query {
+  int refs;               /* holders, the cache is one */
+  uint64_t catalog;       /* generation of the catalog it was compiled with */
+  uint64_t used;          /* the last use, for the cache */
+  int n;
+  Query_Insn code[QUERY_MAX_CODE];
+  char expr[];
+} Query;
+
+
+/* prototypes */
+extern Query *query_compile(const char *expr, int *error);
+extern Query *query_get(const char *expr, int *error);
+extern void query_release(Query *q);
+extern int query_search(const Query *q, Terminal_Data *ts, int n,
+                Terminal_Data *out);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
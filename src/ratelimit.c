@@ -0,0 +1,236 @@
+/*
+ * ratelimit.c
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+#include "shm.h"
+
+/* tokens are kept in thousandths, so a bucket fills by rate thousandths
+ * every millisecond
+ */
+#define TOKEN  1000
+
+/* a client's bucket
+ * the state is the tokens and the time they were counted, in ms, in a
+ * single word, so a request takes a token with one compare and swap. a
+ * state of 0 is a full bucket, the one of a new client
+ * slots are a cache line each, clients on the same line would slow down
+ * each other
+ */
+typedef struct ratelimit_slot {
+  uint64_t key;           /* the client, 0 if it's free */
+  uint64_t state;         /* tokens << 32 | ms */
+} __attribute__((aligned(64))) Ratelimit_Slot;
+
+typedef struct ratelimit_table {
+  uint64_t base;          /* ns, the time of ms 0 */
+  uint64_t limited;
+  uint64_t untracked;
+  Ratelimit_Slot slots[RATELIMIT_SLOTS];
+} Ratelimit_Table;
+
+static Ratelimit_Table Local_Table;
+static Ratelimit_Table *Table = &Local_Table;
+static uint32_t Rate;     /* tokens a second, 0 if there's no limit */
+static uint32_t Burst;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  /* the coarse clock is enough for ms, and it's a lot cheaper */
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* set the limits, requests a second and at once
+ * a rate of 0 disables them, a burst of 0 is one second of requests
+ * returns false if they are out of range
+ */
+bool ratelimit_configure(unsigned int rate, unsigned int burst) {
+  if (rate > RATELIMIT_MAX || burst > RATELIMIT_MAX) {
+    return false;
+  }
+  Rate = rate;
+  Burst = (burst > 0) ? burst : rate;
+  if (Table->base == 0) {
+    Table->base = now_ns();
+  }
+  return true;
+}
+
+bool ratelimit_enabled(void) {
+  return Rate > 0;
+}
+
+/* move the table to shared memory (see shm.h), for the workers */
+bool ratelimit_share(void) {
+  Ratelimit_Table *t;
+
+  if ((t = shm_alloc(sizeof(Ratelimit_Table))) == NULL) {
+    return false;
+  }
+  if (!shm_attached()) {
+    memcpy(t, Table, sizeof(Ratelimit_Table));
+  }
+  Table = t;
+  return true;
+}
+
+/* the time in ms, never 0, a state of 0 is a new client */
+uint32_t ratelimit_now(void) {
+  return (uint32_t) ((now_ns() - Table->base) / 1000000) + 1;
+}
+
+/* FNV-1a */
+static uint64_t hash(uint64_t h, const void *p, size_t len) {
+  const unsigned char *c = p;
+
+  while (len-- > 0) {
+    h ^= *c++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* the key of a client, it's API key or it's address (without the port)
+ * the first byte keeps keys and addresses apart
+ */
+uint64_t ratelimit_key(const char *api_key, const struct sockaddr *addr) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  if (api_key != NULL) {
+    h = hash(h, "k", 1);
+    h = hash(h, api_key, strlen(api_key));
+  } else if (addr != NULL && addr->sa_family == AF_INET) {
+    h = hash(h, "4", 1);
+    h = hash(h, &((const struct sockaddr_in *) addr)->sin_addr, sizeof(struct in_addr));
+  } else if (addr != NULL && addr->sa_family == AF_INET6) {
+    h = hash(h, "6", 1);
+    h = hash(h, &((const struct sockaddr_in6 *) addr)->sin6_addr, sizeof(struct in6_addr));
+  } else {
+    /* unix sockets and the like, all the same client */
+    h = hash(h, "u", 1);
+  }
+  return (h != 0) ? h : 1;
+}
+
+/* take a token of a bucket
+ * returns 0 if there was one, else the ms until there's one
+ */
+static uint32_t consume(Ratelimit_Slot *s, uint32_t now) {
+  uint64_t old, new, tokens;
+  uint32_t last;
+
+  old = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+  for (;;) {
+    if (old == 0) {
+      tokens = (uint64_t) Burst * TOKEN;
+    } else {
+      tokens = old >> 32;
+      last = (uint32_t) old;
+      /* the clock of another worker can be a little behind */
+      if ((int32_t) (now - last) > 0) {
+        tokens += (uint64_t) (now - last) * Rate;
+      }
+      if (tokens > (uint64_t) Burst * TOKEN) {
+        tokens = (uint64_t) Burst * TOKEN;
+      }
+    }
+    if (tokens < TOKEN) {
+      return (TOKEN - tokens + Rate - 1) / Rate;
+    }
+    new = ((tokens - TOKEN) << 32) | now;
+    if (__atomic_compare_exchange_n(&s->state, &old, new, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return 0;
+    }
+  }
+}
+
+/* take a token of the client with key at time now (ms)
+ * returns 0 if it can go on, else the ms until it can
+ */
+uint32_t ratelimit_take(uint64_t key, uint32_t now) {
+  Ratelimit_Slot *s, *victim = NULL;
+  uint64_t k, expected, state;
+  uint32_t oldest = 0, idle;
+  int i;
+
+  assert(key != 0);
+
+  for (i = 0; i < RATELIMIT_PROBE; i++) {
+    s = &Table->slots[(key + i) & (RATELIMIT_SLOTS - 1)];
+    k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+    if (k == 0) {
+      expected = 0;
+      if (__atomic_compare_exchange_n(&s->key, &expected, key, false,
+              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return consume(s, now);
+      }
+      /* taken meanwhile, maybe by the same client */
+      k = expected;
+    }
+    if (k == key) {
+      return consume(s, now);
+    }
+    /* the client idle the longest, in case there's no room. a state of
+     * 0 is a client that just came
+     */
+    state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    idle = now - (uint32_t) state;
+    if (state != 0 && (int32_t) idle >= RATELIMIT_IDLE * 1000 && idle > oldest) {
+      oldest = idle;
+      victim = s;
+    }
+  }
+
+  if (victim != NULL) {
+    expected = __atomic_load_n(&victim->key, __ATOMIC_ACQUIRE);
+    if (__atomic_compare_exchange_n(&victim->key, &expected, key, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&victim->state, 0, __ATOMIC_RELAXED);
+      return consume(victim, now);
+    }
+  }
+  __atomic_add_fetch(&Table->untracked, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* check the limit of a client
+ * returns 0 if it can go on, else the seconds to wait, for Retry-After
+ */
+int ratelimit_check(const char *api_key, const struct sockaddr *addr) {
+  uint32_t wait;
+
+  if (Rate == 0) {
+    return 0;
+  }
+  if ((wait = ratelimit_take(ratelimit_key(api_key, addr), ratelimit_now())) == 0) {
+    return 0;
+  }
+  __atomic_add_fetch(&Table->limited, 1, __ATOMIC_RELAXED);
+  return (wait + 999) / 1000;
+}
+
+/* the counters, and how many slots are taken (a scan of the table) */
+void ratelimit_get_stats(Ratelimit_Stats *st) {
+  int i;
+
+  assert(st != NULL);
+
+  st->limited = __atomic_load_n(&Table->limited, __ATOMIC_RELAXED);
+  st->untracked = __atomic_load_n(&Table->untracked, __ATOMIC_RELAXED);
+  st->clients = 0;
+  for (i = 0; i < RATELIMIT_SLOTS; i++) {
+    if (__atomic_load_n(&Table->slots[i].key, __ATOMIC_RELAXED) != 0) {
+      st->clients++;
+    }
+  }
+}
+
+/* vim: set et sm ai ts=2: */
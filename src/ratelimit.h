@@ -0,0 +1,54 @@
+/*
+ * ratelimit.h
+ *
+ */
+
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* per client rate limits
+ * every client has a token bucket: it can make up to burst requests at
+ * once, and then rate requests a second. a client is the API key it sends
+ * in the X-API-Key header, or it's IP address if it sends none. requests
+ * over the limit are answered 429, with Retry-After
+ * the buckets are in a fixed size hash table, with no lock: a client is
+ * found probing up to RATELIMIT_PROBE slots from it's hash, and a request
+ * takes a token with a compare and swap on it's slot, so clients don't
+ * share anything but the table. a new client takes a free slot, or the
+ * one of a client idle for RATELIMIT_IDLE seconds or more. if there's
+ * none, it's not limited, the table is for the clients that are active
+ * a slot is taken back by another client while it's in use only when
+ * it's idle, the worst that can happen then is a token more or less
+ * with workers (option -w) the table is in shared memory, the limits
+ * are for all of them
+ */
+#define RATELIMIT_SLOTS       4096    /* a power of 2 */
+#define RATELIMIT_PROBE       8
+#define RATELIMIT_IDLE        60      /* seconds */
+#define RATELIMIT_MAX         1000000 /* most rate and burst */
+#define RATELIMIT_KEY_HEADER  "X-API-Key"
+
+typedef struct ratelimit_stats {
+  uint64_t limited;       /* requests answered 429 */
+  uint64_t untracked;     /* requests of clients with no room in the table */
+  int clients;            /* slots taken */
+} Ratelimit_Stats;
+
+
+/* prototypes */
+extern bool ratelimit_configure(unsigned int rate, unsigned int burst);
+extern bool ratelimit_enabled(void);
+extern bool ratelimit_share(void);
+extern uint64_t ratelimit_key(const char *api_key, const struct sockaddr *addr);
+extern uint32_t ratelimit_take(uint64_t key, uint32_t now);
+extern int ratelimit_check(const char *api_key, const struct sockaddr *addr);
+extern uint32_t ratelimit_now(void);
+extern void ratelimit_get_stats(Ratelimit_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
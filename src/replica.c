@@ -0,0 +1,638 @@
+/*
+ * replica.c
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "jansson.h"
+#include "replica.h"
+#include "change_feed.h"
+#include "msgpack.h"
+#include "pool.h"
+#include "catalog.h"
+
+/* changes read from the change feed at once, by every sender */
+#define REPLICA_BATCH  64
+
+/* a follower that can't reach the primary tries again after this */
+#define REPLICA_RETRY_MS  1000
+
+/* a follower that gets nothing for this long thinks the primary is gone
+ * the primary sends a heartbeat every REPLICA_HEARTBEAT_MS when idle
+ */
+#define REPLICA_TIMEOUT_MS  (3 * REPLICA_HEARTBEAT_MS)
+
+#define REPLICATION_JSON "replication"
+#define REPLICATION_ROLE_JSON "role"
+#define REPLICATION_FOLLOWERS_JSON "followers"
+#define REPLICATION_SEQ_JSON "seq"
+#define REPLICATION_APPLIED_JSON "applied_seq"
+#define REPLICATION_PRIMARY_JSON "primary_seq"
+#define REPLICATION_LAG_JSON "lag"
+#define REPLICATION_CONTACT_JSON "last_contact_ms"
+
+typedef enum replica_role {
+  ROLE_NONE = 0,
+  ROLE_PRIMARY,
+  ROLE_FOLLOWER
+} Replica_Role;
+
+/* set once at startup, before any request */
+static Replica_Role Role;
+static char *Address;           /* of the primary, for a follower */
+
+/* primary: followers connected */
+static int Followers;
+
+/* follower: where it is, in sequence numbers of the primary
+ * written only by the follower thread, read by GET /terminals/stats. they
+ * are always read and written with __atomic, even by the follower thread
+ */
+static uint64_t Applied_Seq;    /* the last change applied */
+static uint64_t Primary_Seq;    /* the last change the primary has */
+static int64_t Last_Contact;    /* ms of the last frame (monotonic clock), 0 is never */
+
+
+/* milliseconds of the monotonic clock */
+static int64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+/* changes are small, and a follower should get them as soon as they're
+ * sent. it fails for Unix sockets, that's fine
+ */
+static void no_delay(int fd) {
+  int on = 1;
+
+  (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/* open a socket that listens on an address, or that's connected to it
+ * the address is unix:/path, or host:port. the host can be empty to
+ * listen on all the addresses
+ * returns the socket, or -1
+ */
+static int open_socket(const char *address, bool listening) {
+  struct sockaddr_un sun;
+  struct addrinfo hints;
+  struct addrinfo *res, *ai;
+  char host[256];
+  const char *port;
+  int fd;
+  int on = 1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    if (strlen(address + 5) >= sizeof(sun.sun_path)) {
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, address + 5);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      return -1;
+    }
+    if (listening) {
+      /* the socket file left by a previous run */
+      unlink(sun.sun_path);
+      if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0 && listen(fd, 16) == 0) {
+        return fd;
+      }
+    } else if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0) {
+      return fd;
+    }
+    close(fd);
+    return -1;
+  }
+
+  if ((port = strrchr(address, ':')) == NULL ||
+      port - address >= (int) sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, address, port - address);
+  host[port - address] = '\0';
+  port++;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &res) != 0) {
+    return -1;
+  }
+  fd = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+      continue;
+    }
+    if (listening) {
+      (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+        break;
+      }
+    } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      no_delay(fd);
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static bool send_all(int fd, const void *data, size_t len, int flags) {
+  const char *p = data;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(fd, p, len, flags | MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* false at the end of the stream, on errors and on timeouts */
+static bool recv_all(int fd, void *data, size_t len) {
+  char *p = data;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = recv(fd, p, len, 0)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* send a frame with it's length, and release it
+ * frame is NULL if it couldn't be built
+ */
+static bool send_frame(int fd, char *frame, size_t len) {
+  unsigned char header[4];
+  bool st;
+
+  if (frame == NULL) {
+    return false;
+  }
+  header[0] = len >> 24;
+  header[1] = len >> 16;
+  header[2] = len >> 8;
+  header[3] = len;
+  st = send_all(fd, header, sizeof(header), MSG_MORE) &&
+    send_all(fd, frame, len, 0);
+  pool_free(frame);
+  return st;
+}
+
+static char *frame_done(Msgpack_Buffer *b, size_t *len) {
+  if (b->error || b->len > REPLICA_MAX_FRAME) {
+    pool_free(b->data);
+    return NULL;
+  }
+  *len = b->len;
+  return b->data;
+}
+
+static void pack_types(Msgpack_Buffer *b, Terminal_Data *t) {
+  int i, n;
+
+  for (n = 0; n < N_CARDS && t->cards[n] != 0; n++) {
+  }
+  msgpack_pack_array(b, n);
+  for (i = 0; i < n; i++) {
+    msgpack_pack_uint(b, t->cards[i]);
+  }
+  for (n = 0; n < N_TRXS && t->trxs[n] != 0; n++) {
+  }
+  msgpack_pack_array(b, n);
+  for (i = 0; i < n; i++) {
+    msgpack_pack_uint(b, t->trxs[i]);
+  }
+}
+
+static bool read_types(Msgpack_Reader *r, Terminal_Data *t) {
+  uint32_t i, n;
+  uint64_t v;
+
+  if (!msgpack_read_array(r, &n) || n > N_CARDS) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if (!msgpack_read_uint(r, &v) || v == 0 || v > UINT32_MAX) {
+      return false;
+    }
+    t->cards[i] = v;
+  }
+  if (!msgpack_read_array(r, &n) || n > N_TRXS) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if (!msgpack_read_uint(r, &v) || v == 0 || v > UINT32_MAX) {
+      return false;
+    }
+    t->trxs[i] = v;
+  }
+  return true;
+}
+
+/* encode a snapshot frame, with all the terminals of a snapshot
+ * the returned buffer must be released by the caller with pool_free()
+ */
+char *replica_snapshot_frame(Terminal_Snapshot *snap, size_t *len) {
+  Msgpack_Buffer b;
+  int i;
+
+  assert(snap != NULL);
+  assert(len != NULL);
+
+  msgpack_buffer_init(&b, 64 + snap->n * 32);
+  msgpack_pack_array(&b, 3);
+  msgpack_pack_uint(&b, REPLICA_SNAPSHOT);
+  msgpack_pack_uint(&b, snap->seq);
+  msgpack_pack_array(&b, snap->n);
+  for (i = 0; i < snap->n; i++) {
+    msgpack_pack_array(&b, 4);
+    msgpack_pack_uint(&b, snap->terminals[i].id);
+    msgpack_pack_uint(&b, snap->versions[i]);
+    pack_types(&b, &snap->terminals[i]);
+  }
+  return frame_done(&b, len);
+}
+
+/* encode a change frame
+ * the returned buffer must be released by the caller with pool_free()
+ */
+char *replica_change_frame(Terminal_Change *c, size_t *len) {
+  Msgpack_Buffer b;
+
+  assert(c != NULL);
+  assert(len != NULL);
+
+  msgpack_buffer_init(&b, 64);
+  msgpack_pack_array(&b, 7);
+  msgpack_pack_uint(&b, REPLICA_CHANGE);
+  msgpack_pack_uint(&b, c->seq);
+  msgpack_pack_uint(&b, c->op);
+  msgpack_pack_uint(&b, c->version);
+  msgpack_pack_uint(&b, c->terminal.id);
+  pack_types(&b, &c->terminal);
+  return frame_done(&b, len);
+}
+
+/* encode a heartbeat frame, with the last sequence number of the primary
+ * the returned buffer must be released by the caller with pool_free()
+ */
+char *replica_heartbeat_frame(uint64_t seq, size_t *len) {
+  Msgpack_Buffer b;
+
+  assert(len != NULL);
+
+  msgpack_buffer_init(&b, 16);
+  msgpack_pack_array(&b, 2);
+  msgpack_pack_uint(&b, REPLICA_HEARTBEAT);
+  msgpack_pack_uint(&b, seq);
+  return frame_done(&b, len);
+}
+
+static bool apply_snapshot(Msgpack_Reader *r) {
+  Terminal_Data *t;
+  uint32_t *versions;
+  uint32_t i, n, m;
+  uint64_t id, version;
+  bool st = true;
+
+  if (!msgpack_read_array(r, &n) || n > N_TERMINALS) {
+    return false;
+  }
+  /* one more, malloc(0) can be NULL */
+  if ((t = malloc((n + 1) * (sizeof(Terminal_Data) + sizeof(uint32_t)))) == NULL) {
+    return false;
+  }
+  versions = (uint32_t *) &t[n + 1];
+  for (i = 0; st && i < n; i++) {
+    terminal_init_data(&t[i]);
+    st = msgpack_read_array(r, &m) && m == 4 &&
+      msgpack_read_uint(r, &id) && id != 0 && id <= UINT32_MAX &&
+      msgpack_read_uint(r, &version) && version <= UINT32_MAX &&
+      read_types(r, &t[i]);
+    t[i].id = id;
+    versions[i] = version;
+  }
+  if (st) {
+    /* the types are checked in the catalog (see catalog.h) */
+    catalog_read_begin();
+    terminal_load_snapshot(t, versions, n);
+    catalog_read_end();
+  }
+  free(t);
+  return st;
+}
+
+static bool apply_change(Msgpack_Reader *r) {
+  Terminal_Change c;
+  uint64_t op, version, id;
+  bool st;
+
+  memset(&c, 0, sizeof(c));
+  terminal_init_data(&c.terminal);
+  if (!msgpack_read_uint(r, &op) || op > CHANGE_DELETE ||
+      !msgpack_read_uint(r, &version) || version > UINT32_MAX ||
+      !msgpack_read_uint(r, &id) || id == 0 || id > UINT32_MAX ||
+      !read_types(r, &c.terminal)) {
+    return false;
+  }
+  c.op = op;
+  c.version = version;
+  c.terminal.id = id;
+  catalog_read_begin();
+  st = terminal_apply_change(&c);
+  catalog_read_end();
+  return st;
+}
+
+/* apply a frame (without it's length) to the terminals table
+ * returns false if it's not a valid frame, or it can't be applied
+ */
+bool replica_apply_frame(const char *data, size_t len) {
+  Msgpack_Reader r;
+  uint32_t n;
+  uint64_t type, seq;
+
+  assert(data != NULL);
+
+  msgpack_reader_init(&r, data, len);
+  if (!msgpack_read_array(&r, &n) || n < 2 ||
+      !msgpack_read_uint(&r, &type) || !msgpack_read_uint(&r, &seq)) {
+    return false;
+  }
+  switch (type) {
+  case REPLICA_SNAPSHOT:
+    if (n != 3 || !apply_snapshot(&r)) {
+      return false;
+    }
+    __atomic_store_n(&Applied_Seq, seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&Primary_Seq, seq, __ATOMIC_RELAXED);
+    break;
+  case REPLICA_CHANGE:
+    if (n != 7 || !apply_change(&r)) {
+      return false;
+    }
+    __atomic_store_n(&Applied_Seq, seq, __ATOMIC_RELAXED);
+    if (seq > __atomic_load_n(&Primary_Seq, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&Primary_Seq, seq, __ATOMIC_RELAXED);
+    }
+    break;
+  case REPLICA_HEARTBEAT:
+    if (n != 2) {
+      return false;
+    }
+    __atomic_store_n(&Primary_Seq, seq, __ATOMIC_RELAXED);
+    break;
+  default:
+    return false;
+  }
+  __atomic_store_n(&Last_Contact, now_ms(), __ATOMIC_RELAXED);
+  return true;
+}
+
+static bool send_snapshot(int fd, uint64_t *since) {
+  Terminal_Snapshot *snap;
+  char *frame;
+  size_t len = 0;
+
+  if ((snap = terminal_snapshot_acquire()) == NULL) {
+    return false;
+  }
+  frame = replica_snapshot_frame(snap, &len);
+  *since = snap->seq;
+  terminal_snapshot_release(snap);
+  return send_frame(fd, frame, len);
+}
+
+/* primary, a thread for every follower
+ * it sends a snapshot, and then the changes after it from the change
+ * feed. a follower that's so far behind that the changes it needs are
+ * not in the feed anymore gets a new snapshot
+ */
+static void *sender(void *arg) {
+  int fd = (int) (intptr_t) arg;
+  Terminal_Change *changes;
+  uint64_t since, next, last;
+  char *frame;
+  size_t len = 0;
+  int i, n;
+  bool st = false;
+
+  if ((changes = malloc(REPLICA_BATCH * sizeof(Terminal_Change))) != NULL) {
+    st = send_snapshot(fd, &since);
+  }
+  while (st) {
+    n = change_feed_read(since, changes, REPLICA_BATCH, &next);
+    if (n == CHANGE_FEED_RESYNC) {
+      st = send_snapshot(fd, &since);
+    } else if (n == 0) {
+      if ((last = change_feed_wait(since, REPLICA_HEARTBEAT_MS)) == since) {
+        frame = replica_heartbeat_frame(last, &len);
+        st = send_frame(fd, frame, len);
+      }
+    } else {
+      /* so the follower knows how far behind it is */
+      frame = replica_heartbeat_frame(change_feed_last_seq(), &len);
+      st = send_frame(fd, frame, len);
+      for (i = 0; st && i < n; i++) {
+        frame = replica_change_frame(&changes[i], &len);
+        st = send_frame(fd, frame, len);
+      }
+      since = next;
+    }
+  }
+
+  free(changes);
+  close(fd);
+  __atomic_sub_fetch(&Followers, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* primary, takes the connections of the followers */
+static void *acceptor(void *arg) {
+  int listen_fd = (int) (intptr_t) arg;
+  pthread_t thread;
+  int fd;
+
+  for (;;) {
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        /* out of descriptors or the like, don't spin */
+        sleep_ms(REPLICA_RETRY_MS);
+      }
+      continue;
+    }
+    no_delay(fd);
+    __atomic_add_fetch(&Followers, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&thread, NULL, sender, (void *) (intptr_t) fd) != 0) {
+      close(fd);
+      __atomic_sub_fetch(&Followers, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+/* follower, gets the frames from the primary and applies them
+ * when the connection is lost, it connects again and starts over from a
+ * new snapshot
+ */
+static void *follower(void *arg) {
+  unsigned char header[4];
+  struct timeval tv;
+  char *frame;
+  size_t len;
+  int fd;
+
+  if ((frame = malloc(REPLICA_MAX_FRAME)) == NULL) {
+    fprintf(stderr, "replica: out of memory\n");
+    return NULL;
+  }
+  for (;;) {
+    if ((fd = open_socket(Address, false)) < 0) {
+      sleep_ms(REPLICA_RETRY_MS);
+      continue;
+    }
+    tv.tv_sec = REPLICA_TIMEOUT_MS / 1000;
+    tv.tv_usec = (REPLICA_TIMEOUT_MS % 1000) * 1000;
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    fprintf(stderr, "replica: following %s\n", Address);
+
+    while (recv_all(fd, header, sizeof(header))) {
+      len = ((size_t) header[0] << 24) | ((size_t) header[1] << 16) |
+        ((size_t) header[2] << 8) | header[3];
+      if (len > REPLICA_MAX_FRAME || !recv_all(fd, frame, len) ||
+          !replica_apply_frame(frame, len)) {
+        break;
+      }
+    }
+    close(fd);
+    fprintf(stderr, "replica: lost %s, connecting again\n", Address);
+    sleep_ms(REPLICA_RETRY_MS);
+  }
+  return NULL;
+}
+
+/* add the state of the replication to GET /terminals/stats */
+static void replica_stats(json_t *stats) {
+  json_t *json;
+  uint64_t applied, primary;
+  int64_t contact;
+
+  if ((json = json_object()) == NULL) {
+    return;
+  }
+  if (Role == ROLE_PRIMARY) {
+    json_object_set_new(json, REPLICATION_ROLE_JSON, json_string("primary"));
+    json_object_set_new(json, REPLICATION_FOLLOWERS_JSON,
+      json_integer(__atomic_load_n(&Followers, __ATOMIC_RELAXED)));
+    json_object_set_new(json, REPLICATION_SEQ_JSON,
+      json_integer(change_feed_last_seq()));
+  } else {
+    applied = __atomic_load_n(&Applied_Seq, __ATOMIC_RELAXED);
+    primary = __atomic_load_n(&Primary_Seq, __ATOMIC_RELAXED);
+    contact = __atomic_load_n(&Last_Contact, __ATOMIC_RELAXED);
+    json_object_set_new(json, REPLICATION_ROLE_JSON, json_string("follower"));
+    json_object_set_new(json, REPLICATION_APPLIED_JSON, json_integer(applied));
+    json_object_set_new(json, REPLICATION_PRIMARY_JSON, json_integer(primary));
+    json_object_set_new(json, REPLICATION_LAG_JSON,
+      json_integer(primary > applied ? primary - applied : 0));
+    json_object_set_new(json, REPLICATION_CONTACT_JSON,
+      contact != 0 ? json_integer(now_ms() - contact) : json_null());
+  }
+  json_object_set_new(stats, REPLICATION_JSON, json);
+}
+
+/* make this server a primary, that listens for followers on address
+ * returns false if it can't listen on it
+ */
+bool replica_primary_start(const char *address) {
+  pthread_t thread;
+  int fd;
+
+  assert(address != NULL);
+
+  if (Role != ROLE_NONE || (fd = open_socket(address, true)) < 0) {
+    return false;
+  }
+  if (pthread_create(&thread, NULL, acceptor, (void *) (intptr_t) fd) != 0) {
+    close(fd);
+    return false;
+  }
+  pthread_detach(thread);
+  Role = ROLE_PRIMARY;
+  terminal_set_stats_hook(replica_stats);
+  return true;
+}
+
+/* make this server a read only follower of the primary at address
+ * it connects in the background, and keeps trying if it can't
+ */
+bool replica_follower_start(const char *address) {
+  pthread_t thread;
+
+  assert(address != NULL);
+
+  if (Role != ROLE_NONE || (Address = strdup(address)) == NULL) {
+    return false;
+  }
+  Role = ROLE_FOLLOWER;
+  if (pthread_create(&thread, NULL, follower, NULL) != 0) {
+    Role = ROLE_NONE;
+    free(Address);
+    Address = NULL;
+    return false;
+  }
+  pthread_detach(thread);
+  terminal_set_stats_hook(replica_stats);
+  return true;
+}
+
+/* true for a follower, it only serves reads */
+bool replica_read_only(void) {
+  return Role == ROLE_FOLLOWER;
+}
+
+/* vim: set et sm ai ts=2: */
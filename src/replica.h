@@ -0,0 +1,55 @@
+/*
+ * replica.h
+ *
+ */
+
+#ifndef __REPLICA_H
+#define __REPLICA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "terminal.h"
+
+/* log-shipping replication
+ * a primary server listens on an address (option -R), and streams the
+ * changes of it's change feed (see change_feed.h) to every follower that
+ * connects. a follower (option -F) connects to the primary, loads a
+ * snapshot of the whole table, and then applies every change it gets, so
+ * it can serve reads. followers are read only
+ * addresses are host:port for TCP, or unix:/path for a Unix socket
+ *
+ * every frame is a 4 bytes length, big endian, and a MessagePack array
+ *   [1, seq, [[id, version, [cards], [trxs]], ...]]  snapshot
+ *   [2, seq, op, version, id, [cards], [trxs]]       change
+ *   [3, seq]                                         heartbeat
+ * seq is the sequence number of the change feed of the primary, the last
+ * change in the snapshot, the change itself, or the last change of the
+ * primary. card and transaction types are ids, both servers have the same
+ * catalogs
+ */
+
+#define REPLICA_MAX_FRAME  (1024 * 1024)
+#define REPLICA_HEARTBEAT_MS  1000
+
+typedef enum replica_frame_type {
+  REPLICA_SNAPSHOT = 1,
+  REPLICA_CHANGE,
+  REPLICA_HEARTBEAT
+} Replica_Frame_Type;
+
+
+/* prototypes */
+extern bool replica_primary_start(const char *address);
+extern bool replica_follower_start(const char *address);
+extern bool replica_read_only(void);
+
+extern char *replica_snapshot_frame(Terminal_Snapshot *snap, size_t *len);
+extern char *replica_change_frame(Terminal_Change *c, size_t *len);
+extern char *replica_heartbeat_frame(uint64_t seq, size_t *len);
+extern bool replica_apply_frame(const char *data, size_t len);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,224 @@
+/*
+ * shm.c
+ *
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm.h"
+
+/* pieces are aligned to cache lines, so a piece never shares a line with
+ * the one before it
+ */
+#define SHM_ALIGN  64
+
+/* the segment starts with a header, with the sizes of the pieces taken
+ * so far. a process that attaches to a segment created by another one
+ * (see shm_attach()) takes the same pieces, in the same order, and the
+ * sizes should be the same, or the two processes don't agree on what's in
+ * the segment
+ */
+#define SHM_MAGIC  0x7465726d
+#define SHM_MAX_PIECES  16
+
+typedef struct shm_header {
+  uint32_t magic;
+  uint32_t n;
+  size_t sizes[SHM_MAX_PIECES];
+} Shm_Header;
+
+static char *Base;      /* the segment, NULL until shm_init() */
+static size_t Size;
+static size_t Used;
+static int Fd = -1;
+static int Pieces;      /* taken by this process */
+static bool Attached;   /* created by another process */
+
+/* create the shared segment, of size bytes
+ * the file is sparse, pages that are never used take no memory
+ * returns false if it can't be created
+ */
+bool shm_init(size_t size) {
+  void *p;
+  int fd;
+
+  assert(Base == NULL);
+
+  if ((fd = memfd_create("terminals", MFD_CLOEXEC)) < 0) {
+    return false;
+  }
+  if (ftruncate(fd, size) != 0 ||
+      (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  Base = p;
+  Size = size;
+  Fd = fd;
+  ((Shm_Header *) Base)->magic = SHM_MAGIC;
+  Used = (sizeof(Shm_Header) + SHM_ALIGN - 1) & ~(size_t) (SHM_ALIGN - 1);
+  return true;
+}
+
+/* map a segment created by another process, that's given as a file (see
+ * handoff.h). the pieces already in it are taken again with shm_alloc(),
+ * without changing them
+ * returns false if it can't be mapped, or it's not a segment
+ */
+bool shm_attach(int fd) {
+  struct stat st;
+  void *p;
+
+  assert(Base == NULL);
+
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Shm_Header) ||
+      (p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    return false;
+  }
+  if (((Shm_Header *) p)->magic != SHM_MAGIC) {
+    munmap(p, st.st_size);
+    return false;
+  }
+  Base = p;
+  Size = st.st_size;
+  Fd = fd;
+  Used = (sizeof(Shm_Header) + SHM_ALIGN - 1) & ~(size_t) (SHM_ALIGN - 1);
+  Attached = true;
+  return true;
+}
+
+/* true if the segment was created by another process, the pieces taken
+ * with shm_alloc() are already initialized
+ */
+bool shm_attached(void) {
+  return Attached;
+}
+
+/* true if there's a shared segment */
+bool shm_enabled(void) {
+  return Base != NULL;
+}
+
+/* the file of the segment, -1 if there's none */
+int shm_fd(void) {
+  return Fd;
+}
+
+/* take size bytes of the segment, zeroed
+ * it's only called while there's a single process and thread, so it takes
+ * no lock. returns NULL if there's no segment or no room left in it
+ * in an attached segment, it's the piece the other process took in the
+ * same order, NULL if that one had another size
+ */
+void *shm_alloc(size_t size) {
+  Shm_Header *h = (Shm_Header *) Base;
+  void *p;
+
+  if (Base == NULL || Pieces >= SHM_MAX_PIECES) {
+    return NULL;
+  }
+  if (Attached) {
+    if (Pieces >= (int) h->n || h->sizes[Pieces] != size) {
+      return NULL;
+    }
+  } else {
+    h->sizes[Pieces] = size;
+    h->n = Pieces + 1;
+  }
+  size = (size + SHM_ALIGN - 1) & ~(size_t) (SHM_ALIGN - 1);
+  if (size > Size - Used) {
+    return NULL;
+  }
+  p = Base + Used;
+  Used += size;
+  Pieces++;
+  return p;
+}
+
+/* initialize locks that live in the segment, so they can be used by all
+ * the processes that map it
+ */
+bool shm_mutex_init(pthread_mutex_t *m) {
+  pthread_mutexattr_t attr;
+  bool st;
+
+  if (pthread_mutexattr_init(&attr) != 0) {
+    return false;
+  }
+  st = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+    pthread_mutex_init(m, &attr) == 0;
+  pthread_mutexattr_destroy(&attr);
+  return st;
+}
+
+bool shm_rwlock_init(pthread_rwlock_t *l) {
+  pthread_rwlockattr_t attr;
+  bool st;
+
+  if (pthread_rwlockattr_init(&attr) != 0) {
+    return false;
+  }
+  st = pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+    pthread_rwlock_init(l, &attr) == 0;
+  pthread_rwlockattr_destroy(&attr);
+  return st;
+}
+
+bool shm_cond_init(pthread_cond_t *c) {
+  pthread_condattr_t attr;
+  bool st;
+
+  if (pthread_condattr_init(&attr) != 0) {
+    return false;
+  }
+  st = pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+    pthread_cond_init(c, &attr) == 0;
+  pthread_condattr_destroy(&attr);
+  return st;
+}
+
+/* the time timeout_ms from now, for the timed locks */
+static struct timespec deadline(int timeout_ms) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+/* true if a lock in the segment can be taken in timeout_ms, it's let go
+ * at once. it's how the first process finds out if a worker that died
+ * was holding it: a lock held by a process that's gone is never let go
+ * (see run_workers() in main.c)
+ */
+bool shm_mutex_free(pthread_mutex_t *m, int timeout_ms) {
+  struct timespec ts = deadline(timeout_ms);
+
+  if (pthread_mutex_timedlock(m, &ts) != 0) {
+    return false;
+  }
+  pthread_mutex_unlock(m);
+  return true;
+}
+
+bool shm_rwlock_free(pthread_rwlock_t *l, int timeout_ms) {
+  struct timespec ts = deadline(timeout_ms);
+
+  if (pthread_rwlock_timedwrlock(l, &ts) != 0) {
+    return false;
+  }
+  pthread_rwlock_unlock(l);
+  return true;
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,42 @@
+/*
+ * shm.h
+ *
+ */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* shared memory, for the state shared by worker processes (option -w)
+ * it's a single segment, an anonymous file (memfd) mapped shared, so it's
+ * inherited by fork(). modules take their pieces with shm_alloc() before
+ * the workers are started, and keep using them as if they were their own
+ * static variables. locks that live in the segment are initialized with
+ * the shm_*_init() functions, so they work across processes
+ * the segment is never unmapped, it's used until the process ends
+ * the segment can also be given to the next release of the server, on a
+ * hot restart (see handoff.h), that attaches to it with shm_attach() and
+ * so keeps the terminals with no copy
+ */
+#define SHM_DEFAULT_SIZE  (4 * 1024 * 1024)
+
+
+/* prototypes */
+extern bool shm_init(size_t size);
+extern bool shm_attach(int fd);
+extern bool shm_attached(void);
+extern bool shm_enabled(void);
+extern int shm_fd(void);
+extern void *shm_alloc(size_t size);
+extern bool shm_mutex_init(pthread_mutex_t *m);
+extern bool shm_rwlock_init(pthread_rwlock_t *l);
+extern bool shm_cond_init(pthread_cond_t *c);
+extern bool shm_mutex_free(pthread_mutex_t *m, int timeout_ms);
+extern bool shm_rwlock_free(pthread_rwlock_t *l, int timeout_ms);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
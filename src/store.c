@@ -0,0 +1,841 @@
+/*
+ * store.c
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "mem.h"
+
+#define STORE_MAGIC         "TRMSTORE"
+#define STORE_HEADER_SIZE   64
+#define STORE_SCAN_RECORDS  256     /* read at once by store_scan() */
+
+/* the state of a record */
+#define RECORD_EMPTY    0
+#define RECORD_USED     1
+#define RECORD_DELETED  2
+
+/* a counter of the sketch doesn't go beyond SKETCH_MAX, and all of them
+ * are halved after SKETCH_AGING uses for every entry of the shard
+ */
+#define SKETCH_MAX    15
+#define SKETCH_AGING  10
+
+_Static_assert((STORE_CACHE_SHARDS & (STORE_CACHE_SHARDS - 1)) == 0 &&
+    STORE_CACHE_SHARDS <= 256, "STORE_CACHE_SHARDS should be a power of 2, up to 256");
+
+typedef struct store_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t capacity;
+} Store_Header;
+
+_Static_assert(sizeof(Store_Header) <= STORE_HEADER_SIZE, "the header is too big");
+
+typedef struct store_record {
+  uint32_t state;
+  uint32_t version;
+  Terminal_Data t;
+} Store_Record;
+
+/* a terminal in the cache, with id 0 if the entry is free */
+typedef struct cache_entry {
+  uint32_t version;
+  uint32_t ref;           /* used since the hand went by */
+  uint32_t next;          /* the next entry + 1 in the chain of the bucket */
+  Terminal_Data t;
+} Cache_Entry;
+
+/* a shard of the cache
+ * entries are found by id in chains from the buckets. entries from n to
+ * the end have never been used, a removed entry is left free for the hand
+ */
+typedef struct cache_shard {
+  pthread_mutex_t lock;
+  uint32_t size;          /* entries */
+  uint32_t n;             /* used so far */
+  uint32_t cached;
+  uint32_t hand;
+  uint32_t mask;          /* of the buckets, a power of 2 - 1 */
+  uint32_t *buckets;      /* entry + 1, 0 is the end of the chain */
+  Cache_Entry *entries;
+  uint32_t width;         /* counters in a row of the sketch, a power of 2 */
+  uint32_t uses;          /* since the sketch was halved */
+  uint8_t *sketch;
+} __attribute__((aligned(64))) Cache_Shard;
+
+static int Fd = -1;
+static char *Path;              /* of the file, to compact it */
+static uint32_t Capacity;
+static uint32_t Used;           /* records, changed holding the lock exclusive */
+static uint32_t Deleted;
+static uint32_t Cache_Size;
+static Cache_Shard Shards[STORE_CACHE_SHARDS];
+static Store_Stats Stats;
+
+/* a hash of an id, for the file and the cache (murmur3's finalizer) */
+static uint32_t id_hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+static uint32_t next_power_of_2(uint32_t n) {
+  uint32_t p = 1;
+
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+/* the cache */
+
+static Cache_Shard *shard_of(terminal_id id) {
+  return &Shards[(id_hash(id) >> 24) & (STORE_CACHE_SHARDS - 1)];
+}
+
+/* count a use of an id in the sketch of the shard */
+static void sketch_add(Cache_Shard *s, terminal_id id) {
+  uint8_t *c;
+  uint32_t i;
+  int row;
+
+  for (row = 0; row < STORE_SKETCH_ROWS; row++) {
+    c = &s->sketch[row * s->width + (id_hash(id + row * 0x9e3779b9u) & (s->width - 1))];
+    if (*c < SKETCH_MAX) {
+      (*c)++;
+    }
+  }
+  if (++s->uses >= s->size * SKETCH_AGING) {
+    for (i = 0; i < STORE_SKETCH_ROWS * s->width; i++) {
+      s->sketch[i] >>= 1;
+    }
+    s->uses = 0;
+  }
+}
+
+/* how many times an id was used, lately. it's never less than that, it
+ * can be more when other ids have the same counters
+ */
+static uint32_t sketch_estimate(Cache_Shard *s, terminal_id id) {
+  uint32_t c, min = SKETCH_MAX;
+  int row;
+
+  for (row = 0; row < STORE_SKETCH_ROWS; row++) {
+    c = s->sketch[row * s->width + (id_hash(id + row * 0x9e3779b9u) & (s->width - 1))];
+    if (c < min) {
+      min = c;
+    }
+  }
+  return min;
+}
+
+/* the entry of an id, -1 if it's not in the shard */
+static int entry_find(Cache_Shard *s, terminal_id id) {
+  uint32_t e;
+
+  for (e = s->buckets[id_hash(id) & s->mask]; e != 0; e = s->entries[e - 1].next) {
+    if (s->entries[e - 1].t.id == id) {
+      return e - 1;
+    }
+  }
+  return -1;
+}
+
+static void entry_link(Cache_Shard *s, int i) {
+  uint32_t *bucket = &s->buckets[id_hash(s->entries[i].t.id) & s->mask];
+
+  s->entries[i].next = *bucket;
+  *bucket = i + 1;
+}
+
+static void entry_unlink(Cache_Shard *s, int i) {
+  uint32_t *link = &s->buckets[id_hash(s->entries[i].t.id) & s->mask];
+
+  while (*link != (uint32_t) i + 1) {
+    link = &s->entries[*link - 1].next;
+  }
+  *link = s->entries[i].next;
+}
+
+/* the entry to evict, the first the hand finds free or not used since it
+ * went by. the ones it passes are cleared, so it's found in two rounds
+ */
+static int clock_victim(Cache_Shard *s) {
+  Cache_Entry *e;
+  int i;
+
+  for (;;) {
+    i = s->hand;
+    e = &s->entries[i];
+    s->hand = (s->hand + 1) % s->n;
+    if (e->t.id == 0 || !e->ref) {
+      return i;
+    }
+    e->ref = 0;
+  }
+}
+
+/* get a terminal from the cache, the use is counted if it's there or not */
+static bool cache_get(terminal_id id, Terminal_Data *t, uint32_t *version) {
+  Cache_Shard *s = shard_of(id);
+  int i;
+
+  if (s->size == 0) {
+    __atomic_add_fetch(&Stats.misses, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  pthread_mutex_lock(&s->lock);
+  sketch_add(s, id);
+  if ((i = entry_find(s, id)) < 0) {
+    pthread_mutex_unlock(&s->lock);
+    __atomic_add_fetch(&Stats.misses, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  s->entries[i].ref = 1;
+  memcpy(t, &s->entries[i].t, sizeof(Terminal_Data));
+  if (version != NULL) {
+    *version = s->entries[i].version;
+  }
+  pthread_mutex_unlock(&s->lock);
+  __atomic_add_fetch(&Stats.hits, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* add a terminal read from the file, if the filter lets it in */
+static void cache_admit(Terminal_Data *t, uint32_t version) {
+  Cache_Shard *s = shard_of(t->id);
+  Cache_Entry *e;
+  int i;
+
+  if (s->size == 0) {
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  if (entry_find(s, t->id) >= 0) {
+    /* another reader was first */
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+  if (s->n < s->size) {
+    i = s->n++;
+  } else {
+    i = clock_victim(s);
+    e = &s->entries[i];
+    if (e->t.id != 0) {
+      if (sketch_estimate(s, t->id) <= sketch_estimate(s, e->t.id)) {
+        pthread_mutex_unlock(&s->lock);
+        __atomic_add_fetch(&Stats.rejected, 1, __ATOMIC_RELAXED);
+        return;
+      }
+      entry_unlink(s, i);
+      s->cached--;
+      __atomic_add_fetch(&Stats.evictions, 1, __ATOMIC_RELAXED);
+    }
+  }
+  e = &s->entries[i];
+  memcpy(&e->t, t, sizeof(Terminal_Data));
+  e->version = version;
+  e->ref = 0;
+  entry_link(s, i);
+  s->cached++;
+  pthread_mutex_unlock(&s->lock);
+  __atomic_add_fetch(&Stats.admitted, 1, __ATOMIC_RELAXED);
+}
+
+/* change a terminal in the cache, if it's there */
+static void cache_update(Terminal_Data *t, uint32_t version) {
+  Cache_Shard *s = shard_of(t->id);
+  int i;
+
+  if (s->size == 0) {
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  if ((i = entry_find(s, t->id)) >= 0) {
+    memcpy(&s->entries[i].t, t, sizeof(Terminal_Data));
+    s->entries[i].version = version;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void cache_remove(terminal_id id) {
+  Cache_Shard *s = shard_of(id);
+  int i;
+
+  if (s->size == 0) {
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  if ((i = entry_find(s, id)) >= 0) {
+    entry_unlink(s, i);
+    s->entries[i].t.id = 0;
+    s->entries[i].ref = 0;
+    s->cached--;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void cache_clear(void) {
+  Cache_Shard *s;
+  int i;
+
+  for (i = 0; i < STORE_CACHE_SHARDS; i++) {
+    s = &Shards[i];
+    if (s->size == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&s->lock);
+    memset(s->buckets, 0, (s->mask + 1) * sizeof(uint32_t));
+    memset(s->sketch, 0, STORE_SKETCH_ROWS * s->width);
+    s->n = 0;
+    s->cached = 0;
+    s->hand = 0;
+    s->uses = 0;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static void cache_free(void) {
+  int i;
+
+  for (i = 0; i < STORE_CACHE_SHARDS; i++) {
+    mem_free(MEM_STORE, Shards[i].buckets);
+    mem_free(MEM_STORE, Shards[i].entries);
+    mem_free(MEM_STORE, Shards[i].sketch);
+    memset(&Shards[i], 0, sizeof(Cache_Shard));
+  }
+  Cache_Size = 0;
+}
+
+/* room for size terminals, split in the shards */
+static bool cache_init(uint32_t size) {
+  Cache_Shard *s;
+  uint32_t n;
+  int i;
+
+  n = (size + STORE_CACHE_SHARDS - 1) / STORE_CACHE_SHARDS;
+  for (i = 0; i < STORE_CACHE_SHARDS; i++) {
+    s = &Shards[i];
+    memset(s, 0, sizeof(Cache_Shard));
+    pthread_mutex_init(&s->lock, NULL);
+    if (n == 0) {
+      continue;
+    }
+    s->size = n;
+    s->mask = next_power_of_2(n) - 1;
+    s->width = next_power_of_2(2 * n < 16 ? 16 : 2 * n);
+    s->buckets = mem_calloc(MEM_STORE, s->mask + 1, sizeof(uint32_t));
+    s->entries = mem_calloc(MEM_STORE, n, sizeof(Cache_Entry));
+    s->sketch = mem_calloc(MEM_STORE, STORE_SKETCH_ROWS, s->width);
+    if (s->buckets == NULL || s->entries == NULL || s->sketch == NULL) {
+      cache_free();
+      return false;
+    }
+  }
+  Cache_Size = n * STORE_CACHE_SHARDS;
+  return true;
+}
+
+/* the file */
+
+static off_t record_offset(uint32_t pos) {
+  return STORE_HEADER_SIZE + (off_t) pos * sizeof(Store_Record);
+}
+
+static bool record_read(uint32_t pos, Store_Record *r) {
+  __atomic_add_fetch(&Stats.reads, 1, __ATOMIC_RELAXED);
+  return pread(Fd, r, sizeof(Store_Record), record_offset(pos)) ==
+      (ssize_t) sizeof(Store_Record);
+}
+
+static bool record_write(uint32_t pos, Store_Record *r) {
+  __atomic_add_fetch(&Stats.writes, 1, __ATOMIC_RELAXED);
+  return pwrite(Fd, r, sizeof(Store_Record), record_offset(pos)) ==
+      (ssize_t) sizeof(Store_Record);
+}
+
+/* find the record of an id, in *r
+ * returns 1 with it's position in *pos, or 0 with the position for it:
+ * the first deleted record of the probe sequence, or the empty one at
+ * it's end. -1 if the file can't be read, or there's no room
+ */
+static int record_find(terminal_id id, uint32_t *pos, Store_Record *r) {
+  uint32_t p, n, free_pos = UINT32_MAX;
+
+  for (p = id_hash(id) & (Capacity - 1), n = 0; n < Capacity;
+      p = (p + 1) & (Capacity - 1), n++) {
+    if (!record_read(p, r)) {
+      return -1;
+    }
+    if (r->state == RECORD_EMPTY) {
+      break;
+    }
+    if (r->state == RECORD_DELETED) {
+      if (free_pos == UINT32_MAX) {
+        free_pos = p;
+      }
+    } else if (r->t.id == id) {
+      *pos = p;
+      return 1;
+    }
+  }
+  if (free_pos != UINT32_MAX) {
+    *pos = free_pos;
+  } else if (n < Capacity) {
+    *pos = p;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/* call fn for the records from pos on, up to STORE_SCAN_RECORDS of them,
+ * read at once to buf, and their positions
+ * returns how many, 0 at the end of the file, -1 if it can't be read
+ */
+static int records_read(uint32_t pos, Store_Record *buf,
+        void (*fn)(Store_Record *r, uint32_t pos, void *arg), void *arg) {
+  uint32_t i, n;
+
+  if (pos >= Capacity) {
+    return 0;
+  }
+  n = Capacity - pos < STORE_SCAN_RECORDS ? Capacity - pos : STORE_SCAN_RECORDS;
+  if (pread(Fd, buf, n * sizeof(Store_Record), record_offset(pos)) !=
+      (ssize_t) (n * sizeof(Store_Record))) {
+    return -1;
+  }
+  __atomic_add_fetch(&Stats.reads, n, __ATOMIC_RELAXED);
+  for (i = 0; i < n; i++) {
+    fn(&buf[i], pos + i, arg);
+  }
+  return n;
+}
+
+/* call fn for every record of the file, and it's position
+ * returns false if it can't be read
+ */
+static bool records_scan(void (*fn)(Store_Record *r, uint32_t pos, void *arg),
+        void *arg) {
+  Store_Record *buf;
+  uint32_t pos = 0;
+  int n;
+
+  if ((buf = mem_malloc(MEM_STORE, STORE_SCAN_RECORDS * sizeof(Store_Record))) == NULL) {
+    return false;
+  }
+  while ((n = records_read(pos, buf, fn, arg)) > 0) {
+    pos += n;
+  }
+  mem_free(MEM_STORE, buf);
+  return n == 0;
+}
+
+static void record_count(Store_Record *r, uint32_t pos, void *arg) {
+  (void) pos;
+  (void) arg;
+
+  if (r->state == RECORD_USED) {
+    Used++;
+  } else if (r->state == RECORD_DELETED) {
+    Deleted++;
+  }
+}
+
+/* a new file, with empty records (a hole, until they are written) */
+static bool file_create(int fd, uint32_t capacity) {
+  Store_Header h;
+  char header[STORE_HEADER_SIZE];
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, STORE_MAGIC, sizeof(h.magic));
+  h.record_size = sizeof(Store_Record);
+  h.capacity = capacity;
+  memset(header, 0, sizeof(header));
+  memcpy(header, &h, sizeof(h));
+  return pwrite(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+      ftruncate(fd, STORE_HEADER_SIZE + (off_t) capacity * sizeof(Store_Record)) == 0;
+}
+
+/* a file being compacted, see store_compact() */
+typedef struct compact_state {
+  int fd;
+  bool error;
+} Compact_State;
+
+/* write a record to the compacted file, at the first empty one of it's
+ * probe sequence. there are no deleted records, and the ids are unique
+ */
+static void record_copy(Store_Record *r, uint32_t pos, void *arg) {
+  Compact_State *cs = arg;
+  Store_Record old;
+  uint32_t p, n;
+
+  (void) pos;
+
+  if (r->state != RECORD_USED || cs->error) {
+    return;
+  }
+  for (p = id_hash(r->t.id) & (Capacity - 1), n = 0; n < Capacity;
+      p = (p + 1) & (Capacity - 1), n++) {
+    if (pread(cs->fd, &old, sizeof(old), record_offset(p)) != (ssize_t) sizeof(old)) {
+      break;
+    }
+    if (old.state == RECORD_EMPTY) {
+      cs->error = pwrite(cs->fd, r, sizeof(Store_Record), record_offset(p)) !=
+          (ssize_t) sizeof(Store_Record);
+      __atomic_add_fetch(&Stats.writes, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  cs->error = true;
+}
+
+/* sync the directory of a file, so a rename() in it is on disk */
+static bool sync_dir(const char *path) {
+  char dir[FILENAME_MAX];
+  int fd;
+  bool st;
+
+  if (snprintf(dir, sizeof(dir), "%s", path) >= (int) sizeof(dir)) {
+    return false;
+  }
+  if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0) {
+    return false;
+  }
+  st = fsync(fd) == 0;
+  close(fd);
+  return st;
+}
+
+/* drop the deleted records: the terminals are written to a new file, in
+ * the order of the old one, that's synced and renamed over it, and the
+ * rename is synced. a crash leaves the old file or the new one, whole
+ * it's called by store_open(), before the store is used
+ * returns false if it can't be written, the store is as it was
+ */
+static bool store_compact(void) {
+  char tmp[FILENAME_MAX];
+  Compact_State cs;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.compact", Path) >= (int) sizeof(tmp) ||
+      (cs.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    return false;
+  }
+  cs.error = false;
+  if (!file_create(cs.fd, Capacity) || !records_scan(record_copy, &cs) ||
+      cs.error || fsync(cs.fd) != 0 || rename(tmp, Path) != 0) {
+    close(cs.fd);
+    unlink(tmp);
+    return false;
+  }
+  if (!sync_dir(Path)) {
+    fprintf(stderr, "store: can't sync the directory of %s: %s\n", Path,
+        strerror(errno));
+  }
+  close(Fd);
+  Fd = cs.fd;
+  __atomic_store_n(&Deleted, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&Stats.compactions, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* open the store in a file, created with room for capacity terminals if
+ * it doesn't exist (rounded up to a power of 2). a file that exists keeps
+ * the capacity it has, and it's compacted if it has deleted records (left
+ * by a release that marked them, see store_remove()). the cache has room
+ * for cache_size terminals, 0 is no cache
+ * it should be called before any other thread uses the store
+ * returns false if the file can't be created, or it's not a store
+ */
+bool store_open(const char *fname, uint32_t capacity, uint32_t cache_size) {
+  Store_Header h;
+  struct stat sb;
+  int fd;
+
+  assert(fname != NULL);
+
+  store_close();
+  if ((fd = open(fname, O_RDWR | O_CREAT, 0644)) < 0) {
+    return false;
+  }
+  if (fstat(fd, &sb) != 0) {
+    close(fd);
+    return false;
+  }
+  if (sb.st_size == 0) {
+    capacity = next_power_of_2(capacity < 16 ? 16 : capacity);
+    if (!file_create(fd, capacity)) {
+      close(fd);
+      return false;
+    }
+  } else {
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) ||
+        memcmp(h.magic, STORE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.record_size != sizeof(Store_Record) ||
+        h.capacity == 0 || (h.capacity & (h.capacity - 1)) != 0 ||
+        sb.st_size < record_offset(h.capacity)) {
+      close(fd);
+      return false;
+    }
+    capacity = h.capacity;
+  }
+
+  if ((Path = strdup(fname)) == NULL) {
+    close(fd);
+    return false;
+  }
+  memset(&Stats, 0, sizeof(Stats));
+  Fd = fd;
+  Capacity = capacity;
+  Used = 0;
+  Deleted = 0;
+  if (!records_scan(record_count, NULL) || !cache_init(cache_size)) {
+    store_close();
+    return false;
+  }
+  /* if it can't be compacted the deleted records are reused by adds */
+  if (Deleted > 0 && !store_compact()) {
+    fprintf(stderr, "store: can't compact %s: %s\n", Path, strerror(errno));
+  }
+  return true;
+}
+
+/* close the store, it should not be in use */
+void store_close(void) {
+  if (Fd < 0) {
+    return;
+  }
+  close(Fd);
+  Fd = -1;
+  free(Path);
+  Path = NULL;
+  cache_free();
+}
+
+/* get a terminal and it's version, from the cache if it's there
+ * the caller holds the lock of the store, shared at least
+ * returns false if there's no such terminal
+ */
+bool store_get(terminal_id id, Terminal_Data *t, uint32_t *version) {
+  Store_Record r;
+  uint32_t pos;
+
+  assert(t != NULL);
+  if (Fd < 0 || id == 0) {
+    return false;
+  }
+  if (cache_get(id, t, version)) {
+    return true;
+  }
+  if (record_find(id, &pos, &r) != 1) {
+    return false;
+  }
+  cache_admit(&r.t, r.version);
+  memcpy(t, &r.t, sizeof(Terminal_Data));
+  if (version != NULL) {
+    *version = r.version;
+  }
+  return true;
+}
+
+/* write a terminal with a version, a new one or over the one with the
+ * same id. the caller holds the lock of the store exclusive
+ * returns false if the store is full, or it can't be written
+ */
+bool store_put(Terminal_Data *t, uint32_t version) {
+  Store_Record r;
+  uint32_t pos;
+  int found;
+
+  assert(t != NULL && t->id != 0);
+  if (Fd < 0 || (found = record_find(t->id, &pos, &r)) < 0) {
+    return false;
+  }
+  if (!found && (uint64_t) Used * 100 >= (uint64_t) Capacity * STORE_MAX_FILL) {
+    return false;
+  }
+  /* an empty record is taken, the deleted ones count in the fill */
+  if (!found && r.state == RECORD_EMPTY &&
+      (uint64_t) (Used + Deleted) * 100 >= (uint64_t) Capacity * STORE_MAX_FILL) {
+    return false;
+  }
+  if (!found && r.state == RECORD_DELETED) {
+    __atomic_sub_fetch(&Deleted, 1, __ATOMIC_RELAXED);
+  }
+  r.state = RECORD_USED;
+  r.version = version;
+  memcpy(&r.t, t, sizeof(Terminal_Data));
+  if (!record_write(pos, &r)) {
+    return false;
+  }
+  if (!found) {
+    __atomic_add_fetch(&Used, 1, __ATOMIC_RELAXED);
+  }
+  cache_update(t, version);
+  return true;
+}
+
+/* remove a terminal, the caller holds the lock of the store exclusive
+ * the records after it's own, up to an empty one, are moved back if they
+ * can be (Knuth's algorithm R): one that's not at home goes to the hole if
+ * it's on it's probe sequence, and leaves a hole of it's own. no record is
+ * marked deleted, the file is as if the terminal had never been added, so
+ * it never has to be compacted and the probes don't get longer
+ * returns false if there's no such terminal, or the file can't be written
+ */
+bool store_remove(terminal_id id) {
+  Store_Record r;
+  uint32_t pos, p, home, n;
+
+  if (Fd < 0 || id == 0 || record_find(id, &pos, &r) != 1) {
+    return false;
+  }
+  cache_remove(id);
+  for (p = (pos + 1) & (Capacity - 1), n = 1; n < Capacity;
+      p = (p + 1) & (Capacity - 1), n++) {
+    if (!record_read(p, &r)) {
+      return false;
+    }
+    if (r.state == RECORD_EMPTY) {
+      break;
+    }
+    /* it stays if it's home is after the hole, going round up to it */
+    home = id_hash(r.t.id) & (Capacity - 1);
+    if (((p - home) & (Capacity - 1)) < ((p - pos) & (Capacity - 1))) {
+      continue;
+    }
+    if (!record_write(pos, &r)) {
+      return false;
+    }
+    pos = p;
+  }
+  memset(&r, 0, sizeof(r));
+  r.state = RECORD_EMPTY;
+  if (!record_write(pos, &r)) {
+    return false;
+  }
+  __atomic_sub_fetch(&Used, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* remove all the terminals, the caller holds the lock of the store
+ * exclusive
+ */
+bool store_clear(void) {
+  if (Fd < 0) {
+    return false;
+  }
+  cache_clear();
+  __atomic_store_n(&Deleted, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&Used, 0, __ATOMIC_RELAXED);
+  return ftruncate(Fd, STORE_HEADER_SIZE) == 0 &&
+      ftruncate(Fd, record_offset(Capacity)) == 0;
+}
+
+/* the number of terminals in the store */
+uint32_t store_count(void) {
+  return __atomic_load_n(&Used, __ATOMIC_RELAXED);
+}
+
+typedef struct scan_state {
+  void (*fn)(Terminal_Data *t, uint32_t version, void *arg);
+  void *arg;
+} Scan_State;
+
+static void record_scan(Store_Record *r, uint32_t pos, void *arg) {
+  Scan_State *ss = arg;
+
+  (void) pos;
+
+  if (r->state == RECORD_USED) {
+    ss->fn(&r->t, r->version, ss->arg);
+  }
+}
+
+/* call fn for every terminal in the store, in file order, with it's
+ * version. the file is read STORE_SCAN_RECORDS at a time, not through the
+ * cache, so a scan doesn't change what's cached
+ * the caller holds the lock of the store, shared at least. with it
+ * exclusive, fn can store_put() the terminal it's given: it's written
+ * over it's own record, the scan doesn't see it again
+ */
+bool store_scan(void (*fn)(Terminal_Data *t, uint32_t version, void *arg),
+        void *arg) {
+  Scan_State ss = { fn, arg };
+
+  assert(fn != NULL);
+  return Fd >= 0 && records_scan(record_scan, &ss);
+}
+
+/* call fn for the terminals of the next STORE_SCAN_RECORDS records from
+ * *pos (0 for the first ones), like store_scan() does, and move *pos past
+ * them. the caller holds the lock of the store, shared at least, and can
+ * let go of it between two calls: a scan isn't as long as the lock is
+ * held. but a remove moves records back, so if the store changed between
+ * two calls a terminal can be missed, or given twice, the scan has to
+ * start over
+ * returns 1 if there are more records, 0 at the end, -1 if they can't be
+ * read
+ */
+int store_scan_next(uint32_t *pos,
+        void (*fn)(Terminal_Data *t, uint32_t version, void *arg), void *arg) {
+  Scan_State ss = { fn, arg };
+  Store_Record *buf;
+  int n;
+
+  assert(pos != NULL && fn != NULL);
+  if (Fd < 0 ||
+      (buf = mem_malloc(MEM_STORE, STORE_SCAN_RECORDS * sizeof(Store_Record))) == NULL) {
+    return -1;
+  }
+  if ((n = records_read(*pos, buf, record_scan, &ss)) > 0) {
+    *pos += n;
+  }
+  mem_free(MEM_STORE, buf);
+  return n < 0 ? -1 : *pos < Capacity;
+}
+
+void store_get_stats(Store_Stats *st) {
+  int i;
+
+  assert(st != NULL);
+
+  st->capacity = Capacity;
+  st->terminals = store_count();
+  st->deleted = __atomic_load_n(&Deleted, __ATOMIC_RELAXED);
+  st->compactions = __atomic_load_n(&Stats.compactions, __ATOMIC_RELAXED);
+  st->cache_size = Cache_Size;
+  st->cached = 0;
+  for (i = 0; i < STORE_CACHE_SHARDS; i++) {
+    if (Shards[i].size > 0) {
+      pthread_mutex_lock(&Shards[i].lock);
+      st->cached += Shards[i].cached;
+      pthread_mutex_unlock(&Shards[i].lock);
+    }
+  }
+  st->hits = __atomic_load_n(&Stats.hits, __ATOMIC_RELAXED);
+  st->misses = __atomic_load_n(&Stats.misses, __ATOMIC_RELAXED);
+  st->admitted = __atomic_load_n(&Stats.admitted, __ATOMIC_RELAXED);
+  st->rejected = __atomic_load_n(&Stats.rejected, __ATOMIC_RELAXED);
+  st->evictions = __atomic_load_n(&Stats.evictions, __ATOMIC_RELAXED);
+  st->reads = __atomic_load_n(&Stats.reads, __ATOMIC_RELAXED);
+  st->writes = __atomic_load_n(&Stats.writes, __ATOMIC_RELAXED);
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,79 @@
+/*
+ * store.h
+ *
+ */
+
+#ifndef __STORE_H
+#define __STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "terminal.h"
+
+/* on-disk key-value store of terminals, with a bounded cache in memory
+ * it's the disk backend of the terminals table (option -D, see
+ * terminal_open_store()), for more terminals than fit in the memory of
+ * every worker
+ * the file is a hash table of fixed size records, by terminal id, with
+ * open addressing and linear probing. a record has the id, the version,
+ * and the types of a terminal, so a terminal is read with a pread() or
+ * two and nothing about the file is kept in memory but it's size. a remove
+ * moves the records after it back to fill the hole, so there are no
+ * deleted records to skip (a file of an older release that has them is
+ * compacted when it's opened). records are in the byte order of the host,
+ * and writes are not synced, a crash can lose the last ones
+ * the capacity is set when the file is created, an add fails when it's
+ * STORE_MAX_FILL percent full
+ * reads go through the cache, STORE_CACHE_SHARDS shards with a lock of
+ * their own. a shard evicts with CLOCK (a reference bit for every entry,
+ * cleared by the hand as it goes round), and admits a terminal that was
+ * read from the file only if it's been used more often than the one it
+ * would evict (a TinyLFU filter): the uses of every id are counted in a
+ * count-min sketch of STORE_SKETCH_ROWS rows of small counters, that are
+ * halved now and then so old uses are forgotten. a scan of many terminals
+ * used once doesn't wipe out the ones used all the time
+ * writes go to the file, and to the cache if the terminal is in it
+ * the store has no lock of it's own for the file: the caller holds a lock
+ * shared to read, and exclusive to write
+ */
+#define STORE_DEFAULT_CAPACITY  (1 << 20)   /* terminals, a power of 2 */
+#define STORE_DEFAULT_CACHE     65536       /* terminals */
+#define STORE_MAX_FILL          75          /* percent of the capacity */
+#define STORE_CACHE_SHARDS      16
+#define STORE_SKETCH_ROWS       4
+
+typedef struct store_stats {
+  uint64_t capacity;
+  uint64_t terminals;
+  uint64_t deleted;       /* records of an older file, not compacted */
+  uint64_t compactions;
+  uint64_t cache_size;    /* terminals it can hold */
+  uint64_t cached;
+  uint64_t hits;
+  uint64_t misses;        /* read from the file */
+  uint64_t admitted;
+  uint64_t rejected;      /* by the filter, used less than the victim */
+  uint64_t evictions;
+  uint64_t reads;         /* of records */
+  uint64_t writes;
+} Store_Stats;
+
+
+/* prototypes */
+extern bool store_open(const char *fname, uint32_t capacity, uint32_t cache_size);
+extern void store_close(void);
+extern bool store_get(terminal_id id, Terminal_Data *t, uint32_t *version);
+extern bool store_put(Terminal_Data *t, uint32_t version);
+extern bool store_remove(terminal_id id);
+extern bool store_clear(void);
+extern uint32_t store_count(void);
+extern bool store_scan(void (*fn)(Terminal_Data *t, uint32_t version, void *arg),
+                void *arg);
+extern int store_scan_next(uint32_t *pos,
+                void (*fn)(Terminal_Data *t, uint32_t version, void *arg), void *arg);
+extern void store_get_stats(Store_Stats *st);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -4,21 +4,62 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
 #include "terminal.h"
 #include "jansson.h"
+#include "msgpack.h"
+#include "pool.h"
+#include "id_lease.h"
+#include "change_feed.h"
+#include "shm.h"
+#include "trace.h"
+#include "catalog.h"
+#include "store.h"
+#include "mem.h"
 
 /* these constants are for encoding/decoding types in JSON */
 #define TERMINAL_ID_JSON "id"
 #define CARD_TYPE_JSON "CardType"
 #define TRANSACTION_TYPE_JSON "TransactionType"
+#define STATS_TERMINALS_JSON "terminals"
+#define STATS_PROFILES_JSON "profiles"
+#define STATS_OVERFLOWS_JSON "overflows"
+#define STATS_COMBINATIONS_JSON "Combinations"
+#define STATS_STORE_JSON "store"
+#define STATS_CAPACITY_JSON "capacity"
+#define STATS_READS_JSON "reads"
+#define STATS_WRITES_JSON "writes"
+#define STATS_DELETED_JSON "deleted"
+#define STATS_COMPACTIONS_JSON "compactions"
+#define STATS_CACHE_JSON "cache"
+#define STATS_SIZE_JSON "size"
+#define STATS_CACHED_JSON "cached"
+#define STATS_HITS_JSON "hits"
+#define STATS_MISSES_JSON "misses"
+#define STATS_HIT_RATE_JSON "hit_rate"
+#define STATS_ADMITTED_JSON "admitted"
+#define STATS_REJECTED_JSON "rejected"
+#define STATS_EVICTIONS_JSON "evictions"
+#define PATCH_ADD_JSON "add"
+#define PATCH_REMOVE_JSON "remove"
+#define CHANGE_SEQ_JSON "seq"
+#define CHANGE_OP_JSON "op"
+#define CHANGE_VERSION_JSON "version"
+#define CHANGE_TERMINAL_JSON "terminal"
+#define CHANGE_NEXT_JSON "next"
+#define CHANGE_CHANGES_JSON "changes"
+#define CHANGE_RESYNC_JSON "resync"
 
 /* this is the terminals "table"
  * it's implemented as a simple array
- * in this implementation, there's always "full table scans" stepping
- * through the whole table looking for data.
- * this same "full table scan" is used by find_by_id and find_by_name functions
- * and in add (aka insert), when looking for an empty slot
+ * lookups by id use a hash index (index) and empty slots are kept in a
+ * free list (free_slots), so only the functions that return the whole
+ * table step through it, up to the last slot ever used
  *
  * this terminals "table" should be a proper database table in a real world
  * implementation.  If kept in memory, this should not be an array but
@@ -35,10 +76,288 @@
  * them can change the structure at a time (that is, add or delete terminals)
  * Readers shouldn't be blocked by other readers, but they should be blocked
  * by writers as the write operation can affect the lookups.
- * The current implementation IS NOT THREAD SAFE
+ * This is what terminals_lock does: it protects the structure of the table
+ * (which slots are used, the index and the free slots). terminal_add() and
+ * terminal_delete() take it exclusive, everything else takes it shared.
+ * The content of a terminal is protected by the lock of it's stripe
+ * (stripes[slot % N_STRIPES]), so updates to terminals in different stripes
+ * run in parallel. Functions that return many terminals take all stripes
+ * at once, so the result is consistent. Functions that return the whole
+ * table work on a snapshot instead (terminal_snapshot_acquire()), so they
+ * hold the locks only to copy the table, not while encoding it
+ * Locks are always taken in this order: terminals_lock, and then the
+ * stripes from the lowest to the highest
+ * Reads of a single terminal take no lock at all, they use the seqlocks
+ * of the table and of the slot instead, and try again if a writer was
+ * changing them. so a GET of a terminal never waits, and never makes a
+ * writer wait
+ * All of it is in Table, that's in shared memory when the server runs
+ * many worker processes, and the locks are shared by all of them
  * 
  */
-static Terminal_Data Terminals[N_TERMINALS];
+#define N_STRIPES  16
+
+/* the stripes, every one in it's own cache line so writers to different
+ * stripes don't fight for the same line
+ */
+typedef struct stripe {
+  pthread_rwlock_t lock;
+} __attribute__((aligned(64))) Stripe;
+
+/* index from terminal id to slot in the terminals table, so lookups by id
+ * don't scan the whole table
+ * it's a hash table with open addressing and linear probing, an entry
+ * is the slot + 1, and 0 is an empty entry.
+ * it's kept at most half full so probe sequences are short
+ */
+#define N_INDEX  2048
+_Static_assert(N_INDEX >= 2 * N_TERMINALS, "N_INDEX is too small for N_TERMINALS");
+_Static_assert((N_INDEX & (N_INDEX - 1)) == 0, "N_INDEX should be a power of 2");
+
+/* profiles, the distinct combinations of card and transaction types
+ * (see Terminal_Slot). every terminal holds one, and a writer holds one
+ * more while it changes a terminal, holding it's stripe lock or
+ * terminals_lock exclusive, so there's always room for them
+ * a profile doesn't change while terminals have it, it's taken back when
+ * the last one lets it go. it's found by the hash of it's types in an
+ * index like the one of the terminals
+ */
+#define N_PROFILES  (N_TERMINALS + N_STRIPES)
+#define N_PROFILE_INDEX  4096
+_Static_assert(N_PROFILE_INDEX >= 2 * N_PROFILES, "N_PROFILE_INDEX is too small for N_PROFILES");
+_Static_assert((N_PROFILE_INDEX & (N_PROFILE_INDEX - 1)) == 0, "N_PROFILE_INDEX should be a power of 2");
+
+/* a profile is a small vector: the types are in the profile itself when
+ * there are up to PROFILE_CARDS card types and PROFILE_TRXS transaction
+ * types, so the usual profile is a single cache line. a longer one has
+ * them in an overflow block, with room for all the types of the catalogs.
+ * the blocks are a pool in the table, with no pointers, the table is in
+ * shared memory at a different address in every process. there's a block
+ * for every profile, so it never runs out, and the pool is last in the
+ * table: it's pages are not written until a block is used (the segment is
+ * sparse, see shm.h), so they take memory on demand. a block is in the
+ * memory accounting from when it's first used
+ * the arrays are cleared past the end, so a terminal is copied out of a
+ * profile whole, with no loop
+ */
+#define PROFILE_CARDS  8
+#define PROFILE_TRXS   5
+#define N_OVERFLOW     N_PROFILES
+
+_Static_assert(sizeof(card_type_id) == sizeof(uint32_t) &&
+    sizeof(transaction_type_id) == sizeof(uint32_t),
+    "card and transaction type ids are compared with the same functions");
+
+typedef struct profile {
+  uint32_t refs;          /* terminals with it, 0 if it's free */
+  uint32_t hash;
+  uint32_t overflow;      /* the block + 1, 0 if the types are inline */
+  card_type_id cards[PROFILE_CARDS];
+  transaction_type_id trxs[PROFILE_TRXS];
+} __attribute__((aligned(64))) Profile;
+
+_Static_assert(sizeof(Profile) == 64, "a Profile should be a cache line");
+_Static_assert(PROFILE_CARDS < N_CARDS && PROFILE_TRXS < N_TRXS,
+    "a terminal has room for the ends of the types of a Profile");
+
+typedef struct profile_overflow {
+  card_type_id cards[N_CARDS];
+  transaction_type_id trxs[N_TRXS];
+} Profile_Overflow;
+
+/* everything about the table is in a single structure, so it can be moved
+ * to shared memory and be used by many worker processes at once (see
+ * terminal_share()). until then it's Local_Table
+ */
+typedef struct terminal_table {
+  pthread_rwlock_t terminals_lock;
+  Stripe stripes[N_STRIPES];
+
+  /* the generation of the terminals table
+   * it changes every time the table changes, so anything built from the
+   * whole table (like the JSON encoding of all terminals) can be cached
+   * and reused while the generation is the same
+   */
+  uint64_t generation;
+
+  /* seqlocks for readers that take no lock (see terminal_get_version())
+   * table_seq is odd while the structure of the table changes (holding
+   * terminals_lock exclusive), slot_seq[slot] while the content of a slot
+   * changes (holding it's stripe lock)
+   */
+  uint32_t table_seq;
+  uint32_t slot_seq[N_TERMINALS];
+
+  /* version of every slot
+   * it changes every time the terminal in the slot is added, updated or
+   * deleted, so a (id, version) pair seen by a client is stale as soon as
+   * anybody else changes the terminal. it's sent as the ETag of a
+   * terminal. it's protected by the stripe lock, like the terminal data
+   */
+  uint32_t version[N_TERMINALS];
+
+  /* free slots
+   * deleted slots are kept in a stack, so they are reused in O(1), most
+   * recently freed first. slots from slots_used to the end have never been
+   * used, no scan looks beyond slots_used
+   */
+  int free_slots[N_TERMINALS];
+  int n_free;
+  int slots_used;
+
+  int index[N_INDEX];
+
+  /* aggregate counters, for capacity planning
+   * how many terminals there are, how many accept every card type and
+   * every transaction type, and every combination of both.
+   * they are updated with atomic operations every time a terminal is
+   * added, changed or removed, so reading them takes no lock and never
+   * waits for writers. the counters are indexed by the catalog positions
+   * (card_type_index(), transaction_type_index())
+   */
+  Terminal_Stats stats;
+
+  Terminal_Slot terminals[N_TERMINALS];
+
+  /* the profiles, see Profile. profiles_lock is taken last, after the
+   * table locks, and only to make a profile or take one back: the
+   * references are counted with atomic operations, see profile_take().
+   * the id of a profile is it's position + 1, free ones are kept in a
+   * stack like free slots
+   */
+  pthread_mutex_t profiles_lock;
+  int free_profiles[N_PROFILES];
+  int n_free_profiles;
+  int profiles_used;
+  int profile_index[N_PROFILE_INDEX];
+  Profile profiles[N_PROFILES];
+
+  /* overflow blocks of the long profiles, free ones in a stack too
+   * the blocks should be last, see Profile
+   */
+  int free_overflow[N_OVERFLOW];
+  int n_free_overflow;
+  int overflow_used;
+  Profile_Overflow overflow[N_OVERFLOW];
+} Terminal_Table;
+
+static Terminal_Table Local_Table = {
+  .terminals_lock = PTHREAD_RWLOCK_INITIALIZER,
+  .stripes = { [0 ... N_STRIPES - 1] = { PTHREAD_RWLOCK_INITIALIZER } },
+  .generation = 1,
+  .profiles_lock = PTHREAD_MUTEX_INITIALIZER
+};
+static Terminal_Table *Table = &Local_Table;
+
+/* overflow blocks in the memory accounting of this process */
+static int Overflow_Counted;
+
+/* the storage backends of the terminals table
+ * the functions of the model work on the backend in use: the table in
+ * memory (Table), or an on-disk store with a bounded cache in memory (see
+ * store.h), for more terminals than fit in memory. a backend keeps the
+ * terminals and their versions, the generation, the aggregate counters
+ * and the change feed are the same for both
+ * the terminals are given to add with their new ids, and a snapshot is
+ * a new one, with the refs for terminal_snapshot_acquire() to set
+ * the backend is chosen before any other thread uses the table (see
+ * terminal_open_store())
+ */
+#define SCAN_BATCH  256     /* terminals of the store given at once, see terminal_scan() */
+#define SCAN_PASSES 3       /* of the store not holding it's lock, see disk_scan() */
+
+typedef struct terminal_backend {
+  const char *name;
+  bool (*get)(terminal_id id, Terminal_Data *t, uint32_t *version);
+  int (*get_many)(const terminal_id *ids, int n, Terminal_Data *out);
+  int (*add)(Terminal_Data *t, int n, uint32_t *versions);
+  Terminal_Status (*update)(terminal_id id, Terminal_Data *t,
+          uint32_t if_version, uint32_t *version);
+  Terminal_Status (*patch)(terminal_id id, Terminal_Data *add,
+          Terminal_Data *remove, uint32_t if_version,
+          Terminal_Data *out, uint32_t *version);
+  Terminal_Status (*delete)(terminal_id id, uint32_t if_version);
+  bool (*apply_change)(Terminal_Change *c);
+  void (*load_snapshot)(Terminal_Data *t, uint32_t *versions, int n);
+  Terminal_Snapshot *(*snapshot)(void);
+  bool (*scan)(Terminal_Scan *s, bool (*fn)(Terminal_Data *t, int n, void *arg),
+          void *arg);
+  Terminal_Stats *(*stats)(void);
+} Terminal_Backend;
+
+static const Terminal_Backend Memory_Backend;
+static const Terminal_Backend Disk_Backend;
+static const Terminal_Backend *Backend = &Memory_Backend;
+
+/* snapshots of the table, for readers of the whole table
+ * see terminal_snapshot_acquire()
+ */
+static pthread_mutex_t Snapshot_Lock = PTHREAD_MUTEX_INITIALIZER;
+static Terminal_Snapshot *Current_Snapshot;
+
+/* adds to the JSON of the counters, see terminal_set_stats_hook() */
+static void (*Stats_Hook)(struct json_t *stats);
+
+/* lock of the stripe of a slot */
+static pthread_rwlock_t *stripe_lock(int slot) {
+  return &Table->stripes[slot % N_STRIPES].lock;
+}
+
+/* lock all stripes shared, to read many terminals at once
+ * the caller should hold terminals_lock
+ */
+static void stripes_rdlock_all(void) {
+  int i;
+
+  for (i = 0; i < N_STRIPES; i++) {
+    pthread_rwlock_rdlock(&Table->stripes[i].lock);
+  }
+}
+
+static void stripes_unlock_all(void) {
+  int i;
+
+  for (i = N_STRIPES - 1; i >= 0; i--) {
+    pthread_rwlock_unlock(&Table->stripes[i].lock);
+  }
+}
+
+/* change the version of a slot, 0 is never used as a version */
+static uint32_t version_next(int slot) {
+  if (++Table->version[slot] == 0) {
+    Table->version[slot] = 1;
+  }
+  return Table->version[slot];
+}
+
+/* seqlocks, see Terminal_Table
+ * a writer makes the counter odd before it changes anything, and even
+ * again when it's done. a reader that sees the same even counter before
+ * and after it reads, read something no writer was changing
+ */
+static void seq_write_begin(uint32_t *seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(uint32_t *seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t seq_read_begin(uint32_t *seq) {
+  uint32_t s;
+
+  while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+    sched_yield();
+  }
+  return s;
+}
+
+/* true if a writer changed something since seq_read_begin() */
+static bool seq_read_retry(uint32_t *seq, uint32_t s) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
 
 /* copies terminal data */
 static void terminal_copy(Terminal_Data *a, Terminal_Data *b) {
@@ -47,13 +366,49 @@ static void terminal_copy(Terminal_Data *a, Terminal_Data *b) {
   memcpy(a, b, sizeof(Terminal_Data));
 }
 
+static bool add_card_type_id(Terminal_Data *t, card_type_id id);
+static bool add_transaction_type_id(Terminal_Data *t, transaction_type_id id);
+static void remove_card_type_id(Terminal_Data *t, card_type_id id);
+static void remove_transaction_type_id(Terminal_Data *t, transaction_type_id id);
+static int drop_unknown_types(Terminal_Data *t);
+
+/* add (delta 1) or remove (delta -1) a terminal to the aggregate counters */
+static void stats_apply(Terminal_Data *t, int delta) {
+  Terminal_Stats *stats = Backend->stats();
+  int i, j;
+  int ci, ti;
+
+  __atomic_add_fetch(&stats->terminals, delta, __ATOMIC_RELAXED);
+  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
+    ci = card_type_index(t->cards[i]);
+    if (ci < 0) {
+      continue;
+    }
+    __atomic_add_fetch(&stats->cards[ci], delta, __ATOMIC_RELAXED);
+    for (j = 0; j < N_TRXS && t->trxs[j] != 0; j++) {
+      ti = transaction_type_index(t->trxs[j]);
+      if (ti < 0) {
+        continue;
+      }
+      __atomic_add_fetch(&stats->combinations[ci][ti], delta, __ATOMIC_RELAXED);
+    }
+  }
+  for (j = 0; j < N_TRXS && t->trxs[j] != 0; j++) {
+    ti = transaction_type_index(t->trxs[j]);
+    if (ti < 0) {
+      continue;
+    }
+    __atomic_add_fetch(&stats->trxs[ti], delta, __ATOMIC_RELAXED);
+  }
+}
+
 /* generates a new terminal id
- * this is a simple implementation that generates sequential ids
+ * ids come from a block leased to the thread (see id_lease.h), so threads
+ * adding terminals don't share a counter. ids are unique, also across
+ * restarts, but not sequential. 0 means there are no more ids
  */
 static terminal_id new_terminal_id(void) {
-  static terminal_id id_sequence = 1;
-
-  return id_sequence++;
+  return id_lease_next();
 }
 
 /* initializes the terminal data, setting everything to 0
@@ -72,166 +427,2471 @@ void terminal_init_data(Terminal_Data *t) {
   }
 }
 
-/* find a terminal in the table using it's id */
-Terminal_Data *terminal_find_by_id(terminal_id id) {
+/* hash for the index, multiplicative hashing (Knuth) */
+static unsigned int index_hash(terminal_id id) {
+  return (id * 2654435761u) & (N_INDEX - 1);
+}
+
+/* get the slot for a terminal id, -1 if it's not in the table
+ * the caller should hold terminals_lock, or check table_seq after it
+ * (then the index can change while it's read, so the probe sequence is
+ * never longer than the index)
+ */
+static int index_find(terminal_id id) {
+  unsigned int h, n;
+  int entry;
+
+  for (h = index_hash(id), n = 0; n < N_INDEX; h = (h + 1) & (N_INDEX - 1), n++) {
+    if ((entry = __atomic_load_n(&Table->index[h], __ATOMIC_RELAXED)) == 0) {
+      break;
+    }
+    if (Table->terminals[entry - 1].id == id) {
+      return entry - 1;
+    }
+  }
+  return -1;
+}
+
+/* add a terminal slot to the index
+ * the caller should hold terminals_lock exclusive
+ */
+static void index_insert(terminal_id id, int slot) {
+  unsigned int h;
+
+  for (h = index_hash(id); Table->index[h] != 0; h = (h + 1) & (N_INDEX - 1)) {
+    ;
+  }
+  Table->index[h] = slot + 1;
+}
+
+/* remove a terminal id from the index
+ * the entries after it in the probe sequence are moved back, so lookups
+ * never need tombstones
+ * the caller should hold terminals_lock exclusive, and the id of the slot
+ * should still be in the table
+ */
+static void index_remove(terminal_id id) {
+  unsigned int h, i, k;
+
+  for (h = index_hash(id); Table->index[h] != 0; h = (h + 1) & (N_INDEX - 1)) {
+    if (Table->terminals[Table->index[h] - 1].id == id) {
+      break;
+    }
+  }
+  if (Table->index[h] == 0) {
+    return;
+  }
+  Table->index[h] = 0;
+  for (i = (h + 1) & (N_INDEX - 1); Table->index[i] != 0; i = (i + 1) & (N_INDEX - 1)) {
+    k = index_hash(Table->terminals[Table->index[i] - 1].id);
+    /* the entry can move to the hole if it's home is not between the
+     * hole and where it is now (cyclically)
+     */
+    if ((i > h && (k <= h || k > i)) || (i < h && k <= h && k > i)) {
+      Table->index[h] = Table->index[i];
+      Table->index[i] = 0;
+      h = i;
+    }
+  }
+}
+
+/* get a free slot, -1 if the table is full
+ * the caller should hold terminals_lock exclusive
+ */
+static int slot_alloc(void) {
+  if (Table->n_free > 0) {
+    return Table->free_slots[--Table->n_free];
+  }
+  if (Table->slots_used < N_TERMINALS) {
+    return Table->slots_used++;
+  }
+  return -1;
+}
+
+/* hash of the types of a terminal, for the profile index */
+static uint32_t profile_hash(Terminal_Data *t) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
+    h = (h ^ t->cards[i]) * 16777619u;
+  }
+  h = (h ^ 0xffffffffu) * 16777619u;
+  for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
+    h = (h ^ t->trxs[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* true if the ids of a terminal, up to the 0 at the end, are the n ids
+ * of a list cleared past it's end
+ */
+static bool ids_match(const uint32_t *ids, int n, const uint32_t *t_ids, int t_n) {
+  int i;
+
+  for (i = 0; i < t_n && t_ids[i] != 0; i++) {
+    if (i == n || ids[i] != t_ids[i]) {
+      return false;
+    }
+  }
+  return i == n || ids[i] == 0;
+}
+
+/* copy the ids of a terminal to a list of n, clearing it past the end
+ * returns false if they don't fit
+ */
+static bool ids_copy(uint32_t *ids, int n, const uint32_t *t_ids, int t_n) {
+  int i;
+
+  memset(ids, 0, n * sizeof(uint32_t));
+  for (i = 0; i < t_n && t_ids[i] != 0; i++) {
+    if (i == n) {
+      return false;
+    }
+    ids[i] = t_ids[i];
+  }
+  return true;
+}
+
+/* true if the types of a terminal are these ones, in the same order */
+static bool types_match(const card_type_id *cards, const transaction_type_id *trxs,
+        Terminal_Data *t) {
+  return ids_match(cards, N_CARDS, t->cards, N_CARDS) &&
+      ids_match(trxs, N_TRXS, t->trxs, N_TRXS);
+}
+
+/* copy the types of a terminal, with nothing after the end */
+static void types_copy(card_type_id *cards, transaction_type_id *trxs,
+        Terminal_Data *t) {
+  ids_copy(cards, N_CARDS, t->cards, N_CARDS);
+  ids_copy(trxs, N_TRXS, t->trxs, N_TRXS);
+}
+
+/* true if the types of a terminal are the ones of a profile */
+static bool profile_match(Profile *p, Terminal_Data *t) {
+  Profile_Overflow *o;
+
+  if (p->overflow != 0) {
+    o = &Table->overflow[p->overflow - 1];
+    return types_match(o->cards, o->trxs, t);
+  }
+  return ids_match(p->cards, PROFILE_CARDS, t->cards, N_CARDS) &&
+      ids_match(p->trxs, PROFILE_TRXS, t->trxs, N_TRXS);
+}
+
+/* the overflow blocks up to used are in the memory accounting */
+static void overflow_count(int used) {
+  if (used > Overflow_Counted) {
+    mem_fixed(MEM_STORE, (used - Overflow_Counted) * sizeof(Profile_Overflow));
+    Overflow_Counted = used;
+  }
+}
+
+/* fill a free profile with the types of a terminal
+ * returns false if they don't fit inline and there's no overflow block
+ * left, that can't be with a block for every profile. the caller holds
+ * profiles_lock
+ */
+static bool profile_fill(Profile *p, Terminal_Data *t) {
+  int block;
+
+  p->overflow = 0;
+  if (ids_copy(p->cards, PROFILE_CARDS, t->cards, N_CARDS) &&
+      ids_copy(p->trxs, PROFILE_TRXS, t->trxs, N_TRXS)) {
+    return true;
+  }
+  if (Table->n_free_overflow > 0) {
+    block = Table->free_overflow[--Table->n_free_overflow];
+  } else if (Table->overflow_used < N_OVERFLOW) {
+    block = Table->overflow_used++;
+    overflow_count(Table->overflow_used);
+  } else {
+    return false;
+  }
+  types_copy(Table->overflow[block].cards, Table->overflow[block].trxs, t);
+  p->overflow = block + 1;
+  __atomic_add_fetch(&Table->stats.overflows, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* find the profile with the types of a terminal, and their hash, with
+ * no lock: the index can change meanwhile, so one that's there can be
+ * missed, and the one that's found can be taken back at any time
+ * returns it's id, 0 if it's not found
+ */
+static uint32_t profile_find(Terminal_Data *t, uint32_t hash) {
+  unsigned int h, n;
+  Profile *p;
+  int entry;
+
+  for (h = hash & (N_PROFILE_INDEX - 1), n = 0; n < N_PROFILE_INDEX;
+      h = (h + 1) & (N_PROFILE_INDEX - 1), n++) {
+    entry = __atomic_load_n(&Table->profile_index[h], __ATOMIC_ACQUIRE);
+    if (entry <= 0 || entry > N_PROFILES) {
+      break;
+    }
+    p = &Table->profiles[entry - 1];
+    if (__atomic_load_n(&p->hash, __ATOMIC_RELAXED) == hash && profile_match(p, t)) {
+      return entry;
+    }
+  }
+  return 0;
+}
+
+static void profile_drop(uint32_t id);
+
+/* take the profile with the types of a terminal, a new one if nobody
+ * has them. returns it's id, 0 if there's no room for it
+ * the caller should hold a stripe lock or terminals_lock exclusive, so
+ * it's in the count of N_PROFILES
+ * a profile that's there is taken with no lock: it's found with
+ * profile_find(), and a reference is added with a CAS if it has some (one
+ * with none is being taken back, it's left to profiles_lock). it can
+ * have been taken back and reused meanwhile, so it's checked again once
+ * it's held and can't change. profiles_lock is taken to make a new one
+ */
+static uint32_t profile_take(Terminal_Data *t) {
+  unsigned int h;
+  uint32_t hash, refs, id = 0;
+  Profile *p;
+  int entry, i;
+
+  hash = profile_hash(t);
+  if ((id = profile_find(t, hash)) != 0) {
+    p = &Table->profiles[id - 1];
+    refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+    while (refs > 0 && !__atomic_compare_exchange_n(&p->refs, &refs, refs + 1,
+              true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    }
+    if (refs > 0) {
+      if (p->hash == hash && profile_match(p, t)) {
+        return id;
+      }
+      profile_drop(id);
+    }
+    id = 0;
+  }
+
+  pthread_mutex_lock(&Table->profiles_lock);
+  for (h = hash & (N_PROFILE_INDEX - 1);
+      (entry = Table->profile_index[h]) != 0;
+      h = (h + 1) & (N_PROFILE_INDEX - 1)) {
+    p = &Table->profiles[entry - 1];
+    if (p->hash == hash && profile_match(p, t)) {
+      /* with no references it's being taken back, it's kept */
+      __atomic_add_fetch(&p->refs, 1, __ATOMIC_ACQUIRE);
+      id = entry;
+      goto out;
+    }
+  }
+
+  /* a new one, h is the first empty entry of the index */
+  if (Table->n_free_profiles > 0) {
+    i = Table->free_profiles[--Table->n_free_profiles];
+  } else if (Table->profiles_used < N_PROFILES) {
+    i = Table->profiles_used++;
+  } else {
+    goto out;
+  }
+  p = &Table->profiles[i];
+  if (!profile_fill(p, t)) {
+    Table->free_profiles[Table->n_free_profiles++] = i;
+    goto out;
+  }
+  __atomic_store_n(&p->hash, hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->refs, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&Table->profile_index[h], i + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&Table->stats.profiles, 1, __ATOMIC_RELAXED);
+  id = i + 1;
+
+out:
+  pthread_mutex_unlock(&Table->profiles_lock);
+  return id;
+}
+
+/* let go of a profile taken with profile_take(), it's taken back if
+ * nobody else has it. the index is fixed as index_remove() does
+ * the reference is let go with no lock, profiles_lock is taken by the
+ * one that lets go of the last one. it's taken back if it has no
+ * references still (it can be taken again meanwhile, holding the lock),
+ * and it's in the index: another one that let go of the last reference
+ * of it can have taken it back already
+ */
+static void profile_drop(uint32_t id) {
+  unsigned int h, i, k;
+  Profile *p;
+  int entry;
+
+  if (id == 0) {
+    return;
+  }
+  p = &Table->profiles[id - 1];
+  if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_RELEASE) > 0) {
+    return;
+  }
+  pthread_mutex_lock(&Table->profiles_lock);
+  if (__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) > 0) {
+    pthread_mutex_unlock(&Table->profiles_lock);
+    return;
+  }
+  for (h = p->hash & (N_PROFILE_INDEX - 1); (entry = Table->profile_index[h]) != (int) id;
+      h = (h + 1) & (N_PROFILE_INDEX - 1)) {
+    if (entry == 0) {
+      pthread_mutex_unlock(&Table->profiles_lock);
+      return;
+    }
+  }
+  /* readers with no lock can miss an entry that's moved, not find a
+   * wrong one: they check it
+   */
+  __atomic_store_n(&Table->profile_index[h], 0, __ATOMIC_RELEASE);
+  for (i = (h + 1) & (N_PROFILE_INDEX - 1); Table->profile_index[i] != 0;
+      i = (i + 1) & (N_PROFILE_INDEX - 1)) {
+    k = Table->profiles[Table->profile_index[i] - 1].hash & (N_PROFILE_INDEX - 1);
+    if ((i > h && (k <= h || k > i)) || (i < h && k <= h && k > i)) {
+      __atomic_store_n(&Table->profile_index[h], Table->profile_index[i], __ATOMIC_RELEASE);
+      __atomic_store_n(&Table->profile_index[i], 0, __ATOMIC_RELEASE);
+      h = i;
+    }
+  }
+  if (p->overflow != 0) {
+    Table->free_overflow[Table->n_free_overflow++] = p->overflow - 1;
+    __atomic_sub_fetch(&Table->stats.overflows, 1, __ATOMIC_RELAXED);
+  }
+  Table->free_profiles[Table->n_free_profiles++] = id - 1;
+  __atomic_sub_fetch(&Table->stats.profiles, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&Table->profiles_lock);
+}
+
+/* get the terminal in a slot
+ * the profile of a slot doesn't change while the slot doesn't, so a
+ * reader with no lock reads it in the seqlock of the slot, as the id
+ */
+static void slot_load(int slot, Terminal_Data *t) {
+  uint32_t profile, overflow;
+  Profile_Overflow *o;
+  Profile *p;
+
+  t->id = __atomic_load_n(&Table->terminals[slot].id, __ATOMIC_RELAXED);
+  profile = __atomic_load_n(&Table->terminals[slot].profile, __ATOMIC_RELAXED);
+  if (profile == 0 || profile > N_PROFILES) {
+    /* a free slot, or one seen while it's changed (read again) */
+    t->cards[0] = 0;
+    t->trxs[0] = 0;
+    return;
+  }
+  p = &Table->profiles[profile - 1];
+  overflow = __atomic_load_n(&p->overflow, __ATOMIC_RELAXED);
+  if (overflow == 0) {
+    /* only the ends are written past the types, clearing the arrays of
+     * the terminal costs more than the copy (see Terminal_Data)
+     */
+    memcpy(t->cards, p->cards, sizeof(p->cards));
+    t->cards[PROFILE_CARDS] = 0;
+    memcpy(t->trxs, p->trxs, sizeof(p->trxs));
+    t->trxs[PROFILE_TRXS] = 0;
+  } else if (overflow <= N_OVERFLOW) {
+    o = &Table->overflow[overflow - 1];
+    memcpy(t->cards, o->cards, sizeof(t->cards));
+    memcpy(t->trxs, o->trxs, sizeof(t->trxs));
+  } else {
+    /* the profile was taken back and reused meanwhile (read again) */
+    t->cards[0] = 0;
+    t->trxs[0] = 0;
+  }
+}
+
+/* move the terminals table to shared memory (see shm.h), so it's shared
+ * by all the worker processes started after this. the terminals already
+ * in the table are kept. if the segment is attached (a hot restart, see
+ * handoff.h), the table that's in it is used instead
+ * it should be called before any other thread uses the table
+ * returns false if there's no room for it in shared memory
+ */
+bool terminal_share(void) {
+  Terminal_Table *t;
+  int i;
+
+  if ((t = shm_alloc(sizeof(Terminal_Table))) == NULL) {
+    return false;
+  }
+  if (shm_attached()) {
+    /* the table of the release before, as it is now (see handoff.h). it
+     * still serves from it, so it's not changed: the types it has that
+     * are not in this catalog are skipped by the encoders
+     */
+    Table = t;
+    overflow_count(Table->overflow_used);
+    return true;
+  }
+  /* the overflow blocks that were never used are zero already */
+  memcpy(t, Table, offsetof(Terminal_Table, overflow) +
+      Table->overflow_used * sizeof(Profile_Overflow));
+  if (!shm_rwlock_init(&t->terminals_lock)) {
+    return false;
+  }
+  for (i = 0; i < N_STRIPES; i++) {
+    if (!shm_rwlock_init(&t->stripes[i].lock)) {
+      return false;
+    }
+  }
+  if (!shm_mutex_init(&t->profiles_lock)) {
+    return false;
+  }
+  Table = t;
+  return true;
+}
+
+/* true if no lock of the table is held for more than timeout_ms, so a
+ * worker process that died was not in the middle of a change (see
+ * terminal_repair())
+ */
+bool terminal_locks_free(int timeout_ms) {
+  int i;
+
+  if (!shm_rwlock_free(&Table->terminals_lock, timeout_ms)) {
+    return false;
+  }
+  for (i = 0; i < N_STRIPES; i++) {
+    if (!shm_rwlock_free(&Table->stripes[i].lock, timeout_ms)) {
+      return false;
+    }
+  }
+  return shm_mutex_free(&Table->profiles_lock, timeout_ms);
+}
+
+/* rebuild the shared table after a worker process died holding it's locks
+ * the locks of pthreads in shared memory are not robust: one that's held
+ * by a process that's gone is never let go, and what it protects may be
+ * half changed (a seqlock left odd, an index entry missing, a free list
+ * or the references of a profile off by one). it's called by the first
+ * process, with no worker running, so it takes no lock: the locks are
+ * initialized again, and the index, the free slots, the profiles and the
+ * counters are built again from the ids and the types in the slots. a
+ * slot that was being added, with no profile yet, is dropped, and so are
+ * the types not in the catalog. the slots and their versions don't move
+ * returns false if there's no memory for it
+ */
+bool terminal_repair(void) {
+  Terminal_Data *t;
+  uint32_t profile;
+  int i, slot;
+
+  if (Backend != &Memory_Backend) {
+    return true;
+  }
+  if ((t = mem_malloc(MEM_STORE, N_TERMINALS * sizeof(Terminal_Data))) == NULL) {
+    return false;
+  }
+  if (!shm_rwlock_init(&Table->terminals_lock) ||
+      !shm_mutex_init(&Table->profiles_lock)) {
+    mem_free(MEM_STORE, t);
+    return false;
+  }
+  for (i = 0; i < N_STRIPES; i++) {
+    if (!shm_rwlock_init(&Table->stripes[i].lock)) {
+      mem_free(MEM_STORE, t);
+      return false;
+    }
+  }
+
+  /* what's in the slots, before the profiles are built again */
+  for (slot = 0; slot < Table->slots_used; slot++) {
+    profile = Table->terminals[slot].profile;
+    t[slot].id = 0;
+    if (Table->terminals[slot].id != 0 && profile != 0 && profile <= N_PROFILES &&
+        Table->profiles[profile - 1].refs > 0) {
+      slot_load(slot, &t[slot]);
+      drop_unknown_types(&t[slot]);
+    }
+  }
+
+  memset(Table->terminals, 0, sizeof(Table->terminals));
+  memset(Table->index, 0, sizeof(Table->index));
+  memset(&Table->stats, 0, sizeof(Table->stats));
+  memset(Table->profile_index, 0, sizeof(Table->profile_index));
+  Table->n_free = 0;
+  Table->n_free_profiles = 0;
+  Table->profiles_used = 0;
+  Table->n_free_overflow = 0;
+  Table->overflow_used = 0;
+  for (slot = Table->slots_used - 1; slot >= 0; slot--) {
+    if (t[slot].id == 0 || index_find(t[slot].id) >= 0 ||
+        (profile = profile_take(&t[slot])) == 0) {
+      Table->free_slots[Table->n_free++] = slot;
+      continue;
+    }
+    Table->terminals[slot].id = t[slot].id;
+    Table->terminals[slot].profile = profile;
+    index_insert(t[slot].id, slot);
+    stats_apply(&t[slot], 1);
+  }
+
+  /* no writer is left in the middle of a change */
+  Table->table_seq += Table->table_seq & 1;
+  for (slot = 0; slot < N_TERMINALS; slot++) {
+    Table->slot_seq[slot] += Table->slot_seq[slot] & 1;
+  }
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  mem_free(MEM_STORE, t);
+  return true;
+}
+
+/* find a terminal in the table using it's id
+ * the returned pointer is to the slot in the table itself, and the
+ * terminal can be changed or deleted while it's used. terminal_get() is
+ * a safer alternative that returns a copy
+ * only the table in memory has slots, it's NULL with the disk backend
+ */
+const Terminal_Slot *terminal_find_by_id(terminal_id id) {
+  int slot;
+
+  if (id == 0 || Backend != &Memory_Backend) {
+    return NULL;
+  }
+
+  pthread_rwlock_rdlock(&Table->terminals_lock);
+  slot = index_find(id);
+  pthread_rwlock_unlock(&Table->terminals_lock);
+
+  return (slot < 0) ? NULL : &Table->terminals[slot];
+}
+
+/* get a copy of a terminal using it's id
+ * returns false if there's no such terminal
+ */
+bool terminal_get(terminal_id id, Terminal_Data *t) {
+  return terminal_get_version(id, t, NULL);
+}
+
+/* get a copy of a terminal using it's id, and it's version
+ * the version is the same until the terminal changes
+ * returns false if there's no such terminal
+ */
+bool terminal_get_version(terminal_id id, Terminal_Data *t, uint32_t *version) {
+  assert(t != NULL);
+  if (id == 0) {
+    return false;
+  }
+  return Backend->get(id, t, version);
+}
+
+static bool memory_get(terminal_id id, Terminal_Data *t, uint32_t *version) {
+  uint32_t table_seq, slot_seq = 0;
+  uint32_t v = 0;
+  int slot;
+
+  /* no lock, the copy is tried again if a writer changed the structure
+   * of the table or the slot while it was done
+   */
+  do {
+    table_seq = seq_read_begin(&Table->table_seq);
+    if ((slot = index_find(id)) >= 0) {
+      slot_seq = seq_read_begin(&Table->slot_seq[slot]);
+      slot_load(slot, t);
+      v = Table->version[slot];
+    }
+  } while ((slot >= 0 && seq_read_retry(&Table->slot_seq[slot], slot_seq)) ||
+      seq_read_retry(&Table->table_seq, table_seq));
+
+  if (slot >= 0 && version != NULL) {
+    *version = v;
+  }
+  return slot >= 0;
+}
+
+/* pair of a slot in the terminals table and a position in the request */
+typedef struct slot_ref {
+  int slot;
+  int pos;
+} Slot_Ref;
+
+static int slot_ref_compare(const void *a, const void *b) {
+  return ((const Slot_Ref *) a)->slot - ((const Slot_Ref *) b)->slot;
+}
+
+static int id_compare(const void *a, const void *b) {
+  terminal_id x = *(const terminal_id *) a;
+  terminal_id y = *(const terminal_id *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* parse a list of ids and id ranges, like "1,2,3,10-20", for
+ * terminal_get_many()
+ * the ids are sorted and duplicates removed. returns the number of ids,
+ * or -1 if the list is invalid (an empty list, an empty element like in
+ * "1,,2" or "1,2,", or not an id) or has more than max ids
+ */
+int terminal_parse_id_list(const char *s, terminal_id *ids, int max) {
+  unsigned long first, last, id;
+  const char *p = s;
+  char *end;
+  int n = 0;
+  int i, j;
+
+  assert(s != NULL && ids != NULL);
+
+  for (;;) {
+    /* an element, that's never empty */
+    if (!isdigit((unsigned char) *p)) {
+      return -1;
+    }
+    first = last = strtoul(p, &end, 10);
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (!isdigit((unsigned char) *p)) {
+        return -1;
+      }
+      last = strtoul(p, &end, 10);
+      p = end;
+    }
+    if (first == 0 || last < first || last > UINT32_MAX ||
+        last - first >= (unsigned long) (max - n)) {
+      return -1;
+    }
+    for (id = first; id <= last; id++) {
+      ids[n++] = id;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    if (*p++ != ',') {
+      return -1;
+    }
+  }
+
+  qsort(ids, n, sizeof(terminal_id), id_compare);
+  for (i = 0, j = 0; i < n; i++) {
+    if (j == 0 || ids[j - 1] != ids[i]) {
+      ids[j++] = ids[i];
+    }
+  }
+  return j;
+}
+
+/* get copies of many terminals, all in a single read section so the
+ * result is consistent
+ * out[i] gets the terminal with id ids[i], or an empty terminal (id 0) if
+ * there's no such terminal. returns the number of terminals found
+ * the ids are resolved first, and the table is read in slot order so the
+ * copies walk the memory forward
+ */
+int terminal_get_many(const terminal_id *ids, int n, Terminal_Data *out) {
+  assert(ids != NULL || n == 0);
+  assert(out != NULL || n == 0);
+
+  if (n <= 0) {
+    return 0;
+  }
+  return Backend->get_many(ids, n, out);
+}
+
+static int memory_get_many(const terminal_id *ids, int n, Terminal_Data *out) {
+  Slot_Ref *refs;
+  int found = 0;
+  int i, slot;
+
+  if ((refs = mem_malloc(MEM_STORE, n * sizeof(Slot_Ref))) == NULL) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&Table->terminals_lock);
+  for (i = 0; i < n; i++) {
+    if (ids[i] != 0 && (slot = index_find(ids[i])) >= 0) {
+      refs[found].slot = slot;
+      refs[found].pos = i;
+      found++;
+    } else {
+      terminal_init_data(&out[i]);
+    }
+  }
+  qsort(refs, found, sizeof(Slot_Ref), slot_ref_compare);
+  stripes_rdlock_all();
+  for (i = 0; i < found; i++) {
+    slot_load(refs[i].slot, &out[refs[i].pos]);
+  }
+  stripes_unlock_all();
+  pthread_rwlock_unlock(&Table->terminals_lock);
+
+  mem_free(MEM_STORE, refs);
+  return found;
+}
+
+/* validate a terminal data information
+ * for a terminal to be valid, it has to reference valid cards types
+ * as well as valid transaction types
+ * it's checked where terminals come in, by the functions that change the
+ * table: a type is never removed from the catalog, only retired, and a
+ * retired type is still found by id. terminals written with another
+ * catalog (a store, a primary, a table of a release before) can have
+ * types this one never had, they are dropped as they are loaded (see
+ * drop_unknown_types()), and skipped by the encoders
+ * a type is found by it's position in the catalog, a load and no scan
+ */
+bool terminal_is_valid(Terminal_Data *t) {
+  int i;
+
+  assert(t != NULL);
+
+  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
+    if (card_type_index(t->cards[i]) < 0) {
+      return false;
+    }
+  }
+
+  for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
+    if (transaction_type_index(t->trxs[i]) < 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* drop the types of a terminal that are not in the catalog, the others
+ * keep their order
+ * returns how many were dropped
+ */
+static int drop_unknown_types(Terminal_Data *t) {
+  int i, n, dropped;
+
+  for (i = 0, n = 0; i < N_CARDS && t->cards[i] != 0; i++) {
+    if (card_type_index(t->cards[i]) >= 0) {
+      t->cards[n++] = t->cards[i];
+    }
+  }
+  for (dropped = i - n; n < i; n++) {
+    t->cards[n] = 0;
+  }
+
+  for (i = 0, n = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
+    if (transaction_type_index(t->trxs[i]) >= 0) {
+      t->trxs[n++] = t->trxs[i];
+    }
+  }
+  for (dropped += i - n; n < i; n++) {
+    t->trxs[n] = 0;
+  }
+  return dropped;
+}
+
+/* add a new terminal with the id given, holding terminals_lock, and set
+ * it's version, if version is not NULL
+ * returns false if the table is full, the id is not used again then
+ */
+static bool slot_add(Terminal_Data *t, terminal_id id, uint32_t *version) {
+  uint32_t v;
+  uint32_t profile;
+  int slot;
+
+  /* get an empty slot in the terminals table, a deleted one if there's
+   * any, or else the first one never used
+   */
+  if ((slot = slot_alloc()) < 0) {
+    /* can not insert into terminal table.  the table is full */
+    return false;
+  }
+  if ((profile = profile_take(t)) == 0) {
+    Table->free_slots[Table->n_free++] = slot;
+    return false;
+  }
+  t->id = id;
+
+  /* copy terminal data to the terminal table
+   * no stripe lock is needed, nobody else holds terminals_lock
+   */
+  seq_write_begin(&Table->table_seq);
+  Table->terminals[slot].id = id;
+  Table->terminals[slot].profile = profile;
+  v = version_next(slot);
+  change_feed_append(CHANGE_ADD, t, v);
+  index_insert(t->id, slot);
+  seq_write_end(&Table->table_seq);
+  stats_apply(t, 1);
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  if (version != NULL) {
+    *version = v;
+  }
+  return true;
+}
+
+bool terminal_add(Terminal_Data *t) {
+  return terminal_add_version(t, NULL);
+}
+
+/* add a new terminal, and get it's version, for the ETag of POST
+ * a new terminal doesn't always have version 1: a slot that's used again
+ * goes on with the versions of the terminal that had it
+ */
+bool terminal_add_version(Terminal_Data *t, uint32_t *version) {
+  terminal_id id;
+
+  assert(t != NULL);
+  /* terminal should be a new terminal */
+  assert(t->id == 0);
+  /* all terminal data should be valid */
+  assert(terminal_is_valid(t));
+
+  /* generate a new terminal id for this terminal
+   * it's done before taking the lock, it needs no lock
+   */
+  if ((id = new_terminal_id()) == 0) {
+    return false;
+  }
+
+  t->id = id;
+  if (Backend->add(t, 1, version) == 1) {
+    return true;
+  }
+  t->id = 0;
+  return false;
+}
+
+/* add terminals with their new ids, taking the lock once */
+static int memory_add(Terminal_Data *t, int n, uint32_t *versions) {
+  int added;
+
+  pthread_rwlock_wrlock(&Table->terminals_lock);
+  for (added = 0; added < n && slot_add(&t[added], t[added].id,
+          (versions != NULL) ? &versions[added] : NULL); added++) {
+  }
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  return added;
+}
+
+/* add many new terminals, like terminal_add(), taking the lock once
+ * returns how many were added: the ones before the first that doesn't
+ * fit, n if all do
+ */
+int terminal_add_many(Terminal_Data *t, int n) {
+  int added, i;
+
+  assert(t != NULL && n >= 0);
+
+  for (i = 0; i < n; i++) {
+    assert(t[i].id == 0);
+    assert(terminal_is_valid(&t[i]));
+    /* taken back below, if it's not used */
+    if ((t[i].id = new_terminal_id()) == 0) {
+      break;
+    }
+  }
+  n = i;
+
+  added = (n > 0) ? Backend->add(t, n, NULL) : 0;
+  for (i = added; i < n; i++) {
+    t[i].id = 0;
+  }
+  return added;
+}
+
+/* check the version of a slot against the version the caller expects */
+static bool version_matches(int slot, uint32_t if_version) {
+  return if_version == TERMINAL_ANY_VERSION || Table->version[slot] == if_version;
+}
+
+/* replace the card and transaction types of a terminal, for PUT
+ * the id of t is ignored, on return t has the id of the terminal
+ * if if_version is not TERMINAL_ANY_VERSION, the terminal is only changed
+ * if it's version is that one. the new version is stored in *version
+ * (if it's not NULL)
+ */
+Terminal_Status terminal_update(terminal_id id, Terminal_Data *t,
+        uint32_t if_version,
+        uint32_t *version) {
+  assert(t != NULL);
+  /* all terminal data should be valid */
+  assert(terminal_is_valid(t));
+
+  if (id == 0) {
+    return TERMINAL_NOT_FOUND;
+  }
+  return Backend->update(id, t, if_version, version);
+}
+
+static Terminal_Status memory_update(terminal_id id, Terminal_Data *t,
+        uint32_t if_version,
+        uint32_t *version) {
+  Terminal_Status st = TERMINAL_OK;
+  uint32_t new_version, profile, old_profile;
+  Terminal_Data old;
+  int slot;
+
+  pthread_rwlock_rdlock(&Table->terminals_lock);
+  if (id == 0 || (slot = index_find(id)) < 0) {
+    pthread_rwlock_unlock(&Table->terminals_lock);
+    return TERMINAL_NOT_FOUND;
+  }
+  pthread_rwlock_wrlock(stripe_lock(slot));
+  if (!version_matches(slot, if_version)) {
+    st = TERMINAL_CONFLICT;
+  } else if ((profile = profile_take(t)) == 0) {
+    st = TERMINAL_NO_SPACE;
+  } else {
+    t->id = id;
+    slot_load(slot, &old);
+    stats_apply(&old, -1);
+    old_profile = Table->terminals[slot].profile;
+    seq_write_begin(&Table->slot_seq[slot]);
+    Table->terminals[slot].profile = profile;
+    new_version = version_next(slot);
+    seq_write_end(&Table->slot_seq[slot]);
+    profile_drop(old_profile);
+    stats_apply(t, 1);
+    change_feed_append(CHANGE_UPDATE, t, new_version);
+    if (version != NULL) {
+      *version = new_version;
+    }
+    __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(stripe_lock(slot));
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  return st;
+}
+
+/* apply a delta to the card and transaction types of a terminal, for PATCH
+ * the types in remove are removed first, then the types in add are added
+ * the result is copied to out. the version is checked and returned as
+ * terminal_update() does.
+ * if there's no room for the types of the result the terminal is not
+ * changed, and TERMINAL_NO_SPACE is returned
+ */
+Terminal_Status terminal_patch(terminal_id id, Terminal_Data *add,
+        Terminal_Data *remove,
+        uint32_t if_version,
+        Terminal_Data *out,
+        uint32_t *version) {
+  assert(add != NULL);
+  assert(remove != NULL);
+  assert(terminal_is_valid(add));
+  assert(terminal_is_valid(remove));
+
+  if (id == 0) {
+    return TERMINAL_NOT_FOUND;
+  }
+  return Backend->patch(id, add, remove, if_version, out, version);
+}
+
+/* apply the delta of a PATCH to the types of a terminal, the types in
+ * remove are removed first, then the types in add are added
+ * returns false if there's no room for them
+ */
+static bool patch_apply(Terminal_Data *t, Terminal_Data *add, Terminal_Data *remove) {
+  int i;
+
+  for (i = 0; i < N_CARDS && remove->cards[i] != 0; i++) {
+    remove_card_type_id(t, remove->cards[i]);
+  }
+  for (i = 0; i < N_TRXS && remove->trxs[i] != 0; i++) {
+    remove_transaction_type_id(t, remove->trxs[i]);
+  }
+  for (i = 0; i < N_CARDS && add->cards[i] != 0; i++) {
+    if (!add_card_type_id(t, add->cards[i])) {
+      return false;
+    }
+  }
+  for (i = 0; i < N_TRXS && add->trxs[i] != 0; i++) {
+    if (!add_transaction_type_id(t, add->trxs[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Terminal_Status memory_patch(terminal_id id, Terminal_Data *add,
+        Terminal_Data *remove,
+        uint32_t if_version,
+        Terminal_Data *out,
+        uint32_t *version) {
+  Terminal_Status st = TERMINAL_OK;
+  Terminal_Data t, old;
+  uint32_t new_version, profile, old_profile;
+  int slot;
+
+  pthread_rwlock_rdlock(&Table->terminals_lock);
+  if (id == 0 || (slot = index_find(id)) < 0) {
+    pthread_rwlock_unlock(&Table->terminals_lock);
+    return TERMINAL_NOT_FOUND;
+  }
+  pthread_rwlock_wrlock(stripe_lock(slot));
+  if (!version_matches(slot, if_version)) {
+    st = TERMINAL_CONFLICT;
+    goto out;
+  }
+
+  /* the delta is applied to a copy, so the terminal is not changed
+   * if it fails
+   */
+  slot_load(slot, &t);
+  old = t;
+  if (!patch_apply(&t, add, remove)) {
+    st = TERMINAL_NO_SPACE;
+    goto out;
+  }
+
+  if ((profile = profile_take(&t)) == 0) {
+    st = TERMINAL_NO_SPACE;
+    goto out;
+  }
+  stats_apply(&old, -1);
+  old_profile = Table->terminals[slot].profile;
+  seq_write_begin(&Table->slot_seq[slot]);
+  Table->terminals[slot].profile = profile;
+  new_version = version_next(slot);
+  seq_write_end(&Table->slot_seq[slot]);
+  profile_drop(old_profile);
+  stats_apply(&t, 1);
+  if (out != NULL) {
+    terminal_copy(out, &t);
+  }
+  change_feed_append(CHANGE_UPDATE, &t, new_version);
+  if (version != NULL) {
+    *version = new_version;
+  }
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+
+out:
+  pthread_rwlock_unlock(stripe_lock(slot));
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  return st;
+}
+
+/* delete a terminal from the terminals table
+ * the version is checked as terminal_update() does. the slot is reused
+ * by the next terminal_add(), the id is never reused
+ */
+Terminal_Status terminal_delete(terminal_id id, uint32_t if_version) {
+  if (id == 0) {
+    return TERMINAL_NOT_FOUND;
+  }
+  return Backend->delete(id, if_version);
+}
+
+static Terminal_Status memory_delete(terminal_id id, uint32_t if_version) {
+  Terminal_Data t;
+  int slot;
+
+  pthread_rwlock_wrlock(&Table->terminals_lock);
+  if (id == 0 || (slot = index_find(id)) < 0) {
+    pthread_rwlock_unlock(&Table->terminals_lock);
+    return TERMINAL_NOT_FOUND;
+  }
+  if (!version_matches(slot, if_version)) {
+    pthread_rwlock_unlock(&Table->terminals_lock);
+    return TERMINAL_CONFLICT;
+  }
+
+  /* the index needs the id of the slot to remove it */
+  slot_load(slot, &t);
+  seq_write_begin(&Table->table_seq);
+  index_remove(id);
+  stats_apply(&t, -1);
+  change_feed_append(CHANGE_DELETE, &t, version_next(slot));
+  profile_drop(Table->terminals[slot].profile);
+  Table->terminals[slot].id = 0;
+  Table->terminals[slot].profile = 0;
+  seq_write_end(&Table->table_seq);
+  Table->free_slots[Table->n_free++] = slot;
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  return TERMINAL_OK;
+}
+
+/* apply a change replicated from another server (see replica.h)
+ * the terminal gets the id and the version of the change. an add or an
+ * update of a terminal that's not in the table adds it, a delete of a
+ * terminal that's not in the table does nothing
+ * the change is appended to the change feed of this server
+ * returns false if the table is full
+ */
+bool terminal_apply_change(Terminal_Change *c) {
+  assert(c != NULL);
+  if (c->terminal.id == 0) {
+    return true;
+  }
+  drop_unknown_types(&c->terminal);
+  return Backend->apply_change(c);
+}
+
+static bool memory_apply_change(Terminal_Change *c) {
+  Terminal_Data *t = &c->terminal, old;
+  uint32_t profile;
+  int slot;
+
+  pthread_rwlock_wrlock(&Table->terminals_lock);
+  seq_write_begin(&Table->table_seq);
+  slot = index_find(t->id);
+  if (c->op == CHANGE_DELETE) {
+    if (slot >= 0) {
+      index_remove(t->id);
+      slot_load(slot, &old);
+      stats_apply(&old, -1);
+      profile_drop(Table->terminals[slot].profile);
+      Table->terminals[slot].id = 0;
+      Table->terminals[slot].profile = 0;
+      Table->version[slot] = c->version;
+      Table->free_slots[Table->n_free++] = slot;
+    }
+  } else {
+    if ((profile = profile_take(t)) == 0) {
+      seq_write_end(&Table->table_seq);
+      pthread_rwlock_unlock(&Table->terminals_lock);
+      return false;
+    }
+    if (slot >= 0) {
+      slot_load(slot, &old);
+      stats_apply(&old, -1);
+      profile_drop(Table->terminals[slot].profile);
+    } else {
+      if ((slot = slot_alloc()) < 0) {
+        profile_drop(profile);
+        seq_write_end(&Table->table_seq);
+        pthread_rwlock_unlock(&Table->terminals_lock);
+        return false;
+      }
+      Table->terminals[slot].id = t->id;
+      index_insert(t->id, slot);
+    }
+    Table->terminals[slot].profile = profile;
+    Table->version[slot] = c->version;
+    stats_apply(t, 1);
+  }
+  change_feed_append(c->op, t, c->version);
+  seq_write_end(&Table->table_seq);
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  return true;
+}
+
+/* replace the whole terminals table, with the terminals and versions of
+ * a snapshot of another server (see replica.h)
+ * readers see the old table or the new one, never a mix
+ * the change feed of this server can't tell what changed, so it asks
+ * all of it's clients to resync
+ * types that are not in the catalog are dropped, see terminal_is_valid()
+ */
+void terminal_load_snapshot(Terminal_Data *t, uint32_t *versions, int n) {
+  int i, dropped;
+
+  assert(t != NULL || n == 0);
+  for (i = 0, dropped = 0; i < n; i++) {
+    dropped += (drop_unknown_types(&t[i]) > 0);
+  }
+  if (dropped > 0) {
+    fprintf(stderr, "terminals: dropped the types not in the catalog from "
+        "%d terminals of the snapshot\n", dropped);
+  }
+  Backend->load_snapshot(t, versions, n);
+}
+
+static void memory_load_snapshot(Terminal_Data *t, uint32_t *versions, int n) {
+  int i;
+
+  assert(n <= N_TERMINALS);
+
+  pthread_rwlock_wrlock(&Table->terminals_lock);
+  seq_write_begin(&Table->table_seq);
+  memset(Table->terminals, 0, sizeof(Table->terminals));
+  memset(Table->index, 0, sizeof(Table->index));
+  memset(&Table->stats, 0, sizeof(Table->stats));
+  Table->n_free = 0;
+  Table->slots_used = 0;
+  /* nobody else holds a profile, writers hold terminals_lock too */
+  pthread_mutex_lock(&Table->profiles_lock);
+  memset(Table->profile_index, 0, sizeof(Table->profile_index));
+  Table->n_free_profiles = 0;
+  Table->profiles_used = 0;
+  Table->n_free_overflow = 0;
+  Table->overflow_used = 0;
+  pthread_mutex_unlock(&Table->profiles_lock);
+  for (i = 0; i < n; i++) {
+    Table->terminals[i].id = t[i].id;
+    Table->terminals[i].profile = profile_take(&t[i]);
+    Table->version[i] = versions[i];
+    index_insert(t[i].id, i);
+    stats_apply(&t[i], 1);
+  }
+  Table->slots_used = n;
+  seq_write_end(&Table->table_seq);
+  change_feed_reset();
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&Table->terminals_lock);
+}
+
+/* get a snapshot of the terminals table, the terminals as they were at
+ * a single generation. the snapshot doesn't change while it's held, no
+ * matter what writers do, and holding it doesn't block them.
+ * readers of the same generation share the snapshot, the first one copies
+ * the table (holding the locks only for the copy). a snapshot is freed when
+ * it's not the current one and the last reader releases it
+ * returns NULL if there's no memory for a new snapshot
+ */
+Terminal_Snapshot *terminal_snapshot_acquire(void) {
+  Terminal_Snapshot *snap;
+  Terminal_Snapshot *old = NULL;
+
+  pthread_mutex_lock(&Snapshot_Lock);
+  snap = Current_Snapshot;
+  if (snap != NULL && snap->generation == terminal_generation()) {
+    snap->refs++;
+    pthread_mutex_unlock(&Snapshot_Lock);
+    return snap;
+  }
+
+  if ((snap = Backend->snapshot()) == NULL) {
+    pthread_mutex_unlock(&Snapshot_Lock);
+    return NULL;
+  }
+
+  /* one reference for being the current snapshot, one for the caller */
+  snap->refs = 2;
+  if (Current_Snapshot != NULL && --Current_Snapshot->refs == 0) {
+    old = Current_Snapshot;
+  }
+  Current_Snapshot = snap;
+  pthread_mutex_unlock(&Snapshot_Lock);
+
+  mem_free(MEM_SNAPSHOTS, old);
+  return snap;
+}
+
+/* copy the table to a new snapshot */
+static Terminal_Snapshot *memory_snapshot(void) {
+  Terminal_Snapshot *snap;
+  int i, n;
+
+  /* room for a full table, so nothing is allocated while holding the
+   * table locks
+   */
+  snap = mem_malloc(MEM_SNAPSHOTS, sizeof(Terminal_Snapshot) +
+            N_TERMINALS * (sizeof(Terminal_Data) + sizeof(uint32_t)));
+  if (snap == NULL) {
+    return NULL;
+  }
+  snap->versions = (uint32_t *) &snap->terminals[N_TERMINALS];
+
+  /* writers change the generation, and append to the change feed,
+   * holding a stripe lock or terminals_lock exclusive, so the generation
+   * and the sequence number read here are the ones of the copy
+   */
+  pthread_rwlock_rdlock(&Table->terminals_lock);
+  stripes_rdlock_all();
+  snap->generation = terminal_generation();
+  snap->seq = change_feed_last_seq();
+  for (n = 0, i = 0; i < Table->slots_used; i++) {
+    if (Table->terminals[i].id != 0) {
+      snap->versions[n] = Table->version[i];
+      slot_load(i, &snap->terminals[n++]);
+    }
+  }
+  stripes_unlock_all();
+  pthread_rwlock_unlock(&Table->terminals_lock);
+  snap->n = n;
+  return snap;
+}
+
+/* release a snapshot taken with terminal_snapshot_acquire() */
+void terminal_snapshot_release(Terminal_Snapshot *snap) {
+  bool last;
+
+  if (snap == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&Snapshot_Lock);
+  last = (--snap->refs == 0);
+  pthread_mutex_unlock(&Snapshot_Lock);
+  if (last) {
+    mem_free(MEM_SNAPSHOTS, snap);
+  }
+}
+
+/* give the terminals of the whole table to fn, as they are at a single
+ * generation, some at a time (empty ones, with id 0, are skipped by fn).
+ * s is set before the first of them. fn returns false to stop
+ * it's for readers of the whole table that need no copy of it, like the
+ * encoders of all the terminals: with the store on disk they are read
+ * from the file a batch at a time, not copied to a snapshot
+ * if the table changes during the scan it can start over: fn is given no
+ * terminals (t is NULL), it drops the ones it was given, and s is set
+ * again before the next ones
+ * returns false if fn stopped, or the terminals can't be read
+ */
+bool terminal_scan(Terminal_Scan *s,
+        bool (*fn)(Terminal_Data *t, int n, void *arg), void *arg) {
+  assert(s != NULL && fn != NULL);
+  return Backend->scan(s, fn, arg);
+}
+
+/* the table in memory is given at once, from a snapshot */
+static bool memory_scan(Terminal_Scan *s,
+        bool (*fn)(Terminal_Data *t, int n, void *arg), void *arg) {
+  Terminal_Snapshot *snap;
+  bool st;
+  int i;
+
+  if ((snap = terminal_snapshot_acquire()) == NULL) {
+    return false;
+  }
+  s->generation = snap->generation;
+  s->seq = snap->seq;
+  for (i = 0, s->n = 0; i < snap->n; i++) {
+    s->n += (snap->terminals[i].id != 0);
+  }
+  st = fn(snap->terminals, snap->n, arg);
+  terminal_snapshot_release(snap);
+  return st;
+}
+
+/* get the current generation of the terminals table */
+uint64_t terminal_generation(void) {
+  return __atomic_load_n(&Table->generation, __ATOMIC_ACQUIRE);
+}
+
+/* get the aggregate counters
+ * every counter is read atomically, but they are not read all at the same
+ * time, a writer can change some of them while they are read
+ */
+void terminal_get_stats(Terminal_Stats *st) {
+  Terminal_Stats *stats = Backend->stats();
+  int i, j;
+  int nc, nt;
+
+  assert(st != NULL);
+
+  memset(st, 0, sizeof(Terminal_Stats));
+  for (nc = 0; card_type_at(nc) != NULL; nc++) {
+    ;
+  }
+  for (nt = 0; transaction_type_at(nt) != NULL; nt++) {
+    ;
+  }
+
+  st->terminals = __atomic_load_n(&stats->terminals, __ATOMIC_RELAXED);
+  st->profiles = __atomic_load_n(&stats->profiles, __ATOMIC_RELAXED);
+  st->overflows = __atomic_load_n(&stats->overflows, __ATOMIC_RELAXED);
+  for (i = 0; i < nc; i++) {
+    st->cards[i] = __atomic_load_n(&stats->cards[i], __ATOMIC_RELAXED);
+    for (j = 0; j < nt; j++) {
+      st->combinations[i][j] = __atomic_load_n(&stats->combinations[i][j],
+                                  __ATOMIC_RELAXED);
+    }
+  }
+  for (j = 0; j < nt; j++) {
+    st->trxs[j] = __atomic_load_n(&stats->trxs[j], __ATOMIC_RELAXED);
+  }
+}
+
+static Terminal_Stats *memory_stats(void) {
+  return &Table->stats;
+}
+
+static const Terminal_Backend Memory_Backend = {
+  .name = "memory",
+  .get = memory_get,
+  .get_many = memory_get_many,
+  .add = memory_add,
+  .update = memory_update,
+  .patch = memory_patch,
+  .delete = memory_delete,
+  .apply_change = memory_apply_change,
+  .load_snapshot = memory_load_snapshot,
+  .snapshot = memory_snapshot,
+  .scan = memory_scan,
+  .stats = memory_stats
+};
+
+/* the disk backend, see store.h
+ * the store is read holding Disk_Lock shared, and changed holding it
+ * exclusive, so a terminal is checked and changed at once. a new terminal
+ * starts at version 1, the generation and the change feed are the ones
+ * of the table in memory, the counters are Disk_Stats
+ */
+static pthread_rwlock_t Disk_Lock = PTHREAD_RWLOCK_INITIALIZER;
+static Terminal_Stats Disk_Stats;
+
+/* the version after v, 0 is never used as a version */
+static uint32_t version_after(uint32_t v) {
+  return (v + 1 == 0) ? 1 : v + 1;
+}
+
+static bool disk_get(terminal_id id, Terminal_Data *t, uint32_t *version) {
+  bool st;
+
+  pthread_rwlock_rdlock(&Disk_Lock);
+  st = store_get(id, t, version);
+  pthread_rwlock_unlock(&Disk_Lock);
+  return st;
+}
+
+static int disk_get_many(const terminal_id *ids, int n, Terminal_Data *out) {
+  int found = 0;
+  int i;
+
+  pthread_rwlock_rdlock(&Disk_Lock);
+  for (i = 0; i < n; i++) {
+    if (ids[i] != 0 && store_get(ids[i], &out[i], NULL)) {
+      found++;
+    } else {
+      terminal_init_data(&out[i]);
+    }
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return found;
+}
+
+static int disk_add(Terminal_Data *t, int n, uint32_t *versions) {
+  int added;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  for (added = 0; added < n && store_put(&t[added], 1); added++) {
+    /* the ids are new, it's the first version of them */
+    if (versions != NULL) {
+      versions[added] = 1;
+    }
+    stats_apply(&t[added], 1);
+    change_feed_append(CHANGE_ADD, &t[added], 1);
+  }
+  if (added > 0) {
+    __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return added;
+}
+
+/* write a terminal that's changed, the old one is in old
+ * the caller holds Disk_Lock exclusive
+ */
+static Terminal_Status disk_replace(Terminal_Data *old, Terminal_Data *t,
+        uint32_t new_version) {
+  if (!store_put(t, new_version)) {
+    return TERMINAL_NO_SPACE;
+  }
+  stats_apply(old, -1);
+  stats_apply(t, 1);
+  change_feed_append(CHANGE_UPDATE, t, new_version);
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  return TERMINAL_OK;
+}
+
+static Terminal_Status disk_update(terminal_id id, Terminal_Data *t,
+        uint32_t if_version,
+        uint32_t *version) {
+  Terminal_Status st;
+  Terminal_Data old;
+  uint32_t v;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  if (!store_get(id, &old, &v)) {
+    st = TERMINAL_NOT_FOUND;
+  } else if (if_version != TERMINAL_ANY_VERSION && v != if_version) {
+    st = TERMINAL_CONFLICT;
+  } else {
+    t->id = id;
+    v = version_after(v);
+    if ((st = disk_replace(&old, t, v)) == TERMINAL_OK && version != NULL) {
+      *version = v;
+    }
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return st;
+}
+
+static Terminal_Status disk_patch(terminal_id id, Terminal_Data *add,
+        Terminal_Data *remove,
+        uint32_t if_version,
+        Terminal_Data *out,
+        uint32_t *version) {
+  Terminal_Status st;
+  Terminal_Data t, old;
+  uint32_t v;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  if (!store_get(id, &old, &v)) {
+    st = TERMINAL_NOT_FOUND;
+  } else if (if_version != TERMINAL_ANY_VERSION && v != if_version) {
+    st = TERMINAL_CONFLICT;
+  } else {
+    t = old;
+    v = version_after(v);
+    if (!patch_apply(&t, add, remove)) {
+      st = TERMINAL_NO_SPACE;
+    } else if ((st = disk_replace(&old, &t, v)) == TERMINAL_OK) {
+      if (out != NULL) {
+        terminal_copy(out, &t);
+      }
+      if (version != NULL) {
+        *version = v;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return st;
+}
+
+static Terminal_Status disk_delete(terminal_id id, uint32_t if_version) {
+  Terminal_Status st = TERMINAL_OK;
+  Terminal_Data t;
+  uint32_t v;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  if (!store_get(id, &t, &v)) {
+    st = TERMINAL_NOT_FOUND;
+  } else if (if_version != TERMINAL_ANY_VERSION && v != if_version) {
+    st = TERMINAL_CONFLICT;
+  } else if (store_remove(id)) {
+    stats_apply(&t, -1);
+    change_feed_append(CHANGE_DELETE, &t, version_after(v));
+    __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  } else {
+    st = TERMINAL_NOT_FOUND;
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return st;
+}
+
+static bool disk_apply_change(Terminal_Change *c) {
+  Terminal_Data *t = &c->terminal, old;
+  bool found;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  found = store_get(t->id, &old, NULL);
+  if (c->op == CHANGE_DELETE) {
+    if (found && store_remove(t->id)) {
+      stats_apply(&old, -1);
+    }
+  } else {
+    if (!store_put(t, c->version)) {
+      pthread_rwlock_unlock(&Disk_Lock);
+      return false;
+    }
+    if (found) {
+      stats_apply(&old, -1);
+    }
+    stats_apply(t, 1);
+  }
+  change_feed_append(c->op, t, c->version);
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&Disk_Lock);
+  return true;
+}
+
+static void disk_load_snapshot(Terminal_Data *t, uint32_t *versions, int n) {
+  int i;
+
+  pthread_rwlock_wrlock(&Disk_Lock);
+  store_clear();
+  memset(&Disk_Stats, 0, sizeof(Disk_Stats));
+  for (i = 0; i < n && store_put(&t[i], versions[i]); i++) {
+    stats_apply(&t[i], 1);
+  }
+  change_feed_reset();
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&Disk_Lock);
+}
+
+/* a snapshot being filled, with room for max terminals */
+typedef struct snapshot_fill {
+  Terminal_Snapshot *snap;
+  int max;
+} Snapshot_Fill;
+
+static void snapshot_add(Terminal_Data *t, uint32_t version, void *arg) {
+  Snapshot_Fill *f = arg;
+
+  if (f->snap->n < f->max) {
+    f->snap->versions[f->snap->n] = version;
+    terminal_copy(&f->snap->terminals[f->snap->n++], t);
+  }
+}
+
+/* copy the store to a new snapshot, it's read in file order
+ * there can be more terminals than fit in the table in memory, so the
+ * room is for the ones there are, allocated holding Disk_Lock. the
+ * encoders of the whole table don't copy it, they use terminal_scan()
+ */
+static Terminal_Snapshot *disk_snapshot(void) {
+  Terminal_Snapshot *snap;
+  Snapshot_Fill f;
+
+  pthread_rwlock_rdlock(&Disk_Lock);
+  f.max = store_count();
+  snap = mem_malloc(MEM_SNAPSHOTS, sizeof(Terminal_Snapshot) +
+            f.max * (sizeof(Terminal_Data) + sizeof(uint32_t)));
+  if (snap != NULL) {
+    snap->versions = (uint32_t *) &snap->terminals[f.max];
+    snap->generation = terminal_generation();
+    snap->seq = change_feed_last_seq();
+    snap->n = 0;
+    f.snap = snap;
+    if (!store_scan(snapshot_add, &f)) {
+      mem_free(MEM_SNAPSHOTS, snap);
+      snap = NULL;
+    }
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return snap;
+}
+
+/* a scan of the store, the terminals read and not given yet */
+typedef struct disk_scan_state {
+  bool (*fn)(Terminal_Data *t, int n, void *arg);
+  void *arg;
+  bool stopped;
+  int n;
+  Terminal_Data *batch;
+} Disk_Scan_State;
+
+static void scan_add(Terminal_Data *t, uint32_t version, void *arg) {
+  Disk_Scan_State *ds = arg;
+
+  (void) version;
+  if (ds->stopped) {
+    return;
+  }
+  terminal_copy(&ds->batch[ds->n++], t);
+  if (ds->n == SCAN_BATCH) {
+    ds->stopped = !ds->fn(ds->batch, ds->n, ds->arg);
+    ds->n = 0;
+  }
+}
+
+/* a pass of the store holding Disk_Lock shared only to read a batch, fn
+ * is given it after. the generation is the same for every batch, or the
+ * pass is dropped: a change is made holding the lock exclusive, and it
+ * bumps the generation
+ * returns 1 if it's done, 0 if the table changed, -1 if fn stopped or the
+ * store can't be read
+ */
+static int disk_scan_pass(Terminal_Scan *s, Disk_Scan_State *ds) {
+  uint32_t pos = 0;
+  int more;
+
+  do {
+    pthread_rwlock_rdlock(&Disk_Lock);
+    if (pos == 0) {
+      s->generation = terminal_generation();
+      s->seq = change_feed_last_seq();
+      s->n = store_count();
+    } else if (terminal_generation() != s->generation) {
+      pthread_rwlock_unlock(&Disk_Lock);
+      return 0;
+    }
+    more = store_scan_next(&pos, scan_add, ds);
+    pthread_rwlock_unlock(&Disk_Lock);
+    if (more >= 0 && !ds->stopped && ds->n > 0) {
+      ds->stopped = !ds->fn(ds->batch, ds->n, ds->arg);
+    }
+    ds->n = 0;
+  } while (more > 0 && !ds->stopped);
+  return (more < 0 || ds->stopped) ? -1 : 1;
+}
+
+/* a pass of the store holding Disk_Lock shared all along, it's never
+ * dropped. returns 1 if it's done, -1 as disk_scan_pass()
+ */
+static int disk_scan_held(Terminal_Scan *s, Disk_Scan_State *ds) {
+  bool st;
+
+  pthread_rwlock_rdlock(&Disk_Lock);
+  s->generation = terminal_generation();
+  s->seq = change_feed_last_seq();
+  s->n = store_count();
+  st = store_scan(scan_add, ds);
+  if (st && !ds->stopped && ds->n > 0) {
+    ds->stopped = !ds->fn(ds->batch, ds->n, ds->arg);
+  }
+  pthread_rwlock_unlock(&Disk_Lock);
+  return (!st || ds->stopped) ? -1 : 1;
+}
+
+/* the store is read in file order, a batch at a time, so only a batch is
+ * in memory and writers don't wait for fn (an encoder, say) to go through
+ * the whole table. a pass that sees the table change starts over, and
+ * after SCAN_PASSES of them Disk_Lock is held shared all along, so a scan
+ * of a table that's always changing ends too
+ */
+static bool disk_scan(Terminal_Scan *s,
+        bool (*fn)(Terminal_Data *t, int n, void *arg), void *arg) {
+  Disk_Scan_State ds = { fn, arg, false, 0, NULL };
+  int pass, done = 0;
+
+  if ((ds.batch = mem_malloc(MEM_SNAPSHOTS, SCAN_BATCH * sizeof(Terminal_Data))) == NULL) {
+    return false;
+  }
+  for (pass = 0; done == 0; pass++) {
+    if (pass > 0 && !fn(NULL, 0, arg)) {
+      done = -1;
+    } else if (pass < SCAN_PASSES) {
+      done = disk_scan_pass(s, &ds);
+    } else {
+      done = disk_scan_held(s, &ds);
+    }
+  }
+  mem_free(MEM_SNAPSHOTS, ds.batch);
+  return done > 0;
+}
+
+static Terminal_Stats *disk_stats(void) {
+  return &Disk_Stats;
+}
+
+static const Terminal_Backend Disk_Backend = {
+  .name = "disk",
+  .get = disk_get,
+  .get_many = disk_get_many,
+  .add = disk_add,
+  .update = disk_update,
+  .patch = disk_patch,
+  .delete = disk_delete,
+  .apply_change = disk_apply_change,
+  .load_snapshot = disk_load_snapshot,
+  .snapshot = disk_snapshot,
+  .scan = disk_scan,
+  .stats = disk_stats
+};
+
+/* the terminals of a store as it's opened */
+typedef struct store_count {
+  terminal_id last;
+  int dropped;
+  bool error;
+} Store_Count;
+
+/* count a terminal of the store, and keep the highest id. a terminal with
+ * types not in the catalog is written again without them
+ */
+static void store_count_terminal(Terminal_Data *t, uint32_t version, void *arg) {
+  Store_Count *sc = arg;
+
+  if (drop_unknown_types(t) > 0) {
+    sc->dropped++;
+    sc->error |= !store_put(t, version);
+  }
+  stats_apply(t, 1);
+  if (t->id > sc->last) {
+    sc->last = t->id;
+  }
+}
+
+/* keep the terminals in an on-disk store (option -D, see store.h) instead
+ * of the table in memory. the store is created with room for capacity
+ * terminals if the file doesn't exist, and it's cache has room for
+ * cache_size. the terminals it has are counted, and new ids start above
+ * theirs. the types not in the catalog are dropped from the store (see
+ * terminal_is_valid()). the table in memory is left as it is, it's back
+ * with terminal_close_store()
+ * it should be called before any other thread uses the table, and not
+ * with terminal_share(), every process would have a cache of it's own
+ * returns false if the store can't be opened
+ */
+bool terminal_open_store(const char *fname, uint32_t capacity, uint32_t cache_size) {
+  Store_Count sc = { 0, 0, false };
+
+  if (!store_open(fname, capacity, cache_size)) {
+    return false;
+  }
+  memset(&Disk_Stats, 0, sizeof(Disk_Stats));
+  Backend = &Disk_Backend;
+  if (!store_scan(store_count_terminal, &sc) || sc.error) {
+    Backend = &Memory_Backend;
+    store_close();
+    return false;
+  }
+  if (sc.dropped > 0) {
+    fprintf(stderr, "terminals: dropped the types not in the catalog from "
+        "%d terminals of %s\n", sc.dropped, fname);
+  }
+  id_lease_reserve(sc.last);
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* go back to the table in memory, with the terminals it had */
+void terminal_close_store(void) {
+  if (Backend != &Disk_Backend) {
+    return;
+  }
+  Backend = &Memory_Backend;
+  store_close();
+  __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+}
+
+/* the name of the backend in use, "memory" or "disk" */
+const char *terminal_backend(void) {
+  return Backend->name;
+}
+
+/* add the table to the memory accounting (see mem.h), once the backend
+ * is chosen. it's static or in shared memory, not from malloc. the disk
+ * backend doesn't use it, the store counts it's cache
+ */
+void terminal_account_memory(void) {
+  size_t index = sizeof(Table->index) + sizeof(Table->profile_index);
+
+  if (Backend != &Memory_Backend) {
+    return;
+  }
+  /* the overflow blocks are counted when they are used */
+  mem_fixed(MEM_STORE, sizeof(Terminal_Table) - index - sizeof(Table->overflow));
+  mem_fixed(MEM_INDEX, index);
+}
+
+/* prepare for encoding to json
+ * this is a helper function that gets a jansson
+ * representation of the terminal data
+*/
+static void types_prepare_json(json_t *json, Terminal_Data *t);
+
+static json_t *terminal_prepare_json(Terminal_Data *t) {
+  json_t *json;
+
+  assert(t != NULL);
+
+  /* initialize the json structure */
+  json = json_object();
+
+  /* add the terminal id */
+  json_object_set_new(json, TERMINAL_ID_JSON, json_integer(t->id));
+
+  types_prepare_json(json, t);
+  return json;
+}
+
+/* add the card and transaction types of a terminal to it's JSON object
+ * a type that's not in the catalog has no name, it's skipped: the table
+ * of a release before, attached in shared memory, is not changed
+ */
+static void types_prepare_json(json_t *json, Terminal_Data *t) {
+  Card_Type *ct;
+  Transaction_Type *tt;
+  int i;
+
+  /* add the card type array */
+  json_t *cta = json_array();
+  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
+    if ((ct = card_type_find_by_id(t->cards[i])) != NULL) {
+      json_array_append_new(cta, json_string(ct->name));
+    }
+  }
+  json_object_set_new(json, CARD_TYPE_JSON, cta);
+
+  /* add the transaction type array */
+  json_t *tta = json_array();
+  for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
+    if ((tt = transaction_type_find_by_id(t->trxs[i])) != NULL) {
+      json_array_append_new(tta, json_string(tt->name));
+    }
+  }
+  json_object_set_new(json, TRANSACTION_TYPE_JSON, tta);
+}
+
+/* the JSON of the profiles, rendered once and spliced after the id of
+ * every terminal that has them, as json_dumps() with JSON_INDENT(1)
+ * would write them: a terminal alone (depth 0) or in an array (depth 1)
+ * fragments are kept by every process, the names of the types depend on
+ * it's catalog. there's one for every profile of the table, by it's id:
+ * a terminal's profile is found with no lock (profile_find()), and the
+ * fragment is checked against the types and the catalog generation
+ * before it's used, a profile that's taken back and reused has other
+ * types. a reader copies a fragment in it's seqlock, and renders it if
+ * it's stale after it takes the seqlock (makes it odd) with a CAS, so
+ * fragments of different profiles are rendered at once. a profile that
+ * doesn't fit is encoded the long way
+ */
+#define PROFILE_JSON_SIZE  1024
+
+typedef struct profile_json {
+  uint32_t seq;
+  uint64_t catalog;       /* generation of the names, 0 if it's empty */
+  card_type_id cards[N_CARDS];
+  transaction_type_id trxs[N_TRXS];
+  uint32_t len[2];
+  char json[2][PROFILE_JSON_SIZE];
+} Profile_Json;
+
+static Profile_Json Profile_Jsons[N_PROFILES];
+
+/* render the fragments of the types of a terminal, at both depths, with
+ * room for PROFILE_JSON_SIZE bytes at each, and their lengths
+ * returns false if they don't fit
+ */
+static bool profile_json_render(Terminal_Data *t, char json[2][PROFILE_JSON_SIZE],
+        uint32_t len[2]) {
+  json_free_t free_fn;
+  json_t *types;
+  size_t n, i, j;
+  char *p;
+  bool st = false;
+
+  types = json_object();
+  types_prepare_json(types, t);
+  p = json_dumps(types, JSON_INDENT(1));
+  json_decref(types);
+
+  /* p is "{\n" and the types, the fragment goes after the id */
+  if (p != NULL && (n = strlen(p)) < PROFILE_JSON_SIZE / 2) {
+    json[0][0] = ',';
+    json[0][1] = '\n';
+    memcpy(json[0] + 2, p + 2, n - 2);
+    len[0] = n;
+    /* one more space of indentation on every line */
+    for (i = 0, j = 0; i < len[0]; i++) {
+      json[1][j++] = json[0][i];
+      if (json[0][i] == '\n') {
+        json[1][j++] = ' ';
+      }
+    }
+    len[1] = j;
+    st = true;
+  }
+  if (p != NULL) {
+    json_get_alloc_funcs(NULL, &free_fn);
+    free_fn(p);
+  }
+  return st;
+}
+
+/* copy the fragment of the types of a terminal, at depth, to buf, that
+ * has room for PROFILE_JSON_SIZE bytes
+ * returns it's length, 0 if there's no fragment for them: the terminal
+ * has no profile in the table, or they don't fit
+ */
+static size_t profile_json_copy(Terminal_Data *t, int depth, char *buf) {
+  Profile_Json *pj;
+  uint64_t catalog;
+  uint32_t id, s, len;
+  bool hit, rendered = false;
+
+  if ((id = profile_find(t, profile_hash(t))) == 0) {
+    return 0;
+  }
+  pj = &Profile_Jsons[id - 1];
+  catalog = catalog_current()->generation;
+  for (;;) {
+    s = seq_read_begin(&pj->seq);
+    len = pj->len[depth];
+    hit = pj->catalog == catalog && len <= PROFILE_JSON_SIZE &&
+      types_match(pj->cards, pj->trxs, t);
+    if (hit) {
+      memcpy(buf, pj->json[depth], len);
+    }
+    if (seq_read_retry(&pj->seq, s)) {
+      continue;
+    }
+    if (hit || rendered) {
+      return hit ? len : 0;
+    }
+    /* the generation is read before the names, so the names are never
+     * older than it. if another thread renders it, it's read again
+     */
+    if (__atomic_compare_exchange_n(&pj->seq, &s, s + 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      pj->catalog = 0;
+      if (profile_json_render(t, pj->json, pj->len)) {
+        types_copy(pj->cards, pj->trxs, t);
+        pj->catalog = catalog;
+      }
+      __atomic_store_n(&pj->seq, s + 2, __ATOMIC_RELEASE);
+      rendered = true;
+    }
+  }
+}
+
+/* encode as json all terminal data
+* the returned pointer must be released by the caller with terminal_free_json()
+*/
+char *terminal_to_json(Terminal_Data *t) {
+  json_malloc_t malloc_fn;
+  uint64_t start;
+  json_t *json;
+  size_t len;
+  char *p;
+  int n;
+
+  assert(t != NULL);
+
+  /* the id, and the fragment of it's profile */
+  start = trace_start();
+  json_get_alloc_funcs(&malloc_fn, NULL);
+  if ((p = malloc_fn(PROFILE_JSON_SIZE + 32)) != NULL) {
+    n = sprintf(p, "{\n \"" TERMINAL_ID_JSON "\": %u", t->id);
+    if ((len = profile_json_copy(t, 0, p + n)) > 0) {
+      p[n + len] = '\0';
+      trace_end("json splice", start);
+      return p;
+    }
+    terminal_free_json(p);
+  }
+
+  /* the long way */
+  json = terminal_prepare_json(t);
+  start = trace_end("json build", start);
+
+  /* generate the json encoded object as a string */
+  p = json_dumps(json, JSON_INDENT(1));
+  trace_end("json dumps", start);
+
+  /* release all memory allocated for json */
+  json_decref(json);
+
+  /* the returned pointer must be released by the caller */
+  return p;
+}
+
+/* encode a terminal as compact json, on a single line, like a line of
+ * NDJSON
+ * the returned pointer must be released by the caller with terminal_free_json()
+ */
+char *terminal_to_json_line(Terminal_Data *t) {
+  json_t *json;
+  char *p;
+
+  json = terminal_prepare_json(t);
+  p = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
+  return p;
+}
+
+/* the fragments of an encoding of many terminals, for the ones with no
+ * profile in the table (the store on disk keeps none): a fragment is
+ * rendered for the first terminal with the types, and copied from there
+ * for the others. it's found by the hash of the types, and it's kept at
+ * most half full
+ */
+#define JSON_MEMO  256
+
+typedef struct json_memo {
+  uint32_t hash;
+  uint32_t len;           /* of the fragment, 0 if the entry is free */
+  size_t at;              /* of the fragment in the encoding */
+  card_type_id cards[N_CARDS];
+  transaction_type_id trxs[N_TRXS];
+} Json_Memo;
+
+/* the encoding of many terminals, as they are given (see
+ * terminal_all_to_json())
+ */
+typedef struct json_scan {
+  Terminal_Scan s;
+  int found;
+  char *p;
+  size_t pos;
+  size_t size;
+  Json_Memo *memo;
+  int memos;
+} Json_Scan;
+
+/* make room for len more bytes in the encoding, it's twice as large when
+ * it grows
+ */
+static bool json_scan_room(Json_Scan *js, size_t len) {
+  json_malloc_t malloc_fn;
+  json_free_t free_fn;
+  size_t size;
+  char *p;
+
+  if (js->pos + len <= js->size) {
+    return true;
+  }
+  for (size = js->size > 0 ? 2 * js->size : 4096; size < js->pos + len; size *= 2) {
+  }
+  json_get_alloc_funcs(&malloc_fn, &free_fn);
+  if ((p = malloc_fn(size)) == NULL) {
+    return false;
+  }
+  if (js->p != NULL) {
+    memcpy(p, js->p, js->pos);
+    free_fn(js->p);
+  }
+  js->p = p;
+  js->size = size;
+  return true;
+}
+
+/* a terminal with no fragment for it's profile, encoded by itself, with
+ * one more space of indentation on every line
+ */
+static bool json_scan_long(Json_Scan *js, Terminal_Data *t) {
+  json_t *json;
+  size_t len, i;
+  char *p;
+  bool st;
+
+  json = terminal_prepare_json(t);
+  p = json_dumps(json, JSON_INDENT(1));
+  json_decref(json);
+  if (p == NULL) {
+    return false;
+  }
+  len = strlen(p);
+  if ((st = json_scan_room(js, 2 * len + 1))) {
+    js->p[js->pos++] = ' ';
+    for (i = 0; i < len; i++) {
+      js->p[js->pos++] = p[i];
+      if (p[i] == '\n') {
+        js->p[js->pos++] = ' ';
+      }
+    }
+  }
+  terminal_free_json(p);
+  return st;
+}
+
+/* copy the fragment of the types of a terminal at depth 1 to buf, the
+ * one of it's profile, or the one in the encoding already for the types
+ * (see Json_Memo)
+ * returns it's length, 0 if they don't fit
+ */
+static size_t json_scan_fragment(Json_Scan *js, Terminal_Data *t, char *buf) {
+  char json[2][PROFILE_JSON_SIZE];
+  uint32_t len[2], hash, h;
+  Json_Memo *m = NULL;
+  size_t n;
+
+  if ((n = profile_json_copy(t, 1, buf)) > 0) {
+    return n;
+  }
+  if (js->memo == NULL) {
+    js->memo = mem_calloc(MEM_SERIALIZER, JSON_MEMO, sizeof(Json_Memo));
+  }
+  hash = profile_hash(t);
+  if (js->memo != NULL) {
+    for (h = hash & (JSON_MEMO - 1); (m = &js->memo[h])->len != 0;
+        h = (h + 1) & (JSON_MEMO - 1)) {
+      if (m->hash == hash && types_match(m->cards, m->trxs, t)) {
+        memcpy(buf, js->p + m->at, m->len);
+        return m->len;
+      }
+    }
+  }
+  if (!profile_json_render(t, json, len)) {
+    return 0;
+  }
+  memcpy(buf, json[1], len[1]);
+  if (m != NULL && js->memos < JSON_MEMO / 2) {
+    m->hash = hash;
+    m->len = len[1];
+    m->at = buf - js->p;
+    types_copy(m->cards, m->trxs, t);
+    js->memos++;
+  }
+  return len[1];
+}
+
+/* release what an encoding has, but the encoding */
+static void json_scan_done(Json_Scan *js) {
+  if (js->memo != NULL) {
+    mem_free(MEM_SERIALIZER, js->memo);
+    js->memo = NULL;
+  }
+}
+
+/* the id of every terminal, and the fragment of it's profile, as
+ * json_dumps() would write the array with JSON_INDENT(1)
+ */
+static bool json_scan_splice(Terminal_Data *t, int n, void *arg) {
+  Json_Scan *js = arg;
+  size_t len, at;
   int i;
 
-  if (id == 0) {
-    return NULL;
+  if (t == NULL) {
+    /* the scan starts over, the fragments written are gone */
+    js->found = 0;
+    js->pos = 0;
+    if (js->memo != NULL) {
+      memset(js->memo, 0, JSON_MEMO * sizeof(Json_Memo));
+    }
+    js->memos = 0;
+    return true;
   }
-
-  for (i = 0; i < N_TERMINALS; i++) {
-    if (Terminals[i].id == id) {
-      return &Terminals[i];
+  for (i = 0; i < n; i++) {
+    if (t[i].id == 0) {
+      continue;
+    }
+    if (js->found++ == js->s.n ||
+        !json_scan_room(js, PROFILE_JSON_SIZE + 32)) {
+      return false;
+    }
+    js->pos += sprintf(js->p + js->pos, "%s", js->found > 1 ? ",\n" : "[\n");
+    at = js->pos;
+    js->pos += sprintf(js->p + js->pos, " {\n  \"" TERMINAL_ID_JSON "\": %u", t[i].id);
+    if ((len = json_scan_fragment(js, &t[i], js->p + js->pos)) > 0) {
+      js->pos += len;
+    } else {
+      js->pos = at;
+      if (!json_scan_long(js, &t[i])) {
+        return false;
+      }
     }
   }
-  return NULL;
+  return true;
 }
 
-/* validate a terminal data information
- * for a terminal to be valid, it has to reference valid cards types
- * as well as valid transaction types
+/* encode as json the whole terminals table, and the generation it's of
+ * (generation can be NULL)
+ * the encoding works on a scan (terminal_scan()), so it sees a single
+ * generation of the table, and the table is not copied for it: the
+ * fragments of the profiles are spliced in a buffer that grows to the
+ * length of the encoding
+ * the returned pointer must be released by the caller with terminal_free_json()
  */
-bool terminal_is_valid(Terminal_Data *t) {
-  int i;
+char *terminal_all_to_json(uint64_t *generation) {
+  Json_Scan js;
+  uint64_t start;
 
-  assert(t != NULL);
-
-  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
-    if (card_type_find_by_id(t->cards[i]) == NULL) {
-      return false;
+  start = trace_start();
+  memset(&js, 0, sizeof(js));
+  if (!terminal_scan(&js.s, json_scan_splice, &js) || js.found != js.s.n ||
+      !json_scan_room(&js, 3)) {
+    json_scan_done(&js);
+    if (js.p != NULL) {
+      terminal_free_json(js.p);
     }
+    return NULL;
   }
-
-  for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
-    if (transaction_type_find_by_id(t->trxs[i]) == NULL) {
-      return false;
-    }
+  json_scan_done(&js);
+  strcpy(js.p + js.pos, js.found > 0 ? "\n]" : "[]");
+  trace_end("json splice", start);
+  if (generation != NULL) {
+    *generation = js.s.generation;
   }
-
-  return true;
+  return js.p;
 }
 
-/* add / insert a new terminal in the terminals table
+/* encode as json an array of terminals, like the result of
+ * terminal_get_many(). empty terminals (id 0) are skipped
+ * the returned pointer must be released by the caller with terminal_free_json()
  */
-bool terminal_add(Terminal_Data *t) {
+char *terminal_array_to_json(Terminal_Data *t, int n) {
+  Json_Scan js;
+  uint64_t start;
   int i;
 
-  assert(t != NULL);
-  /* terminal should be a new terminal */
-  assert(t->id == 0);
-  /* all terminal data should be valid */
-  assert(terminal_is_valid(t));
+  /* the id of every terminal, and the fragment of it's profile */
+  start = trace_start();
+  memset(&js, 0, sizeof(js));
+  for (i = 0; i < n; i++) {
+    js.s.n += (t[i].id != 0);
+  }
+  if (!json_scan_splice(t, n, &js) || !json_scan_room(&js, 3)) {
+    json_scan_done(&js);
+    if (js.p != NULL) {
+      terminal_free_json(js.p);
+    }
+    return NULL;
+  }
+  json_scan_done(&js);
+  strcpy(js.p + js.pos, js.found > 0 ? "\n]" : "[]");
+  trace_end("json splice", start);
+  return js.p;
+}
 
-  /* find an empty slot in the terminals table
-   * this simply scans the whole table looking for an empty slot (id == 0)
-   * a more efficient lookup could be implemented, but that would need a
-   * different representation
-   */
-  for (i = 0; i < N_TERMINALS; i++) {
-    if (Terminals[i].id == 0) {
-      /* empty slot */
+/* set a function that adds to the JSON encoding of the aggregate counters,
+ * so other modules can report their state with them, like replication
+ * it gets the JSON object, and adds members to it
+ */
+void terminal_set_stats_hook(void (*hook)(struct json_t *stats)) {
+  Stats_Hook = hook;
+}
 
-      /* generate a new terminal id for this terminal */
-      t->id = new_terminal_id();
+/* the counters of the disk backend, and the hit rate of it's cache */
+static json_t *store_prepare_json(void) {
+  Store_Stats st;
+  json_t *json, *cache;
+  uint64_t lookups;
 
-      /* copy terminal data to the terminal table */
-      terminal_copy(&Terminals[i], t);
-      return true;
-    }
-  }
+  store_get_stats(&st);
+  lookups = st.hits + st.misses;
 
-  /* can not insert into terminal table.  the table is full */
-  return false;
+  cache = json_object();
+  json_object_set_new(cache, STATS_SIZE_JSON, json_integer(st.cache_size));
+  json_object_set_new(cache, STATS_CACHED_JSON, json_integer(st.cached));
+  json_object_set_new(cache, STATS_HITS_JSON, json_integer(st.hits));
+  json_object_set_new(cache, STATS_MISSES_JSON, json_integer(st.misses));
+  json_object_set_new(cache, STATS_HIT_RATE_JSON,
+      json_real(lookups > 0 ? (double) st.hits / lookups : 0.0));
+  json_object_set_new(cache, STATS_ADMITTED_JSON, json_integer(st.admitted));
+  json_object_set_new(cache, STATS_REJECTED_JSON, json_integer(st.rejected));
+  json_object_set_new(cache, STATS_EVICTIONS_JSON, json_integer(st.evictions));
+
+  json = json_object();
+  json_object_set_new(json, STATS_CAPACITY_JSON, json_integer(st.capacity));
+  json_object_set_new(json, STATS_TERMINALS_JSON, json_integer(st.terminals));
+  json_object_set_new(json, STATS_READS_JSON, json_integer(st.reads));
+  json_object_set_new(json, STATS_WRITES_JSON, json_integer(st.writes));
+  json_object_set_new(json, STATS_DELETED_JSON, json_integer(st.deleted));
+  json_object_set_new(json, STATS_COMPACTIONS_JSON,
+      json_integer(st.compactions));
+  json_object_set_new(json, STATS_CACHE_JSON, cache);
+  return json;
 }
 
-/* prepare for encoding to json
- * this is a helper function that gets a jansson
- * representation of the terminal data
-*/
-static json_t *terminal_prepare_json(Terminal_Data *t) {
+/* encode as json the aggregate counters
+ * { "terminals": 2,
+ *   "CardType": { "Visa": 2, ... },
+ *   "TransactionType": { "Credit": 2, ... },
+ *   "Combinations": { "Visa": { "Credit": 2, ... }, ... } }
+ * with the disk backend, the counters of the store are in "store":
+ *   { "capacity": 1048576, "terminals": 2, "reads": 5, "writes": 2,
+ *     "deleted": 0, "compactions": 0,
+ *     "cache": { "size": 65536, "cached": 2, "hits": 7, "misses": 3,
+ *       "hit_rate": 0.7, "admitted": 2, "rejected": 0, "evictions": 0 } }
+ * the returned pointer must be released by the caller with terminal_free_json()
+ */
+char *terminal_stats_to_json(void) {
+  Terminal_Stats st;
   Card_Type *ct;
   Transaction_Type *tt;
+  json_t *json, *cards, *trxs, *combinations, *by_trx;
   char *p;
-  int i;
-  json_t *json;
+  int i, j;
 
-  assert(terminal_is_valid(t));
+  terminal_get_stats(&st);
 
-  /* initialize the json structure */
   json = json_object();
+  json_object_set_new(json, STATS_TERMINALS_JSON, json_integer(st.terminals));
+  json_object_set_new(json, STATS_PROFILES_JSON, json_integer(st.profiles));
+  json_object_set_new(json, STATS_OVERFLOWS_JSON, json_integer(st.overflows));
 
-  /* add the terminal id */
-  json_object_set(json, TERMINAL_ID_JSON, json_integer(t->id));
+  cards = json_object();
+  combinations = json_object();
+  for (i = 0; (ct = card_type_at(i)) != NULL; i++) {
+    json_object_set_new(cards, ct->name, json_integer(st.cards[i]));
+    by_trx = json_object();
+    for (j = 0; (tt = transaction_type_at(j)) != NULL; j++) {
+      json_object_set_new(by_trx, tt->name, json_integer(st.combinations[i][j]));
+    }
+    json_object_set_new(combinations, ct->name, by_trx);
+  }
 
-  /* add the card type array */
-  json_t *cta = json_array();
-  for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
-    ct = card_type_find_by_id(t->cards[i]);
-    json_array_append(cta, json_string(ct->name));
+  trxs = json_object();
+  for (j = 0; (tt = transaction_type_at(j)) != NULL; j++) {
+    json_object_set_new(trxs, tt->name, json_integer(st.trxs[j]));
   }
-  json_object_set(json, CARD_TYPE_JSON, cta);
 
-  /* add the transaction type array */
-  json_t *tta = json_array();
-  for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
-    tt = transaction_type_find_by_id(t->trxs[i]);
-    json_array_append(tta, json_string(tt->name));
+  json_object_set_new(json, CARD_TYPE_JSON, cards);
+  json_object_set_new(json, TRANSACTION_TYPE_JSON, trxs);
+  json_object_set_new(json, STATS_COMBINATIONS_JSON, combinations);
+  if (Backend == &Disk_Backend) {
+    json_object_set_new(json, STATS_STORE_JSON, store_prepare_json());
+  }
+  if (Stats_Hook != NULL) {
+    Stats_Hook(json);
   }
-  json_object_set(json, TRANSACTION_TYPE_JSON, tta);
 
-  return json;
+  p = json_dumps(json, JSON_INDENT(1));
+  json_decref(json);
+  return p;
 }
 
-/* encode as json all terminal data
-* the returned pointer must be freed by the caller
-*/
-char *terminal_to_json(Terminal_Data *t) {
-  json_t *json;
-  char *p;
+/* names of the change operations in the change feed */
+static const char *Change_Op_Names[] = {
+  "add",
+  "update",
+  "delete"
+};
 
-  assert(terminal_is_valid(t));
+/* prepare for encoding to json a change of the change feed */
+static json_t *change_prepare_json(Terminal_Change *c) {
+  json_t *json;
 
-  json = terminal_prepare_json(t);
+  json = json_object();
+  json_object_set_new(json, CHANGE_SEQ_JSON, json_integer(c->seq));
+  json_object_set_new(json, CHANGE_OP_JSON, json_string(Change_Op_Names[c->op]));
+  json_object_set_new(json, CHANGE_VERSION_JSON, json_integer(c->version));
+  if (c->op == CHANGE_DELETE) {
+    json_object_set_new(json, TERMINAL_ID_JSON, json_integer(c->terminal.id));
+  } else {
+    json_object_set_new(json, CHANGE_TERMINAL_JSON, terminal_prepare_json(&c->terminal));
+  }
+  return json;
+}
 
-  /* generate the json encoded object as a string */
-  p = json_dumps(json, JSON_INDENT(1));
+/* encode as json a change of the change feed
+ * { "seq": 12, "op": "update", "version": 3, "terminal": { ... } }
+ * deletes have the "id" of the terminal instead of the terminal
+ * the returned pointer must be released by the caller with terminal_free_json()
+ */
+char *terminal_change_to_json(Terminal_Change *c) {
+  json_t *json;
+  char *p;
 
-  /* clear all memory allocated for json */
-  json_object_clear(json);
+  assert(c != NULL);
 
-  /* the returned pointer must be freed by the caller */
+  json = change_prepare_json(c);
+  p = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
   return p;
 }
 
-char *terminal_all_to_json(void) {
-  int i;
+/* encode as json a list of changes of the change feed, and the sequence
+ * number to ask for the next ones
+ * { "next": 14, "changes": [ { "seq": 13, ... }, { "seq": 14, ... } ] }
+ * the returned pointer must be released by the caller with terminal_free_json()
+ */
+char *terminal_changes_to_json(Terminal_Change *c, int n, uint64_t next) {
+  json_t *json, *changes;
   char *p;
-  json_t *json;
-
-  /* initialize the json structure */
-  json = json_array();
+  int i;
 
-  for (i = 0; i < N_TERMINALS; i++) {
-    if (Terminals[i].id != 0) {
-      json_array_append(json, terminal_prepare_json(&Terminals[i]));
-    }
+  json = json_object();
+  json_object_set_new(json, CHANGE_NEXT_JSON, json_integer(next));
+  changes = json_array();
+  for (i = 0; i < n; i++) {
+    json_array_append_new(changes, change_prepare_json(&c[i]));
   }
+  json_object_set_new(json, CHANGE_CHANGES_JSON, changes);
 
-  /* generate the json encoded object as a string */
   p = json_dumps(json, JSON_INDENT(1));
+  json_decref(json);
+  return p;
+}
+
+/* encode as json the resync marker of the change feed, for clients that
+ * asked for changes that are not kept anymore
+ * { "resync": true, "next": 5000 }
+ * the client should read the whole table, and ask for changes after next
+ * the returned pointer must be released by the caller with terminal_free_json()
+ */
+char *terminal_resync_to_json(uint64_t next) {
+  json_t *json;
+  char *p;
 
-  /* clear all memory allocated for json */
-  json_object_clear(json);
+  json = json_object();
+  json_object_set_new(json, CHANGE_RESYNC_JSON, json_true());
+  json_object_set_new(json, CHANGE_NEXT_JSON, json_integer(next));
 
+  p = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
   return p;
 }
 
+/* release a string returned by terminal_to_json() or terminal_all_to_json()
+ * the string comes from jansson, and jansson may be configured to use
+ * another allocator (see arena.c), so it's given back with the same
+ * allocator instead of free()
+ */
+void terminal_free_json(char *p) {
+  json_free_t free_fn;
+
+  json_get_alloc_funcs(NULL, &free_fn);
+  free_fn(p);
+}
+
 
 /* decode the received JSON and build the terminal data structure
  * perform validation
  */
 bool terminal_load_json(Terminal_Data *t, const char *input) {
+  return terminal_load_jsonb(t, input, strlen(input));
+}
+
+/* like terminal_load_json(), the input is len bytes and it's not NUL
+ * terminated, like a line of a file
+ */
+bool terminal_load_jsonb(Terminal_Data *t, const char *input, size_t len) {
   int i;
   json_t *json;
   json_error_t json_err;
@@ -243,7 +2903,7 @@ bool terminal_load_json(Terminal_Data *t, const char *input) {
   terminal_init_data(t);
 
   /* initialize the json structure */
-  json = json_loads(input, JSON_DECODE_ANY, &json_err);
+  json = json_loadb(input, len, JSON_DECODE_ANY, &json_err);
   if (json == NULL) {
     /* TODO */
 #if 0
@@ -268,7 +2928,7 @@ bool terminal_load_json(Terminal_Data *t, const char *input) {
       CARD_TYPE_JSON
     );
 #endif
-    json_object_clear(json);
+    json_decref(json);
     return false;
   }
   /* check that every value received in the array
@@ -302,7 +2962,7 @@ bool terminal_load_json(Terminal_Data *t, const char *input) {
       "TransactonType"
     );
 #endif
-    json_object_clear(json);
+    json_decref(json);
     return false;
   }
   /* check that every value received in the array
@@ -326,11 +2986,12 @@ bool terminal_load_json(Terminal_Data *t, const char *input) {
     }
   }
 
-  /* clean all memory allocated for json */
-  json_object_clear(json);
+  /* release all memory allocated for json */
+  json_decref(json);
 
-  /* at this point all terminal data should be valid */
-  assert(terminal_is_valid(t));
+  /* the types were found one by one as they were parsed, the terminal is
+   * checked again by the function that adds it to the table
+   */
 
   /* if any error was seen during JSON parsing, return an error
    * although some data could have been parsed succesfully
@@ -338,9 +2999,313 @@ bool terminal_load_json(Terminal_Data *t, const char *input) {
   return !error_seen;
 }
 
+/* decode the card and transaction type names of a JSON object, like
+ * { "CardType": [ "Visa" ], "TransactionType": [ "Credit" ] }
+ * both arrays are optional. returns false if any name is not valid
+ */
+static bool load_types_json(Terminal_Data *t, json_t *json) {
+  json_t *cta, *tta, *v;
+  size_t i;
+
+  terminal_init_data(t);
+  if (json == NULL) {
+    return true;
+  }
+  if (!json_is_object(json)) {
+    return false;
+  }
+
+  cta = json_object_get(json, CARD_TYPE_JSON);
+  if (cta != NULL) {
+    if (!json_is_array(cta)) {
+      return false;
+    }
+    for (i = 0; i < json_array_size(cta); i++) {
+      v = json_array_get(cta, i);
+      if (!json_is_string(v) || !terminal_add_card_type(t, json_string_value(v))) {
+        return false;
+      }
+    }
+  }
+
+  tta = json_object_get(json, TRANSACTION_TYPE_JSON);
+  if (tta != NULL) {
+    if (!json_is_array(tta)) {
+      return false;
+    }
+    for (i = 0; i < json_array_size(tta); i++) {
+      v = json_array_get(tta, i);
+      if (!json_is_string(v) || !terminal_add_transaction_type(t, json_string_value(v))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* decode the received JSON of a PATCH, the card and transaction types to
+ * add and to remove from a terminal
+ * { "add": { "CardType": [ "Visa" ] },
+ *   "remove": { "CardType": [ "Amex" ], "TransactionType": [ "Cheque" ] } }
+ * every part is optional
+ */
+bool terminal_load_patch_json(Terminal_Data *add, Terminal_Data *remove,
+        const char *input) {
+  json_t *json;
+  json_error_t json_err;
+  bool st;
+
+  assert(add != NULL);
+  assert(remove != NULL);
+
+  terminal_init_data(add);
+  terminal_init_data(remove);
+
+  json = json_loads(input, JSON_DECODE_ANY, &json_err);
+  if (json == NULL) {
+    return false;
+  }
+  st = json_is_object(json) &&
+    load_types_json(add, json_object_get(json, PATCH_ADD_JSON)) &&
+    load_types_json(remove, json_object_get(json, PATCH_REMOVE_JSON));
+
+  /* release all memory allocated for json */
+  json_decref(json);
+  return st;
+}
+
+/* encode a terminal as MessagePack
+ * it's the same map as the JSON encoding, but card and transaction types
+ * are sent as their integer ids instead of their names
+ */
+static void terminal_pack(Msgpack_Buffer *b, Terminal_Data *t) {
+  int i, n;
+
+  msgpack_pack_map(b, 3);
+  msgpack_pack_str(b, TERMINAL_ID_JSON);
+  msgpack_pack_uint(b, t->id);
+
+  for (n = 0; n < N_CARDS && t->cards[n] != 0; n++) {
+    ;
+  }
+  msgpack_pack_str(b, CARD_TYPE_JSON);
+  msgpack_pack_array(b, n);
+  for (i = 0; i < n; i++) {
+    msgpack_pack_uint(b, t->cards[i]);
+  }
+
+  for (n = 0; n < N_TRXS && t->trxs[n] != 0; n++) {
+    ;
+  }
+  msgpack_pack_str(b, TRANSACTION_TYPE_JSON);
+  msgpack_pack_array(b, n);
+  for (i = 0; i < n; i++) {
+    msgpack_pack_uint(b, t->trxs[i]);
+  }
+}
+
+/* encode as MessagePack all terminal data
+ * the returned buffer is a pool buffer, it must be released by the caller
+ * with pool_free()
+ */
+char *terminal_to_msgpack(Terminal_Data *t, size_t *len) {
+  Msgpack_Buffer b;
+
+  assert(t != NULL);
+  assert(len != NULL);
+
+  msgpack_buffer_init(&b, 64);
+  terminal_pack(&b, t);
+  if (b.error) {
+    pool_free(b.data);
+    return NULL;
+  }
+  *len = b.len;
+  return b.data;
+}
+
+/* the encoding of the whole table as it's scanned */
+typedef struct msgpack_scan {
+  Terminal_Scan s;
+  int found;
+  bool started;
+  Msgpack_Buffer b;
+} Msgpack_Scan;
+
+/* the array, with room for the terminals of the scan as a guess, the
+ * buffer grows if it's not enough
+ */
+static void msgpack_scan_start(Msgpack_Scan *ms) {
+  msgpack_buffer_init(&ms->b, 32 * ((size_t) ms->s.n + 1));
+  msgpack_pack_array(&ms->b, ms->s.n);
+  ms->started = true;
+}
+
+static bool msgpack_scan_pack(Terminal_Data *t, int n, void *arg) {
+  Msgpack_Scan *ms = arg;
+  int i;
+
+  if (t == NULL) {
+    /* the scan starts over */
+    if (ms->started) {
+      pool_free(ms->b.data);
+    }
+    ms->started = false;
+    ms->found = 0;
+    return true;
+  }
+  if (!ms->started) {
+    msgpack_scan_start(ms);
+  }
+  for (i = 0; i < n; i++) {
+    if (t[i].id == 0) {
+      continue;
+    }
+    if (ms->found++ == ms->s.n) {
+      return false;
+    }
+    terminal_pack(&ms->b, &t[i]);
+  }
+  return !ms->b.error;
+}
+
+/* encode as MessagePack the whole terminals table, as an array, and the
+ * generation it's of (generation can be NULL)
+ * as terminal_all_to_json(), from a scan
+ * the returned buffer must be released by the caller with pool_free()
+ */
+char *terminal_all_to_msgpack(size_t *len, uint64_t *generation) {
+  Msgpack_Scan ms;
+  bool st;
+
+  assert(len != NULL);
+
+  memset(&ms, 0, sizeof(ms));
+  st = terminal_scan(&ms.s, msgpack_scan_pack, &ms);
+  if (st && !ms.started) {
+    /* no terminals in the store */
+    msgpack_scan_start(&ms);
+  }
+  if (!st || ms.found != ms.s.n || ms.b.error) {
+    if (ms.started) {
+      pool_free(ms.b.data);
+    }
+    return NULL;
+  }
+  *len = ms.b.len;
+  if (generation != NULL) {
+    *generation = ms.s.generation;
+  }
+  return ms.b.data;
+}
+
+/* encode as MessagePack an array of terminals, like the result of
+ * terminal_get_many(). empty terminals (id 0) are skipped
+ * the returned buffer must be released by the caller with pool_free()
+ */
+char *terminal_array_to_msgpack(Terminal_Data *t, int n, size_t *len) {
+  Msgpack_Buffer b;
+  int i, found;
+
+  assert(len != NULL);
+
+  for (found = 0, i = 0; i < n; i++) {
+    if (t[i].id != 0) {
+      found++;
+    }
+  }
+  msgpack_buffer_init(&b, 32 * (found + 1));
+  msgpack_pack_array(&b, found);
+  for (i = 0; i < n; i++) {
+    if (t[i].id != 0) {
+      terminal_pack(&b, &t[i]);
+    }
+  }
+  if (b.error) {
+    pool_free(b.data);
+    return NULL;
+  }
+  *len = b.len;
+  return b.data;
+}
+
+/* decode the received MessagePack and build the terminal data structure
+ * like terminal_load_json(), but card and transaction types are integer ids
+ * perform validation
+ */
+bool terminal_load_msgpack(Terminal_Data *t, const char *input, size_t len) {
+  Msgpack_Reader r;
+  Card_Type *ct;
+  Transaction_Type *tt;
+  const char *key;
+  uint32_t key_len;
+  uint32_t n, m, i;
+  uint64_t id;
+  bool cards_seen = false;
+  bool trxs_seen = false;
+  int error_seen = false;
+
+  assert(t != NULL);
+  assert(input != NULL);
+
+  /* initialize the receiving structure for terminal data */
+  terminal_init_data(t);
+
+  msgpack_reader_init(&r, input, len);
+  if (!msgpack_read_map(&r, &n)) {
+    return false;
+  }
+  while (n-- > 0) {
+    if (!msgpack_read_str(&r, &key, &key_len)) {
+      return false;
+    }
+    if (key_len == strlen(CARD_TYPE_JSON) &&
+        strncmp(key, CARD_TYPE_JSON, key_len) == 0) {
+      if (!msgpack_read_array(&r, &m)) {
+        return false;
+      }
+      cards_seen = true;
+      for (i = 0; i < m; i++) {
+        if (!msgpack_read_uint(&r, &id)) {
+          return false;
+        }
+        /* retired types are kept by the terminals that have them, no
+         * other one can take them
+         */
+        if (id > UINT32_MAX || (ct = card_type_find_by_id(id)) == NULL ||
+            ct->retired || !add_card_type_id(t, id)) {
+          error_seen = true;
+        }
+      }
+    } else if (key_len == strlen(TRANSACTION_TYPE_JSON) &&
+        strncmp(key, TRANSACTION_TYPE_JSON, key_len) == 0) {
+      if (!msgpack_read_array(&r, &m)) {
+        return false;
+      }
+      trxs_seen = true;
+      for (i = 0; i < m; i++) {
+        if (!msgpack_read_uint(&r, &id)) {
+          return false;
+        }
+        if (id > UINT32_MAX || (tt = transaction_type_find_by_id(id)) == NULL ||
+            tt->retired || !add_transaction_type_id(t, id)) {
+          error_seen = true;
+        }
+      }
+    } else if (!msgpack_skip(&r)) {
+      /* other keys, like the id, are ignored */
+      return false;
+    }
+  }
+
+  /* the types were found one by one as they were parsed */
+
+  /* both arrays are required, and any error seen is an error */
+  return cards_seen && trxs_seen && !error_seen;
+}
+
 /* add a card type to this terminal */
 bool terminal_add_card_type(Terminal_Data *t, const char *name) {
-  int i;
   Card_Type *ct;
 
   assert(t != NULL);
@@ -349,9 +3314,17 @@ bool terminal_add_card_type(Terminal_Data *t, const char *name) {
   if ((ct = card_type_find_by_name(name)) == NULL) {
     return false;
   }
+  return add_card_type_id(t, ct->id);
+}
+
+/* add a card type to this terminal, by it's id
+ * the id should be a valid one
+ */
+static bool add_card_type_id(Terminal_Data *t, card_type_id id) {
+  int i;
 
   for (i = 0; i < N_CARDS && t->cards[i] != 0; i++) {
-    if (t->cards[i] == ct->id) {
+    if (t->cards[i] == id) {
       /* value is already present in the array,
        * and should not be duplicated
        */
@@ -366,13 +3339,15 @@ bool terminal_add_card_type(Terminal_Data *t, const char *name) {
   }
 
   /* the card type can be inserted in the relationship */
-  t->cards[i] = ct->id;
+  t->cards[i] = id;
+  if (i + 1 < N_CARDS) {
+    t->cards[i + 1] = 0;
+  }
   return true;
 }
 
 /* add a transaction type to this terminal */
 bool terminal_add_transaction_type(Terminal_Data *t, const char *name) {
-  int i;
   Transaction_Type *tt;
 
   assert(t != NULL);
@@ -381,9 +3356,17 @@ bool terminal_add_transaction_type(Terminal_Data *t, const char *name) {
   if ((tt = transaction_type_find_by_name(name)) == NULL) {
     return false;
   }
+  return add_transaction_type_id(t, tt->id);
+}
+
+/* add a transaction type to this terminal, by it's id
+ * the id should be a valid one
+ */
+static bool add_transaction_type_id(Terminal_Data *t, transaction_type_id id) {
+  int i;
 
   for (i = 0; i < N_TRXS && t->trxs[i] != 0; i++) {
-    if (t->trxs[i] == tt->id) {
+    if (t->trxs[i] == id) {
       /* value is already present in the array,
        * and should not be duplicated
        */
@@ -397,10 +3380,49 @@ bool terminal_add_transaction_type(Terminal_Data *t, const char *name) {
     return false;
   }
 
-  /* the card type can be inserted in the relationship */
-  t->trxs[i] = tt->id;
+  /* the transaction type can be inserted in the relationship */
+  t->trxs[i] = id;
+  if (i + 1 < N_TRXS) {
+    t->trxs[i + 1] = 0;
+  }
   return true;
 }
 
+/* remove a card type from this terminal, by it's id
+ * the last one takes it's place, so the array has no holes
+ */
+static void remove_card_type_id(Terminal_Data *t, card_type_id id) {
+  int i, last;
+
+  for (last = 0; last < N_CARDS && t->cards[last] != 0; last++) {
+    ;
+  }
+  for (i = 0; i < last; i++) {
+    if (t->cards[i] == id) {
+      t->cards[i] = t->cards[last - 1];
+      t->cards[last - 1] = 0;
+      return;
+    }
+  }
+}
+
+/* remove a transaction type from this terminal, by it's id
+ * the last one takes it's place, so the array has no holes
+ */
+static void remove_transaction_type_id(Terminal_Data *t, transaction_type_id id) {
+  int i, last;
+
+  for (last = 0; last < N_TRXS && t->trxs[last] != 0; last++) {
+    ;
+  }
+  for (i = 0; i < last; i++) {
+    if (t->trxs[i] == id) {
+      t->trxs[i] = t->trxs[last - 1];
+      t->trxs[last - 1] = 0;
+      return;
+    }
+  }
+}
+
 
 /* vim: set et sm ai ts=2: */
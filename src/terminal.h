@@ -7,15 +7,20 @@
 #define __TERMINAL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "card_type.h"
 #include "transaction_type.h"
 
-#define N_CARDS 10
-#define N_TRXS  5
+/* a terminal can have every type in the catalog, and a type once */
+#define N_CARDS MAX_CARD_TYPES
+#define N_TRXS  MAX_TRANSACTION_TYPES
 #define N_TERMINALS  1000
 
+/* jansson's JSON values, for functions that add to a JSON encoding */
+struct json_t;
+
 /* have a specific, separate type for ids */
 typedef uint32_t terminal_id;
 
@@ -29,14 +34,12 @@ typedef uint32_t terminal_id;
  *      a 0 in the array marks the end of data, this enables an early stop
  *      in scanning the array for references
  *
- * having an array with a fixed number of slots is:
- * innefficient in space, as you reserve more memory than needed. not used
- * positions still use memory
- * imposes an artificial limit.  when the array is full, no more data can
- * be inserted into it
- *
- * a better implementation would resize the arrays as needed to accomodate
- * new data, using malloc/free/realloc. 
+ * nothing after the 0 is read, and it's not cleared by anything but
+ * terminal_init_data(). the arrays have room for every type of the
+ * catalogs, so there's no limit but the catalogs
+ * it's the type used to pass terminals around, it's not the way they are
+ * kept: the table keeps every distinct set of types once, in a profile
+ * that's as long as the types it has (see Terminal_Slot)
  */
 typedef struct terminal_data {
   terminal_id id;
@@ -45,14 +48,140 @@ typedef struct terminal_data {
 } Terminal_Data;
 
 
+/* a terminal as it's kept in the terminals table
+ * most terminals have one of a handful of combinations of card and
+ * transaction types, so every distinct combination (a profile) is kept
+ * once, with a count of the terminals that have it, and a terminal only
+ * refers to it's profile. it's read back as a Terminal_Data
+ * a profile is a small vector of a cache line, with room for the types
+ * of most terminals in it, the rare terminal with more of them has them
+ * in a block of it's own
+ */
+typedef struct terminal_slot {
+  terminal_id id;         /* 0 if the slot is free */
+  uint32_t profile;       /* 1 and up, 0 if the slot is free */
+} Terminal_Slot;
+
+
+/* a snapshot of the terminals table, at a single generation
+ * terminals has n terminals, in table order. it must not be changed, it's
+ * shared by all the readers of the same generation
+ */
+typedef struct terminal_snapshot {
+  uint64_t generation;
+  uint64_t seq;           /* the last change in the change feed at the snapshot */
+  int refs;               /* readers holding it, and 1 while it's the current one */
+  int n;
+  uint32_t *versions;     /* the version of every terminal */
+  Terminal_Data terminals[];
+} Terminal_Snapshot;
+
+/* a scan of the whole table, at a single generation (see terminal_scan())
+ * it's set before the terminals are given, and again if the scan starts
+ * over, n is how many there are
+ */
+typedef struct terminal_scan {
+  uint64_t generation;
+  uint64_t seq;
+  int n;
+} Terminal_Scan;
+
+
+/* a change to the terminals table, as it's sent in the change feed
+ * (see change_feed.h). terminal is the terminal after the change, a
+ * deleted terminal has only it's id
+ */
+typedef enum change_op {
+  CHANGE_ADD = 0,
+  CHANGE_UPDATE,
+  CHANGE_DELETE
+} Change_Op;
+
+typedef struct terminal_change {
+  uint64_t seq;
+  Change_Op op;
+  uint32_t version;
+  Terminal_Data terminal;
+} Terminal_Change;
+
+
+/* result of the functions that change a terminal */
+typedef enum terminal_status {
+  TERMINAL_OK = 0,
+  TERMINAL_NOT_FOUND,   /* there's no terminal with that id */
+  TERMINAL_CONFLICT,    /* the version of the terminal is not the expected one */
+  TERMINAL_NO_SPACE     /* no room for the types of the terminal */
+} Terminal_Status;
+
+/* version that matches any version of a terminal */
+#define TERMINAL_ANY_VERSION  0
+
+
+/* aggregate counters for the terminals table
+ * card types and transaction types are indexed by their position in the
+ * catalogs, see card_type_index() and transaction_type_index()
+ */
+typedef struct terminal_stats {
+  uint64_t terminals;
+  uint64_t profiles;      /* distinct combinations of types in use */
+  uint64_t overflows;     /* profiles too long for a cache line */
+  uint64_t cards[MAX_CARD_TYPES];
+  uint64_t trxs[MAX_TRANSACTION_TYPES];
+  uint64_t combinations[MAX_CARD_TYPES][MAX_TRANSACTION_TYPES];
+} Terminal_Stats;
+
+
 /* prototypes */
 extern void terminal_init_data(Terminal_Data *t);
-extern Terminal_Data *terminal_find_by_id(terminal_id id);
+extern bool terminal_share(void);
+extern bool terminal_locks_free(int timeout_ms);
+extern bool terminal_repair(void);
+extern bool terminal_open_store(const char *fname, uint32_t capacity,
+        uint32_t cache_size);
+extern void terminal_close_store(void);
+extern const char *terminal_backend(void);
+extern void terminal_account_memory(void);
+extern const Terminal_Slot *terminal_find_by_id(terminal_id id);
+extern bool terminal_get(terminal_id id, Terminal_Data *t);
+extern bool terminal_get_version(terminal_id id, Terminal_Data *t, uint32_t *version);
+extern int terminal_parse_id_list(const char *s, terminal_id *ids, int max);
+extern int terminal_get_many(const terminal_id *ids, int n, Terminal_Data *out);
 extern bool terminal_is_valid(Terminal_Data *t);
 extern bool terminal_add(Terminal_Data *t);
+extern bool terminal_add_version(Terminal_Data *t, uint32_t *version);
+extern int terminal_add_many(Terminal_Data *t, int n);
+extern Terminal_Status terminal_update(terminal_id id, Terminal_Data *t,
+        uint32_t if_version, uint32_t *version);
+extern Terminal_Status terminal_patch(terminal_id id, Terminal_Data *add,
+        Terminal_Data *remove, uint32_t if_version,
+        Terminal_Data *out, uint32_t *version);
+extern Terminal_Status terminal_delete(terminal_id id, uint32_t if_version);
+extern bool terminal_apply_change(Terminal_Change *c);
+extern void terminal_load_snapshot(Terminal_Data *t, uint32_t *versions, int n);
+extern uint64_t terminal_generation(void);
+extern Terminal_Snapshot *terminal_snapshot_acquire(void);
+extern void terminal_snapshot_release(Terminal_Snapshot *snap);
+extern bool terminal_scan(Terminal_Scan *s,
+        bool (*fn)(Terminal_Data *t, int n, void *arg), void *arg);
+extern void terminal_get_stats(Terminal_Stats *st);
+extern void terminal_set_stats_hook(void (*hook)(struct json_t *stats));
+extern char *terminal_stats_to_json(void);
+extern char *terminal_change_to_json(Terminal_Change *c);
+extern char *terminal_changes_to_json(Terminal_Change *c, int n, uint64_t next);
+extern char *terminal_resync_to_json(uint64_t next);
 extern char *terminal_to_json(Terminal_Data *t);
-extern char *terminal_all_to_json(void);
+extern char *terminal_to_json_line(Terminal_Data *t);
+extern char *terminal_all_to_json(uint64_t *generation);
+extern char *terminal_array_to_json(Terminal_Data *t, int n);
+extern void terminal_free_json(char *p);
 extern bool terminal_load_json(Terminal_Data *t, const char *input);
+extern bool terminal_load_jsonb(Terminal_Data *t, const char *input, size_t len);
+extern bool terminal_load_patch_json(Terminal_Data *add, Terminal_Data *remove,
+        const char *input);
+extern char *terminal_to_msgpack(Terminal_Data *t, size_t *len);
+extern char *terminal_all_to_msgpack(size_t *len, uint64_t *generation);
+extern char *terminal_array_to_msgpack(Terminal_Data *t, int n, size_t *len);
+extern bool terminal_load_msgpack(Terminal_Data *t, const char *input, size_t len);
 extern bool terminal_add_card_type(Terminal_Data *t, const char *name);
 extern bool terminal_add_transaction_type(Terminal_Data *t, const char *name);
 
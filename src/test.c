@@ -3,13 +3,49 @@
  *
  */
 
+#include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 
 #include "card_type.h"
 #include "transaction_type.h"
 #include "terminal.h"
+#include "arena.h"
+#include "pool.h"
+#include "compress.h"
+#include "msgpack.h"
+#include "header.h"
+#include "id_lease.h"
+#include "change_feed.h"
+#include "replica.h"
+#include "shm.h"
+#include "handoff.h"
+#include "catalog.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "job_pool.h"
+#include "import.h"
+#include "export.h"
+#include "store.h"
+#include "query.h"
+#include "mem.h"
+#include "jansson.h"
+#include "zlib.h"
 
 
 
@@ -34,6 +70,15 @@ void test_card_type_find_by_id(void) {
   CU_ASSERT(NULL == card_type_find_by_id(8192));
 }
 
+void test_card_type_index(void) {
+  CU_ASSERT(0 == card_type_index(1));
+  CU_ASSERT(4 == card_type_index(5));
+  CU_ASSERT(-1 == card_type_index(8192));
+  CU_ASSERT(1 == card_type_at(0)->id);
+  CU_ASSERT(5 == card_type_at(4)->id);
+  CU_ASSERT(NULL == card_type_at(5));
+}
+
 /* transaction_type tests
  */
 void test_transaction_type_is_valid(void) {
@@ -54,8 +99,40 @@ void test_transaction_type_find_by_id(void) {
   CU_ASSERT(NULL == transaction_type_find_by_id(8192));
 }
 
+void test_transaction_type_index(void) {
+  CU_ASSERT(0 == transaction_type_index(91));
+  CU_ASSERT(3 == transaction_type_index(94));
+  CU_ASSERT(-1 == transaction_type_index(8192));
+  CU_ASSERT(91 == transaction_type_at(0)->id);
+  CU_ASSERT(94 == transaction_type_at(3)->id);
+  CU_ASSERT(NULL == transaction_type_at(4));
+}
+
 /* terminal tests
  */
+
+/* true if two terminals have the same id and types, nothing after the
+ * end of the types counts
+ */
+static bool same_terminal(Terminal_Data *a, Terminal_Data *b) {
+  int i;
+
+  if (a->id != b->id) {
+    return false;
+  }
+  for (i = 0; i < N_CARDS && (a->cards[i] != 0 || b->cards[i] != 0); i++) {
+    if (a->cards[i] != b->cards[i]) {
+      return false;
+    }
+  }
+  for (i = 0; i < N_TRXS && (a->trxs[i] != 0 || b->trxs[i] != 0); i++) {
+    if (a->trxs[i] != b->trxs[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void test_terminal_init_data(void) {
   Terminal_Data t;
   t.id = 1; t.cards[0] = 2; t.trxs[0] = 91;
@@ -70,6 +147,507 @@ void test_terminal_find_by_id(void) {
   CU_ASSERT(NULL == terminal_find_by_id(9876));
 }
 
+void test_terminal_get(void) {
+  Terminal_Data t;
+
+  CU_ASSERT(true == terminal_get(1, &t));
+  CU_ASSERT(1 == t.id);
+  CU_ASSERT(1 == t.cards[0]);
+  CU_ASSERT(false == terminal_get(9876, &t));
+  CU_ASSERT(false == terminal_get(0, &t));
+}
+
+void test_terminal_parse_id_list(void) {
+  terminal_id ids[16];
+
+  CU_ASSERT(5 == terminal_parse_id_list("7,1,3-5,4", ids, 16));
+  CU_ASSERT(1 == ids[0] && 3 == ids[1] && 5 == ids[3] && 7 == ids[4]);
+  CU_ASSERT(1 == terminal_parse_id_list("2", ids, 16));
+  CU_ASSERT(16 == terminal_parse_id_list("1-16", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("1-17", ids, 16));
+
+  /* no empty elements */
+  CU_ASSERT(-1 == terminal_parse_id_list("", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("1,2,", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list(",1", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("1,,2", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list(",", ids, 16));
+
+  CU_ASSERT(-1 == terminal_parse_id_list("0", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("5-3", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("3-", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("1;2", ids, 16));
+  CU_ASSERT(-1 == terminal_parse_id_list("4294967296", ids, 16));
+}
+
+void test_terminal_get_many(void) {
+  Terminal_Data t;
+  Terminal_Data out[4];
+  terminal_id ids[4];
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Amex");
+  terminal_add_transaction_type(&t, "Cheque");
+  CU_ASSERT(true == terminal_add(&t));
+
+  ids[0] = t.id;
+  ids[1] = 9876;
+  ids[2] = 1;
+  ids[3] = 0;
+  CU_ASSERT(2 == terminal_get_many(ids, 4, out));
+  CU_ASSERT(t.id == out[0].id);
+  CU_ASSERT(4 == out[0].cards[0]);
+  CU_ASSERT(0 == out[1].id);
+  CU_ASSERT(1 == out[2].id);
+  CU_ASSERT(0 == out[3].id);
+  CU_ASSERT(0 == terminal_get_many(ids, 0, out));
+}
+
+void test_terminal_get_stats(void) {
+  Terminal_Stats before, after;
+  Terminal_Data t;
+  int visa, amex, credit, cheque;
+
+  visa = card_type_index(1);
+  amex = card_type_index(4);
+  credit = transaction_type_index(93);
+  cheque = transaction_type_index(91);
+
+  terminal_get_stats(&before);
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_card_type(&t, "Amex");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  terminal_get_stats(&after);
+
+  CU_ASSERT(before.terminals + 1 == after.terminals);
+  CU_ASSERT(before.cards[visa] + 1 == after.cards[visa]);
+  CU_ASSERT(before.cards[amex] + 1 == after.cards[amex]);
+  CU_ASSERT(before.trxs[credit] + 1 == after.trxs[credit]);
+  CU_ASSERT(before.trxs[cheque] == after.trxs[cheque]);
+  CU_ASSERT(before.combinations[visa][credit] + 1 == after.combinations[visa][credit]);
+  CU_ASSERT(before.combinations[amex][credit] + 1 == after.combinations[amex][credit]);
+  CU_ASSERT(before.combinations[visa][cheque] == after.combinations[visa][cheque]);
+}
+
+void test_terminal_add_version(void) {
+  Terminal_Data t, u;
+  uint32_t v1, v2;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add_version(&t, &v1));
+  CU_ASSERT(0 != v1);
+  CU_ASSERT(true == terminal_get_version(t.id, &u, &v2));
+  CU_ASSERT(v1 == v2);
+
+  /* the slot is used again, with the versions after the ones it had */
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Amex");
+  terminal_add_transaction_type(&t, "Savings");
+  CU_ASSERT(true == terminal_add_version(&t, &v1));
+  CU_ASSERT(true == terminal_get_version(t.id, &u, &v2));
+  CU_ASSERT(v1 == v2);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, v1));
+}
+
+void test_terminal_update(void) {
+  Terminal_Data t, u;
+  uint32_t v1, v2;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  CU_ASSERT(true == terminal_get_version(t.id, &u, &v1));
+  CU_ASSERT(0 != v1);
+
+  terminal_init_data(&u);
+  terminal_add_card_type(&u, "Amex");
+  terminal_add_transaction_type(&u, "Savings");
+  CU_ASSERT(TERMINAL_OK == terminal_update(t.id, &u, v1, &v2));
+  CU_ASSERT(t.id == u.id);
+  CU_ASSERT(v1 != v2);
+  CU_ASSERT(true == terminal_get(t.id, &u));
+  CU_ASSERT(4 == u.cards[0]);
+  CU_ASSERT(0 == u.cards[1]);
+  CU_ASSERT(92 == u.trxs[0]);
+
+  /* stale version */
+  CU_ASSERT(TERMINAL_CONFLICT == terminal_update(t.id, &u, v1, NULL));
+  CU_ASSERT(TERMINAL_OK == terminal_update(t.id, &u, TERMINAL_ANY_VERSION, NULL));
+  CU_ASSERT(TERMINAL_NOT_FOUND == terminal_update(9876, &u, TERMINAL_ANY_VERSION, NULL));
+}
+
+void test_terminal_patch(void) {
+  Terminal_Data t, add, remove, out;
+  uint32_t v1, v2;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_card_type(&t, "Amex");
+  terminal_add_card_type(&t, "JBC");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  CU_ASSERT(true == terminal_get_version(t.id, &out, &v1));
+
+  terminal_init_data(&add);
+  terminal_init_data(&remove);
+  terminal_add_card_type(&add, "EFTPOS");
+  terminal_add_card_type(&remove, "Visa");
+  terminal_add_transaction_type(&remove, "Credit");
+  CU_ASSERT(TERMINAL_OK == terminal_patch(t.id, &add, &remove, v1, &out, &v2));
+  CU_ASSERT(v1 != v2);
+  /* the last card type takes the place of the removed one */
+  CU_ASSERT(5 == out.cards[0]);
+  CU_ASSERT(4 == out.cards[1]);
+  CU_ASSERT(3 == out.cards[2]);
+  CU_ASSERT(0 == out.cards[3]);
+  CU_ASSERT(0 == out.trxs[0]);
+  CU_ASSERT(true == terminal_get(t.id, &t));
+  CU_ASSERT(true == same_terminal(&t, &out));
+
+  CU_ASSERT(TERMINAL_CONFLICT == terminal_patch(t.id, &add, &remove, v1, NULL, NULL));
+  CU_ASSERT(TERMINAL_NOT_FOUND == terminal_patch(9876, &add, &remove,
+              TERMINAL_ANY_VERSION, NULL, NULL));
+
+  /* types already there are not duplicated */
+  terminal_init_data(&remove);
+  CU_ASSERT(TERMINAL_OK == terminal_patch(t.id, &add, &remove,
+              TERMINAL_ANY_VERSION, &out, NULL));
+  CU_ASSERT(5 == out.cards[0]);
+  CU_ASSERT(0 == out.cards[3]);
+}
+
+void test_terminal_delete(void) {
+  Terminal_Data a, b, c, t;
+  const Terminal_Slot *p;
+  terminal_id ids[200];
+  uint32_t v;
+  int i, wrong;
+
+  terminal_init_data(&a);
+  terminal_add_card_type(&a, "Visa");
+  terminal_add_transaction_type(&a, "Cheque");
+  b = a;
+  c = a;
+  CU_ASSERT(true == terminal_add(&a));
+  CU_ASSERT(true == terminal_add(&b));
+  p = terminal_find_by_id(a.id);
+  CU_ASSERT(true == terminal_get_version(a.id, &t, &v));
+
+  CU_ASSERT(TERMINAL_CONFLICT == terminal_delete(a.id, v + 1));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(a.id, v));
+  CU_ASSERT(false == terminal_get(a.id, &t));
+  CU_ASSERT(TERMINAL_NOT_FOUND == terminal_delete(a.id, TERMINAL_ANY_VERSION));
+  CU_ASSERT(true == terminal_get(b.id, &t));
+
+  /* the slot is reused, with a new id and a new version */
+  CU_ASSERT(true == terminal_add(&c));
+  CU_ASSERT(c.id != a.id);
+  CU_ASSERT(p == terminal_find_by_id(c.id));
+  CU_ASSERT(true == terminal_get_version(c.id, &t, &v));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(c.id, v));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(b.id, TERMINAL_ANY_VERSION));
+
+  /* the index still finds every terminal after deleting every other one */
+  for (i = 0; i < 200; i++) {
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, "Visa");
+    terminal_add(&t);
+    ids[i] = t.id;
+  }
+  for (i = 0; i < 200; i += 2) {
+    CU_ASSERT(TERMINAL_OK == terminal_delete(ids[i], TERMINAL_ANY_VERSION));
+  }
+  for (i = 0, wrong = 0; i < 200; i++) {
+    if (terminal_get(ids[i], &t) != (i % 2 == 1)) {
+      wrong++;
+    }
+  }
+  CU_ASSERT(0 == wrong);
+  for (i = 1; i < 200; i += 2) {
+    CU_ASSERT(TERMINAL_OK == terminal_delete(ids[i], TERMINAL_ANY_VERSION));
+  }
+}
+
+void test_terminal_profiles(void) {
+  Terminal_Data a, b, c, d, add, remove;
+  Terminal_Stats st;
+  uint64_t before;
+
+  terminal_get_stats(&st);
+  before = st.profiles;
+
+  /* terminals with the same types share a profile */
+  terminal_init_data(&a);
+  terminal_add_card_type(&a, "JBC");
+  terminal_add_card_type(&a, "EFTPOS");
+  terminal_add_transaction_type(&a, "Other");
+  b = a;
+  c = a;
+  CU_ASSERT(true == terminal_add(&a));
+  CU_ASSERT(true == terminal_add(&b));
+  CU_ASSERT(true == terminal_add(&c));
+  terminal_get_stats(&st);
+  CU_ASSERT(before + 1 == st.profiles);
+
+  terminal_init_data(&d);
+  terminal_add_card_type(&d, "JBC");
+  terminal_add_transaction_type(&d, "Other");
+  CU_ASSERT(true == terminal_add(&d));
+  terminal_get_stats(&st);
+  CU_ASSERT(before + 2 == st.profiles);
+
+  /* moving terminals between profiles that are there adds none */
+  add = d;
+  CU_ASSERT(TERMINAL_OK == terminal_update(a.id, &add, TERMINAL_ANY_VERSION, NULL));
+  terminal_init_data(&add);
+  terminal_init_data(&remove);
+  terminal_add_card_type(&remove, "EFTPOS");
+  CU_ASSERT(TERMINAL_OK == terminal_patch(b.id, &add, &remove,
+              TERMINAL_ANY_VERSION, NULL, NULL));
+  terminal_get_stats(&st);
+  CU_ASSERT(before + 2 == st.profiles);
+  CU_ASSERT(true == terminal_get(b.id, &b));
+  add = d;
+  add.id = b.id;
+  CU_ASSERT(true == same_terminal(&b, &add));
+
+  /* the last one with a profile drops it */
+  CU_ASSERT(TERMINAL_OK == terminal_delete(c.id, TERMINAL_ANY_VERSION));
+  terminal_get_stats(&st);
+  CU_ASSERT(before + 1 == st.profiles);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(a.id, TERMINAL_ANY_VERSION));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(b.id, TERMINAL_ANY_VERSION));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(d.id, TERMINAL_ANY_VERSION));
+  terminal_get_stats(&st);
+  CU_ASSERT(before == st.profiles);
+}
+
+void test_terminal_snapshot_acquire(void) {
+  Terminal_Snapshot *s1, *s2;
+  Terminal_Data t, u;
+  int i, found;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+
+  /* readers of the same generation share the snapshot */
+  s1 = terminal_snapshot_acquire();
+  CU_ASSERT(s1 != NULL);
+  s2 = terminal_snapshot_acquire();
+  CU_ASSERT(s1 == s2);
+  terminal_snapshot_release(s2);
+  CU_ASSERT(s1->generation == terminal_generation());
+
+  /* a writer changes the table, not the snapshot */
+  terminal_init_data(&u);
+  terminal_add_card_type(&u, "Amex");
+  terminal_add_transaction_type(&u, "Savings");
+  CU_ASSERT(TERMINAL_OK == terminal_update(t.id, &u, TERMINAL_ANY_VERSION, NULL));
+  for (i = 0, found = 0; i < s1->n; i++) {
+    if (s1->terminals[i].id == t.id) {
+      found++;
+      CU_ASSERT(1 == s1->terminals[i].cards[0]);
+    }
+  }
+  CU_ASSERT(1 == found);
+  CU_ASSERT(s1->generation != terminal_generation());
+
+  /* a new reader gets the new generation */
+  s2 = terminal_snapshot_acquire();
+  CU_ASSERT(s1 != s2);
+  CU_ASSERT(s2->generation == terminal_generation());
+  for (i = 0; i < s2->n; i++) {
+    if (s2->terminals[i].id == t.id) {
+      CU_ASSERT(4 == s2->terminals[i].cards[0]);
+    }
+  }
+  terminal_snapshot_release(s1);
+  terminal_snapshot_release(s2);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+}
+
+void test_terminal_apply_change(void) {
+  Terminal_Change c;
+  Terminal_Data t;
+  uint32_t version;
+
+  /* a change from the primary, with it's id and version */
+  memset(&c, 0, sizeof(c));
+  terminal_init_data(&c.terminal);
+  c.op = CHANGE_ADD;
+  c.version = 5;
+  c.terminal.id = 4000000001u;
+  terminal_add_card_type(&c.terminal, "Visa");
+  CU_ASSERT(true == terminal_apply_change(&c));
+  CU_ASSERT(true == terminal_get_version(c.terminal.id, &t, &version));
+  CU_ASSERT(5 == version);
+  CU_ASSERT(1 == t.cards[0]);
+
+  c.op = CHANGE_UPDATE;
+  c.version = 6;
+  terminal_add_card_type(&c.terminal, "Amex");
+  CU_ASSERT(true == terminal_apply_change(&c));
+  CU_ASSERT(true == terminal_get_version(c.terminal.id, &t, &version));
+  CU_ASSERT(6 == version);
+  CU_ASSERT(0 != t.cards[1]);
+
+  /* deleting twice is not an error, the change was already applied */
+  c.op = CHANGE_DELETE;
+  c.version = 7;
+  CU_ASSERT(true == terminal_apply_change(&c));
+  CU_ASSERT(false == terminal_get(c.terminal.id, &t));
+  CU_ASSERT(true == terminal_apply_change(&c));
+}
+
+void test_terminal_load_snapshot(void) {
+  Terminal_Snapshot *old, *snap;
+  Terminal_Data t[2];
+  uint32_t versions[2] = { 3, 9 };
+  Terminal_Stats st;
+
+  old = terminal_snapshot_acquire();
+  CU_ASSERT(old != NULL);
+  CU_ASSERT(old->seq == change_feed_last_seq());
+
+  terminal_init_data(&t[0]);
+  t[0].id = 4000000002u;
+  terminal_add_card_type(&t[0], "Visa");
+  terminal_init_data(&t[1]);
+  t[1].id = 4000000003u;
+  terminal_add_card_type(&t[1], "Amex");
+  terminal_load_snapshot(t, versions, 2);
+
+  snap = terminal_snapshot_acquire();
+  CU_ASSERT(2 == snap->n);
+  CU_ASSERT(9 == snap->versions[1]);
+  CU_ASSERT(4000000003u == snap->terminals[1].id);
+  terminal_snapshot_release(snap);
+  terminal_get_stats(&st);
+  CU_ASSERT(2 == st.terminals);
+  CU_ASSERT(true == terminal_get(4000000002u, &t[0]));
+
+  /* put the table back, for the other tests */
+  terminal_load_snapshot(old->terminals, old->versions, old->n);
+  terminal_snapshot_release(old);
+  CU_ASSERT(false == terminal_get(4000000002u, &t[0]));
+}
+
+/* two contents, a reader should always see one of them, never a mix */
+static void *flip_writer(void *arg) {
+  Terminal_Data *t = arg;
+  Terminal_Data a, b;
+  int i;
+
+  terminal_init_data(&a);
+  terminal_add_card_type(&a, "Visa");
+  terminal_add_transaction_type(&a, "Credit");
+  terminal_init_data(&b);
+  terminal_add_card_type(&b, "Amex");
+  terminal_add_card_type(&b, "MasterCard");
+  terminal_add_transaction_type(&b, "Savings");
+  for (i = 0; i < 20000; i++) {
+    terminal_update(t->id, (i & 1) ? &a : &b, TERMINAL_ANY_VERSION, NULL);
+  }
+  return NULL;
+}
+
+void test_terminal_get_concurrent(void) {
+  pthread_t thread;
+  Terminal_Data t, r;
+  int i, torn = 0, missing = 0;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+
+  /* reads take no lock, they try again while the writer changes the slot */
+  pthread_create(&thread, NULL, flip_writer, &t);
+  for (i = 0; i < 200000; i++) {
+    if (!terminal_get(t.id, &r)) {
+      missing++;
+    } else if ((r.cards[0] == 1) != (r.cards[1] == 0) ||
+        (r.cards[0] == 1) != (r.trxs[0] == t.trxs[0])) {
+      torn++;
+    }
+  }
+  pthread_join(thread, NULL);
+  CU_ASSERT(0 == missing);
+  CU_ASSERT(0 == torn);
+}
+
+#define PROFILE_THREADS    4
+#define PROFILE_TERMINALS  8
+
+/* move terminals of it's own between the same few profiles as the other
+ * threads, so the references of a profile go up and down at once, and
+ * the last one is often let go
+ */
+static void *profile_writer(void *arg) {
+  terminal_id *ids = arg;
+  Terminal_Data t;
+  int i;
+
+  for (i = 0; i < 4000; i++) {
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, (i % 3 == 0) ? "EFTPOS" : "JBC");
+    terminal_add_transaction_type(&t, (i % 2 == 0) ? "Cheque" : "Savings");
+    terminal_update(ids[i % PROFILE_TERMINALS], &t, TERMINAL_ANY_VERSION, NULL);
+  }
+  return NULL;
+}
+
+void test_terminal_profiles_concurrent(void) {
+  static terminal_id ids[PROFILE_THREADS * PROFILE_TERMINALS];
+  pthread_t threads[PROFILE_THREADS];
+  Terminal_Stats st;
+  Terminal_Data t;
+  uint64_t before;
+  int i;
+
+  terminal_get_stats(&st);
+  before = st.profiles;
+  for (i = 0; i < PROFILE_THREADS * PROFILE_TERMINALS; i++) {
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, "JBC");
+    terminal_add_transaction_type(&t, "Other");
+    CU_ASSERT(true == terminal_add(&t));
+    ids[i] = t.id;
+  }
+
+  /* profiles are taken and let go with no lock, but to make one or take
+   * one back: none is lost, or taken back while it's used
+   */
+  for (i = 0; i < PROFILE_THREADS; i++) {
+    pthread_create(&threads[i], NULL, profile_writer, &ids[i * PROFILE_TERMINALS]);
+  }
+  for (i = 0; i < PROFILE_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  /* the last update of a terminal is i = 3992 + it's index: JBC or
+   * EFTPOS, with Cheque or Savings
+   */
+  for (i = 0; i < PROFILE_THREADS * PROFILE_TERMINALS; i++) {
+    CU_ASSERT(true == terminal_get(ids[i], &t));
+    CU_ASSERT(0 != t.cards[0] && 0 == t.cards[1] && 0 != t.trxs[0] && 0 == t.trxs[1]);
+  }
+  terminal_get_stats(&st);
+  CU_ASSERT(before + 4 == st.profiles);
+  for (i = 0; i < PROFILE_THREADS * PROFILE_TERMINALS; i++) {
+    CU_ASSERT(TERMINAL_OK == terminal_delete(ids[i], TERMINAL_ANY_VERSION));
+  }
+  terminal_get_stats(&st);
+  CU_ASSERT(before == st.profiles);
+}
+
 void test_terminal_is_valid(void) {
   Terminal_Data t;
   terminal_init_data(&t);
@@ -118,7 +696,31 @@ void test_terminal_to_json(void) {
   actual = terminal_to_json(&t);
   CU_ASSERT(NULL != actual);
   CU_ASSERT_STRING_EQUAL(actual, expected);
-  free(actual);
+  terminal_free_json(actual);
+}
+
+void test_terminal_array_to_json(void) {
+  Terminal_Data t[3];
+  char *actual;
+  char *expected = "[\n\
+ {\n\
+  \"id\": 5,\n\
+  \"CardType\": [\n\
+   \"Visa\"\n\
+  ],\n\
+  \"TransactionType\": []\n\
+ }\n\
+]";
+
+  terminal_init_data(&t[0]);
+  terminal_init_data(&t[1]);
+  t[1].id = 5;
+  terminal_add_card_type(&t[1], "Visa");
+  terminal_init_data(&t[2]);
+  actual = terminal_array_to_json(t, 3);
+  CU_ASSERT(NULL != actual);
+  CU_ASSERT_STRING_EQUAL(actual, expected);
+  terminal_free_json(actual);
 }
 
 void test_terminal_load_json(void) {
@@ -200,30 +802,3129 @@ void test_terminal_load_json(void) {
   terminal_init_data(&t);
   CU_ASSERT(false == terminal_load_json(&t, input));
 }
+void test_terminal_load_patch_json(void) {
+  Terminal_Data add, remove;
+
+  CU_ASSERT(true == terminal_load_patch_json(&add, &remove,
+        "{\"add\": {\"CardType\": [\"Visa\"]},"
+        " \"remove\": {\"CardType\": [\"Amex\"], \"TransactionType\": [\"Cheque\"]}}"));
+  CU_ASSERT(1 == add.cards[0]);
+  CU_ASSERT(0 == add.trxs[0]);
+  CU_ASSERT(4 == remove.cards[0]);
+  CU_ASSERT(91 == remove.trxs[0]);
+
+  CU_ASSERT(true == terminal_load_patch_json(&add, &remove, "{}"));
+  CU_ASSERT(0 == add.cards[0]);
+  CU_ASSERT(false == terminal_load_patch_json(&add, &remove,
+        "{\"add\": {\"CardType\": [\"Diners\"]}}"));
+  CU_ASSERT(false == terminal_load_patch_json(&add, &remove,
+        "{\"remove\": {\"CardType\": \"Visa\"}}"));
+  CU_ASSERT(false == terminal_load_patch_json(&add, &remove, "[]"));
+  CU_ASSERT(false == terminal_load_patch_json(&add, &remove, "{"));
+}
+
+void test_terminal_to_msgpack(void) {
+  Terminal_Data t;
+  char *actual;
+  size_t len;
+  /* { "id": 1, "CardType": [ 1, 2 ], "TransactionType": [ 93, 92 ] } */
+  char expected[] = "\x83\xa2id\x01\xa8" "CardType\x92\x01\x02"
+    "\xafTransactionType\x92\x5d\x5c";
+
+  terminal_init_data(&t);
+  t.id = 1;
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_card_type(&t, "MasterCard");
+  terminal_add_transaction_type(&t, "Credit");
+  terminal_add_transaction_type(&t, "Savings");
+  actual = terminal_to_msgpack(&t, &len);
+  CU_ASSERT(NULL != actual);
+  CU_ASSERT(sizeof(expected) - 1 == len);
+  CU_ASSERT(0 == memcmp(actual, expected, len));
+  pool_free(actual);
+}
+
+void test_terminal_load_msgpack(void) {
+  Terminal_Data t;
+  /* { "id": 7, "CardType": [ 1, 2 ], "TransactionType": [ 93 ] } */
+  char valid[] = "\x83\xa2id\x07\xa8" "CardType\x92\x01\x02"
+    "\xafTransactionType\x91\x5d";
+  /* missing TransactionType */
+  char missing[] = "\x81\xa8" "CardType\x92\x01\x02";
+  /* card type 8192 doesn't exist */
+  char invalid[] = "\x82\xa8" "CardType\x91\xcd\x20\x00"
+    "\xafTransactionType\x91\x5d";
+  /* truncated */
+  char truncated[] = "\x83\xa2id\x07\xa8" "CardType\x92\x01";
+
+  CU_ASSERT(true == terminal_load_msgpack(&t, valid, sizeof(valid) - 1));
+  CU_ASSERT(0 == t.id);
+  CU_ASSERT(1 == t.cards[0]);
+  CU_ASSERT(2 == t.cards[1]);
+  CU_ASSERT(93 == t.trxs[0]);
+  CU_ASSERT(0 == t.trxs[1]);
+  CU_ASSERT(false == terminal_load_msgpack(&t, missing, sizeof(missing) - 1));
+  CU_ASSERT(false == terminal_load_msgpack(&t, invalid, sizeof(invalid) - 1));
+  CU_ASSERT(false == terminal_load_msgpack(&t, truncated, sizeof(truncated) - 1));
+  CU_ASSERT(false == terminal_load_msgpack(&t, "{xxx]", 5));
+}
+
+
+/* arena tests
+ */
+void test_arena_malloc(void) {
+  Arena_Stats st;
+  char *a, *b;
+
+  a = arena_malloc(10);
+  b = arena_malloc(100);
+  CU_ASSERT(NULL != a);
+  CU_ASSERT(NULL != b);
+  CU_ASSERT(0 == ((size_t) a & 15));
+  CU_ASSERT(0 == ((size_t) b & 15));
+  CU_ASSERT(a != b);
+  arena_get_stats(&st);
+  CU_ASSERT(st.bytes_in_use >= 110);
+
+  /* bigger than a chunk */
+  CU_ASSERT(NULL != arena_malloc(1024 * 1024));
+}
+
+void test_arena_reset(void) {
+  Arena_Stats st;
+  size_t chunk_allocs;
+
+  arena_reset();
+  arena_get_stats(&st);
+  CU_ASSERT(0 == st.bytes_in_use);
+
+  /* after a reset, memory is reused without new chunks */
+  arena_malloc(100);
+  arena_reset();
+  arena_get_stats(&st);
+  chunk_allocs = st.chunk_allocs;
+  arena_malloc(100);
+  arena_reset();
+  arena_malloc(100);
+  arena_get_stats(&st);
+  CU_ASSERT(chunk_allocs == st.chunk_allocs);
+  arena_reset();
+}
+
+/* pool tests
+ */
+void test_pool_alloc(void) {
+  Pool_Stats st;
+  size_t hits;
+  char *p, *q;
+
+  p = pool_alloc(100);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(pool_size(p) >= 100);
+  pool_free(p);
+
+  /* a freed buffer is reused by the same size class */
+  pool_get_stats(&st);
+  hits = st.hits;
+  q = pool_alloc(200);
+  CU_ASSERT(p == q);
+  pool_get_stats(&st);
+  CU_ASSERT(hits + 1 == st.hits);
+  pool_free(q);
+
+  /* too big for the pools */
+  p = pool_alloc(8 * 1024 * 1024);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(pool_size(p) >= 8 * 1024 * 1024);
+  pool_free(p);
+}
+
+void test_pool_realloc(void) {
+  char *p;
+
+  p = pool_alloc(10);
+  strcpy(p, "terminals");
+  p = pool_realloc(p, 100 * 1024);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(pool_size(p) >= 100 * 1024);
+  CU_ASSERT_STRING_EQUAL(p, "terminals");
+  pool_free(p);
+}
+
+/* compress tests
+ */
+void test_compress_negotiate(void) {
+  compress_configure(COMPRESS_DEFAULT_LEVEL, 100);
+  CU_ASSERT(ENCODING_IDENTITY == compress_negotiate(NULL, 1000));
+  CU_ASSERT(ENCODING_GZIP == compress_negotiate("gzip", 1000));
+  CU_ASSERT(ENCODING_GZIP == compress_negotiate("gzip, deflate", 1000));
+  CU_ASSERT(ENCODING_DEFLATE == compress_negotiate("deflate, gzip;q=0.5", 1000));
+  CU_ASSERT(ENCODING_DEFLATE == compress_negotiate("br, DEFLATE", 1000));
+  CU_ASSERT(ENCODING_IDENTITY == compress_negotiate("gzip;q=0", 1000));
+  CU_ASSERT(ENCODING_IDENTITY == compress_negotiate("br, identity", 1000));
+  /* too small to compress */
+  CU_ASSERT(ENCODING_IDENTITY == compress_negotiate("gzip", 10));
+  /* compression disabled */
+  compress_configure(0, 100);
+  CU_ASSERT(ENCODING_IDENTITY == compress_negotiate("gzip", 1000));
+  compress_configure(COMPRESS_DEFAULT_LEVEL, COMPRESS_DEFAULT_MIN_SIZE);
+}
+
+void test_compress_buffer(void) {
+  char input[BUFSIZ];
+  char output[BUFSIZ];
+  uLongf output_len = sizeof(output);
+  size_t len;
+  char *p;
+  int i;
+
+  input[0] = '\0';
+  for (i = 0; i < 100; i++) {
+    strcat(input, "{ \"id\": 1 }");
+  }
+
+  p = compress_buffer(input, strlen(input), ENCODING_DEFLATE, &len);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(len < strlen(input));
+  CU_ASSERT(Z_OK == uncompress((Bytef *) output, &output_len, (Bytef *) p, len));
+  CU_ASSERT(strlen(input) == output_len);
+  CU_ASSERT(0 == memcmp(input, output, output_len));
+  pool_free(p);
+
+  p = compress_buffer(input, strlen(input), ENCODING_GZIP, &len);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(len < strlen(input));
+  /* gzip magic */
+  CU_ASSERT(0x1f == (unsigned char) p[0]);
+  CU_ASSERT(0x8b == (unsigned char) p[1]);
+  pool_free(p);
+}
+
+/* msgpack tests
+ */
+void test_msgpack_pack(void) {
+  Msgpack_Buffer b;
+  char expected[] = "\x92\x7f\xcc\x80\xcd\x01\x00\xce\x00\x01\x00\x00"
+    "\xa3" "abc";
+
+  msgpack_buffer_init(&b, 1);
+  msgpack_pack_array(&b, 2);
+  msgpack_pack_uint(&b, 127);
+  msgpack_pack_uint(&b, 128);
+  msgpack_pack_uint(&b, 256);
+  msgpack_pack_uint(&b, 65536);
+  msgpack_pack_str(&b, "abc");
+  CU_ASSERT(false == b.error);
+  CU_ASSERT(sizeof(expected) - 1 == b.len);
+  CU_ASSERT(0 == memcmp(b.data, expected, b.len));
+  pool_free(b.data);
+}
+
+void test_msgpack_read(void) {
+  Msgpack_Reader r;
+  const char *s;
+  uint32_t n, len;
+  uint64_t v;
+  /* [ 300, "abc", { 1: nil }, -1, 1.5 ] */
+  char input[] = "\x95\xcd\x01\x2c\xa3" "abc\x81\x01\xc0\xff"
+    "\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00";
+
+  msgpack_reader_init(&r, input, sizeof(input) - 1);
+  CU_ASSERT(false == msgpack_read_map(&r, &n));
+  CU_ASSERT(true == msgpack_read_array(&r, &n));
+  CU_ASSERT(5 == n);
+  CU_ASSERT(false == msgpack_read_str(&r, &s, &len));
+  CU_ASSERT(true == msgpack_read_uint(&r, &v));
+  CU_ASSERT(300 == v);
+  CU_ASSERT(true == msgpack_read_str(&r, &s, &len));
+  CU_ASSERT(3 == len);
+  CU_ASSERT(0 == strncmp(s, "abc", 3));
+  CU_ASSERT(true == msgpack_skip(&r));
+  CU_ASSERT(false == msgpack_read_uint(&r, &v));
+  CU_ASSERT(true == msgpack_skip(&r));
+  CU_ASSERT(true == msgpack_skip(&r));
+  CU_ASSERT(false == msgpack_skip(&r));
+}
+
+/* header tests
+ */
+void test_header_quality(void) {
+  CU_ASSERT(-1.0 == header_quality(NULL, "gzip"));
+  CU_ASSERT(1.0 == header_quality("gzip", "gzip"));
+  CU_ASSERT(1.0 == header_quality("deflate, GZIP", "gzip"));
+  CU_ASSERT(0.5 == header_quality("deflate, gzip;q=0.5", "gzip"));
+  CU_ASSERT(0.5 == header_quality("text/html;level=1;q=0.5", "text/html"));
+  CU_ASSERT(-1.0 == header_quality("gzip", "deflate"));
+  CU_ASSERT(-1.0 == header_quality("application/jsonx", "application/json"));
+}
+
+void test_header_range(void) {
+  uint64_t first = 0, last = 0;
+
+  CU_ASSERT(HEADER_RANGE_OK == header_range("bytes=100-199", 1000, &first, &last));
+  CU_ASSERT(100 == first && 199 == last);
+  CU_ASSERT(HEADER_RANGE_OK == header_range("bytes=900-", 1000, &first, &last));
+  CU_ASSERT(900 == first && 999 == last);
+  CU_ASSERT(HEADER_RANGE_OK == header_range("bytes=500-5000", 1000, &first, &last));
+  CU_ASSERT(500 == first && 999 == last);
+  CU_ASSERT(HEADER_RANGE_OK == header_range("bytes=-100", 1000, &first, &last));
+  CU_ASSERT(900 == first && 999 == last);
+  CU_ASSERT(HEADER_RANGE_OK == header_range("bytes=-5000", 1000, &first, &last));
+  CU_ASSERT(0 == first && 999 == last);
+
+  /* past the end */
+  CU_ASSERT(HEADER_RANGE_UNSATISFIABLE == header_range("bytes=1000-", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_UNSATISFIABLE == header_range("bytes=-0", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_UNSATISFIABLE == header_range("bytes=0-", 0, &first, &last));
+
+  /* not valid, or many ranges, the whole body is sent */
+  CU_ASSERT(HEADER_RANGE_NONE == header_range(NULL, 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_NONE == header_range("items=0-1", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_NONE == header_range("bytes=200-100", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_NONE == header_range("bytes=a-b", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_NONE == header_range("bytes=0-1,5-6", 1000, &first, &last));
+  CU_ASSERT(HEADER_RANGE_NONE == header_range("bytes=2000-,5-6", 1000, &first, &last));
+}
 
 
 /* tests */
-int main() {
-  CU_initialize_registry();
-  CU_pSuite suite = CU_add_suite("rest server", 0, 0);
+/* id_lease tests
+ */
+#define N_LEASE_THREADS  4
+#define LEASE_IDS        1000
 
-  /* card_type tests */
-  CU_add_test(suite, "card_type_is_valid", test_card_type_is_valid);
-  CU_add_test(suite, "card_type_find_by_name", test_card_type_find_by_name);
-  CU_add_test(suite, "card_type_find_by_id", test_card_type_find_by_id);
+static void *lease_worker(void *arg) {
+  uint32_t *ids = arg;
+  int i;
 
-  /* transaction_type tests */
-  CU_add_test(suite, "transaction_type_is_valid", test_transaction_type_is_valid);
-  CU_add_test(suite, "transaction_type_find_by_name", test_transaction_type_find_by_name);
-  CU_add_test(suite, "transaction_type_find_by_id", test_transaction_type_find_by_id);
+  for (i = 0; i < LEASE_IDS; i++) {
+    ids[i] = id_lease_next();
+  }
+  return NULL;
+}
 
-  /* terminal tests */
-  CU_add_test(suite, "terminal_add", test_terminal_add);
-  CU_add_test(suite, "terminal_init_data", test_terminal_init_data);
-  CU_add_test(suite, "terminal_find_by_id", test_terminal_find_by_id);
-  CU_add_test(suite, "terminal_is_valid", test_terminal_is_valid);
-  CU_add_test(suite, "terminal_to_json", test_terminal_to_json);
-  CU_add_test(suite, "terminal_load_json", test_terminal_load_json);
+static void *lease_worker_one(void *arg) {
+  *(uint32_t *) arg = id_lease_next();
+  return NULL;
+}
+
+static int uint32_compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+void test_id_lease_next(void) {
+  static uint32_t ids[N_LEASE_THREADS * LEASE_IDS];
+  pthread_t threads[N_LEASE_THREADS];
+  int i, dups;
+
+  for (i = 0; i < N_LEASE_THREADS; i++) {
+    pthread_create(&threads[i], NULL, lease_worker, &ids[i * LEASE_IDS]);
+  }
+  for (i = 0; i < N_LEASE_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  qsort(ids, N_LEASE_THREADS * LEASE_IDS, sizeof(uint32_t), uint32_compare);
+  for (i = 1, dups = 0; i < N_LEASE_THREADS * LEASE_IDS; i++) {
+    if (ids[i] == ids[i - 1]) {
+      dups++;
+    }
+  }
+  CU_ASSERT(0 != ids[0]);
+  CU_ASSERT(0 == dups);
+  CU_ASSERT(ids[N_LEASE_THREADS * LEASE_IDS - 1] <= id_lease_high_water());
+}
+
+void test_id_lease_configure(void) {
+  char path[] = "/tmp/test_id_lease.XXXXXX";
+  pthread_t thread;
+  uint32_t id;
+  FILE *f;
+  int fd;
+  unsigned int v;
+
+  CU_ASSERT((fd = mkstemp(path)) >= 0);
+  CU_ASSERT(write(fd, "100000\n", 7) == 7);
+  close(fd);
+
+  /* a new thread takes a block above the saved high-water mark */
+  CU_ASSERT(true == id_lease_configure(path, 16));
+  CU_ASSERT(100000 == id_lease_high_water());
+  pthread_create(&thread, NULL, lease_worker_one, &id);
+  pthread_join(thread, NULL);
+  CU_ASSERT(100001 == id);
+  CU_ASSERT(100016 == id_lease_high_water());
+
+  /* and the new high-water mark is saved */
+  CU_ASSERT((f = fopen(path, "r")) != NULL);
+  CU_ASSERT(fscanf(f, "%u", &v) == 1);
+  CU_ASSERT(100016 == v);
+  fclose(f);
+
+  f = fopen(path, "w");
+  fputs("garbage\n", f);
+  fclose(f);
+  CU_ASSERT(false == id_lease_configure(path, 0));
+
+  unlink(path);
+  CU_ASSERT(true == id_lease_configure(NULL, ID_LEASE_DEFAULT_BLOCK));
+}
+
+/* change_feed tests
+ */
+void test_change_feed_append(void) {
+  Terminal_Change c[4];
+  Terminal_Data t;
+  uint64_t since, next;
+  uint32_t v;
+
+  /* every change to the table is in the feed, in order */
+  since = change_feed_last_seq();
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  terminal_add_card_type(&t, "Amex");
+  CU_ASSERT(TERMINAL_OK == terminal_update(t.id, &t, TERMINAL_ANY_VERSION, &v));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+
+  CU_ASSERT(3 == change_feed_read(since, c, 4, &next));
+  CU_ASSERT(since + 3 == next);
+  CU_ASSERT(since + 1 == c[0].seq);
+  CU_ASSERT(CHANGE_ADD == c[0].op);
+  CU_ASSERT(t.id == c[0].terminal.id);
+  CU_ASSERT(0 == c[0].terminal.cards[1]);
+  CU_ASSERT(CHANGE_UPDATE == c[1].op);
+  CU_ASSERT(v == c[1].version);
+  CU_ASSERT(4 == c[1].terminal.cards[1]);
+  CU_ASSERT(CHANGE_DELETE == c[2].op);
+  CU_ASSERT(t.id == c[2].terminal.id);
+  CU_ASSERT(0 == c[2].terminal.cards[0]);
+
+  /* a client up to date gets nothing, a batch is limited by max */
+  CU_ASSERT(0 == change_feed_read(next, c, 4, &next));
+  CU_ASSERT(since + 3 == next);
+  CU_ASSERT(2 == change_feed_read(since, c, 2, &next));
+  CU_ASSERT(since + 2 == next);
+}
+
+void test_change_feed_read(void) {
+  Terminal_Change c[1];
+  Terminal_Data t;
+  uint64_t since, next;
+  int i;
+
+  since = change_feed_last_seq();
+  /* a sequence number not given yet, from another run of the server */
+  CU_ASSERT(CHANGE_FEED_RESYNC == change_feed_read(since + 100, c, 1, &next));
+  CU_ASSERT(since == next);
+
+  /* changes that are not in the ring anymore */
+  terminal_init_data(&t);
+  t.id = 12345;
+  for (i = 0; i < CHANGE_FEED_SIZE + 1; i++) {
+    change_feed_append(CHANGE_UPDATE, &t, 1);
+  }
+  CU_ASSERT(CHANGE_FEED_RESYNC == change_feed_read(since, c, 1, &next));
+  CU_ASSERT(since + CHANGE_FEED_SIZE + 1 == next);
+  CU_ASSERT(1 == change_feed_read(since + 1, c, 1, &next));
+  CU_ASSERT(since + 2 == c[0].seq);
+}
+
+void test_change_feed_wait(void) {
+  Terminal_Data t;
+  uint64_t since;
+
+  since = change_feed_last_seq();
+  CU_ASSERT(since == change_feed_wait(since, 10));
+  terminal_init_data(&t);
+  t.id = 12345;
+  change_feed_append(CHANGE_UPDATE, &t, 1);
+  CU_ASSERT(since + 1 == change_feed_wait(since, 1000));
+}
+
+void test_change_feed_reset(void) {
+  Terminal_Change c[1];
+  uint64_t since, next;
+
+  since = change_feed_last_seq();
+  change_feed_reset();
+  CU_ASSERT(since + CHANGE_FEED_SIZE == change_feed_last_seq());
+  CU_ASSERT(CHANGE_FEED_RESYNC == change_feed_read(since, c, 1, &next));
+  CU_ASSERT(since + CHANGE_FEED_SIZE == next);
+  CU_ASSERT(0 == change_feed_read(next, c, 1, &next));
+}
+
+void test_terminal_changes_to_json(void) {
+  Terminal_Change c[2];
+  char *p;
+
+  memset(c, 0, sizeof(c));
+  c[0].seq = 7;
+  c[0].op = CHANGE_ADD;
+  c[0].version = 1;
+  c[0].terminal.id = 3;
+  c[0].terminal.cards[0] = 1;
+  c[0].terminal.trxs[0] = 93;
+  c[1].seq = 8;
+  c[1].op = CHANGE_DELETE;
+  c[1].version = 2;
+  c[1].terminal.id = 3;
+
+  p = terminal_change_to_json(&c[1]);
+  CU_ASSERT(0 == strcmp(p, "{\"seq\":8,\"op\":\"delete\",\"version\":2,\"id\":3}"));
+  terminal_free_json(p);
+
+  p = terminal_change_to_json(&c[0]);
+  CU_ASSERT(NULL != strstr(p, "\"op\":\"add\""));
+  CU_ASSERT(NULL != strstr(p, "\"terminal\":{"));
+  CU_ASSERT(NULL == strchr(p, '\n'));
+  terminal_free_json(p);
+
+  p = terminal_changes_to_json(c, 2, 8);
+  CU_ASSERT(NULL != strstr(p, "\"next\": 8"));
+  CU_ASSERT(NULL != strstr(p, "\"changes\": ["));
+  terminal_free_json(p);
+
+  p = terminal_resync_to_json(8);
+  CU_ASSERT(0 == strcmp(p, "{\"resync\":true,\"next\":8}"));
+  terminal_free_json(p);
+}
+
+/* replica tests
+ */
+void test_replica_apply_frame(void) {
+  Terminal_Snapshot *snap;
+  Terminal_Change c;
+  Terminal_Data t;
+  uint32_t version;
+  char *frame, *snap_frame;
+  size_t len, snap_len;
+  int n;
+
+  snap = terminal_snapshot_acquire();
+  n = snap->n;
+  snap_frame = replica_snapshot_frame(snap, &snap_len);
+  CU_ASSERT(snap_frame != NULL);
+  terminal_snapshot_release(snap);
+
+  memset(&c, 0, sizeof(c));
+  terminal_init_data(&c.terminal);
+  c.seq = 42;
+  c.op = CHANGE_ADD;
+  c.version = 2;
+  c.terminal.id = 4000000004u;
+  terminal_add_card_type(&c.terminal, "EFTPOS");
+  terminal_add_transaction_type(&c.terminal, "Cheque");
+  frame = replica_change_frame(&c, &len);
+  CU_ASSERT(true == replica_apply_frame(frame, len));
+  CU_ASSERT(true == terminal_get_version(c.terminal.id, &t, &version));
+  CU_ASSERT(2 == version);
+  CU_ASSERT(true == same_terminal(&t, &c.terminal));
+  /* cut short */
+  CU_ASSERT(false == replica_apply_frame(frame, len - 1));
+  pool_free(frame);
+
+  frame = replica_heartbeat_frame(50, &len);
+  CU_ASSERT(true == replica_apply_frame(frame, len));
+  pool_free(frame);
+  CU_ASSERT(false == replica_apply_frame("\x91\x09", 2));
+
+  /* the snapshot takes the table back to before the change */
+  CU_ASSERT(true == replica_apply_frame(snap_frame, snap_len));
+  CU_ASSERT(false == terminal_get(c.terminal.id, &t));
+  snap = terminal_snapshot_acquire();
+  CU_ASSERT(n == snap->n);
+  terminal_snapshot_release(snap);
+  pool_free(snap_frame);
+}
+
+/* admission tests
+ */
+static int Suspended, Resumed;
+
+static void fake_suspend(void *arg) {
+  __atomic_add_fetch(&Suspended, 1, __ATOMIC_RELAXED);
+}
+
+static void fake_resume(void *arg) {
+  __atomic_add_fetch(&Resumed, 1, __ATOMIC_RELAXED);
+}
+
+void test_admission_classify(void) {
+  CU_ASSERT(ADMISSION_GET == admission_classify("GET", "/terminals/12"));
+  CU_ASSERT(ADMISSION_GET == admission_classify("GET", "/terminals/stats"));
+  CU_ASSERT(ADMISSION_GET == admission_classify("GET", "/catalog"));
+  CU_ASSERT(ADMISSION_COLLECTION == admission_classify("GET", "/terminals"));
+  CU_ASSERT(ADMISSION_COLLECTION == admission_classify("GET", "/export"));
+  CU_ASSERT(ADMISSION_NONE == admission_classify("GET", "/terminals/changes"));
+  CU_ASSERT(ADMISSION_WRITE == admission_classify("POST", "/terminals"));
+  CU_ASSERT(ADMISSION_WRITE == admission_classify("DELETE", "/terminals/12"));
+}
+
+void test_admission_limit(void) {
+  Admission_Ticket t[12], g;
+  Admission_Stats st;
+  int i;
+
+  memset(t, 0, sizeof(t));
+  memset(&g, 0, sizeof(g));
+  Suspended = Resumed = 0;
+  admission_configure(4, fake_suspend, fake_resume);
+
+  /* the collection takes half the threads */
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[0], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[1], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[2], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(1 == Suspended);
+
+  /* cheap requests are not held by it */
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&g, ADMISSION_GET, NULL));
+  admission_leave(&g);
+  CU_ASSERT(ADMISSION_IDLE == admission_state(&g));
+
+  /* a slot given back goes to the one waiting */
+  admission_leave(&t[0]);
+  CU_ASSERT(1 == Resumed);
+  CU_ASSERT(ADMISSION_ADMITTED == admission_state(&t[2]));
+  admission_leave(&t[2]);
+
+  /* up to 4 times the limit wait, the rest are rejected at once */
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[0], ADMISSION_COLLECTION, NULL));
+  for (i = 2; i < 10; i++) {
+    CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[i], ADMISSION_COLLECTION, NULL));
+  }
+  CU_ASSERT(ADMISSION_REJECTED == admission_enter(&t[10], ADMISSION_COLLECTION, NULL));
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(2 == st.limit);
+  CU_ASSERT(2 == st.in_flight);
+  CU_ASSERT(8 == st.waiting);
+  CU_ASSERT(1 == st.rejected);
+
+  /* and the ones waiting past the deadline too */
+  admission_expire(admission_now() + 2000000000ULL);
+  for (i = 2; i < 10; i++) {
+    CU_ASSERT(ADMISSION_REJECTED == admission_state(&t[i]));
+  }
+  CU_ASSERT(9 == Resumed);
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(0 == st.waiting);
+  CU_ASSERT(8 == st.expired);
+
+  admission_leave(&t[0]);
+  admission_leave(&t[1]);
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(0 == st.in_flight);
+}
+
+void test_admission_cancel(void) {
+  Admission_Ticket t[4];
+  Admission_Stats st;
+
+  memset(t, 0, sizeof(t));
+  admission_configure(4, fake_suspend, fake_resume);
+
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[0], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[1], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[2], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[3], ADMISSION_COLLECTION, NULL));
+
+  /* out of the list, the one after it keeps it's turn */
+  admission_cancel(&t[2]);
+  CU_ASSERT(ADMISSION_IDLE == admission_state(&t[2]));
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(1 == st.waiting);
+
+  /* a request admitted and never answered gives back it's slot */
+  admission_cancel(&t[0]);
+  CU_ASSERT(ADMISSION_ADMITTED == admission_state(&t[3]));
+  admission_cancel(&t[3]);
+  admission_leave(&t[1]);
+  admission_cancel(&t[1]);
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(0 == st.in_flight);
+  CU_ASSERT(0 == st.waiting);
+}
+
+/* a window of requests of the given latency */
+static void admission_window(Admission_Class cls, uint64_t latency) {
+  Admission_Ticket t;
+  int i;
+
+  memset(&t, 0, sizeof(t));
+  for (i = 0; i < ADMISSION_WINDOW; i++) {
+    CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t, cls, NULL));
+    t.started = admission_now() - latency;
+    admission_leave(&t);
+  }
+}
+
+void test_admission_adapt(void) {
+  Admission_Ticket t[5];
+  Admission_Stats st;
+  int i;
+
+  memset(t, 0, sizeof(t));
+  admission_configure(4, fake_suspend, fake_resume);
+
+  /* the lowest latency is the reference */
+  admission_window(ADMISSION_WRITE, 1000000);
+  admission_get_stats(ADMISSION_WRITE, &st);
+  CU_ASSERT(4 == st.limit);
+  CU_ASSERT(st.min_latency_ns >= 1000000 && st.min_latency_ns < 2000000);
+
+  /* slower, the limit goes down */
+  admission_window(ADMISSION_WRITE, 10000000);
+  admission_get_stats(ADMISSION_WRITE, &st);
+  CU_ASSERT(3 == st.limit);
+  CU_ASSERT(st.latency_ns >= 10000000);
+
+  /* fast again, and requests had to wait: it goes up */
+  for (i = 0; i < 3; i++) {
+    CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[i], ADMISSION_WRITE, NULL));
+  }
+  CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[3], ADMISSION_WRITE, NULL));
+  admission_cancel(&t[3]);
+  for (i = 0; i < 3; i++) {
+    admission_cancel(&t[i]);
+  }
+  admission_window(ADMISSION_WRITE, 1000000);
+  admission_get_stats(ADMISSION_WRITE, &st);
+  CU_ASSERT(4 == st.limit);
+
+  /* never beyond the limits of the class */
+  admission_window(ADMISSION_WRITE, 1000000);
+  admission_get_stats(ADMISSION_WRITE, &st);
+  CU_ASSERT(4 == st.limit);
+
+  /* cheap requests keep their limit */
+  admission_window(ADMISSION_GET, 1000000);
+  admission_window(ADMISSION_GET, 50000000);
+  admission_get_stats(ADMISSION_GET, &st);
+  CU_ASSERT(4 == st.limit);
+}
+
+static int Admission_Peak;
+static int Admission_Running;
+
+static void *admission_worker(void *arg) {
+  Admission_Ticket t;
+  Admission_State st;
+  int i, n;
+
+  memset(&t, 0, sizeof(t));
+  for (i = 0; i < 20000; i++) {
+    st = admission_enter(&t, ADMISSION_COLLECTION, NULL);
+    while (st == ADMISSION_WAITING) {
+      sched_yield();
+      st = admission_state(&t);
+    }
+    if (st == ADMISSION_ADMITTED) {
+      n = __atomic_add_fetch(&Admission_Running, 1, __ATOMIC_SEQ_CST);
+      if (n > __atomic_load_n(&Admission_Peak, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&Admission_Peak, n, __ATOMIC_RELAXED);
+      }
+      __atomic_sub_fetch(&Admission_Running, 1, __ATOMIC_SEQ_CST);
+      admission_leave(&t);
+    }
+  }
+  return NULL;
+}
+
+void test_admission_concurrent(void) {
+  pthread_t threads[8];
+  Admission_Stats st;
+  int i;
+
+  admission_configure(4, fake_suspend, fake_resume);
+  CU_ASSERT(true == admission_start());
+  for (i = 0; i < 8; i++) {
+    pthread_create(&threads[i], NULL, admission_worker, NULL);
+  }
+  for (i = 0; i < 8; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  /* never more than the limit at once, and every slot is given back */
+  admission_get_stats(ADMISSION_COLLECTION, &st);
+  CU_ASSERT(Admission_Peak <= 2);
+  CU_ASSERT(0 == st.in_flight);
+  CU_ASSERT(0 == st.waiting);
+}
+
+void test_admission_shutdown(void) {
+  Admission_Ticket t[3];
+
+  memset(t, 0, sizeof(t));
+  admission_configure(4, fake_suspend, fake_resume);
+
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[0], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_ADMITTED == admission_enter(&t[1], ADMISSION_COLLECTION, NULL));
+  CU_ASSERT(ADMISSION_WAITING == admission_enter(&t[2], ADMISSION_COLLECTION, NULL));
+  admission_shutdown();
+  CU_ASSERT(ADMISSION_REJECTED == admission_state(&t[2]));
+
+  /* nobody waits anymore */
+  CU_ASSERT(ADMISSION_REJECTED == admission_enter(&t[2], ADMISSION_COLLECTION, NULL));
+  admission_leave(&t[0]);
+  admission_leave(&t[1]);
+  admission_configure(4, fake_suspend, fake_resume);
+}
+
+/* ratelimit tests
+ * the tests give the time, in ms. keys that are a multiple of
+ * RATELIMIT_SLOTS apart start probing from the same slot
+ */
+void test_ratelimit_take(void) {
+  uint64_t key = 0x10001;
+  uint32_t now = 1000000;
+  int i;
+
+  CU_ASSERT(ratelimit_configure(10, 5));
+  CU_ASSERT(ratelimit_enabled());
+
+  /* the burst at once, then a token every 100 ms */
+  for (i = 0; i < 5; i++) {
+    CU_ASSERT(0 == ratelimit_take(key, now));
+  }
+  CU_ASSERT(100 == ratelimit_take(key, now));
+  CU_ASSERT(40 == ratelimit_take(key, now + 60));
+  CU_ASSERT(0 == ratelimit_take(key, now + 100));
+  CU_ASSERT(100 == ratelimit_take(key, now + 100));
+
+  /* it fills up to the burst, no more */
+  now += 3600 * 1000;
+  for (i = 0; i < 5; i++) {
+    CU_ASSERT(0 == ratelimit_take(key, now));
+  }
+  CU_ASSERT(100 == ratelimit_take(key, now));
+
+  /* another client has it's own bucket */
+  CU_ASSERT(0 == ratelimit_take(key + 1, now));
+
+  /* a clock a little behind doesn't give tokens */
+  CU_ASSERT(0 != ratelimit_take(key, now - 50));
+
+  CU_ASSERT(!ratelimit_configure(RATELIMIT_MAX + 1, 0));
+  CU_ASSERT(ratelimit_configure(0, 0));
+  CU_ASSERT(!ratelimit_enabled());
+  CU_ASSERT(0 == ratelimit_check(NULL, NULL));
+}
+
+void test_ratelimit_key(void) {
+  struct sockaddr_in a, b;
+  struct sockaddr_in6 c;
+
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(40000);
+  a.sin_addr.s_addr = htonl(0x0a000001);
+  b = a;
+  b.sin_port = htons(40001);
+  memset(&c, 0, sizeof(c));
+  c.sin6_family = AF_INET6;
+
+  /* the address without the port */
+  CU_ASSERT(ratelimit_key(NULL, (struct sockaddr *) &a) ==
+      ratelimit_key(NULL, (struct sockaddr *) &b));
+  b.sin_addr.s_addr = htonl(0x0a000002);
+  CU_ASSERT(ratelimit_key(NULL, (struct sockaddr *) &a) !=
+      ratelimit_key(NULL, (struct sockaddr *) &b));
+  CU_ASSERT(ratelimit_key(NULL, (struct sockaddr *) &a) !=
+      ratelimit_key(NULL, (struct sockaddr *) &c));
+
+  /* the API key, from anywhere */
+  CU_ASSERT(ratelimit_key("abc", (struct sockaddr *) &a) ==
+      ratelimit_key("abc", (struct sockaddr *) &b));
+  CU_ASSERT(ratelimit_key("abc", NULL) != ratelimit_key("abd", NULL));
+  CU_ASSERT(ratelimit_key("abc", NULL) != ratelimit_key(NULL, (struct sockaddr *) &a));
+  CU_ASSERT(0 != ratelimit_key(NULL, NULL));
+}
+
+void test_ratelimit_evict(void) {
+  uint64_t base = 0x20064;
+  uint32_t now = 2000000;
+  Ratelimit_Stats before, after;
+  int i;
+
+  CU_ASSERT(ratelimit_configure(1, 1));
+
+  /* all the slots a key probes are taken by active clients */
+  for (i = 0; i < RATELIMIT_PROBE; i++) {
+    CU_ASSERT(0 == ratelimit_take(base + i * RATELIMIT_SLOTS, now));
+  }
+  ratelimit_get_stats(&before);
+  CU_ASSERT(0 == ratelimit_take(base + RATELIMIT_PROBE * RATELIMIT_SLOTS, now + 1000));
+  CU_ASSERT(0 == ratelimit_take(base + RATELIMIT_PROBE * RATELIMIT_SLOTS, now + 1000));
+  ratelimit_get_stats(&after);
+  CU_ASSERT(before.untracked + 2 == after.untracked);
+
+  /* once they are idle, the new client takes the place of one */
+  now += RATELIMIT_IDLE * 1000;
+  CU_ASSERT(0 == ratelimit_take(base + RATELIMIT_PROBE * RATELIMIT_SLOTS, now));
+  CU_ASSERT(1000 == ratelimit_take(base + RATELIMIT_PROBE * RATELIMIT_SLOTS, now));
+  ratelimit_get_stats(&after);
+  CU_ASSERT(before.untracked + 2 == after.untracked);
+  CU_ASSERT(before.clients == after.clients);
+  ratelimit_configure(0, 0);
+}
+
+void test_ratelimit_check(void) {
+  Ratelimit_Stats before, after;
+
+  CU_ASSERT(ratelimit_configure(1, 2));
+  ratelimit_get_stats(&before);
+  CU_ASSERT(0 == ratelimit_check("test_ratelimit_check", NULL));
+  CU_ASSERT(0 == ratelimit_check("test_ratelimit_check", NULL));
+  CU_ASSERT(1 == ratelimit_check("test_ratelimit_check", NULL));
+  ratelimit_get_stats(&after);
+  CU_ASSERT(before.limited + 1 == after.limited);
+  CU_ASSERT(before.clients + 1 == after.clients);
+  ratelimit_configure(0, 0);
+}
+
+/* threads taking tokens of the same client at the same time, no more
+ * than the burst go through
+ */
+#define RATELIMIT_THREADS  4
+
+static void *ratelimit_thread(void *arg) {
+  int *allowed = arg;
+  int i;
+
+  for (i = 0; i < 1000; i++) {
+    if (ratelimit_take(0x30201, 3000000) == 0) {
+      (*allowed)++;
+    }
+  }
+  return NULL;
+}
+
+void test_ratelimit_concurrent(void) {
+  pthread_t threads[RATELIMIT_THREADS];
+  int allowed[RATELIMIT_THREADS] = { 0 };
+  int i, total = 0;
+
+  CU_ASSERT(ratelimit_configure(1, 1000));
+  for (i = 0; i < RATELIMIT_THREADS; i++) {
+    pthread_create(&threads[i], NULL, ratelimit_thread, &allowed[i]);
+  }
+  for (i = 0; i < RATELIMIT_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    total += allowed[i];
+  }
+  CU_ASSERT(1000 == total);
+  ratelimit_configure(0, 0);
+}
+
+/* trace tests
+ */
+void test_trace_sample(void) {
+  uint32_t id;
+  int i;
+
+  trace_configure(0);
+  for (i = 0; i < 10; i++) {
+    CU_ASSERT(0 == trace_sample());
+  }
+
+  /* one of every 3 */
+  trace_configure(3);
+  CU_ASSERT(0 == trace_sample());
+  CU_ASSERT(0 == trace_sample());
+  CU_ASSERT(0 != (id = trace_sample()));
+  CU_ASSERT(0 == trace_sample());
+  CU_ASSERT(0 == trace_sample());
+  CU_ASSERT(id + 1 == trace_sample());
+  trace_configure(0);
+
+  /* a request not traced has no spans */
+  trace_enter(0);
+  CU_ASSERT(0 == trace_start());
+  CU_ASSERT(0 == trace_end("test", 0));
+}
+
+/* the spans written as Chrome trace events, parsed back
+ * returns how many are of request, -1 if they can't be parsed
+ */
+static int trace_count(uint32_t request, const char *name) {
+  json_t *json, *events, *e;
+  char *p = NULL;
+  size_t len = 0, i;
+  FILE *f;
+  int n = 0;
+
+  if ((f = open_memstream(&p, &len)) == NULL) {
+    return -1;
+  }
+  if (!trace_write(f)) {
+    fclose(f);
+    free(p);
+    return -1;
+  }
+  fclose(f);
+  json = json_loads(p, 0, NULL);
+  free(p);
+  if (json == NULL || (events = json_object_get(json, "traceEvents")) == NULL) {
+    json_decref(json);
+    return -1;
+  }
+  for (i = 0; i < json_array_size(events); i++) {
+    e = json_array_get(events, i);
+    if (json_integer_value(json_object_get(json_object_get(e, "args"), "request")) == request &&
+        strcmp(json_string_value(json_object_get(e, "name")), name) == 0 &&
+        strcmp(json_string_value(json_object_get(e, "ph")), "X") == 0) {
+      n++;
+    }
+  }
+  json_decref(json);
+  return n;
+}
+
+void test_trace_write(void) {
+  uint64_t start, end;
+  uint32_t id;
+
+  trace_configure(1);
+  CU_ASSERT(0 != (id = trace_sample()));
+  trace_configure(0);
+
+  trace_enter(id);
+  CU_ASSERT(0 != (start = trace_start()));
+  CU_ASSERT(start <= (end = trace_end("test write", start)));
+  trace_span("test write", start, end);
+  trace_enter(0);
+  trace_span("test write", start, end);
+
+  CU_ASSERT(2 == trace_count(id, "test write"));
+}
+
+/* a thread writing more spans than it keeps, while they are written */
+static void *trace_thread(void *arg) {
+  uint32_t id = *(uint32_t *) arg;
+  int i;
+
+  trace_enter(id);
+  for (i = 0; i < TRACE_SPANS + 100; i++) {
+    trace_span("test wrap", i + 1, i + 2);
+  }
+  trace_enter(0);
+  return NULL;
+}
+
+void test_trace_wrap(void) {
+  pthread_t thread;
+  uint32_t id;
+
+  trace_configure(1);
+  id = trace_sample();
+  trace_configure(0);
+
+  CU_ASSERT(0 == pthread_create(&thread, NULL, trace_thread, &id));
+  CU_ASSERT(0 <= trace_count(id, "test wrap"));
+  CU_ASSERT(0 == pthread_join(thread, NULL));
+
+  /* the oldest are overwritten, the one at the head can't be told apart
+   * from one half written
+   */
+  CU_ASSERT(TRACE_SPANS - 1 == trace_count(id, "test wrap"));
+}
+
+/* job_pool tests
+ */
+typedef struct test_job {
+  Job job;
+  int *count;
+  int *gate;            /* waits until it's not 0, if it's not NULL */
+} Test_Job;
+
+static void test_job_run(Job *job) {
+  Test_Job *j = (Test_Job *) ((char *) job - offsetof(Test_Job, job));
+  int i;
+
+  /* up to a second */
+  for (i = 0; j->gate != NULL && i < 100000 &&
+      __atomic_load_n(j->gate, __ATOMIC_ACQUIRE) == 0; i++) {
+    usleep(10);
+  }
+  __atomic_add_fetch(j->count, 1, __ATOMIC_RELEASE);
+}
+
+/* submit again while the queue is full */
+static void submit_test_job(Test_Job *j) {
+  while (!job_pool_submit(&j->job)) {
+    sched_yield();
+  }
+}
+
+void test_job_pool_run(void) {
+  static Test_Job jobs[200];
+  Job_Pool_Stats before, after;
+  int count = 0;
+  int i;
+
+  CU_ASSERT(false == job_pool_running());
+  job_pool_get_stats(&before);
+  jobs[0].job.run = test_job_run;
+  jobs[0].count = &count;
+  CU_ASSERT(false == job_pool_submit(&jobs[0].job));
+
+  CU_ASSERT(true == job_pool_start(4));
+  CU_ASSERT(true == job_pool_running());
+  for (i = 0; i < 200; i++) {
+    jobs[i].job.run = test_job_run;
+    jobs[i].count = &count;
+    jobs[i].gate = NULL;
+    submit_test_job(&jobs[i]);
+  }
+  /* the jobs queued are done before it stops */
+  job_pool_shutdown();
+  CU_ASSERT(false == job_pool_running());
+  CU_ASSERT(200 == count);
+  job_pool_get_stats(&after);
+  CU_ASSERT(0 == after.threads);
+  CU_ASSERT(0 == after.queued && 0 == after.running);
+  CU_ASSERT(before.done + 200 == after.done);
+}
+
+void test_job_pool_steal(void) {
+  Job_Pool_Stats before, after;
+  Test_Job first, second;
+  int count = 0;
+
+  job_pool_get_stats(&before);
+  CU_ASSERT(true == job_pool_start(2));
+
+  /* both jobs are in the queue of this thread, and the first one waits
+   * for the second one, so the other thread has to take it
+   */
+  first.job.run = second.job.run = test_job_run;
+  first.count = &count;
+  first.gate = &count;
+  second.count = &count;
+  second.gate = NULL;
+  CU_ASSERT(true == job_pool_submit(&first.job));
+  CU_ASSERT(true == job_pool_submit(&second.job));
+  job_pool_shutdown();
+  CU_ASSERT(2 == count);
+  job_pool_get_stats(&after);
+  CU_ASSERT(before.stolen < after.stolen);
+}
+
+void test_job_pool_bounded(void) {
+  static Test_Job jobs[JOB_POOL_QUEUE + 2];
+  Job_Pool_Stats st;
+  uint64_t rejected;
+  int count = 0, gate = 0;
+  int i;
+
+  job_pool_get_stats(&st);
+  rejected = st.rejected;
+  CU_ASSERT(true == job_pool_start(1));
+  for (i = 0; i < JOB_POOL_QUEUE + 2; i++) {
+    jobs[i].job.run = test_job_run;
+    jobs[i].count = &count;
+    jobs[i].gate = &gate;
+  }
+
+  /* the thread waits on the first job, the queue fills up behind it */
+  CU_ASSERT(true == job_pool_submit(&jobs[0].job));
+  for (i = 0; i < 100000; i++) {
+    job_pool_get_stats(&st);
+    if (st.running == 1) {
+      break;
+    }
+    usleep(10);
+  }
+  CU_ASSERT(1 == st.running);
+  for (i = 1; i <= JOB_POOL_QUEUE; i++) {
+    CU_ASSERT(true == job_pool_submit(&jobs[i].job));
+  }
+  CU_ASSERT(false == job_pool_submit(&jobs[i].job));
+  job_pool_get_stats(&st);
+  CU_ASSERT(JOB_POOL_QUEUE == st.queued);
+  CU_ASSERT(rejected + 1 == st.rejected);
+
+  __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+  job_pool_shutdown();
+  CU_ASSERT(JOB_POOL_QUEUE + 1 == count);
+}
+
+/* every thread submits to a queue of it's own */
+#define SUBMITTERS  4
+#define SUBMITTED   500
+
+static void *submit_thread(void *arg) {
+  Test_Job *jobs = arg;
+  int i;
+
+  for (i = 0; i < SUBMITTED; i++) {
+    submit_test_job(&jobs[i]);
+  }
+  return NULL;
+}
+
+void test_job_pool_submitters(void) {
+  static Test_Job jobs[SUBMITTERS][SUBMITTED];
+  pthread_t threads[SUBMITTERS];
+  Job_Pool_Stats before, after;
+  int count = 0;
+  int i, k;
+
+  job_pool_get_stats(&before);
+  CU_ASSERT(true == job_pool_start(3));
+  for (k = 0; k < SUBMITTERS; k++) {
+    for (i = 0; i < SUBMITTED; i++) {
+      jobs[k][i].job.run = test_job_run;
+      jobs[k][i].count = &count;
+      jobs[k][i].gate = NULL;
+    }
+    CU_ASSERT(0 == pthread_create(&threads[k], NULL, submit_thread, jobs[k]));
+  }
+  for (k = 0; k < SUBMITTERS; k++) {
+    CU_ASSERT(0 == pthread_join(threads[k], NULL));
+  }
+  /* none is lost, none is run twice */
+  job_pool_shutdown();
+  CU_ASSERT(SUBMITTERS * SUBMITTED == count);
+  job_pool_get_stats(&after);
+  CU_ASSERT(before.done + SUBMITTERS * SUBMITTED == after.done);
+  CU_ASSERT(0 == after.queued && 0 == after.running);
+}
+
+/* import tests
+ */
+static char *write_seed_file(const char *content) {
+  static char path[64];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/tmp/import-test-%d", (int) getpid());
+  if ((f = fopen(path, "w")) == NULL) {
+    return NULL;
+  }
+  fputs(content, f);
+  fclose(f);
+  return path;
+}
+
+/* delete the terminals added since seq, and check they are n */
+static void delete_added(uint64_t seq, uint64_t n) {
+  Terminal_Change c[64];
+  uint64_t next, deleted = 0;
+  int i, k;
+
+  while ((k = change_feed_read(seq, c, 64, &next)) > 0) {
+    for (i = 0; i < k; i++) {
+      if (c[i].op == CHANGE_ADD &&
+          TERMINAL_OK == terminal_delete(c[i].terminal.id, TERMINAL_ANY_VERSION)) {
+        deleted++;
+      }
+    }
+    seq = next;
+  }
+  CU_ASSERT(n == deleted);
+}
+
+void test_import_ndjson(void) {
+  Terminal_Change c[3];
+  Import_Stats st;
+  uint64_t seq, next;
+  char *path;
+  int i, first = 0;
+
+  path = write_seed_file(
+      "{\"CardType\":[\"Visa\",\"Amex\"],\"TransactionType\":[\"Credit\"]}\n"
+      "\n"
+      "{\"CardType\":[\"Nope\"],\"TransactionType\":[\"Credit\"]}\n"
+      "{\"CardType\":[\"JBC\"],\"TransactionType\":[\"Other\"]}\r\n"
+      "{\"CardType\":\n"
+      "{\"id\":99,\"CardType\":[\"EFTPOS\"],\"TransactionType\":[]}");
+  CU_ASSERT(NULL != path);
+
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == import_file(path, 4, false, &st));
+  CU_ASSERT(IMPORT_NDJSON == st.format);
+  CU_ASSERT(4 == st.threads);
+  CU_ASSERT(5 == st.lines);
+  CU_ASSERT(3 == st.added);
+  CU_ASSERT(2 == st.errors);
+  CU_ASSERT(0 == st.not_added);
+
+  /* the threads add their chunks at the same time, the terminal of the
+   * first line is one of the three, with the types in the order of the
+   * file. the id is a new one
+   */
+  CU_ASSERT(3 == change_feed_read(seq, c, 3, &next));
+  for (i = 0; i < 3; i++) {
+    if (1 == c[i].terminal.cards[0] && 4 == c[i].terminal.cards[1] &&
+        93 == c[i].terminal.trxs[0] && 0 == c[i].terminal.trxs[1]) {
+      first++;
+    }
+  }
+  CU_ASSERT(1 == first);
+  delete_added(seq, 3);
+
+  CU_ASSERT(false == import_file("/nonexistent/seed", 1, false, &st));
+  unlink(path);
+}
+
+void test_import_csv(void) {
+  Terminal_Change c[1];
+  Import_Stats st;
+  uint64_t seq, next;
+  char *path;
+
+  /* the header tells the columns, the id is ignored */
+  path = write_seed_file(
+      "id,TransactionType,CardType\r\n"
+      "1,Cheque|Credit,Visa|MasterCard\r\n"
+      "2, Savings , Amex \r\n"
+      "3,Credit,Nope\r\n"
+      "4,Credit\r\n");
+  CU_ASSERT(NULL != path);
+
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == import_file(path, 2, false, &st));
+  CU_ASSERT(IMPORT_CSV == st.format);
+  CU_ASSERT(4 == st.lines);
+  CU_ASSERT(2 == st.added);
+  CU_ASSERT(2 == st.errors);
+  CU_ASSERT(1 == change_feed_read(seq, c, 1, &next));
+  CU_ASSERT(1 == c[0].terminal.cards[0] && 2 == c[0].terminal.cards[1]);
+  CU_ASSERT(91 == c[0].terminal.trxs[0] && 93 == c[0].terminal.trxs[1]);
+  delete_added(seq, 2);
+
+  /* no header, the types are the first columns */
+  path = write_seed_file("Visa,Credit\nAmex|JBC,Cheque\n");
+  CU_ASSERT(true == import_file(path, 1, true, &st));
+  CU_ASSERT(2 == st.lines && 2 == st.added && 0 == st.errors);
+  unlink(path);
+}
+
+/* every line is read once, however the file is split */
+void test_import_split(void) {
+  Import_Stats st;
+  char *content, *p;
+  int i, threads;
+
+  if ((content = malloc(500 * 64)) == NULL) {
+    return;
+  }
+  p = content;
+  for (i = 0; i < 500; i++) {
+    p += sprintf(p, "%s,%s\n", i % 7 == 0 ? "Visa|Amex" : "JBC",
+        i == 250 ? "Nope" : "Credit|Other");
+  }
+  p = write_seed_file(content);
+  free(content);
+  CU_ASSERT(NULL != p);
+  for (threads = 1; threads <= 8; threads++) {
+    CU_ASSERT(true == import_file(p, threads, true, &st));
+    CU_ASSERT(500 == st.lines);
+    CU_ASSERT(499 == st.added);
+    CU_ASSERT(1 == st.errors);
+  }
+  unlink(p);
+}
+
+/* the import stops when the table is full, the rest is counted */
+void test_import_full(void) {
+  Terminal_Stats ts;
+  Import_Stats st;
+  uint64_t seq;
+  char *content, *p;
+  int i, room;
+
+  if ((content = malloc(N_TERMINALS * 16)) == NULL) {
+    return;
+  }
+  p = content;
+  for (i = 0; i < N_TERMINALS; i++) {
+    p += sprintf(p, "Visa,Credit\n");
+  }
+  p = write_seed_file(content);
+  free(content);
+  CU_ASSERT(NULL != p);
+
+  terminal_get_stats(&ts);
+  room = N_TERMINALS - ts.terminals;
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == import_file(p, 2, false, &st));
+  CU_ASSERT(room == st.added);
+  CU_ASSERT(st.not_added > 0);
+  CU_ASSERT(N_TERMINALS == st.lines);
+  CU_ASSERT(st.added + st.not_added == N_TERMINALS);
+  delete_added(seq, room);
+  unlink(p);
+}
+
+/* a chunk that stops when the table is full counts the lines it doesn't
+ * read, so the errors of the chunk after it have their line number
+ */
+void test_import_full_lines(void) {
+  Terminal_Stats ts;
+  Import_Stats st;
+  uint64_t seq;
+  char *content, *p, *out;
+  char errors[256];
+  int i, fd, saved, room;
+  ssize_t n;
+
+  /* every line is as long, the first of the second chunk is the error */
+  if ((content = malloc(2 * N_TERMINALS * 16)) == NULL) {
+    return;
+  }
+  p = content;
+  for (i = 1; i <= 2 * N_TERMINALS; i++) {
+    p += sprintf(p, "%s\n", i == N_TERMINALS + 1 ? "Visa,Crediz" : "Visa,Credit");
+  }
+  p = write_seed_file(content);
+  free(content);
+  CU_ASSERT(NULL != p);
+
+  out = "/tmp/import-test-errors";
+  fflush(stderr);
+  saved = dup(2);
+  fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  CU_ASSERT(fd >= 0 && saved >= 0);
+  dup2(fd, 2);
+  close(fd);
+
+  terminal_get_stats(&ts);
+  room = N_TERMINALS - ts.terminals;
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == import_file(p, 2, false, &st));
+
+  fflush(stderr);
+  dup2(saved, 2);
+  close(saved);
+
+  CU_ASSERT(room == st.added);
+  CU_ASSERT(2 * N_TERMINALS == st.lines);
+  CU_ASSERT(1 == st.errors);
+  CU_ASSERT(st.added + st.not_added + st.errors == 2 * N_TERMINALS);
+  snprintf(errors, sizeof(errors), "%s:%d: unknown transaction type",
+      p, N_TERMINALS + 1);
+  fd = open(out, O_RDONLY);
+  content = malloc(4096);
+  n = read(fd, content, 4095);
+  close(fd);
+  CU_ASSERT(n > 0);
+  content[n > 0 ? n : 0] = '\0';
+  CU_ASSERT(NULL != strstr(content, errors));
+  free(content);
+  unlink(out);
+  delete_added(seq, room);
+  unlink(p);
+}
+
+/* export tests
+ */
+void test_export_ndjson(void) {
+  Terminal_Stats ts;
+  Export_Stats before, after;
+  Terminal_Data t, u;
+  struct stat a, b;
+  uint64_t generation, size, size2;
+  char *buf, *p;
+  int fd, fd2, lines = 0;
+
+  CU_ASSERT(false == export_configure("/nonexistent/dir"));
+  CU_ASSERT(true == export_configure("/tmp"));
+  export_get_stats(&before);
+  terminal_get_stats(&ts);
+
+  fd = export_open(EXPORT_NDJSON, &generation, &size);
+  CU_ASSERT(fd >= 0);
+  CU_ASSERT(true == export_current(EXPORT_NDJSON));
+  CU_ASSERT(generation == terminal_generation());
+
+  /* a terminal on every line, as compact JSON */
+  buf = malloc(size + 1);
+  CU_ASSERT(size == pread(fd, buf, size, 0));
+  buf[size] = '\0';
+  for (p = buf; (p = strchr(p, '\n')) != NULL; p++) {
+    lines++;
+  }
+  CU_ASSERT(ts.terminals == lines);
+  p = strchr(buf, '\n');
+  *p = '\0';
+  CU_ASSERT(NULL == strchr(buf, ' '));
+  CU_ASSERT(true == terminal_load_json(&t, buf));
+  free(buf);
+
+  /* the same generation, the same file */
+  fd2 = export_open(EXPORT_NDJSON, &generation, &size2);
+  CU_ASSERT(fd2 >= 0 && fd2 != fd);
+  CU_ASSERT(size == size2);
+  CU_ASSERT(0 == fstat(fd, &a) && 0 == fstat(fd2, &b));
+  CU_ASSERT(a.st_ino == b.st_ino);
+  close(fd2);
+  export_get_stats(&after);
+  CU_ASSERT(before.written + 1 == after.written);
+  CU_ASSERT(before.reused + 1 == after.reused);
+
+  /* a change makes a new one, the one before is still there for who
+   * has it open
+   */
+  terminal_init_data(&u);
+  terminal_add_card_type(&u, "Visa");
+  terminal_add_transaction_type(&u, "Credit");
+  CU_ASSERT(true == terminal_add(&u));
+  CU_ASSERT(false == export_current(EXPORT_NDJSON));
+  fd2 = export_open(EXPORT_NDJSON, &generation, &size2);
+  CU_ASSERT(fd2 >= 0);
+  CU_ASSERT(0 == fstat(fd2, &b));
+  CU_ASSERT(a.st_ino != b.st_ino);
+  CU_ASSERT(size2 > size);
+  CU_ASSERT(0 == fstat(fd, &a));
+  CU_ASSERT((off_t) size == a.st_size);
+  close(fd2);
+  close(fd);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(u.id, TERMINAL_ANY_VERSION));
+}
+
+void test_export_msgpack(void) {
+  Export_Format format;
+  uint64_t generation, generation2, size;
+  unsigned char c;
+  char *buf, *p;
+  size_t len;
+  int fd;
+
+  CU_ASSERT(true == export_format("msgpack", &format));
+  CU_ASSERT(EXPORT_MSGPACK == format);
+  CU_ASSERT(false == export_format("xml", &format));
+  CU_ASSERT(0 == strcmp("application/msgpack", export_content_type(format)));
+
+  /* an array, like GET /terminals */
+  fd = export_open(EXPORT_MSGPACK, &generation, &size);
+  CU_ASSERT(fd >= 0);
+  CU_ASSERT(size > 0);
+  CU_ASSERT(1 == pread(fd, &c, 1, 0));
+  CU_ASSERT(0x90 == (c & 0xf0) || 0xdc == c || 0xdd == c);
+
+  /* packed a terminal at a time as it's scanned, the same bytes */
+  p = terminal_all_to_msgpack(&len, &generation2);
+  CU_ASSERT(p != NULL && len == size && generation == generation2);
+  buf = malloc(size);
+  CU_ASSERT(size == pread(fd, buf, size, 0));
+  CU_ASSERT(p != NULL && 0 == memcmp(buf, p, len < size ? len : size));
+  free(buf);
+  pool_free(p);
+  close(fd);
+}
+
+/* store tests
+ */
+static char *store_test_file(void) {
+  static char path[64];
+
+  snprintf(path, sizeof(path), "/tmp/store-test-%d", (int) getpid());
+  unlink(path);
+  return path;
+}
+
+static void store_test_terminal(Terminal_Data *t, terminal_id id, const char *card) {
+  terminal_init_data(t);
+  t->id = id;
+  terminal_add_card_type(t, card);
+  terminal_add_transaction_type(t, "Credit");
+}
+
+static void store_test_count(Terminal_Data *t, uint32_t version, void *arg) {
+  (*(int *) arg)++;
+}
+
+void test_store_file(void) {
+  Store_Stats st;
+  Terminal_Data t, u;
+  uint32_t version;
+  char *path;
+  int i, n = 0;
+
+  path = store_test_file();
+  CU_ASSERT(true == store_open(path, 100, 0));
+  store_get_stats(&st);
+  CU_ASSERT(128 == st.capacity);
+
+  for (i = 1; i <= 3; i++) {
+    store_test_terminal(&t, i * 10, i == 2 ? "Amex" : "Visa");
+    CU_ASSERT(true == store_put(&t, i));
+  }
+  CU_ASSERT(3 == store_count());
+  CU_ASSERT(true == store_get(20, &u, &version));
+  CU_ASSERT(20 == u.id && 2 == version);
+  CU_ASSERT(card_type_find_by_name("Amex")->id == u.cards[0]);
+  CU_ASSERT(0 == u.cards[1]);
+  CU_ASSERT(false == store_get(40, &u, &version));
+
+  /* over the one with the same id */
+  store_test_terminal(&t, 20, "JBC");
+  CU_ASSERT(true == store_put(&t, 5));
+  CU_ASSERT(3 == store_count());
+
+  /* a deleted record is reused */
+  CU_ASSERT(true == store_remove(10));
+  CU_ASSERT(false == store_remove(10));
+  CU_ASSERT(false == store_get(10, &u, NULL));
+  CU_ASSERT(2 == store_count());
+  store_test_terminal(&t, 10, "Visa");
+  CU_ASSERT(true == store_put(&t, 7));
+  CU_ASSERT(true == store_scan(store_test_count, &n));
+  CU_ASSERT(3 == n);
+
+  /* it's all there when it's opened again, with it's own capacity */
+  store_close();
+  CU_ASSERT(false == store_get(20, &u, NULL));
+  CU_ASSERT(true == store_open(path, 999, 0));
+  store_get_stats(&st);
+  CU_ASSERT(128 == st.capacity);
+  CU_ASSERT(3 == store_count());
+  CU_ASSERT(true == store_get(20, &u, &version));
+  CU_ASSERT(5 == version);
+  CU_ASSERT(card_type_find_by_name("JBC")->id == u.cards[0]);
+  CU_ASSERT(true == store_get(10, &u, &version));
+  CU_ASSERT(7 == version);
+
+  CU_ASSERT(true == store_clear());
+  CU_ASSERT(0 == store_count());
+  CU_ASSERT(false == store_get(20, &u, NULL));
+  store_close();
+
+  /* full at STORE_MAX_FILL */
+  unlink(path);
+  CU_ASSERT(true == store_open(path, 16, 0));
+  for (i = 1; i <= 16 && (store_test_terminal(&t, i, "Visa"), store_put(&t, 1)); i++) {
+  }
+  CU_ASSERT(16 * STORE_MAX_FILL / 100 + 1 == i);
+  store_close();
+
+  /* not a store */
+  path = write_seed_file("not a store, it's a seed file\n");
+  CU_ASSERT(false == store_open(path, 16, 0));
+  unlink(path);
+  unlink(store_test_file());
+}
+
+void test_store_compact(void) {
+  Store_Stats st;
+  Terminal_Data t, u;
+  uint32_t version, state, record_size;
+  char *path, tmp[80];
+  int fd, i, n = 0;
+
+  /* 50 terminals at a time, in a store with room for 96: a remove leaves
+   * no deleted record, so it never fills up
+   */
+  path = store_test_file();
+  CU_ASSERT(true == store_open(path, 128, 0));
+  for (i = 1; i <= 1000; i++) {
+    store_test_terminal(&t, i, i % 2 ? "Visa" : "Amex");
+    CU_ASSERT(true == store_put(&t, i));
+    if (i > 50) {
+      CU_ASSERT(true == store_remove(i - 50));
+    }
+  }
+  store_get_stats(&st);
+  CU_ASSERT(0 == st.deleted && 0 == st.compactions);
+  CU_ASSERT(50 == store_count());
+  CU_ASSERT(false == store_get(950, &u, NULL));
+  for (i = 951; i <= 1000; i++) {
+    CU_ASSERT(true == store_get(i, &u, &version));
+    CU_ASSERT(i == u.id && i == version);
+    CU_ASSERT(card_type_find_by_name(i % 2 ? "Visa" : "Amex")->id == u.cards[0]);
+  }
+
+  CU_ASSERT(true == store_scan(store_test_count, &n));
+  CU_ASSERT(50 == n);
+
+  /* a file of an older release, with a deleted record (the first one
+   * that's used, marked by hand) is compacted when it's opened
+   */
+  store_close();
+  CU_ASSERT((fd = open(path, O_RDWR)) >= 0);
+  CU_ASSERT(sizeof(record_size) == pread(fd, &record_size, sizeof(record_size), 8));
+  for (i = 0; i < 128; i++) {
+    CU_ASSERT(sizeof(state) == pread(fd, &state, sizeof(state), 64 + (off_t) i * record_size));
+    if (state == 1) {
+      state = 2;
+      CU_ASSERT(sizeof(state) == pwrite(fd, &state, sizeof(state), 64 + (off_t) i * record_size));
+      break;
+    }
+  }
+  close(fd);
+  CU_ASSERT(true == store_open(path, 128, 0));
+  store_get_stats(&st);
+  CU_ASSERT(1 == st.compactions && 0 == st.deleted);
+  CU_ASSERT(49 == store_count());
+  snprintf(tmp, sizeof(tmp), "%s.compact", path);
+  CU_ASSERT(0 != access(tmp, F_OK));
+  store_close();
+  CU_ASSERT(true == store_open(path, 128, 0));
+  store_get_stats(&st);
+  CU_ASSERT(0 == st.compactions && 49 == st.terminals);
+  n = 0;
+  CU_ASSERT(true == store_scan(store_test_count, &n));
+  CU_ASSERT(49 == n);
+
+  /* the records moved back by the removes of a full store are found */
+  CU_ASSERT(true == store_clear());
+  for (i = 1; i <= 128 * STORE_MAX_FILL / 100; i++) {
+    store_test_terminal(&t, i * 7919, "Visa");
+    CU_ASSERT(true == store_put(&t, i));
+  }
+  for (i = 1; i <= 128 * STORE_MAX_FILL / 100; i += 2) {
+    CU_ASSERT(true == store_remove(i * 7919));
+  }
+  for (i = 1; i <= 128 * STORE_MAX_FILL / 100; i++) {
+    CU_ASSERT((i % 2 == 0) == store_get(i * 7919, &u, &version));
+    CU_ASSERT(i % 2 == 1 || (i * 7919 == u.id && i == version));
+  }
+  CU_ASSERT(true == store_clear());
+
+  /* a store full of terminals, the add fails */
+  for (i = 2000; store_test_terminal(&t, i, "Visa"), store_put(&t, 1); i++) {
+  }
+  store_get_stats(&st);
+  CU_ASSERT(128 * STORE_MAX_FILL / 100 == st.terminals);
+  store_close();
+  unlink(path);
+}
+
+void test_store_cache(void) {
+  Store_Stats st, before;
+  Terminal_Data t, u;
+  uint32_t version;
+  int i, k, hits = 0;
+
+  CU_ASSERT(true == store_open(store_test_file(), 1024, 128));
+  store_get_stats(&st);
+  CU_ASSERT(128 == st.cache_size);
+  for (i = 1; i <= 400; i++) {
+    store_test_terminal(&t, i, "Visa");
+    CU_ASSERT(true == store_put(&t, 1));
+  }
+
+  /* read once from the file, then from the cache */
+  CU_ASSERT(true == store_get(1, &u, NULL));
+  CU_ASSERT(true == store_get(1, &u, NULL));
+  store_get_stats(&st);
+  CU_ASSERT(1 == st.hits && 1 == st.misses && 1 == st.admitted);
+  CU_ASSERT(1 == st.cached);
+
+  /* a hot set, used again and again, is not wiped out by a scan of
+   * terminals used once
+   */
+  for (k = 0; k < 5; k++) {
+    for (i = 1; i <= 32; i++) {
+      store_get(i, &u, NULL);
+    }
+  }
+  for (i = 33; i <= 400; i++) {
+    CU_ASSERT(true == store_get(i, &u, NULL));
+    CU_ASSERT(i == u.id);
+  }
+  store_get_stats(&before);
+  CU_ASSERT(before.rejected > 0);
+  CU_ASSERT(before.cached <= 128);
+  for (i = 1; i <= 32; i++) {
+    store_get(i, &u, NULL);
+  }
+  store_get_stats(&st);
+  hits = st.hits - before.hits;
+  CU_ASSERT(hits >= 29);
+
+  /* writes go to the cache too */
+  store_test_terminal(&t, 1, "Amex");
+  CU_ASSERT(true == store_put(&t, 2));
+  CU_ASSERT(true == store_get(1, &u, &version));
+  CU_ASSERT(2 == version);
+  CU_ASSERT(card_type_find_by_name("Amex")->id == u.cards[0]);
+  CU_ASSERT(true == store_remove(2));
+  CU_ASSERT(false == store_get(2, &u, NULL));
+  store_close();
+
+  /* no cache, every read is a miss */
+  CU_ASSERT(true == store_open(store_test_file(), 64, 0));
+  store_test_terminal(&t, 1, "Visa");
+  CU_ASSERT(true == store_put(&t, 1));
+  CU_ASSERT(true == store_get(1, &u, NULL));
+  CU_ASSERT(true == store_get(1, &u, NULL));
+  store_get_stats(&st);
+  CU_ASSERT(0 == st.hits && 2 == st.misses && 0 == st.cached);
+  store_close();
+  unlink(store_test_file());
+}
+
+void test_terminal_store(void) {
+  Terminal_Stats before, st;
+  Terminal_Snapshot *snap;
+  Terminal_Data t, add, remove, out, many[2];
+  terminal_id ids[2];
+  uint32_t version;
+  char *path, *p;
+
+  terminal_get_stats(&before);
+  path = store_test_file();
+  CU_ASSERT(0 == strcmp("memory", terminal_backend()));
+  CU_ASSERT(true == terminal_open_store(path, 256, 64));
+  CU_ASSERT(0 == strcmp("disk", terminal_backend()));
+  terminal_get_stats(&st);
+  CU_ASSERT(0 == st.terminals);
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  CU_ASSERT(t.id != 0);
+  CU_ASSERT(true == terminal_get_version(t.id, &out, &version));
+  CU_ASSERT(1 == version);
+  CU_ASSERT(NULL == terminal_find_by_id(t.id));
+
+  /* versions, as with the table in memory */
+  CU_ASSERT(TERMINAL_OK == terminal_update(t.id, &t, 1, &version));
+  CU_ASSERT(2 == version);
+  CU_ASSERT(TERMINAL_CONFLICT == terminal_update(t.id, &t, 1, &version));
+  CU_ASSERT(TERMINAL_NOT_FOUND == terminal_update(9876, &t, TERMINAL_ANY_VERSION, NULL));
+  terminal_init_data(&add);
+  terminal_init_data(&remove);
+  terminal_add_card_type(&add, "MasterCard");
+  CU_ASSERT(TERMINAL_OK == terminal_patch(t.id, &add, &remove, 2, &out, &version));
+  CU_ASSERT(3 == version);
+  CU_ASSERT(0 != out.cards[1] && 0 == out.cards[2]);
+
+  ids[0] = t.id;
+  ids[1] = 9876;
+  CU_ASSERT(1 == terminal_get_many(ids, 2, many));
+  CU_ASSERT(t.id == many[0].id && 0 == many[1].id);
+
+  snap = terminal_snapshot_acquire();
+  CU_ASSERT(snap != NULL && 1 == snap->n);
+  CU_ASSERT(t.id == snap->terminals[0].id && 3 == snap->versions[0]);
+  terminal_snapshot_release(snap);
+
+  p = terminal_stats_to_json();
+  CU_ASSERT(NULL != strstr(p, "\"store\""));
+  CU_ASSERT(NULL != strstr(p, "\"hit_rate\""));
+  terminal_free_json(p);
+
+  /* it's there when the store is opened again, and new ids are above it */
+  terminal_close_store();
+  CU_ASSERT(false == terminal_get(t.id, &out));
+  CU_ASSERT(true == terminal_open_store(path, 256, 64));
+  CU_ASSERT(true == terminal_get_version(t.id, &out, &version));
+  CU_ASSERT(3 == version);
+  terminal_get_stats(&st);
+  CU_ASSERT(1 == st.terminals);
+  CU_ASSERT(id_lease_high_water() >= t.id);
+
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+  CU_ASSERT(false == terminal_get(t.id, &out));
+  CU_ASSERT(TERMINAL_NOT_FOUND == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+
+  /* the table in memory is back as it was */
+  terminal_close_store();
+  CU_ASSERT(0 == strcmp("memory", terminal_backend()));
+  terminal_get_stats(&st);
+  CU_ASSERT(before.terminals == st.terminals);
+  unlink(path);
+}
+
+/* the terminals of a scan, and the largest batch. with change set, a
+ * terminal is added after the first batch, so the scan starts over
+ */
+typedef struct scan_test {
+  int found;
+  int batch;
+  int stop;
+  int restarts;
+  bool change;
+} Scan_Test;
+
+static bool scan_test_count(Terminal_Data *t, int n, void *arg) {
+  Scan_Test *st = arg;
+  Terminal_Data u;
+  int i;
+
+  if (t == NULL) {
+    st->found = 0;
+    st->restarts++;
+    return true;
+  }
+  if (n > st->batch) {
+    st->batch = n;
+  }
+  for (i = 0; i < n; i++) {
+    st->found += (t[i].id != 0);
+  }
+  if (st->change && st->restarts == 0) {
+    terminal_init_data(&u);
+    terminal_add_card_type(&u, "Visa");
+    terminal_add(&u);
+  }
+  return st->stop == 0 || st->found < st->stop;
+}
+
+void test_terminal_store_scan(void) {
+  Terminal_Scan s;
+  Scan_Test st;
+  Terminal_Data t;
+  uint64_t generation;
+  json_t *json;
+  char *path, *p;
+  size_t len;
+  int i;
+
+  path = store_test_file();
+  CU_ASSERT(true == terminal_open_store(path, 2048, 64));
+  for (i = 0; i < 600; i++) {
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, i % 2 ? "Visa" : "Amex");
+    terminal_add_transaction_type(&t, "Credit");
+    CU_ASSERT(true == terminal_add(&t));
+  }
+
+  /* the store is given a batch at a time, not all at once */
+  memset(&st, 0, sizeof(st));
+  CU_ASSERT(true == terminal_scan(&s, scan_test_count, &st));
+  CU_ASSERT(600 == s.n && 600 == st.found);
+  CU_ASSERT(st.batch > 0 && st.batch < 600);
+  CU_ASSERT(terminal_generation() == s.generation);
+  memset(&st, 0, sizeof(st));
+  st.stop = 1;
+  CU_ASSERT(false == terminal_scan(&s, scan_test_count, &st));
+  CU_ASSERT(st.found < 600);
+
+  /* the store isn't locked while a batch is given, a change meanwhile
+   * starts the scan over, at the new generation
+   */
+  memset(&st, 0, sizeof(st));
+  st.change = true;
+  CU_ASSERT(true == terminal_scan(&s, scan_test_count, &st));
+  CU_ASSERT(1 == st.restarts);
+  CU_ASSERT(601 == s.n && 601 == st.found);
+  CU_ASSERT(terminal_generation() == s.generation);
+
+  p = terminal_all_to_json(&generation);
+  CU_ASSERT(p != NULL);
+  CU_ASSERT(terminal_generation() == generation);
+  json = json_loads(p, 0, NULL);
+  CU_ASSERT(json_is_array(json) && 601 == json_array_size(json));
+  /* the store keeps no profiles, the fragments are spliced all the same */
+  CU_ASSERT(json_is_array(json_object_get(json_array_get(json, 0), "CardType")));
+  CU_ASSERT(json_is_array(json_object_get(json_array_get(json, 600), "CardType")));
+  json_decref(json);
+  terminal_free_json(p);
+
+  generation = 0;
+  p = terminal_all_to_msgpack(&len, &generation);
+  CU_ASSERT(p != NULL && len > 3);
+  CU_ASSERT(terminal_generation() == generation);
+  CU_ASSERT(0xdc == (unsigned char) p[0]);
+  CU_ASSERT(601 == ((unsigned char) p[1] << 8 | (unsigned char) p[2]));
+  pool_free(p);
+
+  p = terminal_stats_to_json();
+  CU_ASSERT(NULL != strstr(p, "\"compactions\""));
+  terminal_free_json(p);
+
+  terminal_close_store();
+  unlink(path);
+}
+
+void test_terminal_store_other_catalog(void) {
+  Terminal_Stats before, st;
+  Terminal_Change c;
+  Terminal_Data t, u;
+  uint32_t version;
+  char *path, *p;
+  int visa, credit;
+
+  /* a store written with a catalog that has types this one never had */
+  CU_ASSERT(NULL == card_type_find_by_id(777));
+  CU_ASSERT(NULL == transaction_type_find_by_id(777));
+  visa = card_type_find_by_name("Visa")->id;
+  credit = transaction_type_find_by_name("Credit")->id;
+  path = store_test_file();
+  CU_ASSERT(true == store_open(path, 64, 0));
+  store_test_terminal(&t, 5, "Visa");
+  t.cards[1] = 777;
+  t.trxs[0] = 777;
+  t.trxs[1] = credit;
+  CU_ASSERT(true == store_put(&t, 3));
+  terminal_init_data(&t);
+  t.id = 6;
+  t.cards[0] = 777;
+  CU_ASSERT(true == store_put(&t, 1));
+  store_close();
+
+  /* they are dropped as it's opened, the other types are kept */
+  terminal_get_stats(&before);
+  CU_ASSERT(true == terminal_open_store(path, 64, 0));
+  terminal_get_stats(&st);
+  CU_ASSERT(2 == st.terminals);
+  CU_ASSERT(1 == st.cards[card_type_index(visa)]);
+  CU_ASSERT(true == terminal_get_version(5, &u, &version));
+  CU_ASSERT(3 == version);
+  CU_ASSERT(visa == u.cards[0] && 0 == u.cards[1]);
+  CU_ASSERT(credit == u.trxs[0] && 0 == u.trxs[1]);
+  CU_ASSERT(true == terminal_get(6, &u));
+  CU_ASSERT(0 == u.cards[0]);
+  p = terminal_all_to_json(NULL);
+  CU_ASSERT(p != NULL && NULL != strstr(p, "\"Visa\""));
+  terminal_free_json(p);
+
+  /* and from a change of a primary */
+  memset(&c, 0, sizeof(c));
+  terminal_init_data(&c.terminal);
+  c.op = CHANGE_UPDATE;
+  c.version = 4;
+  c.terminal.id = 5;
+  c.terminal.cards[0] = 777;
+  c.terminal.cards[1] = visa;
+  CU_ASSERT(true == terminal_apply_change(&c));
+  CU_ASSERT(true == terminal_get(5, &u));
+  CU_ASSERT(visa == u.cards[0] && 0 == u.cards[1]);
+  terminal_close_store();
+
+  /* the store was written again without them */
+  CU_ASSERT(true == store_open(path, 64, 0));
+  CU_ASSERT(true == store_get(6, &u, NULL));
+  CU_ASSERT(0 == u.cards[0]);
+  store_close();
+  unlink(path);
+
+  /* the encoders skip a type they have no name for */
+  terminal_init_data(&t);
+  t.id = 7;
+  t.cards[0] = 777;
+  t.cards[1] = visa;
+  p = terminal_to_json(&t);
+  CU_ASSERT(p != NULL && NULL != strstr(p, "\"Visa\""));
+  terminal_free_json(p);
+  terminal_get_stats(&st);
+  CU_ASSERT(before.terminals == st.terminals);
+}
+
+/* catalog tests
+ */
+#define BUILTIN_CARDS "{\"id\":1,\"name\":\"Visa\"},{\"id\":2,\"name\":\"MasterCard\"}," \
+  "{\"id\":3,\"name\":\"EFTPOS\"},{\"id\":4,\"name\":\"Amex\"},{\"id\":5,\"name\":\"JBC\"}"
+#define BUILTIN_TRXS "{\"id\":91,\"name\":\"Cheque\"},{\"id\":92,\"name\":\"Savings\"}," \
+  "{\"id\":93,\"name\":\"Credit\"},{\"id\":94,\"name\":\"Other\"}"
+#define WITH_DINERS "{\"CardType\":[" BUILTIN_CARDS ",{\"id\":6,\"name\":\"Diners\"}]," \
+  "\"TransactionType\":[" BUILTIN_TRXS ",{\"id\":95,\"name\":\"Debit\"}]}"
+#define WITHOUT_DINERS "{\"CardType\":[" BUILTIN_CARDS "]," \
+  "\"TransactionType\":[" BUILTIN_TRXS "]}"
+
+void test_catalog_load_json(void) {
+  Catalog *c = catalog_current();
+
+  /* the built in one */
+  CU_ASSERT(5 == c->n_cards);
+  CU_ASSERT(4 == c->n_trxs);
+  CU_ASSERT(NULL == card_type_at(5));
+  CU_ASSERT(false == catalog_reload());
+
+  /* new types go after the ones there were */
+  CU_ASSERT(true == catalog_load_json(WITH_DINERS));
+  CU_ASSERT(c != catalog_current());
+  CU_ASSERT(NULL != card_type_find_by_name("Diners"));
+  CU_ASSERT(5 == card_type_index(6));
+  CU_ASSERT(0 == card_type_index(1));
+  CU_ASSERT(4 == transaction_type_index(95));
+  CU_ASSERT(NULL != card_type_at(5));
+  CU_ASSERT(NULL == card_type_at(6));
+
+  /* a catalog that's not valid doesn't change the one in use */
+  c = catalog_current();
+  CU_ASSERT(false == catalog_load_json("{\"CardType\":[{\"id\":1,\"name\":\"Visa\"},"
+      "{\"id\":1,\"name\":\"Other\"}],\"TransactionType\":[]}"));
+  CU_ASSERT(false == catalog_load_json("{\"CardType\":[{\"id\":1,\"name\":\"Visa\"},"
+      "{\"id\":2,\"name\":\"Visa\"}],\"TransactionType\":[]}"));
+  CU_ASSERT(false == catalog_load_json("{\"CardType\":[{\"id\":0,\"name\":\"Visa\"}],"
+      "\"TransactionType\":[]}"));
+  CU_ASSERT(false == catalog_load_json("{\"CardType\":[{\"id\":1}],\"TransactionType\":[]}"));
+  CU_ASSERT(false == catalog_load_json("{\"CardType\":[]}"));
+  CU_ASSERT(false == catalog_load_json("[]"));
+  CU_ASSERT(false == catalog_load_json("{"));
+  CU_ASSERT(c == catalog_current());
+  CU_ASSERT(NULL != card_type_find_by_name("Diners"));
+}
+
+void test_catalog_retired(void) {
+  Terminal_Data t, u;
+  char *p;
+  size_t len;
+
+  CU_ASSERT(true == catalog_load_json(WITH_DINERS));
+  terminal_init_data(&t);
+  CU_ASSERT(true == terminal_add_card_type(&t, "Diners"));
+  CU_ASSERT(true == terminal_add_transaction_type(&t, "Debit"));
+  CU_ASSERT(true == terminal_add(&t));
+
+  /* retired types are found by id, for the terminals that have them */
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  CU_ASSERT(NULL == card_type_find_by_name("Diners"));
+  CU_ASSERT(false == card_type_is_valid("Diners"));
+  CU_ASSERT(NULL != card_type_find_by_id(6));
+  CU_ASSERT(true == card_type_find_by_id(6)->retired);
+  CU_ASSERT(5 == card_type_index(6));
+  CU_ASSERT(true == terminal_is_valid(&t));
+  p = terminal_to_json(&t);
+  CU_ASSERT(NULL != strstr(p, "Diners"));
+  terminal_free_json(p);
+  p = catalog_to_json();
+  CU_ASSERT(NULL != strstr(p, "\"retired\": true"));
+  free(p);
+
+  /* but no other terminal can take them */
+  terminal_init_data(&u);
+  CU_ASSERT(false == terminal_add_card_type(&u, "Diners"));
+  p = terminal_to_msgpack(&t, &len);
+  CU_ASSERT(false == terminal_load_msgpack(&u, p, len));
+  pool_free(p);
+
+  /* back again, at the same position */
+  CU_ASSERT(true == catalog_load_json(WITH_DINERS));
+  CU_ASSERT(NULL != card_type_find_by_name("Diners"));
+  CU_ASSERT(false == card_type_find_by_id(6)->retired);
+  CU_ASSERT(5 == card_type_index(6));
+
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+}
+
+void test_catalog_configure(void) {
+  char path[] = "/tmp/test_catalog.XXXXXX";
+  FILE *f;
+  int fd;
+
+  CU_ASSERT((fd = mkstemp(path)) >= 0);
+  CU_ASSERT(write(fd, WITH_DINERS, strlen(WITH_DINERS)) == (ssize_t) strlen(WITH_DINERS));
+  close(fd);
+
+  CU_ASSERT(true == catalog_configure(path));
+  CU_ASSERT(NULL != card_type_find_by_name("Diners"));
+
+  /* the file is read again on reloads */
+  f = fopen(path, "w");
+  fputs(WITHOUT_DINERS, f);
+  fclose(f);
+  CU_ASSERT(true == catalog_reload());
+  CU_ASSERT(NULL == card_type_find_by_name("Diners"));
+
+  f = fopen(path, "w");
+  fputs("garbage\n", f);
+  fclose(f);
+  CU_ASSERT(false == catalog_reload());
+  CU_ASSERT(NULL != card_type_find_by_name("Visa"));
+
+  unlink(path);
+  CU_ASSERT(false == catalog_configure(path));
+  CU_ASSERT(true == catalog_configure(NULL));
+}
+
+static bool Catalog_Stop;
+
+static void *catalog_reader(void *arg) {
+  int *misses = arg;
+  Card_Type *ct;
+  int i;
+
+  while (!__atomic_load_n(&Catalog_Stop, __ATOMIC_RELAXED)) {
+    /* always a whole catalog, with the types in every one */
+    catalog_read_begin();
+    if (card_type_find_by_name("Visa") == NULL ||
+        transaction_type_find_by_name("Credit") == NULL) {
+      (*misses)++;
+    }
+    for (i = 0; (ct = card_type_at(i)) != NULL; i++) {
+      if (ct->name == NULL || card_type_index(ct->id) != i) {
+        (*misses)++;
+      }
+    }
+    catalog_read_end();
+  }
+  return NULL;
+}
+
+void test_catalog_concurrent(void) {
+  pthread_t thread;
+  int misses = 0;
+  int i;
+
+  __atomic_store_n(&Catalog_Stop, false, __ATOMIC_RELAXED);
+  pthread_create(&thread, NULL, catalog_reader, &misses);
+  for (i = 0; i < 200; i++) {
+    CU_ASSERT(true == catalog_load_json((i % 2) ? WITH_DINERS : WITHOUT_DINERS));
+  }
+  __atomic_store_n(&Catalog_Stop, true, __ATOMIC_RELAXED);
+  pthread_join(thread, NULL);
+  CU_ASSERT(0 == misses);
+}
+
+void test_catalog_read_section(void) {
+  Mem_Stats before, st;
+  Catalog *c;
+  int i;
+
+  /* the catalog of a reader is kept across reloads, until it's done */
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  catalog_read_begin();
+  catalog_read_begin();
+  c = catalog_current();
+  /* the ones replaced before it can go */
+  CU_ASSERT(true == catalog_load_json(WITH_DINERS));
+  mem_get_stats(MEM_CATALOG, &before);
+  for (i = 0; i < 3; i++) {
+    CU_ASSERT(true == catalog_load_json((i % 2) ? WITH_DINERS : WITHOUT_DINERS));
+  }
+  catalog_read_end();
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  mem_get_stats(MEM_CATALOG, &st);
+  CU_ASSERT(before.frees == st.frees);
+  CU_ASSERT(c != catalog_current());
+  CU_ASSERT(0 == strcmp("Visa", c->cards[0].name));
+  catalog_read_end();
+
+  /* and freed by the next reload */
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  mem_get_stats(MEM_CATALOG, &st);
+  CU_ASSERT(st.frees >= before.frees + 5);
+}
+
+void test_catalog_profile_json(void) {
+  Terminal_Data t;
+  uint32_t id;
+  char *p;
+
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Cheque");
+  CU_ASSERT(true == terminal_add(&t));
+
+  /* the second time the types are spliced in, rendered the first */
+  p = terminal_to_json(&t);
+  CU_ASSERT(NULL != p && NULL != strstr(p, "\"Visa\""));
+  terminal_free_json(p);
+  trace_configure(1);
+  id = trace_sample();
+  trace_enter(id);
+  p = terminal_to_json(&t);
+  trace_enter(0);
+  trace_configure(0);
+  CU_ASSERT(1 == trace_count(id, "json splice"));
+  terminal_free_json(p);
+
+  /* a new catalog renders them again, with the new names */
+  CU_ASSERT(true == catalog_load_json("{\"CardType\":[{\"id\":1,\"name\":\"VISA\"},"
+              "{\"id\":2,\"name\":\"MasterCard\"},{\"id\":3,\"name\":\"EFTPOS\"},"
+              "{\"id\":4,\"name\":\"Amex\"},{\"id\":5,\"name\":\"JBC\"}],"
+              "\"TransactionType\":[" BUILTIN_TRXS "]}"));
+  p = terminal_to_json(&t);
+  CU_ASSERT(NULL != p && NULL != strstr(p, "\"VISA\""));
+  CU_ASSERT(NULL != p && NULL == strstr(p, "\"Visa\""));
+  terminal_free_json(p);
+
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  p = terminal_to_json(&t);
+  CU_ASSERT(NULL != p && NULL != strstr(p, "\"Visa\""));
+  terminal_free_json(p);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+}
+
+/* a catalog with more types than fit in a profile inline */
+#define LONG_CARDS BUILTIN_CARDS ",{\"id\":6,\"name\":\"Diners\"}," \
+  "{\"id\":7,\"name\":\"Discover\"},{\"id\":8,\"name\":\"UnionPay\"}," \
+  "{\"id\":9,\"name\":\"Maestro\"},{\"id\":10,\"name\":\"Electron\"}," \
+  "{\"id\":11,\"name\":\"RuPay\"},{\"id\":12,\"name\":\"Mir\"}"
+#define LONG_CATALOG "{\"CardType\":[" LONG_CARDS "]," \
+  "\"TransactionType\":[" BUILTIN_TRXS ",{\"id\":95,\"name\":\"Debit\"}]}"
+
+void test_catalog_long_profile(void) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC",
+    "Diners", "Discover", "UnionPay", "Maestro", "Electron", "RuPay", "Mir" };
+  static char *trxs[] = { "Cheque", "Savings", "Credit", "Other", "Debit" };
+  Terminal_Data t, u, out;
+  Terminal_Stats st;
+  uint64_t overflows;
+  int i;
+
+  CU_ASSERT(true == catalog_load_json(LONG_CATALOG));
+  terminal_get_stats(&st);
+  overflows = st.overflows;
+
+  /* a terminal can have every type of the catalog */
+  terminal_init_data(&t);
+  for (i = 0; i < 12; i++) {
+    CU_ASSERT(true == terminal_add_card_type(&t, cards[i]));
+  }
+  for (i = 0; i < 5; i++) {
+    CU_ASSERT(true == terminal_add_transaction_type(&t, trxs[i]));
+  }
+  u = t;
+  CU_ASSERT(true == terminal_add(&t));
+  CU_ASSERT(true == terminal_get(t.id, &out));
+  CU_ASSERT(true == same_terminal(&t, &out));
+  terminal_get_stats(&st);
+  CU_ASSERT(overflows + 1 == st.overflows);
+
+  /* the same types share the block */
+  CU_ASSERT(true == terminal_add(&u));
+  terminal_get_stats(&st);
+  CU_ASSERT(overflows + 1 == st.overflows);
+
+  /* down to a short one, and the block is let go with the profile */
+  terminal_init_data(&out);
+  terminal_add_card_type(&out, "Mir");
+  terminal_add_transaction_type(&out, "Debit");
+  CU_ASSERT(TERMINAL_OK == terminal_update(u.id, &out, TERMINAL_ANY_VERSION, NULL));
+  CU_ASSERT(true == terminal_get(u.id, &out));
+  CU_ASSERT(12 == out.cards[0] && 0 == out.cards[1]);
+  CU_ASSERT(95 == out.trxs[0] && 0 == out.trxs[1]);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+  terminal_get_stats(&st);
+  CU_ASSERT(overflows == st.overflows);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(u.id, TERMINAL_ANY_VERSION));
+
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+}
+
+/* every profile can be a long one, the blocks are counted as they are used */
+void test_catalog_many_long_profiles(void) {
+  static char *cards[] = { "Visa", "MasterCard", "EFTPOS", "Amex", "JBC",
+    "Diners", "Discover", "UnionPay", "Maestro", "Electron", "RuPay", "Mir" };
+  static terminal_id ids[200];
+  static Terminal_Data ts[200];
+  Terminal_Data t;
+  Terminal_Stats st;
+  Mem_Stats before, after;
+  uint64_t overflows;
+  uint32_t id;
+  json_t *json;
+  char *p;
+  int mask, i, n = 0;
+
+  CU_ASSERT(true == catalog_load_json(LONG_CATALOG));
+  terminal_get_stats(&st);
+  overflows = st.overflows;
+  mem_get_stats(MEM_STORE, &before);
+
+  /* every set of 9 card types or more is a profile of it's own */
+  for (mask = 0; mask < (1 << 12) && n < 200; mask++) {
+    if (__builtin_popcount(mask) < 9) {
+      continue;
+    }
+    terminal_init_data(&t);
+    for (i = 0; i < 12; i++) {
+      if (mask & (1 << i)) {
+        terminal_add_card_type(&t, cards[i]);
+      }
+    }
+    terminal_add_transaction_type(&t, "Debit");
+    CU_ASSERT(true == terminal_add(&t));
+    ids[n++] = t.id;
+  }
+  terminal_get_stats(&st);
+  CU_ASSERT(overflows + n == st.overflows);
+  mem_get_stats(MEM_STORE, &after);
+  CU_ASSERT(after.live > before.live);
+
+  /* every profile has a fragment of it's own, they don't evict each
+   * other: rendered once, then they are all spliced in
+   */
+  for (i = 0; i < n; i++) {
+    CU_ASSERT(true == terminal_get(ids[i], &ts[i]));
+    p = terminal_to_json(&ts[i]);
+    CU_ASSERT(NULL != p && NULL != strstr(p, "\"Debit\""));
+    terminal_free_json(p);
+  }
+  trace_configure(1);
+  id = trace_sample();
+  trace_enter(id);
+  for (i = 0; i < n; i++) {
+    p = terminal_to_json(&ts[i]);
+    terminal_free_json(p);
+  }
+  trace_enter(0);
+  trace_configure(0);
+  CU_ASSERT(n == trace_count(id, "json splice"));
+  p = terminal_array_to_json(ts, n);
+  json = json_loads(p, 0, NULL);
+  CU_ASSERT(json_is_array(json) && n == (int) json_array_size(json));
+  json_decref(json);
+  terminal_free_json(p);
+
+  for (i = 0; i < n; i++) {
+    CU_ASSERT(TERMINAL_OK == terminal_delete(ids[i], TERMINAL_ANY_VERSION));
+  }
+  terminal_get_stats(&st);
+  CU_ASSERT(overflows == st.overflows);
+
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+}
+
+void test_catalog_ids(void) {
+  Catalog *c = catalog_current();
+  Terminal_Data t;
+  int i;
+
+  /* the positions by id are the ones of the types */
+  for (i = 0; i < c->n_cards; i++) {
+    CU_ASSERT(i == card_type_index(c->cards[i].id));
+    CU_ASSERT(&c->cards[i] == card_type_find_by_id(c->cards[i].id));
+  }
+  for (i = 0; i < c->n_trxs; i++) {
+    CU_ASSERT(i == transaction_type_index(c->trxs[i].id));
+  }
+  CU_ASSERT(-1 == card_type_index(0));
+  CU_ASSERT(-1 == card_type_index(CATALOG_FAST_IDS - 1));
+  CU_ASSERT(-1 == transaction_type_index(1));
+
+  /* ids past the map are found too, with a scan */
+  CU_ASSERT(true == catalog_load_json("{\"CardType\":[" BUILTIN_CARDS
+              ",{\"id\":1023,\"name\":\"Last\"},{\"id\":70000,\"name\":\"Big\"}],"
+              "\"TransactionType\":[" BUILTIN_TRXS ",{\"id\":4096,\"name\":\"Wire\"}]}"));
+  c = catalog_current();
+  i = card_type_index(70000);
+  CU_ASSERT(i >= 0 && 70000 == c->cards[i].id);
+  i = card_type_index(1023);
+  CU_ASSERT(i >= 0 && 1023 == c->cards[i].id);
+  CU_ASSERT(NULL != transaction_type_find_by_id(4096));
+  CU_ASSERT(-1 == card_type_index(70001));
+
+  terminal_init_data(&t);
+  CU_ASSERT(true == terminal_add_card_type(&t, "Big"));
+  CU_ASSERT(true == terminal_add_transaction_type(&t, "Wire"));
+  CU_ASSERT(true == terminal_is_valid(&t));
+  t.cards[1] = 6000;
+  CU_ASSERT(false == terminal_is_valid(&t));
+  t.cards[1] = 0;
+  t.trxs[1] = 96;
+  CU_ASSERT(false == terminal_is_valid(&t));
+
+  /* retired, they are still found by id */
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  CU_ASSERT(NULL != card_type_find_by_id(70000));
+  CU_ASSERT(NULL != card_type_find_by_id(1023));
+  CU_ASSERT(NULL == card_type_find_by_name("Big"));
+}
+
+/* query tests
+ */
+static int query_error(const char *expr) {
+  Query *q;
+  int error = -1;
+
+  if ((q = query_compile(expr, &error)) != NULL) {
+    query_release(q);
+    return -1;
+  }
+  return error;
+}
+
+static bool query_test(const char *expr, Terminal_Data *t) {
+  Terminal_Data out;
+  Query *q;
+  bool st;
+  int error;
+
+  q = query_compile(expr, &error);
+  CU_ASSERT(NULL != q);
+  st = (1 == query_search(q, t, 1, &out));
+  query_release(q);
+  return st;
+}
+
+void test_query_compile(void) {
+  char expr[QUERY_MAX_LEN + 2];
+  Query *q;
+  int error, i, n;
+
+  /* a postfix program, with the names as masks of positions */
+  q = query_compile("(CardType has Amex or JBC) and not TransactionType has Cheque", &error);
+  CU_ASSERT(NULL != q);
+  CU_ASSERT(4 == q->n);
+  CU_ASSERT(QUERY_CARDS_ANY == q->code[0].op);
+  CU_ASSERT(((1u << card_type_index(4)) | (1u << card_type_index(5))) == q->code[0].a);
+  CU_ASSERT(QUERY_TRXS_ANY == q->code[1].op);
+  CU_ASSERT((1u << transaction_type_index(91)) == q->code[1].a);
+  CU_ASSERT(QUERY_NOT == q->code[2].op);
+  CU_ASSERT(QUERY_AND == q->code[3].op);
+  query_release(q);
+
+  q = query_compile("cardtype HAS Visa And MasterCard", &error);
+  CU_ASSERT(NULL != q);
+  CU_ASSERT(1 == q->n);
+  CU_ASSERT(QUERY_CARDS_ALL == q->code[0].op);
+  query_release(q);
+
+  q = query_compile("id in 10-20 or TransactionType has \"Credit\"", &error);
+  CU_ASSERT(NULL != q);
+  CU_ASSERT(3 == q->n);
+  CU_ASSERT(QUERY_ID == q->code[0].op);
+  CU_ASSERT(10 == q->code[0].a && 20 == q->code[0].b);
+  query_release(q);
+
+  /* errors are where they are seen */
+  CU_ASSERT(0 == query_error(""));
+  CU_ASSERT(13 == query_error("CardType has Diners"));
+  CU_ASSERT(13 == query_error("CardType has Cheque"));
+  CU_ASSERT(25 == query_error("CardType has Visa or JBC and Amex"));
+  CU_ASSERT(9 == query_error("id in 10-5"));
+  CU_ASSERT(5 == query_error("id > x"));
+  CU_ASSERT(3 == query_error("id has Visa"));
+  CU_ASSERT(5 == query_error("id = 4294967296"));
+  CU_ASSERT(18 == query_error("(CardType has Visa"));
+  CU_ASSERT(17 == query_error("CardType has Visa)"));
+  CU_ASSERT(13 == query_error("CardType has \"Visa"));
+  CU_ASSERT(3 == query_error("not"));
+  CU_ASSERT(0 == query_error("Visa"));
+
+  /* and the limits of a program */
+  for (i = 0, n = 0; i < QUERY_MAX_DEPTH + 1; i++) {
+    n += sprintf(expr + n, "(id = 1 or ");
+  }
+  n += sprintf(expr + n, "id = 1");
+  for (i = 0; i < QUERY_MAX_DEPTH + 1; i++) {
+    n += sprintf(expr + n, ")");
+  }
+  CU_ASSERT(-1 != query_error(expr));
+  for (i = 0, n = 0; i < QUERY_MAX_CODE / 2 + 1; i++) {
+    n += sprintf(expr + n, "%sid = 1", i ? " or " : "");
+  }
+  CU_ASSERT(-1 != query_error(expr));
+  memset(expr, ' ', QUERY_MAX_LEN + 1);
+  expr[QUERY_MAX_LEN + 1] = '\0';
+  CU_ASSERT(QUERY_MAX_LEN == query_error(expr));
+}
+
+void test_query_match(void) {
+  Terminal_Data t;
+
+  terminal_init_data(&t);
+  t.id = 7;
+  terminal_add_card_type(&t, "Amex");
+  terminal_add_transaction_type(&t, "Credit");
+
+  CU_ASSERT(true == query_test("(CardType has Amex or JBC) and not TransactionType has Cheque", &t));
+  CU_ASSERT(false == query_test("CardType has Amex and Visa", &t));
+  CU_ASSERT(true == query_test("not not CardType has Amex", &t));
+  /* and goes before or */
+  CU_ASSERT(true == query_test("CardType has Amex or CardType has Visa and TransactionType has Cheque", &t));
+  CU_ASSERT(false == query_test("(CardType has Amex or CardType has Visa) and TransactionType has Cheque", &t));
+
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Cheque");
+  CU_ASSERT(false == query_test("(CardType has Amex or JBC) and not TransactionType has Cheque", &t));
+  CU_ASSERT(true == query_test("CardType has Amex and Visa", &t));
+  CU_ASSERT(false == query_test("CardType has Amex and JBC", &t));
+  CU_ASSERT(true == query_test("TransactionType has Cheque and Credit", &t));
+
+  CU_ASSERT(true == query_test("id in 5-7", &t));
+  CU_ASSERT(true == query_test("id in 7", &t));
+  CU_ASSERT(false == query_test("id in 8-9", &t));
+  CU_ASSERT(true == query_test("id = 7", &t));
+  CU_ASSERT(false == query_test("id < 7", &t));
+  CU_ASSERT(true == query_test("id <= 7", &t));
+  CU_ASSERT(true == query_test("id > 6", &t));
+  CU_ASSERT(false == query_test("id >= 8", &t));
+  CU_ASSERT(false == query_test("id < 0", &t));
+  CU_ASSERT(false == query_test("id > 4294967295", &t));
+}
+
+void test_query_search(void) {
+  Terminal_Snapshot *snap;
+  Terminal_Data t[3], out[N_TERMINALS];
+  Query *q, *r;
+  char expr[256], ids[64];
+  int error, i, n;
+
+  terminal_init_data(&t[0]);
+  terminal_add_card_type(&t[0], "Amex");
+  terminal_add_transaction_type(&t[0], "Credit");
+  terminal_init_data(&t[1]);
+  terminal_add_card_type(&t[1], "JBC");
+  terminal_add_transaction_type(&t[1], "Cheque");
+  terminal_init_data(&t[2]);
+  terminal_add_card_type(&t[2], "Visa");
+  terminal_add_transaction_type(&t[2], "Savings");
+  CU_ASSERT(3 == terminal_add_many(t, 3));
+  snprintf(ids, sizeof(ids), "(id = %u or id = %u or id = %u)", t[0].id, t[1].id, t[2].id);
+
+  /* in a snapshot of the table */
+  snprintf(expr, sizeof(expr), "%s and (CardType has Amex or JBC) and not TransactionType has Cheque", ids);
+  q = query_get(expr, &error);
+  CU_ASSERT(NULL != q);
+  snap = terminal_snapshot_acquire();
+  CU_ASSERT(NULL != snap);
+  n = query_search(q, snap->terminals, snap->n, out);
+  CU_ASSERT(1 == n);
+  CU_ASSERT(t[0].id == out[0].id);
+  CU_ASSERT(4 == out[0].cards[0]);
+  query_release(q);
+  q = query_get(ids, &error);
+  CU_ASSERT(NULL != q);
+  CU_ASSERT(3 == query_search(q, snap->terminals, snap->n, out));
+  terminal_snapshot_release(snap);
+
+  /* compiled once, while the catalog doesn't change */
+  r = query_get(ids, &error);
+  CU_ASSERT(q == r);
+  query_release(r);
+  CU_ASSERT(true == catalog_load_json(WITH_DINERS));
+  r = query_get(ids, &error);
+  CU_ASSERT(NULL != r && q != r);
+  query_release(r);
+  CU_ASSERT(-1 == query_error("CardType has Diners"));
+  CU_ASSERT(true == catalog_load_json(WITHOUT_DINERS));
+  CU_ASSERT(NULL == query_get("CardType has Diners", &error));
+
+  /* let go by the cache, it's kept by the ones that have it */
+  for (i = 0; i < 2 * QUERY_CACHE; i++) {
+    snprintf(expr, sizeof(expr), "id = %d", i);
+    query_release(query_get(expr, &error));
+  }
+  CU_ASSERT(1 == query_search(q, &t[0], 1, out));
+  r = query_get(ids, &error);
+  CU_ASSERT(NULL != r && q != r);
+  query_release(r);
+  query_release(q);
+
+  for (i = 0; i < 3; i++) {
+    CU_ASSERT(TERMINAL_OK == terminal_delete(t[i].id, TERMINAL_ANY_VERSION));
+  }
+}
+
+/* mem tests
+ */
+void test_mem_accounting(void) {
+  Mem_Stats before, st;
+  char *p, *q;
+  int i;
+
+  /* the bytes are the ones malloc gives, at least the ones asked for */
+  mem_get_stats(MEM_CONNECTIONS, &before);
+  p = mem_malloc(MEM_CONNECTIONS, 100);
+  CU_ASSERT(NULL != p);
+  mem_get_stats(MEM_CONNECTIONS, &st);
+  CU_ASSERT(st.live >= before.live + 100);
+  CU_ASSERT(st.peak >= st.live);
+  CU_ASSERT(before.allocs + 1 == st.allocs);
+  CU_ASSERT(st.bytes >= before.bytes + 100);
+
+  /* a realloc is a free and an allocation */
+  memset(p, 'x', 100);
+  p = mem_realloc(MEM_CONNECTIONS, p, 5000);
+  CU_ASSERT(NULL != p && 'x' == p[99]);
+  mem_get_stats(MEM_CONNECTIONS, &st);
+  CU_ASSERT(st.live >= before.live + 5000);
+  CU_ASSERT(before.allocs + 2 == st.allocs);
+  CU_ASSERT(before.frees + 1 == st.frees);
+  q = mem_calloc(MEM_CONNECTIONS, 10, 10);
+  for (i = 0; q != NULL && i < 100 && q[i] == 0; i++) {
+    ;
+  }
+  CU_ASSERT(100 == i);
+
+  /* and it's back where it was, with the peak it had */
+  mem_free(MEM_CONNECTIONS, p);
+  mem_free(MEM_CONNECTIONS, q);
+  mem_free(MEM_CONNECTIONS, NULL);
+  mem_get_stats(MEM_CONNECTIONS, &st);
+  CU_ASSERT(before.live == st.live);
+  CU_ASSERT(st.peak >= before.live + 5000);
+  CU_ASSERT(before.frees + 3 == st.frees);
+}
+
+void test_mem_subsystems(void) {
+  Mem_Stats before, st;
+  Terminal_Snapshot *snap;
+  Terminal_Data t;
+  json_t *json;
+  char *p;
+
+  /* response buffers, from the pools */
+  mem_get_stats(MEM_RESPONSES, &before);
+  p = pool_alloc(2 * 1024 * 1024);
+  mem_get_stats(MEM_RESPONSES, &st);
+  CU_ASSERT(st.live >= before.live + 2 * 1024 * 1024);
+  pool_free(p);
+  mem_get_stats(MEM_RESPONSES, &st);
+  CU_ASSERT(before.live == st.live);
+
+  /* the arenas */
+  mem_get_stats(MEM_SERIALIZER, &before);
+  p = arena_malloc(8 * 1024 * 1024);
+  mem_get_stats(MEM_SERIALIZER, &st);
+  CU_ASSERT(NULL != p);
+  CU_ASSERT(st.live >= before.live + 8 * 1024 * 1024);
+  arena_reset();
+  mem_get_stats(MEM_SERIALIZER, &st);
+  CU_ASSERT(st.live < before.live + 8 * 1024 * 1024);
+
+  /* a new snapshot for a new generation */
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  terminal_add_transaction_type(&t, "Credit");
+  CU_ASSERT(true == terminal_add(&t));
+  mem_get_stats(MEM_SNAPSHOTS, &before);
+  snap = terminal_snapshot_acquire();
+  mem_get_stats(MEM_SNAPSHOTS, &st);
+  CU_ASSERT(NULL != snap);
+  CU_ASSERT(before.allocs + 1 == st.allocs);
+  CU_ASSERT(st.live > 0);
+  terminal_snapshot_release(snap);
+  CU_ASSERT(TERMINAL_OK == terminal_delete(t.id, TERMINAL_ANY_VERSION));
+
+  /* a reload, the same catalog again */
+  mem_get_stats(MEM_CATALOG, &before);
+  p = catalog_to_json();
+  CU_ASSERT(true == catalog_load_json(p));
+  free(p);
+  mem_get_stats(MEM_CATALOG, &st);
+  CU_ASSERT(before.allocs + 1 == st.allocs);
+  CU_ASSERT(st.live >= (int64_t) sizeof(Catalog));
+
+  /* the table is static, it's added once */
+  mem_get_stats(MEM_INDEX, &before);
+  terminal_account_memory();
+  mem_get_stats(MEM_INDEX, &st);
+  CU_ASSERT(st.live > before.live);
+
+  /* every tag in the JSON */
+  p = mem_to_json();
+  json = json_loads(p, 0, NULL);
+  CU_ASSERT(NULL != json);
+  CU_ASSERT(json_integer_value(json_object_get(json, "live")) > 0);
+  CU_ASSERT(NULL != json_object_get(json_object_get(json_object_get(json, "tags"),
+              "serializer"), "allocs_per_sec"));
+  CU_ASSERT(json_integer_value(json_object_get(json_object_get(json_object_get(json, "tags"),
+              "responses"), "peak")) >= 2 * 1024 * 1024);
+  CU_ASSERT(7 == json_object_size(json_object_get(json, "tags")));
+  json_decref(json);
+  terminal_free_json(p);
+}
+
+/* handoff tests
+ */
+void test_handoff_message(void) {
+  int sv[2], p[2], fd = -1;
+  char c = 0;
+
+  CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  CU_ASSERT(0 == pipe(p));
+
+  /* a descriptor goes through, and it's the same file */
+  CU_ASSERT(true == handoff_send(sv[0], HANDOFF_SEGMENT, &p[1], 1));
+  CU_ASSERT(1 == handoff_recv(sv[1], HANDOFF_SEGMENT, &fd, 1));
+  CU_ASSERT(fd >= 0 && fd != p[1]);
+  CU_ASSERT(1 == write(fd, "x", 1));
+  CU_ASSERT(1 == read(p[0], &c, 1));
+  CU_ASSERT('x' == c);
+  close(fd);
+
+  /* no descriptor */
+  CU_ASSERT(true == handoff_send(sv[0], HANDOFF_HELLO, NULL, 0));
+  CU_ASSERT(0 == handoff_recv(sv[1], HANDOFF_HELLO, NULL, 0));
+
+  /* not the message expected, the descriptor is closed */
+  CU_ASSERT(true == handoff_send(sv[0], HANDOFF_LISTEN, &p[1], 1));
+  CU_ASSERT(-1 == handoff_recv(sv[1], HANDOFF_READY, &fd, 1));
+
+  /* the other end is gone */
+  close(sv[0]);
+  CU_ASSERT(-1 == handoff_recv(sv[1], HANDOFF_HELLO, NULL, 0));
+  close(sv[1]);
+  close(p[0]);
+  close(p[1]);
+}
+
+static bool adopt_nothing(void) {
+  return false;
+}
+
+void test_handoff_take_nobody(void) {
+  char path[64];
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "/tmp/handoff-test-%d", (int) getpid());
+  unlink(path);
+  CU_ASSERT(0 == handoff_take(path, adopt_nothing, &fd));
+  CU_ASSERT(-1 == fd);
+  CU_ASSERT(-1 == handoff_done_fd());
+}
+
+/* the old release, in a child: what it does is written to a pipe */
+static int Give_Report[2];
+static int Give_Listen[2];
+
+static int give_listening(void) {
+  return Give_Listen[0];
+}
+
+static int give_quiesce(void) {
+  if (write(Give_Report[1], "q", 1) != 1) {
+    return -1;
+  }
+  return -1;
+}
+
+/* connect to the old release, as a new one, up to the LISTEN message */
+static int give_connect(const char *path, int *fd) {
+  struct sockaddr_un sun;
+  int sock, i;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  for (i = 0; i < 100; i++) {
+    if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) == 0) {
+      break;
+    }
+    usleep(10000);
+  }
+  if (i == 100 ||
+      !handoff_send(sock, HANDOFF_HELLO, NULL, 0) ||
+      handoff_recv(sock, HANDOFF_SEGMENT, fd, 1) != 1) {
+    close(sock);
+    return -1;
+  }
+  close(*fd);
+  if (!handoff_send(sock, HANDOFF_READY, NULL, 0) ||
+      handoff_recv(sock, HANDOFF_LISTEN, fd, 1) != 1) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+void test_handoff_give(void) {
+  char path[64], buf[8];
+  struct pollfd pfd;
+  int sock, fd = -1, status;
+  pid_t pid;
+
+  snprintf(path, sizeof(path), "/tmp/handoff-give-%d", (int) getpid());
+  unlink(path);
+  CU_ASSERT(0 == pipe(Give_Report));
+  CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, Give_Listen));
+  if ((pid = fork()) == 0) {
+    close(Give_Report[0]);
+    if (!shm_init(1 << 16) ||
+        !handoff_serve(path, give_listening, give_quiesce)) {
+      _exit(1);
+    }
+    pfd.fd = handoff_done_fd();
+    pfd.events = POLLIN;
+    _exit(poll(&pfd, 1, 10000) == 1 ? 0 : 2);
+  }
+  CU_ASSERT(pid > 0);
+  close(Give_Report[1]);
+
+  /* the new release goes away before it says it has the listening
+   * socket, the old one keeps serving
+   */
+  CU_ASSERT((sock = give_connect(path, &fd)) >= 0);
+  close(fd);
+  close(sock);
+
+  /* it has it, the old one stops accepting connections */
+  CU_ASSERT((sock = give_connect(path, &fd)) >= 0);
+  CU_ASSERT(true == handoff_send(sock, HANDOFF_TAKEN, NULL, 0));
+  CU_ASSERT(1 == write(fd, "x", 1));
+  CU_ASSERT(1 == read(Give_Listen[1], buf, 1));
+  CU_ASSERT('x' == buf[0]);
+  close(fd);
+  close(sock);
+
+  CU_ASSERT(pid == waitpid(pid, &status, 0));
+  CU_ASSERT(0 == status);
+  /* quiesced once, the second time */
+  CU_ASSERT(1 == read(Give_Report[0], buf, sizeof(buf)));
+  CU_ASSERT('q' == buf[0]);
+  close(Give_Report[0]);
+  close(Give_Listen[0]);
+  close(Give_Listen[1]);
+  unlink(path);
+}
+
+/* shm tests
+ */
+void test_shm_alloc(void) {
+  char *p, *q;
+
+  CU_ASSERT(NULL == shm_alloc(1));
+  CU_ASSERT(-1 == shm_fd());
+  CU_ASSERT(true == shm_init(SHM_DEFAULT_SIZE));
+  CU_ASSERT(true == shm_enabled());
+  CU_ASSERT(shm_fd() >= 0);
+
+  p = shm_alloc(10);
+  q = shm_alloc(100);
+  CU_ASSERT(p != NULL);
+  CU_ASSERT(0 == ((uintptr_t) p & 63));
+  CU_ASSERT(q == p + 64);
+  CU_ASSERT(0 == q[99]);
+  CU_ASSERT(NULL == shm_alloc(SHM_DEFAULT_SIZE));
+}
+
+void test_terminal_share(void) {
+  Terminal_Stats before, after;
+  Terminal_Change c[1];
+  Terminal_Data t;
+  uint64_t seq, next;
+  pid_t pid;
+  int status;
+
+  terminal_get_stats(&before);
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == terminal_share());
+  CU_ASSERT(true == change_feed_share());
+  CU_ASSERT(true == change_feed_shared());
+  CU_ASSERT(true == id_lease_share());
+  terminal_get_stats(&after);
+  CU_ASSERT(before.terminals == after.terminals);
+  CU_ASSERT(seq == change_feed_last_seq());
+
+  /* a terminal added by another process is seen by this one */
+  if ((pid = fork()) == 0) {
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, "Visa");
+    terminal_add_transaction_type(&t, "Credit");
+    _exit(terminal_add(&t) ? 0 : 1);
+  }
+  CU_ASSERT(pid > 0);
+  CU_ASSERT(pid == waitpid(pid, &status, 0));
+  CU_ASSERT(0 == status);
+  terminal_get_stats(&after);
+  CU_ASSERT(before.terminals + 1 == after.terminals);
+  CU_ASSERT(1 == change_feed_read(seq, c, 1, &next));
+  CU_ASSERT(CHANGE_ADD == c[0].op);
+  CU_ASSERT(true == terminal_get(c[0].terminal.id, &t));
+  CU_ASSERT(id_lease_high_water() >= c[0].terminal.id);
+
+  /* the block of ids of this thread is not the one of the other process */
+  terminal_init_data(&t);
+  terminal_add_card_type(&t, "Visa");
+  CU_ASSERT(true == terminal_add(&t));
+  CU_ASSERT(c[0].terminal.id != t.id);
+}
+
+/* the notify function of the change feed is called in the middle of an
+ * add, holding terminals_lock
+ */
+static void die_holding_locks(void) {
+  _exit(0);
+}
+
+void test_terminal_repair(void) {
+  Terminal_Stats before, after;
+  Terminal_Change c[1];
+  Terminal_Data t, u;
+  uint64_t seq, next;
+  pid_t pid;
+  int status;
+
+  terminal_init_data(&u);
+  terminal_add_card_type(&u, "Amex");
+  terminal_add_transaction_type(&u, "Savings");
+  CU_ASSERT(true == terminal_add(&u));
+  terminal_get_stats(&before);
+  seq = change_feed_last_seq();
+  CU_ASSERT(true == terminal_locks_free(100));
+
+  /* a worker dies in the middle of an add */
+  if ((pid = fork()) == 0) {
+    change_feed_set_notify(die_holding_locks);
+    terminal_init_data(&t);
+    terminal_add_card_type(&t, "JBC");
+    terminal_add_transaction_type(&t, "Credit");
+    terminal_add(&t);
+    _exit(1);
+  }
+  CU_ASSERT(pid > 0);
+  CU_ASSERT(pid == waitpid(pid, &status, 0));
+  CU_ASSERT(0 == status);
+  CU_ASSERT(false == terminal_locks_free(100));
+  CU_ASSERT(true == change_feed_locks_free(100));
+  CU_ASSERT(true == id_lease_locks_free(100));
+  CU_ASSERT(1 == change_feed_read(seq, c, 1, &next));
+
+  CU_ASSERT(true == terminal_repair());
+  CU_ASSERT(true == change_feed_repair());
+  CU_ASSERT(true == id_lease_repair());
+  CU_ASSERT(true == terminal_locks_free(100));
+
+  /* the terminal it added is there, with the ones before */
+  terminal_get_stats(&after);
+  CU_ASSERT(before.terminals + 1 == after.terminals);
+  CU_ASSERT(true == terminal_get(c[0].terminal.id, &t));
+  CU_ASSERT(0 != t.cards[0]);
+  CU_ASSERT(true == terminal_get(u.id, &t));
+  CU_ASSERT(4 == t.cards[0]);
+  CU_ASSERT(CHANGE_FEED_RESYNC == change_feed_read(seq, c, 1, &next));
+  CU_ASSERT(TERMINAL_OK == terminal_delete(u.id, TERMINAL_ANY_VERSION));
+  u.id = 0;
+  CU_ASSERT(true == terminal_add(&u));
+  CU_ASSERT(true == terminal_get(u.id, &t));
+}
+
+int main() {
+  CU_initialize_registry();
+  CU_pSuite suite = CU_add_suite("rest server", 0, 0);
+
+  /* card_type tests */
+  CU_add_test(suite, "card_type_is_valid", test_card_type_is_valid);
+  CU_add_test(suite, "card_type_find_by_name", test_card_type_find_by_name);
+  CU_add_test(suite, "card_type_find_by_id", test_card_type_find_by_id);
+  CU_add_test(suite, "card_type_index", test_card_type_index);
+
+  /* transaction_type tests */
+  CU_add_test(suite, "transaction_type_is_valid", test_transaction_type_is_valid);
+  CU_add_test(suite, "transaction_type_find_by_name", test_transaction_type_find_by_name);
+  CU_add_test(suite, "transaction_type_find_by_id", test_transaction_type_find_by_id);
+  CU_add_test(suite, "transaction_type_index", test_transaction_type_index);
+
+  /* terminal tests */
+  CU_add_test(suite, "terminal_add", test_terminal_add);
+  CU_add_test(suite, "terminal_init_data", test_terminal_init_data);
+  CU_add_test(suite, "terminal_find_by_id", test_terminal_find_by_id);
+  CU_add_test(suite, "terminal_get", test_terminal_get);
+  CU_add_test(suite, "terminal_parse_id_list", test_terminal_parse_id_list);
+  CU_add_test(suite, "terminal_get_many", test_terminal_get_many);
+  CU_add_test(suite, "terminal_get_stats", test_terminal_get_stats);
+  CU_add_test(suite, "terminal_add_version", test_terminal_add_version);
+  CU_add_test(suite, "terminal_update", test_terminal_update);
+  CU_add_test(suite, "terminal_patch", test_terminal_patch);
+  CU_add_test(suite, "terminal_delete", test_terminal_delete);
+  CU_add_test(suite, "terminal_profiles", test_terminal_profiles);
+  CU_add_test(suite, "terminal_profiles_concurrent", test_terminal_profiles_concurrent);
+  CU_add_test(suite, "terminal_snapshot_acquire", test_terminal_snapshot_acquire);
+  CU_add_test(suite, "terminal_apply_change", test_terminal_apply_change);
+  CU_add_test(suite, "terminal_load_snapshot", test_terminal_load_snapshot);
+  CU_add_test(suite, "terminal_get_concurrent", test_terminal_get_concurrent);
+  CU_add_test(suite, "terminal_is_valid", test_terminal_is_valid);
+  CU_add_test(suite, "terminal_to_json", test_terminal_to_json);
+  CU_add_test(suite, "terminal_array_to_json", test_terminal_array_to_json);
+  CU_add_test(suite, "terminal_load_json", test_terminal_load_json);
+  CU_add_test(suite, "terminal_load_patch_json", test_terminal_load_patch_json);
+  CU_add_test(suite, "terminal_changes_to_json", test_terminal_changes_to_json);
+  CU_add_test(suite, "terminal_to_msgpack", test_terminal_to_msgpack);
+  CU_add_test(suite, "terminal_load_msgpack", test_terminal_load_msgpack);
+
+  /* arena tests */
+  CU_add_test(suite, "arena_malloc", test_arena_malloc);
+  CU_add_test(suite, "arena_reset", test_arena_reset);
+
+  /* pool tests */
+  CU_add_test(suite, "pool_alloc", test_pool_alloc);
+  CU_add_test(suite, "pool_realloc", test_pool_realloc);
+
+  /* compress tests */
+  CU_add_test(suite, "compress_negotiate", test_compress_negotiate);
+  CU_add_test(suite, "compress_buffer", test_compress_buffer);
+
+  /* msgpack tests */
+  CU_add_test(suite, "msgpack_pack", test_msgpack_pack);
+  CU_add_test(suite, "msgpack_read", test_msgpack_read);
+
+  /* header tests */
+  CU_add_test(suite, "header_quality", test_header_quality);
+  CU_add_test(suite, "header_range", test_header_range);
+
+  /* id_lease tests */
+  CU_add_test(suite, "id_lease_next", test_id_lease_next);
+  CU_add_test(suite, "id_lease_configure", test_id_lease_configure);
+
+  /* change_feed tests */
+  CU_add_test(suite, "change_feed_append", test_change_feed_append);
+  CU_add_test(suite, "change_feed_read", test_change_feed_read);
+  CU_add_test(suite, "change_feed_wait", test_change_feed_wait);
+  CU_add_test(suite, "change_feed_reset", test_change_feed_reset);
+
+  /* replica tests */
+  CU_add_test(suite, "replica_apply_frame", test_replica_apply_frame);
+
+  /* admission tests */
+  CU_add_test(suite, "admission_classify", test_admission_classify);
+  CU_add_test(suite, "admission_limit", test_admission_limit);
+  CU_add_test(suite, "admission_cancel", test_admission_cancel);
+  CU_add_test(suite, "admission_adapt", test_admission_adapt);
+  CU_add_test(suite, "admission_concurrent", test_admission_concurrent);
+  CU_add_test(suite, "admission_shutdown", test_admission_shutdown);
+
+  /* ratelimit tests */
+  CU_add_test(suite, "ratelimit_take", test_ratelimit_take);
+  CU_add_test(suite, "ratelimit_key", test_ratelimit_key);
+  CU_add_test(suite, "ratelimit_evict", test_ratelimit_evict);
+  CU_add_test(suite, "ratelimit_check", test_ratelimit_check);
+  CU_add_test(suite, "ratelimit_concurrent", test_ratelimit_concurrent);
+
+  /* trace tests */
+  CU_add_test(suite, "trace_sample", test_trace_sample);
+  CU_add_test(suite, "trace_write", test_trace_write);
+  CU_add_test(suite, "trace_wrap", test_trace_wrap);
+
+  /* job_pool tests */
+  CU_add_test(suite, "job_pool_run", test_job_pool_run);
+  CU_add_test(suite, "job_pool_steal", test_job_pool_steal);
+  CU_add_test(suite, "job_pool_bounded", test_job_pool_bounded);
+  CU_add_test(suite, "job_pool_submitters", test_job_pool_submitters);
+
+  /* import tests */
+  CU_add_test(suite, "import_ndjson", test_import_ndjson);
+  CU_add_test(suite, "import_csv", test_import_csv);
+  CU_add_test(suite, "import_split", test_import_split);
+  CU_add_test(suite, "import_full", test_import_full);
+  CU_add_test(suite, "import_full_lines", test_import_full_lines);
+
+  /* export tests */
+  CU_add_test(suite, "export_ndjson", test_export_ndjson);
+  CU_add_test(suite, "export_msgpack", test_export_msgpack);
+
+  /* store tests */
+  CU_add_test(suite, "store_file", test_store_file);
+  CU_add_test(suite, "store_compact", test_store_compact);
+  CU_add_test(suite, "store_cache", test_store_cache);
+  CU_add_test(suite, "terminal_store", test_terminal_store);
+  CU_add_test(suite, "terminal_store_scan", test_terminal_store_scan);
+  CU_add_test(suite, "terminal_store_other_catalog", test_terminal_store_other_catalog);
+
+  /* catalog tests */
+  CU_add_test(suite, "catalog_load_json", test_catalog_load_json);
+  CU_add_test(suite, "catalog_retired", test_catalog_retired);
+  CU_add_test(suite, "catalog_configure", test_catalog_configure);
+  CU_add_test(suite, "catalog_concurrent", test_catalog_concurrent);
+  CU_add_test(suite, "catalog_read_section", test_catalog_read_section);
+  CU_add_test(suite, "catalog_profile_json", test_catalog_profile_json);
+  CU_add_test(suite, "catalog_long_profile", test_catalog_long_profile);
+  CU_add_test(suite, "catalog_many_long_profiles", test_catalog_many_long_profiles);
+  CU_add_test(suite, "catalog_ids", test_catalog_ids);
+
+  /* query tests */
+  CU_add_test(suite, "query_compile", test_query_compile);
+  CU_add_test(suite, "query_match", test_query_match);
+  CU_add_test(suite, "query_search", test_query_search);
+
+  /* mem tests */
+  CU_add_test(suite, "mem_accounting", test_mem_accounting);
+  CU_add_test(suite, "mem_subsystems", test_mem_subsystems);
+
+  /* handoff tests */
+  CU_add_test(suite, "handoff_message", test_handoff_message);
+  CU_add_test(suite, "handoff_take_nobody", test_handoff_take_nobody);
+  CU_add_test(suite, "handoff_give", test_handoff_give);
+
+  /* shm tests, they move the table to shared memory for the rest */
+  CU_add_test(suite, "shm_alloc", test_shm_alloc);
+  CU_add_test(suite, "terminal_share", test_terminal_share);
+  CU_add_test(suite, "terminal_repair", test_terminal_repair);
 
   CU_basic_set_mode(CU_BRM_VERBOSE);
   CU_basic_run_tests();
@@ -0,0 +1,244 @@
+/*
+ * trace.c
+ *
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+
+/* a span, the name is a constant string */
+typedef struct trace_event {
+  const char *name;
+  uint32_t request;
+  uint64_t start;         /* ns */
+  uint64_t end;
+} Trace_Event;
+
+/* the spans of a thread
+ * only the thread writes them, so it takes no lock. a reader copies them
+ * and then reads head again, the ones overwritten meanwhile are dropped
+ * buffers are never freed, a dump can be reading them
+ */
+typedef struct trace_buffer {
+  int tid;
+  uint64_t head;          /* spans written, the next goes at head % TRACE_SPANS */
+  struct trace_buffer *next;
+  Trace_Event events[TRACE_SPANS];
+} Trace_Buffer;
+
+static pthread_mutex_t Buffers_Lock = PTHREAD_MUTEX_INITIALIZER;
+static Trace_Buffer *Buffers;
+static int Next_Tid;
+static unsigned int Every;            /* 0 if tracing is off */
+static uint32_t Next_Request;
+
+static __thread Trace_Buffer *Buffer;
+static __thread uint32_t Request;     /* traced on this thread, 0 if none */
+static __thread unsigned int Count;   /* requests since the last traced */
+
+/* trace one of every requests, 0 is none */
+void trace_configure(unsigned int every) {
+  Every = every;
+}
+
+/* tell if a new request is traced
+ * returns the id of the request in the trace, or 0 if it's not traced
+ */
+uint32_t trace_sample(void) {
+  uint32_t id;
+
+  if (Every == 0 || ++Count < Every) {
+    return 0;
+  }
+  Count = 0;
+  while ((id = __atomic_add_fetch(&Next_Request, 1, __ATOMIC_RELAXED)) == 0)
+    ;
+  return id;
+}
+
+/* the spans of this thread are for request, until the next call
+ * a request of 0 is not traced
+ */
+void trace_enter(uint32_t request) {
+  Request = request;
+}
+
+/* the request of the spans of this thread, 0 if it's not traced */
+uint32_t trace_current(void) {
+  return Request;
+}
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the start of a span, 0 if the request is not traced */
+uint64_t trace_start(void) {
+  return (Request != 0) ? trace_now() : 0;
+}
+
+/* the end of a span that started at start (see trace_start())
+ * returns the time it ended, for the next span, 0 if it's not traced
+ */
+uint64_t trace_end(const char *name, uint64_t start) {
+  uint64_t end;
+
+  if (start == 0) {
+    return 0;
+  }
+  end = trace_now();
+  trace_span(name, start, end);
+  return end;
+}
+
+static Trace_Buffer *thread_buffer(void) {
+  Trace_Buffer *b;
+
+  if (Buffer != NULL) {
+    return Buffer;
+  }
+  if ((b = calloc(1, sizeof(Trace_Buffer))) == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&Buffers_Lock);
+  b->tid = ++Next_Tid;
+  b->next = Buffers;
+  Buffers = b;
+  pthread_mutex_unlock(&Buffers_Lock);
+  Buffer = b;
+  return b;
+}
+
+/* add a span of the request of this thread */
+void trace_span(const char *name, uint64_t start, uint64_t end) {
+  Trace_Buffer *b;
+  Trace_Event *e;
+  uint64_t head;
+
+  if (Request == 0 || (b = thread_buffer()) == NULL) {
+    return;
+  }
+  head = b->head;
+  e = &b->events[head % TRACE_SPANS];
+  /* a reader that sees any of this, sees the head before it */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->request, Request, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->start, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->end, end, __ATOMIC_RELAXED);
+  __atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write the spans of a thread, returns the ones written */
+static int write_buffer(FILE *f, Trace_Buffer *b, Trace_Event *copy, int written) {
+  uint64_t head, first, valid, i;
+  pid_t pid = getpid();
+  Trace_Event *e;
+
+  head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+  first = (head > TRACE_SPANS) ? head - TRACE_SPANS : 0;
+  for (i = first; i < head; i++) {
+    e = &b->events[i % TRACE_SPANS];
+    copy[i - first].name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+    copy[i - first].request = __atomic_load_n(&e->request, __ATOMIC_RELAXED);
+    copy[i - first].start = __atomic_load_n(&e->start, __ATOMIC_RELAXED);
+    copy[i - first].end = __atomic_load_n(&e->end, __ATOMIC_RELAXED);
+  }
+
+  /* the thread went on meanwhile: the span at the head now - TRACE_SPANS
+   * can be half written, and the ones before it are overwritten
+   */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  valid = __atomic_load_n(&b->head, __ATOMIC_RELAXED);
+  valid = (valid >= TRACE_SPANS) ? valid - TRACE_SPANS + 1 : 0;
+
+  for (i = (valid > first) ? valid : first; i < head; i++) {
+    e = &copy[i - first];
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+        "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"request\":%u}}",
+        (written++ > 0) ? ",\n" : "",
+        e->name, (int) pid, b->tid,
+        e->start / 1000.0, (e->end - e->start) / 1000.0,
+        e->request);
+  }
+  return written;
+}
+
+/* write all spans as Chrome trace events
+ * returns false if they can't be written
+ */
+bool trace_write(FILE *f) {
+  Trace_Event *copy;
+  Trace_Buffer *b;
+  int written = 0;
+
+  if ((copy = malloc(TRACE_SPANS * sizeof(Trace_Event))) == NULL) {
+    return false;
+  }
+  fprintf(f, "{\"traceEvents\":[\n");
+  pthread_mutex_lock(&Buffers_Lock);
+  for (b = Buffers; b != NULL; b = b->next) {
+    written = write_buffer(f, b, copy, written);
+  }
+  pthread_mutex_unlock(&Buffers_Lock);
+  fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  free(copy);
+  return !ferror(f);
+}
+
+static void *watch_thread(void *arg) {
+  char path[64];
+  sigset_t set;
+  FILE *f;
+  bool ok;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, TRACE_SIGNAL);
+  for (;;) {
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), TRACE_FILE, (int) getpid());
+    if ((f = fopen(path, "w")) == NULL) {
+      fprintf(stderr, "trace: can not write %s\n", path);
+      continue;
+    }
+    ok = trace_write(f);
+    if (fclose(f) == 0 && ok) {
+      fprintf(stderr, "trace: written to %s\n", path);
+    } else {
+      fprintf(stderr, "trace: can not write %s\n", path);
+    }
+  }
+  return NULL;
+}
+
+/* write the spans to TRACE_FILE on TRACE_SIGNAL
+ * the signal is blocked in the calling thread, and it's taken by a thread
+ * of it's own. it should be called before other threads are started, so
+ * they don't take it either
+ */
+bool trace_watch(void) {
+  pthread_t thread;
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, TRACE_SIGNAL);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+      pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+/* vim: set et sm ai ts=2: */
@@ -0,0 +1,47 @@
+/*
+ * trace.h
+ *
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* request tracing
+ * one of every n requests is traced (option -T), and the stages it goes
+ * through are timed as spans: reading the body, admission, routing, the
+ * handler, the store, the JSON encoding, queueing the response, and the
+ * whole request until libmicrohttpd is done with it
+ * spans are kept in a ring of TRACE_SPANS for every thread, so tracing
+ * takes no lock and the oldest spans are overwritten. they are dumped as
+ * Chrome trace events (chrome://tracing, Perfetto) with GET /trace, or
+ * to a file on TRACE_SIGNAL
+ * a span is timed like this, and it costs a test of a thread variable
+ * when the request is not traced:
+ *
+ *   uint64_t start = trace_start();
+ *   ...
+ *   trace_end("store", start);
+ */
+#define TRACE_SPANS   4096          /* kept for every thread */
+#define TRACE_SIGNAL  SIGUSR2
+#define TRACE_FILE    "trace.%d.json"   /* the dump on TRACE_SIGNAL, by pid */
+
+/* prototypes */
+extern void trace_configure(unsigned int every);
+extern uint32_t trace_sample(void);
+extern void trace_enter(uint32_t request);
+extern uint32_t trace_current(void);
+extern uint64_t trace_now(void);
+extern uint64_t trace_start(void);
+extern uint64_t trace_end(const char *name, uint64_t start);
+extern void trace_span(const char *name, uint64_t start, uint64_t end);
+extern bool trace_write(FILE *f);
+extern bool trace_watch(void);
+
+#endif
+
+/* vim: set et sm ai ts=2: */
@@ -6,29 +6,34 @@
 #include <assert.h>
 #include <string.h>
 #include "transaction_type.h"
+#include "catalog.h"
 
 
 /* this is the transactions types "table"
- * it's implemented as a simple array
- * in this implementation, it's a read only object, that's initialized
- * to a given list of values
- * These values are hardcoded
- * A better implementation would allow reading these values from a file
- * like a config file
+ * it lives in the catalog (see catalog.h), that's read from a config file
+ * and can be reloaded while the server runs. every function here loads the
+ * catalog in use once, with no lock, and works on that one
  *
- * lookups to this array are sequential, always like "full table scan"
- * stepping through the whole table lookwing for data
- * A better implementation would use a hash map to enable fast access
- * although for very low cardinality data like transaction types it won't make 
- * a difference
+ * lookups by name are sequential, always like "full table scan"
+ * for very low cardinality data like transaction types a hash map won't make a
+ * difference. lookups by id use the positions of the catalog (trx_pos), like
+ * the card types, and scan only for big ids
  */
-static Transaction_Type Transactions[] = {
-        { 91, "Cheque" },
-        { 92, "Savings" },
-        { 93, "Credit" },
-        { 94, "Other" },
-        { 0, NULL }
-};
+
+/* the position of a transaction type in a catalog, -1 if it's not there */
+static int find_index(Catalog *c, transaction_type_id id) {
+  int i;
+
+  if (id < CATALOG_FAST_IDS) {
+    return c->trx_pos[id] - 1;
+  }
+  for (i = 0; i < c->n_trxs; i++) {
+    if (c->trxs[i].id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
 
 bool transaction_type_is_valid(const char *name) {
   assert(name != NULL);
@@ -36,26 +41,46 @@ bool transaction_type_is_valid(const char *name) {
 }
 
 Transaction_Type *transaction_type_find_by_name(const char *name) {
+  Catalog *c = catalog_current();
   int i;
 
   assert(name != NULL);
-  for (i = 0; Transactions[i].name != NULL; i++) {
-    if (strcmp(Transactions[i].name, name) == 0) {
-      return &Transactions[i];
+  for (i = 0; i < c->n_trxs; i++) {
+    /* retired types are only found by id */
+    if (!c->trxs[i].retired && strcmp(c->trxs[i].name, name) == 0) {
+      return &c->trxs[i];
     }
   }
   return NULL;
 }
 
 Transaction_Type *transaction_type_find_by_id(transaction_type_id id) {
+  Catalog *c = catalog_current();
   int i;
 
-  for (i = 0; Transactions[i].id != 0; i++) {
-    if (Transactions[i].id == id) {
-      return &Transactions[i];
-    }
+  i = find_index(c, id);
+  return (i < 0) ? NULL : &c->trxs[i];
+}
+
+/* get the position of a transaction type in the table, -1 if it doesn't exist
+ * positions go from 0 to the number of transaction types - 1, so they can be used
+ * to index arrays that have an entry for every transaction type
+ * a type keeps it's position when the catalog is reloaded
+ */
+int transaction_type_index(transaction_type_id id) {
+  return find_index(catalog_current(), id);
+}
+
+/* get the transaction type at a position in the table, NULL past the end
+ * this is the way to step through all transaction types
+ */
+Transaction_Type *transaction_type_at(int i) {
+  Catalog *c = catalog_current();
+
+  if (i < 0 || i >= c->n_trxs) {
+    return NULL;
   }
-  return NULL;
+  return &c->trxs[i];
 }
 
 
@@ -20,12 +20,19 @@ typedef uint32_t transaction_type_id;
 typedef struct transaction_type {
   transaction_type_id id;
   char *name;
+  bool retired;      /* not in the catalog file anymore, see catalog.h */
 } Transaction_Type;
 
+/* most transaction types in the table, for arrays indexed by transaction_type_index() */
+#define MAX_TRANSACTION_TYPES  32
+
+
 /* prototypes */
 extern bool transaction_type_is_valid(const char *name);
 extern Transaction_Type *transaction_type_find_by_name(const char *name);
 extern Transaction_Type *transaction_type_find_by_id(transaction_type_id id);
+extern int transaction_type_index(transaction_type_id id);
+extern Transaction_Type *transaction_type_at(int i);
 
 
 